@@ -4,6 +4,9 @@
 
 #include "apps/netconnector/examples/netconnector_example/netconnector_example_impl.h"
 
+#include <algorithm>
+#include <cstring>
+
 #include <mx/channel.h>
 
 #include "apps/netconnector/examples/netconnector_example/netconnector_example_params.h"
@@ -18,11 +21,25 @@ static constexpr char kRespondingServiceName[] = "netconnector::Example";
 static const std::vector<std::string> kConversation = {
     "Hello!",    "Hello!",   "Do you like my hat?",
     "I do not.", "Good-by!", "Good-by!"};
+
+// Sent by a benchmarking requestor in place of the first line of the
+// conversation. The responder echoes it and every message after it.
+static const std::string kBenchmarkGreeting = "Benchmark!";
+
+// Returns the latency below which |percent| percent of |sorted| fall.
+ftl::TimeDelta Percentile(const std::vector<ftl::TimeDelta>& sorted,
+                          size_t percent) {
+  FTL_DCHECK(!sorted.empty());
+  return sorted[(sorted.size() - 1) * percent / 100];
+}
 }  // namespace
 
 NetConnectorExampleImpl::NetConnectorExampleImpl(
     NetConnectorExampleParams* params)
-    : application_context_(app::ApplicationContext::CreateFromStartupInfo()) {
+    : application_context_(app::ApplicationContext::CreateFromStartupInfo()),
+      message_size_(params->message_size()),
+      message_count_(params->message_count()),
+      window_(params->window()) {
   // The MessageRelay makes using the channel easier. Hook up its callbacks.
   message_relay_.SetMessageReceivedCallback(
       [this](std::vector<uint8_t> message) { HandleReceivedMessage(message); });
@@ -31,7 +48,7 @@ NetConnectorExampleImpl::NetConnectorExampleImpl(
   // In that case, we need to stay around to respond to future requests.
   if (params->register_provider()) {
     message_relay_.SetChannelClosedCallback([this]() {
-      if (conversation_iter_ == kConversation.end()) {
+      if (echoing_ || conversation_iter_ == kConversation.end()) {
         FTL_LOG(INFO) << "Channel closed, quitting";
       } else {
         FTL_LOG(ERROR) << "Channel closed unexpectedly, quitting";
@@ -96,6 +113,25 @@ NetConnectorExampleImpl::NetConnectorExampleImpl(
     device_service_provider->ConnectToService(kRespondingServiceName,
                                               std::move(remote));
 
+    if (params->benchmark()) {
+      benchmark_ = true;
+      latencies_.reserve(message_count_);
+
+      message_relay_.SetChannelClosedCallback([this]() {
+        if (received_count_ == message_count_) {
+          FTL_LOG(INFO) << "Benchmark complete, quitting";
+        } else {
+          FTL_LOG(ERROR) << "Channel closed before the benchmark completed, "
+                            "quitting";
+        }
+
+        mtl::MessageLoop::GetCurrent()->PostQuitTask();
+      });
+
+      SendMessage(kBenchmarkGreeting);
+      return;
+    }
+
     // Start the conversation.
     SendMessage(*conversation_iter_);
     ++conversation_iter_;
@@ -116,6 +152,16 @@ void NetConnectorExampleImpl::SendMessage(const std::string& message_string) {
 
 void NetConnectorExampleImpl::HandleReceivedMessage(
     std::vector<uint8_t> message) {
+  if (benchmark_) {
+    HandleBenchmarkMessage(message);
+    return;
+  }
+
+  if (echoing_) {
+    message_relay_.SendMessage(std::move(message));
+    return;
+  }
+
   std::string message_string(reinterpret_cast<char*>(message.data()), 0,
                              message.size());
 
@@ -127,6 +173,14 @@ void NetConnectorExampleImpl::HandleReceivedMessage(
     return;
   }
 
+  if (conversation_iter_ == kConversation.begin() &&
+      message_string == kBenchmarkGreeting) {
+    FTL_LOG(INFO) << "Echoing benchmark messages";
+    echoing_ = true;
+    message_relay_.SendMessage(std::move(message));
+    return;
+  }
+
   if (message_string != *conversation_iter_) {
     FTL_LOG(ERROR) << "Expected '" << *conversation_iter_
                    << "', closing channel";
@@ -147,4 +201,83 @@ void NetConnectorExampleImpl::HandleReceivedMessage(
   // party is expected to close the channel.
 }
 
+void NetConnectorExampleImpl::HandleBenchmarkMessage(
+    const std::vector<uint8_t>& message) {
+  if (!benchmark_started_) {
+    std::string message_string(reinterpret_cast<const char*>(message.data()),
+                               message.size());
+    if (message_string != kBenchmarkGreeting) {
+      FTL_LOG(ERROR) << "Expected '" << kBenchmarkGreeting
+                     << "', closing channel";
+      message_relay_.CloseChannel();
+      return;
+    }
+
+    FTL_LOG(INFO) << "Sending " << message_count_ << " messages of "
+                  << message_size_ << " bytes, window " << window_;
+    benchmark_started_ = true;
+    start_time_ = ftl::TimePoint::Now();
+    SendBenchmarkMessages();
+    return;
+  }
+
+  if (message.size() != message_size_ || send_times_.empty()) {
+    FTL_LOG(ERROR) << "Unexpected echo, closing channel";
+    message_relay_.CloseChannel();
+    return;
+  }
+
+  // Echoes come back in the order the messages were sent.
+  uint64_t sequence;
+  std::memcpy(&sequence, message.data(), sizeof(sequence));
+  if (sequence != received_count_) {
+    FTL_LOG(ERROR) << "Expected echo " << received_count_ << ", got "
+                   << sequence << ", closing channel";
+    message_relay_.CloseChannel();
+    return;
+  }
+
+  latencies_.push_back(ftl::TimePoint::Now() - send_times_.front());
+  send_times_.pop_front();
+  ++received_count_;
+
+  if (received_count_ == message_count_) {
+    ReportBenchmark();
+    return;
+  }
+
+  SendBenchmarkMessages();
+}
+
+void NetConnectorExampleImpl::SendBenchmarkMessages() {
+  while (sent_count_ < message_count_ && send_times_.size() < window_) {
+    std::vector<uint8_t> message(message_size_);
+    uint64_t sequence = sent_count_;
+    std::memcpy(message.data(), &sequence, sizeof(sequence));
+
+    send_times_.push_back(ftl::TimePoint::Now());
+    message_relay_.SendMessage(std::move(message));
+    ++sent_count_;
+  }
+}
+
+void NetConnectorExampleImpl::ReportBenchmark() {
+  double seconds = (ftl::TimePoint::Now() - start_time_).ToSecondsF();
+  uint64_t bytes = static_cast<uint64_t>(message_count_) * message_size_;
+
+  std::sort(latencies_.begin(), latencies_.end());
+
+  FTL_LOG(INFO) << message_count_ << " round trips in " << seconds * 1000.0
+                << " ms, " << static_cast<uint64_t>(message_count_ / seconds)
+                << " messages/sec, " << bytes / seconds / 1000000.0
+                << " MB/s each way";
+  FTL_LOG(INFO) << "round trip latency: p50 "
+                << Percentile(latencies_, 50).ToMicroseconds() << " us, p90 "
+                << Percentile(latencies_, 90).ToMicroseconds() << " us, p99 "
+                << Percentile(latencies_, 99).ToMicroseconds() << " us, max "
+                << latencies_.back().ToMicroseconds() << " us";
+
+  message_relay_.CloseChannel();
+}
+
 }  // namespace examples
@@ -4,6 +4,9 @@
 
 #pragma once
 
+#include <deque>
+#include <vector>
+
 #include <mx/channel.h>
 
 #include "apps/netconnector/examples/netconnector_example/netconnector_example_params.h"
@@ -11,6 +14,8 @@
 #include "application/lib/app/application_context.h"
 #include "lib/fidl/cpp/bindings/binding_set.h"
 #include "lib/ftl/macros.h"
+#include "lib/ftl/time/time_delta.h"
+#include "lib/ftl/time/time_point.h"
 
 namespace examples {
 
@@ -25,10 +30,38 @@ class NetConnectorExampleImpl {
 
   void HandleReceivedMessage(std::vector<uint8_t> message);
 
+  // Handles a message received by the requestor in benchmark mode.
+  void HandleBenchmarkMessage(const std::vector<uint8_t>& message);
+
+  // Sends benchmark messages until |window_| of them are awaiting their
+  // echoes or all of them have been sent.
+  void SendBenchmarkMessages();
+
+  // Logs the round trip latencies and throughput, closes the channel and
+  // quits.
+  void ReportBenchmark();
+
   std::unique_ptr<app::ApplicationContext> application_context_;
   netconnector::MessageRelay message_relay_;
   std::vector<std::string>::const_iterator conversation_iter_;
 
+  // Set for a requestor in benchmark mode.
+  bool benchmark_ = false;
+  uint32_t message_size_;
+  uint32_t message_count_;
+  uint32_t window_;
+  // Set when the responder has echoed the benchmark greeting.
+  bool benchmark_started_ = false;
+  uint32_t sent_count_ = 0;
+  uint32_t received_count_ = 0;
+  ftl::TimePoint start_time_;
+  // When each message awaiting its echo was sent, oldest first.
+  std::deque<ftl::TimePoint> send_times_;
+  std::vector<ftl::TimeDelta> latencies_;
+
+  // Set for a responder that's echoing benchmark messages.
+  bool echoing_ = false;
+
   FTL_DISALLOW_COPY_AND_ASSIGN(NetConnectorExampleImpl);
 };
 
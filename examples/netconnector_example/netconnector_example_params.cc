@@ -5,8 +5,41 @@
 #include "apps/netconnector/examples/netconnector_example/netconnector_example_params.h"
 
 #include "lib/ftl/logging.h"
+#include "lib/ftl/strings/string_number_conversions.h"
 
 namespace examples {
+namespace {
+
+constexpr uint32_t kDefaultMessageSize = 1024;
+constexpr uint32_t kDefaultMessageCount = 1000;
+constexpr uint32_t kDefaultWindow = 1;
+
+// Benchmark messages start with a sequence number.
+constexpr uint32_t kMinMessageSize = sizeof(uint64_t);
+
+// Channel messages can be no larger than this.
+constexpr uint32_t kMaxMessageSize = 65536;
+
+// Gets the value of a numeric option. Leaves |*value| unchanged if the option
+// isn't present. Returns false if the option is present and its value isn't
+// a number.
+bool GetNumericOption(const ftl::CommandLine& command_line,
+                      const char* name,
+                      uint32_t* value) {
+  std::string value_string;
+  if (!command_line.GetOptionValue(name, &value_string)) {
+    return true;
+  }
+
+  if (!ftl::StringToNumberWithError(value_string, value)) {
+    FTL_LOG(ERROR) << "Invalid --" << name << " value " << value_string;
+    return false;
+  }
+
+  return true;
+}
+
+}  // namespace
 
 NetConnectorExampleParams::NetConnectorExampleParams(
     const ftl::CommandLine& command_line) {
@@ -22,6 +55,37 @@ NetConnectorExampleParams::NetConnectorExampleParams(
     return;
   }
 
+  benchmark_ = command_line.HasOption("benchmark");
+  message_size_ = kDefaultMessageSize;
+  message_count_ = kDefaultMessageCount;
+  window_ = kDefaultWindow;
+
+  if (!GetNumericOption(command_line, "message-size", &message_size_) ||
+      !GetNumericOption(command_line, "message-count", &message_count_) ||
+      !GetNumericOption(command_line, "window", &window_)) {
+    Usage();
+    return;
+  }
+
+  if (benchmark_ && request_device_name_.empty()) {
+    FTL_LOG(ERROR) << "--benchmark requires --request-device";
+    Usage();
+    return;
+  }
+
+  if (message_size_ < kMinMessageSize || message_size_ > kMaxMessageSize) {
+    FTL_LOG(ERROR) << "--message-size must be between " << kMinMessageSize
+                   << " and " << kMaxMessageSize;
+    Usage();
+    return;
+  }
+
+  if (message_count_ == 0 || window_ == 0) {
+    FTL_LOG(ERROR) << "--message-count and --window must be greater than zero";
+    Usage();
+    return;
+  }
+
   is_valid_ = true;
 }
 
@@ -33,7 +97,19 @@ void NetConnectorExampleParams::Usage() {
       << "    --request-device=<name>   request example service from device";
   FTL_LOG(INFO)
       << "    --register-provider       register example service provider";
-  FTL_LOG(INFO) << "options are mutually exclusive";
+  FTL_LOG(INFO) << "--request-device and --register-provider are mutually "
+                   "exclusive";
+  FTL_LOG(INFO) << "benchmark options, used with --request-device:";
+  FTL_LOG(INFO)
+      << "    --benchmark               measure round trips to the device";
+  FTL_LOG(INFO) << "    --message-size=<bytes>    size of each message "
+                   "(default "
+                << kDefaultMessageSize << ")";
+  FTL_LOG(INFO) << "    --message-count=<n>       messages to send (default "
+                << kDefaultMessageCount << ")";
+  FTL_LOG(INFO) << "    --window=<n>              messages in flight at once "
+                   "(default "
+                << kDefaultWindow << ")";
 }
 
 }  // namespace examples
@@ -23,12 +23,29 @@ class NetConnectorExampleParams {
     return request_device_name_;
   }
 
+  // Indicates whether the requestor should measure round trips rather than
+  // have the conversation.
+  bool benchmark() const { return benchmark_; }
+
+  // The size of each benchmark message in bytes.
+  uint32_t message_size() const { return message_size_; }
+
+  // The number of benchmark messages to send.
+  uint32_t message_count() const { return message_count_; }
+
+  // The number of benchmark messages that may be awaiting their echoes.
+  uint32_t window() const { return window_; }
+
  private:
   void Usage();
 
   bool is_valid_;
   bool register_provider_;
   std::string request_device_name_;
+  bool benchmark_;
+  uint32_t message_size_;
+  uint32_t message_count_;
+  uint32_t window_;
 
   FTL_DISALLOW_COPY_AND_ASSIGN(NetConnectorExampleParams);
 };
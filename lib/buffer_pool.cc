@@ -0,0 +1,79 @@
+// Copyright 2017 The Fuchsia Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#include "apps/netconnector/lib/buffer_pool.h"
+
+#include "lib/ftl/logging.h"
+
+namespace netconnector {
+
+// static
+BufferPool* BufferPool::Get() {
+  static BufferPool* pool = new BufferPool();
+  return pool;
+}
+
+BufferPool::BufferPool() {}
+
+BufferPool::~BufferPool() {
+  FTL_NOTREACHED();
+}
+
+std::vector<uint8_t> BufferPool::Allocate(size_t size) {
+  // Find the smallest class that holds |size| bytes.
+  size_t class_index = 0;
+  while (class_index < kClassCount && ClassSize(class_index) < size) {
+    ++class_index;
+  }
+
+  std::vector<uint8_t> buffer;
+
+  if (class_index == kClassCount) {
+    // Too large to pool.
+    buffer.resize(size);
+    return buffer;
+  }
+
+  {
+    ftl::MutexLocker locker(&mutex_);
+    std::vector<std::vector<uint8_t>>& free_buffers =
+        free_buffers_[class_index];
+    if (!free_buffers.empty()) {
+      buffer = std::move(free_buffers.back());
+      free_buffers.pop_back();
+    }
+  }
+
+  if (buffer.capacity() == 0) {
+    buffer.reserve(ClassSize(class_index));
+  }
+
+  FTL_DCHECK(buffer.capacity() >= size);
+  buffer.resize(size);
+  return buffer;
+}
+
+void BufferPool::Recycle(std::vector<uint8_t> buffer) {
+  size_t capacity = buffer.capacity();
+  if (capacity < kMinClassSize || capacity >= ClassSize(kClassCount)) {
+    return;
+  }
+
+  // Find the largest class whose allocations |buffer| can satisfy.
+  size_t class_index = 0;
+  while (class_index + 1 < kClassCount &&
+         ClassSize(class_index + 1) <= capacity) {
+    ++class_index;
+  }
+
+  buffer.clear();
+
+  ftl::MutexLocker locker(&mutex_);
+  std::vector<std::vector<uint8_t>>& free_buffers = free_buffers_[class_index];
+  if (free_buffers.size() < kMaxBuffersPerClass) {
+    free_buffers.push_back(std::move(buffer));
+  }
+}
+
+}  // namespace netconnector
@@ -0,0 +1,58 @@
+// Copyright 2017 The Fuchsia Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#pragma once
+
+#include <vector>
+
+#include "lib/ftl/macros.h"
+#include "lib/ftl/synchronization/mutex.h"
+#include "lib/ftl/synchronization/thread_annotations.h"
+
+namespace netconnector {
+
+// A pool of message buffers in power-of-two size classes. Buffers allocated
+// from the pool have the capacity of their size class, so a buffer recycled
+// after use can satisfy any later allocation in the same class without
+// touching the heap. Buffers may be allocated on one thread and recycled on
+// another.
+//
+// BufferPool is thread-safe.
+class BufferPool {
+ public:
+  // Returns the process-wide pool, creating it on first use.
+  static BufferPool* Get();
+
+  // Returns a buffer of |size| bytes, reusing a pooled buffer if one is
+  // available.
+  std::vector<uint8_t> Allocate(size_t size);
+
+  // Returns |buffer| to the pool for reuse. Buffers that are too small or too
+  // large to pool, or that would exceed the limit for their size class, are
+  // freed.
+  void Recycle(std::vector<uint8_t> buffer);
+
+ private:
+  static const size_t kMinClassSize = 256;
+  static const size_t kClassCount = 9;  // 256 bytes through 64KiB.
+  static const size_t kMaxBuffersPerClass = 64;
+
+  BufferPool();
+
+  // The pool lives for the life of the process, so this is never called.
+  ~BufferPool();
+
+  // Returns the capacity of buffers in the indicated size class.
+  static size_t ClassSize(size_t class_index) {
+    return kMinClassSize << class_index;
+  }
+
+  ftl::Mutex mutex_;
+  std::vector<std::vector<uint8_t>> free_buffers_[kClassCount] FTL_GUARDED_BY(
+      mutex_);
+
+  FTL_DISALLOW_COPY_AND_ASSIGN(BufferPool);
+};
+
+}  // namespace netconnector
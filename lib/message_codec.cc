@@ -0,0 +1,208 @@
+// Copyright 2017 The Fuchsia Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#include "apps/netconnector/lib/message_codec.h"
+
+#include <endian.h>
+
+#include <cstring>
+#include <limits>
+
+#include "apps/netconnector/lib/buffer_pool.h"
+#include "lib/ftl/logging.h"
+
+namespace netconnector {
+
+MessageWriter::MessageWriter(size_t size)
+    : message_(BufferPool::Get()->Allocate(size)) {}
+
+MessageWriter::~MessageWriter() {}
+
+MessageWriter& MessageWriter::operator<<(bool value) {
+  return *this << static_cast<uint8_t>(value ? 1 : 0);
+}
+
+MessageWriter& MessageWriter::operator<<(uint8_t value) {
+  PutBytes(sizeof(value), &value);
+  return *this;
+}
+
+MessageWriter& MessageWriter::operator<<(uint16_t value) {
+  value = htobe16(value);
+  PutBytes(sizeof(value), &value);
+  return *this;
+}
+
+MessageWriter& MessageWriter::operator<<(uint32_t value) {
+  value = htobe32(value);
+  PutBytes(sizeof(value), &value);
+  return *this;
+}
+
+MessageWriter& MessageWriter::operator<<(uint64_t value) {
+  value = htobe64(value);
+  PutBytes(sizeof(value), &value);
+  return *this;
+}
+
+MessageWriter& MessageWriter::operator<<(int8_t value) {
+  return *this << static_cast<uint8_t>(value);
+}
+
+MessageWriter& MessageWriter::operator<<(int16_t value) {
+  return *this << static_cast<uint16_t>(value);
+}
+
+MessageWriter& MessageWriter::operator<<(int32_t value) {
+  return *this << static_cast<uint32_t>(value);
+}
+
+MessageWriter& MessageWriter::operator<<(int64_t value) {
+  return *this << static_cast<uint64_t>(value);
+}
+
+MessageWriter& MessageWriter::operator<<(ftl::StringView value) {
+  FTL_DCHECK(value.size() <= std::numeric_limits<uint32_t>::max());
+  *this << static_cast<uint32_t>(value.size());
+  PutBytes(value.size(), value.data());
+  return *this;
+}
+
+MessageWriter& MessageWriter::operator<<(ByteView value) {
+  FTL_DCHECK(value.size() <= std::numeric_limits<uint32_t>::max());
+  *this << static_cast<uint32_t>(value.size());
+  PutBytes(value.size(), value.data());
+  return *this;
+}
+
+std::vector<uint8_t> MessageWriter::GetMessage() {
+  FTL_DCHECK(position_ == message_.size())
+      << "Message size " << message_.size() << " but " << position_
+      << " bytes written";
+  position_ = 0;
+  return std::move(message_);
+}
+
+void MessageWriter::PutBytes(size_t count, const void* source) {
+  FTL_DCHECK(position_ + count <= message_.size());
+  if (count != 0) {
+    std::memcpy(message_.data() + position_, source, count);
+    position_ += count;
+  }
+}
+
+MessageReader::MessageReader(const uint8_t* data, size_t size)
+    : data_(data), size_(size) {
+  FTL_DCHECK(data_ != nullptr || size_ == 0);
+}
+
+MessageReader::MessageReader(const std::vector<uint8_t>& message)
+    : MessageReader(message.data(), message.size()) {}
+
+MessageReader::~MessageReader() {}
+
+MessageReader& MessageReader::operator>>(bool& value) {
+  uint8_t byte = 0;
+  *this >> byte;
+  if (byte > 1) {
+    healthy_ = false;
+  }
+
+  value = byte != 0;
+  return *this;
+}
+
+MessageReader& MessageReader::operator>>(uint8_t& value) {
+  GetBytes(sizeof(value), &value);
+  return *this;
+}
+
+MessageReader& MessageReader::operator>>(uint16_t& value) {
+  GetBytes(sizeof(value), &value);
+  value = be16toh(value);
+  return *this;
+}
+
+MessageReader& MessageReader::operator>>(uint32_t& value) {
+  GetBytes(sizeof(value), &value);
+  value = be32toh(value);
+  return *this;
+}
+
+MessageReader& MessageReader::operator>>(uint64_t& value) {
+  GetBytes(sizeof(value), &value);
+  value = be64toh(value);
+  return *this;
+}
+
+MessageReader& MessageReader::operator>>(int8_t& value) {
+  GetBytes(sizeof(value), &value);
+  return *this;
+}
+
+MessageReader& MessageReader::operator>>(int16_t& value) {
+  GetBytes(sizeof(value), &value);
+  value = be16toh(value);
+  return *this;
+}
+
+MessageReader& MessageReader::operator>>(int32_t& value) {
+  GetBytes(sizeof(value), &value);
+  value = be32toh(value);
+  return *this;
+}
+
+MessageReader& MessageReader::operator>>(int64_t& value) {
+  GetBytes(sizeof(value), &value);
+  value = be64toh(value);
+  return *this;
+}
+
+MessageReader& MessageReader::operator>>(ftl::StringView& value) {
+  size_t size;
+  const uint8_t* bytes = LengthPrefixedBytes(&size);
+  value = bytes == nullptr
+              ? ftl::StringView()
+              : ftl::StringView(reinterpret_cast<const char*>(bytes), size);
+  return *this;
+}
+
+MessageReader& MessageReader::operator>>(ByteView& value) {
+  size_t size;
+  const uint8_t* bytes = LengthPrefixedBytes(&size);
+  value = bytes == nullptr ? ByteView() : ByteView(bytes, size);
+  return *this;
+}
+
+const uint8_t* MessageReader::Bytes(size_t count) {
+  if (!healthy_ || size_ - position_ < count) {
+    healthy_ = false;
+    return nullptr;
+  }
+
+  const uint8_t* result = data_ + position_;
+  position_ += count;
+  return result;
+}
+
+bool MessageReader::GetBytes(size_t count, void* dest) {
+  const uint8_t* bytes = Bytes(count);
+  if (bytes == nullptr) {
+    std::memset(dest, 0, count);
+    return false;
+  }
+
+  std::memcpy(dest, bytes, count);
+  return true;
+}
+
+const uint8_t* MessageReader::LengthPrefixedBytes(size_t* size) {
+  FTL_DCHECK(size != nullptr);
+  uint32_t length = 0;
+  *this >> length;
+  *size = healthy_ ? length : 0;
+  return healthy_ ? Bytes(*size) : nullptr;
+}
+
+}  // namespace netconnector
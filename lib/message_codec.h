@@ -0,0 +1,237 @@
+// Copyright 2017 The Fuchsia Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <vector>
+
+#include "lib/ftl/macros.h"
+#include "lib/ftl/strings/string_view.h"
+
+namespace netconnector {
+
+// A view of bytes in a message, analogous to ftl::StringView.
+class ByteView {
+ public:
+  ByteView() {}
+
+  ByteView(const uint8_t* data, size_t size) : data_(data), size_(size) {}
+
+  ByteView(const std::vector<uint8_t>& bytes)
+      : data_(bytes.data()), size_(bytes.size()) {}
+
+  const uint8_t* data() const { return data_; }
+
+  size_t size() const { return size_; }
+
+  bool empty() const { return size_ == 0; }
+
+  std::vector<uint8_t> ToVector() const {
+    return std::vector<uint8_t>(data_, data_ + size_);
+  }
+
+ private:
+  const uint8_t* data_ = nullptr;
+  size_t size_ = 0;
+};
+
+// Serializes message fields into a buffer from BufferPool whose size is
+// given up front. Integers are written in network byte order. Strings and
+// byte arrays are written as a uint32 length followed by the bytes.
+class MessageWriter {
+ public:
+  // Creates a writer for a message of exactly |size| bytes.
+  explicit MessageWriter(size_t size);
+
+  ~MessageWriter();
+
+  MessageWriter& operator<<(bool value);
+  MessageWriter& operator<<(uint8_t value);
+  MessageWriter& operator<<(uint16_t value);
+  MessageWriter& operator<<(uint32_t value);
+  MessageWriter& operator<<(uint64_t value);
+  MessageWriter& operator<<(int8_t value);
+  MessageWriter& operator<<(int16_t value);
+  MessageWriter& operator<<(int32_t value);
+  MessageWriter& operator<<(int64_t value);
+  MessageWriter& operator<<(ftl::StringView value);
+  MessageWriter& operator<<(ByteView value);
+
+  // Returns the message, which must have been written completely, and
+  // resets this writer.
+  std::vector<uint8_t> GetMessage();
+
+ private:
+  void PutBytes(size_t count, const void* source);
+
+  std::vector<uint8_t> message_;
+  size_t position_ = 0;
+
+  FTL_DISALLOW_COPY_AND_ASSIGN(MessageWriter);
+};
+
+// Deserializes message fields written by MessageWriter. Strings and byte
+// arrays are read as views into the message rather than copied, so the
+// message must outlive them.
+class MessageReader {
+ public:
+  MessageReader(const uint8_t* data, size_t size);
+
+  explicit MessageReader(const std::vector<uint8_t>& message);
+
+  ~MessageReader();
+
+  // Returns false if a read has run past the end of the message.
+  bool healthy() const { return healthy_; }
+
+  // Returns true if the reader is healthy and the whole message has been
+  // read.
+  bool complete() const { return healthy_ && position_ == size_; }
+
+  MessageReader& operator>>(bool& value);
+  MessageReader& operator>>(uint8_t& value);
+  MessageReader& operator>>(uint16_t& value);
+  MessageReader& operator>>(uint32_t& value);
+  MessageReader& operator>>(uint64_t& value);
+  MessageReader& operator>>(int8_t& value);
+  MessageReader& operator>>(int16_t& value);
+  MessageReader& operator>>(int32_t& value);
+  MessageReader& operator>>(int64_t& value);
+  MessageReader& operator>>(ftl::StringView& value);
+  MessageReader& operator>>(ByteView& value);
+
+ private:
+  // Returns a pointer to the next |count| bytes and consumes them, or returns
+  // nullptr and marks the reader unhealthy if there aren't that many.
+  const uint8_t* Bytes(size_t count);
+
+  bool GetBytes(size_t count, void* dest);
+
+  // Reads a uint32 length and returns a pointer to that many bytes.
+  const uint8_t* LengthPrefixedBytes(size_t* size);
+
+  const uint8_t* data_;
+  size_t size_;
+  size_t position_ = 0;
+  bool healthy_ = true;
+
+  FTL_DISALLOW_COPY_AND_ASSIGN(MessageReader);
+};
+
+namespace internal {
+
+// The serialized sizes of the field types MessageLayout supports. Using any
+// other type in a layout is a compile-time error.
+template <typename T>
+struct FieldTraits;
+
+template <typename T>
+struct FixedSizeFieldTraits {
+  static constexpr size_t kFixedSize = sizeof(T);
+  static size_t VariableSize(T value) { return 0; }
+};
+
+template <>
+struct FieldTraits<bool> : FixedSizeFieldTraits<uint8_t> {};
+template <>
+struct FieldTraits<uint8_t> : FixedSizeFieldTraits<uint8_t> {};
+template <>
+struct FieldTraits<uint16_t> : FixedSizeFieldTraits<uint16_t> {};
+template <>
+struct FieldTraits<uint32_t> : FixedSizeFieldTraits<uint32_t> {};
+template <>
+struct FieldTraits<uint64_t> : FixedSizeFieldTraits<uint64_t> {};
+template <>
+struct FieldTraits<int8_t> : FixedSizeFieldTraits<int8_t> {};
+template <>
+struct FieldTraits<int16_t> : FixedSizeFieldTraits<int16_t> {};
+template <>
+struct FieldTraits<int32_t> : FixedSizeFieldTraits<int32_t> {};
+template <>
+struct FieldTraits<int64_t> : FixedSizeFieldTraits<int64_t> {};
+
+template <>
+struct FieldTraits<ftl::StringView> {
+  static constexpr size_t kFixedSize = sizeof(uint32_t);
+  static size_t VariableSize(ftl::StringView value) { return value.size(); }
+};
+
+template <>
+struct FieldTraits<ByteView> {
+  static constexpr size_t kFixedSize = sizeof(uint32_t);
+  static size_t VariableSize(ByteView value) { return value.size(); }
+};
+
+constexpr size_t Sum() {
+  return 0;
+}
+
+template <typename... TSizes>
+constexpr size_t Sum(size_t first, TSizes... rest) {
+  return first + Sum(rest...);
+}
+
+}  // namespace internal
+
+// Describes a message as a sequence of fields of the types |TFields|, which
+// may be bool, the fixed-size integer types, ftl::StringView and ByteView.
+// For example:
+//
+//     using ChunkMessage = MessageLayout<uint32_t, uint64_t, ByteView>;
+//
+//     relay.SendMessage(ChunkMessage::Write(id, offset, chunk));
+//
+//     uint32_t id;
+//     uint64_t offset;
+//     ByteView chunk;
+//     if (!ChunkMessage::Read(message, &id, &offset, &chunk)) { ... }
+//
+// |Write| computes the exact size of the message and serializes it into a
+// single buffer from BufferPool, which MessageRelay recycles once the message
+// is written to its channel. |Read| decodes the fields in place, so |chunk|
+// above refers to bytes in |message|.
+template <typename... TFields>
+struct MessageLayout {
+  // The size of a message whose strings and byte arrays are all empty.
+  static constexpr size_t kFixedSize =
+      internal::Sum(internal::FieldTraits<TFields>::kFixedSize...);
+
+  // Returns the size of the message with the given fields.
+  static size_t Size(const TFields&... fields) {
+    return kFixedSize +
+           internal::Sum(internal::FieldTraits<TFields>::VariableSize(
+               fields)...);
+  }
+
+  // Serializes a message with the given fields.
+  static std::vector<uint8_t> Write(const TFields&... fields) {
+    MessageWriter writer(Size(fields...));
+    // The braced initializer guarantees the fields are written in order.
+    int unused[] = {0, ((void)(writer << fields), 0)...};
+    (void)unused;
+    return writer.GetMessage();
+  }
+
+  // Deserializes |message| into |fields|. Returns false if |message| isn't
+  // a valid message with this layout.
+  static bool Read(const std::vector<uint8_t>& message, TFields*... fields) {
+    return Read(message.data(), message.size(), fields...);
+  }
+
+  static bool Read(const uint8_t* data, size_t size, TFields*... fields) {
+    if (size < kFixedSize) {
+      return false;
+    }
+
+    MessageReader reader(data, size);
+    int unused[] = {0, ((void)(reader >> *fields), 0)...};
+    (void)unused;
+    return reader.complete();
+  }
+};
+
+}  // namespace netconnector
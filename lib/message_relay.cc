@@ -4,6 +4,10 @@
 
 #include "apps/netconnector/lib/message_relay.h"
 
+#include <cstring>
+
+#include "apps/netconnector/lib/buffer_pool.h"
+#include "apps/netconnector/lib/vmo_message.h"
 #include "lib/ftl/logging.h"
 #include "lib/mtl/tasks/message_loop.h"
 
@@ -32,7 +36,21 @@ void MessageRelayBase::SetChannel(mx::channel channel) {
 }
 
 void MessageRelayBase::SendMessage(std::vector<uint8_t> message) {
-  messages_to_write_.push(std::move(message));
+  messages_to_write_bytes_ += message.size();
+
+  MessageToWrite message_to_write;
+  message_to_write.message_ = std::move(message);
+  if (message_lifetime_ > ftl::TimeDelta::Zero()) {
+    message_to_write.deadline_ = ftl::TimePoint::Now() + message_lifetime_;
+  }
+
+  messages_to_write_.push(std::move(message_to_write));
+
+  if (!write_queue_full_ && write_queue_high_watermark_ != 0 &&
+      messages_to_write_bytes_ >= write_queue_high_watermark_) {
+    write_queue_full_ = true;
+    OnWriteQueueFull(true);
+  }
 
   if (channel_ && !write_async_wait_.is_waiting()) {
     WriteChannelMessages();
@@ -44,55 +62,141 @@ void MessageRelayBase::CloseChannel() {
   OnChannelClosed();
 }
 
-void MessageRelayBase::ReadChannelMessages() {
-  while (channel_) {
-    uint32_t actual_byte_count;
-    uint32_t actual_handle_count;
-    mx_status_t status = channel_.read(0, nullptr, 0, &actual_byte_count,
-                                       nullptr, 0, &actual_handle_count);
+void MessageRelayBase::PauseReading() {
+  reading_paused_ = true;
+  read_async_wait_.Cancel();
+}
 
-    if (status == ERR_SHOULD_WAIT) {
-      // Nothing to read. Wait until there is.
-      read_async_wait_.Start(
-          channel_.get(), MX_CHANNEL_READABLE | MX_CHANNEL_PEER_CLOSED,
-          MX_TIME_INFINITE, [this]() { ReadChannelMessages(); });
-      return;
-    }
+void MessageRelayBase::ResumeReading() {
+  if (!reading_paused_) {
+    return;
+  }
 
-    if (status == ERR_PEER_CLOSED) {
-      // Remote end of the channel closed.
-      CloseChannel();
-      return;
+  reading_paused_ = false;
+
+  if (channel_) {
+    ReadChannelMessages();
+  }
+}
+
+void MessageRelayBase::SetWriteQueueWatermarks(size_t high, size_t low) {
+  FTL_DCHECK(high == 0 || low < high);
+  write_queue_high_watermark_ = high;
+  write_queue_low_watermark_ = low;
+}
+
+void MessageRelayBase::OnWriteQueueFull(bool full) {}
+
+void MessageRelayBase::OnMessagesReceived(
+    std::vector<std::vector<uint8_t>> messages) {
+  for (std::vector<uint8_t>& message : messages) {
+    OnMessageReceived(std::move(message));
+  }
+}
+
+void MessageRelayBase::ReadChannelMessages() {
+  while (channel_ && !reading_paused_) {
+    std::vector<std::vector<uint8_t>> messages;
+    mx_status_t status = NO_ERROR;
+
+    while (messages.size() < kMaxMessagesPerBatch) {
+      std::vector<uint8_t> message;
+      status = ReadChannelMessage(&message);
+      if (status != NO_ERROR) {
+        break;
+      }
+
+      messages.push_back(std::move(message));
     }
 
-    if (status != ERR_BUFFER_TOO_SMALL) {
-      FTL_LOG(ERROR) << "Failed to read (peek) from channel, status " << status;
-      CloseChannel();
-      return;
+    if (!messages.empty()) {
+      OnMessagesReceived(std::move(messages));
+
+      if (!channel_) {
+        // The channel was closed during the callback.
+        return;
+      }
     }
 
-    if (actual_handle_count != 0) {
-      FTL_LOG(ERROR)
-          << "Message received over channel has handles, closing connection";
-      CloseChannel();
+    if (status == ERR_SHOULD_WAIT) {
+      // Nothing more to read. Wait until there is, unless reading was paused
+      // during the callback.
+      if (!reading_paused_) {
+        read_async_wait_.Start(
+            channel_.get(), MX_CHANNEL_READABLE | MX_CHANNEL_PEER_CLOSED,
+            MX_TIME_INFINITE, [this]() { ReadChannelMessages(); });
+      }
+
       return;
     }
 
-    std::vector<uint8_t> message(actual_byte_count);
-    status =
-        channel_.read(0, message.data(), message.size(), &actual_byte_count,
-                      nullptr, 0, &actual_handle_count);
-
     if (status != NO_ERROR) {
-      FTL_LOG(ERROR) << "Failed to read from channel, status " << status;
       CloseChannel();
       return;
     }
+  }
+}
 
-    FTL_DCHECK(actual_byte_count == message.size());
+mx_status_t MessageRelayBase::ReadChannelMessage(
+    std::vector<uint8_t>* message) {
+  FTL_DCHECK(message != nullptr);
 
-    OnMessageReceived(std::move(message));
+  if (read_buffer_.empty()) {
+    read_buffer_.resize(kReadBufferSize);
+  }
+
+  // Most messages fit in |read_buffer_|, so we read without peeking first.
+  // A VMO message carries one handle, if VMO messages are enabled.
+  mx_handle_t handle;
+  uint32_t handle_capacity = vmo_threshold_ == 0 ? 0 : 1;
+  uint32_t actual_byte_count;
+  uint32_t actual_handle_count;
+  mx_status_t status = channel_.read(
+      0, read_buffer_.data(), read_buffer_.size(), &actual_byte_count,
+      &handle, handle_capacity, &actual_handle_count);
+
+  if (status == NO_ERROR && actual_handle_count != 0) {
+    mx::vmo vmo(handle);
+    return ReadVmoMessage(read_buffer_.data(), actual_byte_count, vmo,
+                          max_vmo_message_size_, message);
+  }
+
+  if (status == NO_ERROR) {
+    *message = BufferPool::Get()->Allocate(actual_byte_count);
+    std::memcpy(message->data(), read_buffer_.data(), actual_byte_count);
+    return NO_ERROR;
+  }
+
+  if (status == ERR_SHOULD_WAIT || status == ERR_PEER_CLOSED) {
+    return status;
+  }
+
+  if (status != ERR_BUFFER_TOO_SMALL) {
+    FTL_LOG(ERROR) << "Failed to read from channel, status " << status;
+    return status;
+  }
+
+  // Either VMO messages aren't enabled, or this is a VMO message whose header
+  // is much too large.
+  if (actual_handle_count != 0) {
+    FTL_LOG(ERROR)
+        << "Message received over channel has handles, closing connection";
+    return ERR_INVALID_ARGS;
   }
+
+  // The message is too large for |read_buffer_|. Its size is now known, so we
+  // allocate a buffer for it and read again.
+  *message = BufferPool::Get()->Allocate(actual_byte_count);
+  status = channel_.read(0, message->data(), message->size(),
+                         &actual_byte_count, nullptr, 0, &actual_handle_count);
+
+  if (status != NO_ERROR) {
+    FTL_LOG(ERROR) << "Failed to read from channel, status " << status;
+    return status;
+  }
+
+  FTL_DCHECK(actual_byte_count == message->size());
+  return NO_ERROR;
 }
 
 void MessageRelayBase::WriteChannelMessages() {
@@ -100,11 +204,40 @@ void MessageRelayBase::WriteChannelMessages() {
     return;
   }
 
+  // The clock is read at most once per pass. Messages that expire during the
+  // pass are written anyway.
+  ftl::TimePoint now;
+
   while (!messages_to_write_.empty()) {
-    const std::vector<uint8_t>& message = messages_to_write_.front();
+    const MessageToWrite& front = messages_to_write_.front();
+    const std::vector<uint8_t>& message = front.message_;
+
+    if (front.deadline_ != ftl::TimePoint()) {
+      if (now == ftl::TimePoint()) {
+        now = ftl::TimePoint::Now();
+      }
+
+      if (front.deadline_ <= now) {
+        // Expired. It may have been copied into a VMO for an earlier attempt.
+        vmo_to_write_.reset();
+        ++messages_expired_;
+        PopMessageToWrite();
+        continue;
+      }
+    }
 
-    mx_status_t status =
-        channel_.write(0, message.data(), message.size(), nullptr, 0);
+    mx_status_t status;
+    if (vmo_threshold_ != 0 && message.size() >= vmo_threshold_) {
+      // The VMO is kept if the write must wait, so the message is copied into
+      // it just once.
+      status = vmo_to_write_ ? NO_ERROR
+                             : CopyMessageToVmo(message, &vmo_to_write_);
+      if (status == NO_ERROR) {
+        status = WriteVmoMessage(channel_, message.size(), &vmo_to_write_);
+      }
+    } else {
+      status = channel_.write(0, message.data(), message.size(), nullptr, 0);
+    }
 
     if (status == ERR_SHOULD_WAIT) {
       // No room for the write. Wait until there is.
@@ -126,7 +259,22 @@ void MessageRelayBase::WriteChannelMessages() {
       return;
     }
 
-    messages_to_write_.pop();
+    PopMessageToWrite();
+  }
+}
+
+void MessageRelayBase::PopMessageToWrite() {
+  FTL_DCHECK(!messages_to_write_.empty());
+
+  std::vector<uint8_t>& message = messages_to_write_.front().message_;
+  messages_to_write_bytes_ -= message.size();
+  BufferPool::Get()->Recycle(std::move(message));
+  messages_to_write_.pop();
+
+  if (write_queue_full_ &&
+      messages_to_write_bytes_ <= write_queue_low_watermark_) {
+    write_queue_full_ = false;
+    OnWriteQueueFull(false);
   }
 }
 
@@ -143,6 +291,25 @@ void MessageRelay::SetChannelClosedCallback(std::function<void()> callback) {
   channel_closed_callback_ = callback;
 }
 
+void MessageRelay::SetWriteQueueFullCallback(
+    std::function<void(bool)> callback) {
+  write_queue_full_callback_ = callback;
+}
+
+void MessageRelay::SetMessagesReceivedCallback(
+    std::function<void(std::vector<std::vector<uint8_t>>)> callback) {
+  messages_received_callback_ = callback;
+}
+
+void MessageRelay::OnMessagesReceived(
+    std::vector<std::vector<uint8_t>> messages) {
+  if (messages_received_callback_) {
+    messages_received_callback_(std::move(messages));
+  } else {
+    MessageRelayBase::OnMessagesReceived(std::move(messages));
+  }
+}
+
 void MessageRelay::OnMessageReceived(std::vector<uint8_t> message) {
   if (message_received_callback_) {
     message_received_callback_(std::move(message));
@@ -155,4 +322,10 @@ void MessageRelay::OnChannelClosed() {
   }
 }
 
+void MessageRelay::OnWriteQueueFull(bool full) {
+  if (write_queue_full_callback_) {
+    write_queue_full_callback_(full);
+  }
+}
+
 }  // namespace example
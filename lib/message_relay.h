@@ -8,13 +8,17 @@
 #include <vector>
 
 #include <mx/channel.h>
+#include <mx/vmo.h>
 
 #include "apps/netconnector/lib/async_wait.h"
+#include "lib/ftl/time/time_delta.h"
+#include "lib/ftl/time/time_point.h"
 
 namespace netconnector {
 
-// Moves data-only (no handles) messages across an mx::channel. This is an
-// abstract base class with overridables for message arrival and channel
+// Moves data-only (no handles) messages across an mx::channel. Large messages
+// may optionally be moved in VMOs (see vmo_message.h). This is an abstract
+// base class with overridables for message arrival and channel
 // closure. Use MessageRelay if you prefer to set callbacks for those things.
 //
 // MessageRelayBase is not thread-safe. All methods calls must be serialized.
@@ -31,26 +35,108 @@ class MessageRelayBase {
   // Closes the channel.
   void CloseChannel();
 
+  // Stops reading messages from the channel until ResumeReading is called.
+  void PauseReading();
+
+  // Resumes reading messages from the channel after a call to PauseReading.
+  void ResumeReading();
+
+  // Sets watermarks for the queue of messages waiting to be written to the
+  // channel. OnWriteQueueFull(true) is called when the queue grows to |high|
+  // bytes or more, and OnWriteQueueFull(false) is called when it subsequently
+  // shrinks to |low| bytes or fewer. A |high| value of zero (the default)
+  // means the queue is unbounded.
+  void SetWriteQueueWatermarks(size_t high, size_t low);
+
+  // Returns the number of message bytes waiting to be written to the channel.
+  size_t write_queue_bytes() const { return messages_to_write_bytes_; }
+
+  // Enables VMO messages. Messages of |threshold| bytes or more are written to
+  // the channel in VMOs, and VMO messages read from the channel are accepted
+  // and delivered like any other. A |threshold| of zero (the default) disables
+  // VMO messages, and messages with handles close the channel.
+  void SetVmoThreshold(size_t threshold) { vmo_threshold_ = threshold; }
+
+  // Sets the largest VMO message accepted from the channel. Larger ones close
+  // the channel without their payloads being read. A |max_size| of zero (the
+  // default) means no limit.
+  void SetMaxVmoMessageSize(size_t max_size) {
+    max_vmo_message_size_ = max_size;
+  }
+
+  // Sets how long a message may wait to be written to the channel. Messages
+  // still queued |lifetime| after SendMessage are discarded unwritten. A
+  // |lifetime| of zero (the default) means messages never expire. Only
+  // messages sent after the call are affected.
+  void SetMessageLifetime(ftl::TimeDelta lifetime) {
+    message_lifetime_ = lifetime;
+  }
+
+  // Returns the number of messages discarded because they expired.
+  uint64_t messages_expired() const { return messages_expired_; }
+
  protected:
   MessageRelayBase();
 
   // Called when a message is received.
   virtual void OnMessageReceived(std::vector<uint8_t> message) = 0;
 
+  // Called when one or more messages are received in a single pass over the
+  // channel. The default implementation calls OnMessageReceived for each
+  // message.
+  virtual void OnMessagesReceived(std::vector<std::vector<uint8_t>> messages);
+
   // Called when the channel closes.
   virtual void OnChannelClosed() = 0;
 
+  // Called when the write queue crosses a watermark. The default
+  // implementation does nothing.
+  virtual void OnWriteQueueFull(bool full);
+
  private:
+  // Messages up to this size are read from the channel with a single read.
+  static const size_t kReadBufferSize = 65536;
+  // The maximum number of messages passed to OnMessagesReceived at once.
+  static const size_t kMaxMessagesPerBatch = 32;
+
   // Tries to read messages from channel_ and waits for more.
   void ReadChannelMessages();
 
+  // Reads a message from channel_. Returns NO_ERROR if a message was read,
+  // ERR_SHOULD_WAIT if there are no messages to read, ERR_PEER_CLOSED if the
+  // remote end is closed or some other status on error.
+  mx_status_t ReadChannelMessage(std::vector<uint8_t>* message);
+
+  struct MessageToWrite {
+    std::vector<uint8_t> message_;
+    // When the message expires, or ftl::TimePoint() if it doesn't.
+    ftl::TimePoint deadline_;
+  };
+
   // Writes all the messages in messages_to_write_.
   void WriteChannelMessages();
 
+  // Removes the message at the front of messages_to_write_, which has been
+  // written or has expired.
+  void PopMessageToWrite();
+
   mx::channel channel_;
+  std::vector<uint8_t> read_buffer_;
   AsyncWait read_async_wait_;
   AsyncWait write_async_wait_;
-  std::queue<std::vector<uint8_t>> messages_to_write_;
+  std::queue<MessageToWrite> messages_to_write_;
+  size_t messages_to_write_bytes_ = 0;
+  size_t vmo_threshold_ = 0;
+  size_t max_vmo_message_size_ = 0;
+  ftl::TimeDelta message_lifetime_;
+  uint64_t messages_expired_ = 0;
+  // The VMO holding the message at the front of |messages_to_write_|, if it
+  // couldn't be written yet.
+  mx::vmo vmo_to_write_;
+  size_t write_queue_high_watermark_ = 0;
+  size_t write_queue_low_watermark_ = 0;
+  bool write_queue_full_ = false;
+  bool reading_paused_ = false;
 };
 
 // Moves data-only (no handles) messages across an mx::channel.
@@ -65,16 +151,30 @@ class MessageRelay : public MessageRelayBase {
   void SetMessageReceivedCallback(
       std::function<void(std::vector<uint8_t>)> callback);
 
+  // Sets a callback to receive messages in batches. If set, this callback is
+  // used instead of the message received callback.
+  void SetMessagesReceivedCallback(
+      std::function<void(std::vector<std::vector<uint8_t>>)> callback);
+
   void SetChannelClosedCallback(std::function<void()> callback);
 
+  void SetWriteQueueFullCallback(std::function<void(bool)> callback);
+
  protected:
   void OnMessageReceived(std::vector<uint8_t> message) override;
 
+  void OnMessagesReceived(std::vector<std::vector<uint8_t>> messages) override;
+
   void OnChannelClosed() override;
 
+  void OnWriteQueueFull(bool full) override;
+
  private:
   std::function<void(std::vector<uint8_t>)> message_received_callback_;
+  std::function<void(std::vector<std::vector<uint8_t>>)>
+      messages_received_callback_;
   std::function<void()> channel_closed_callback_;
+  std::function<void(bool)> write_queue_full_callback_;
 
   FTL_DISALLOW_COPY_AND_ASSIGN(MessageRelay);
 };
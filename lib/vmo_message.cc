@@ -0,0 +1,104 @@
+// Copyright 2017 The Fuchsia Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#include "apps/netconnector/lib/vmo_message.h"
+
+#include <cstring>
+
+#include "apps/netconnector/lib/buffer_pool.h"
+#include "lib/ftl/logging.h"
+
+namespace netconnector {
+
+mx_status_t CopyMessageToVmo(const std::vector<uint8_t>& message,
+                             mx::vmo* vmo) {
+  FTL_DCHECK(vmo != nullptr);
+
+  mx::vmo result;
+  mx_status_t status = mx::vmo::create(message.size(), 0, &result);
+  if (status != NO_ERROR) {
+    FTL_LOG(ERROR) << "Failed to create VMO, status " << status;
+    return status;
+  }
+
+  size_t actual;
+  status = result.write(message.data(), 0, message.size(), &actual);
+  if (status != NO_ERROR) {
+    FTL_LOG(ERROR) << "Failed to write VMO, status " << status;
+    return status;
+  }
+
+  FTL_DCHECK(actual == message.size());
+  *vmo = std::move(result);
+  return NO_ERROR;
+}
+
+mx_status_t WriteVmoMessage(const mx::channel& channel,
+                            uint64_t size,
+                            mx::vmo* vmo) {
+  FTL_DCHECK(vmo != nullptr);
+  FTL_DCHECK(*vmo);
+
+  mx_handle_t handle = vmo->get();
+  mx_status_t status =
+      channel.write(0, &size, kVmoMessageHeaderSize, &handle, 1);
+  if (status == NO_ERROR) {
+    // The handle now belongs to the channel.
+    vmo->release();
+  }
+
+  return status;
+}
+
+mx_status_t ReadVmoMessage(const uint8_t* header,
+                           size_t header_size,
+                           const mx::vmo& vmo,
+                           uint64_t max_size,
+                           std::vector<uint8_t>* message) {
+  FTL_DCHECK(header != nullptr);
+  FTL_DCHECK(message != nullptr);
+
+  if (header_size != kVmoMessageHeaderSize) {
+    FTL_LOG(ERROR) << "VMO message has a " << header_size
+                   << "-byte header, expected " << kVmoMessageHeaderSize;
+    return ERR_INVALID_ARGS;
+  }
+
+  uint64_t size;
+  std::memcpy(&size, header, sizeof(size));
+
+  if (max_size != 0 && size > max_size) {
+    FTL_LOG(ERROR) << "VMO message of " << size
+                   << " bytes exceeds the limit of " << max_size << " bytes";
+    return ERR_OUT_OF_RANGE;
+  }
+
+  uint64_t vmo_size;
+  mx_status_t status = vmo.get_size(&vmo_size);
+  if (status != NO_ERROR) {
+    FTL_LOG(ERROR) << "Handle received with VMO message isn't a VMO, status "
+                   << status;
+    return status;
+  }
+
+  if (size > vmo_size) {
+    FTL_LOG(ERROR) << "VMO message of " << size << " bytes in a " << vmo_size
+                   << "-byte VMO";
+    return ERR_OUT_OF_RANGE;
+  }
+
+  *message = BufferPool::Get()->Allocate(size);
+
+  size_t actual;
+  status = vmo.read(message->data(), 0, message->size(), &actual);
+  if (status != NO_ERROR || actual != message->size()) {
+    FTL_LOG(ERROR) << "Failed to read VMO, status " << status;
+    BufferPool::Get()->Recycle(std::move(*message));
+    return status == NO_ERROR ? ERR_OUT_OF_RANGE : status;
+  }
+
+  return NO_ERROR;
+}
+
+}  // namespace netconnector
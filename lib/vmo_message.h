@@ -0,0 +1,49 @@
+// Copyright 2017 The Fuchsia Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <vector>
+
+#include <mx/channel.h>
+#include <mx/vmo.h>
+
+namespace netconnector {
+
+// Large messages may be moved across a channel in a VMO rather than in the
+// channel message itself, which saves copying the payload into and back out
+// of the channel. A VMO message is a channel message whose bytes are the
+// payload size as a uint64 in host byte order (both ends are on the same
+// device), and whose only handle is a VMO holding the payload at offset zero.
+// The VMO may be larger than the payload, because VMO sizes are rounded up to
+// whole pages.
+constexpr size_t kVmoMessageHeaderSize = sizeof(uint64_t);
+
+// Creates a VMO holding |message|.
+mx_status_t CopyMessageToVmo(const std::vector<uint8_t>& message,
+                             mx::vmo* vmo);
+
+// Writes a VMO message of |size| bytes held in |*vmo| to |channel|. If the
+// write succeeds, the VMO handle is transferred and |*vmo| is reset.
+// Otherwise |*vmo| is left as is, so the write can be retried without
+// copying the payload again.
+mx_status_t WriteVmoMessage(const mx::channel& channel,
+                            uint64_t size,
+                            mx::vmo* vmo);
+
+// Reads the payload of a VMO message into |*message|, which is allocated from
+// BufferPool. |header| and |header_size| are the bytes of the channel message,
+// and |vmo| is its handle. Payloads larger than |max_size| are refused with
+// ERR_OUT_OF_RANGE before anything is allocated. A |max_size| of zero means
+// no limit.
+mx_status_t ReadVmoMessage(const uint8_t* header,
+                           size_t header_size,
+                           const mx::vmo& vmo,
+                           uint64_t max_size,
+                           std::vector<uint8_t>* message);
+
+}  // namespace netconnector
@@ -0,0 +1,65 @@
+// Copyright 2017 The Fuchsia Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#include "apps/netconnector/src/bandwidth_shaper.h"
+
+#include "lib/ftl/logging.h"
+
+namespace netconnector {
+
+BandwidthShaper::BandwidthShaper() {}
+
+BandwidthShaper::~BandwidthShaper() {}
+
+void BandwidthShaper::SetLimits(const LimitsByName& service_limits,
+                                const LimitsByName& device_limits) {
+  SetLimits(service_limits, &service_buckets_);
+  SetLimits(device_limits, &device_buckets_);
+}
+
+std::shared_ptr<TokenBucket> BandwidthShaper::ForService(
+    const std::string& service_name) const {
+  return Find(service_buckets_, service_name);
+}
+
+std::shared_ptr<TokenBucket> BandwidthShaper::ForDevice(
+    const std::string& device_name) const {
+  return Find(device_buckets_, device_name);
+}
+
+// static
+void BandwidthShaper::SetLimits(const LimitsByName& limits,
+                                BucketsByName* buckets) {
+  FTL_DCHECK(buckets != nullptr);
+
+  for (auto iter = buckets->begin(); iter != buckets->end();) {
+    if (limits.find(iter->first) == limits.end()) {
+      // Connections may still hold the bucket, so it's opened up rather than
+      // just forgotten.
+      iter->second->SetLimit(BandwidthLimit());
+      iter = buckets->erase(iter);
+    } else {
+      ++iter;
+    }
+  }
+
+  for (auto& pair : limits) {
+    std::shared_ptr<TokenBucket>& bucket = (*buckets)[pair.first];
+    if (bucket) {
+      bucket->SetLimit(pair.second);
+    } else {
+      bucket = std::make_shared<TokenBucket>(pair.second);
+    }
+  }
+}
+
+// static
+std::shared_ptr<TokenBucket> BandwidthShaper::Find(
+    const BucketsByName& buckets,
+    const std::string& name) {
+  auto iter = buckets.find(name);
+  return iter == buckets.end() ? nullptr : iter->second;
+}
+
+}  // namespace netconnector
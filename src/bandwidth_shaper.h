@@ -0,0 +1,64 @@
+// Copyright 2017 The Fuchsia Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#pragma once
+
+#include <memory>
+#include <string>
+#include <unordered_map>
+
+#include "apps/netconnector/src/token_bucket.h"
+#include "lib/ftl/macros.h"
+
+namespace netconnector {
+
+// The token buckets that limit the bandwidth of services and of connections
+// to remote devices. Every channel connected to a limited service shares the
+// service's bucket, and every connection to a limited device shares the
+// device's bucket, so a limit applies to the service or device as a whole.
+//
+// BandwidthShaper is not thread-safe and is used on the main thread. The
+// buckets it hands out may be used on any thread.
+class BandwidthShaper {
+ public:
+  using LimitsByName = std::unordered_map<std::string, BandwidthLimit>;
+  using BucketsByName =
+      std::unordered_map<std::string, std::shared_ptr<TokenBucket>>;
+
+  BandwidthShaper();
+
+  ~BandwidthShaper();
+
+  // Replaces the limits. Buckets that are in use are adjusted in place, so
+  // new limits take effect on open connections. Services and devices that
+  // are no longer limited have their buckets opened up.
+  void SetLimits(const LimitsByName& service_limits,
+                 const LimitsByName& device_limits);
+
+  // Returns the bucket for the service named |service_name|, or null if the
+  // service isn't limited.
+  std::shared_ptr<TokenBucket> ForService(
+      const std::string& service_name) const;
+
+  // Returns the bucket for the device named |device_name|, or null if the
+  // device isn't limited.
+  std::shared_ptr<TokenBucket> ForDevice(const std::string& device_name) const;
+
+  const BucketsByName& service_buckets() const { return service_buckets_; }
+
+  const BucketsByName& device_buckets() const { return device_buckets_; }
+
+ private:
+  static void SetLimits(const LimitsByName& limits, BucketsByName* buckets);
+
+  static std::shared_ptr<TokenBucket> Find(const BucketsByName& buckets,
+                                           const std::string& name);
+
+  BucketsByName service_buckets_;
+  BucketsByName device_buckets_;
+
+  FTL_DISALLOW_COPY_AND_ASSIGN(BandwidthShaper);
+};
+
+}  // namespace netconnector
@@ -0,0 +1,529 @@
+// Copyright 2017 The Fuchsia Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+// Measures the time and heap allocations per operation of the wire codecs and
+// framing on netconnector's hot paths:
+//
+//   parse-<n>:       MessageTransciever receiving and parsing message packets
+//                    written to a loopback TCP connection <n> bytes at a time,
+//                    so packet headers and payloads straddle receives. One
+//                    operation is one packet.
+//   dns-round-trip:  PacketWriter and PacketReader writing and reading back a
+//                    query and a response advertising several instances. One
+//                    operation is one message written and read.
+//   dns-name:        writing instance names that share suffixes, so each name
+//                    is compressed against the ones before it. One operation
+//                    is one name.
+//   relay-drain:     MessageRelay reading messages queued in its channel. One
+//                    operation is one message.
+//
+// usage: netconnector_codec_benchmarks [ --iterations=<count> ]
+//                                      [ --payload-size=<bytes> ]
+//                                      [ --benchmark=<name-prefix> ]
+
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <stdlib.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <atomic>
+#include <cstring>
+#include <functional>
+#include <iostream>
+#include <memory>
+#include <new>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <mx/channel.h>
+
+#include "apps/netconnector/lib/message_relay.h"
+#include "apps/netconnector/src/mdns/dns_message.h"
+#include "apps/netconnector/src/mdns/dns_reading.h"
+#include "apps/netconnector/src/mdns/dns_writing.h"
+#include "apps/netconnector/src/mdns/packet_reader.h"
+#include "apps/netconnector/src/mdns/packet_writer.h"
+#include "apps/netconnector/src/message_transceiver.h"
+#include "lib/ftl/command_line.h"
+#include "lib/ftl/files/unique_fd.h"
+#include "lib/ftl/logging.h"
+#include "lib/ftl/strings/string_number_conversions.h"
+#include "lib/ftl/time/time_point.h"
+#include "lib/mtl/tasks/message_loop.h"
+
+namespace {
+
+// Counts calls to the global allocation functions below. Atomic, because
+// MessageTransciever allocates on its I/O thread.
+std::atomic<uint64_t> allocation_count{0};
+
+}  // namespace
+
+void* operator new(size_t size) {
+  allocation_count.fetch_add(1, std::memory_order_relaxed);
+  void* result = malloc(size == 0 ? 1 : size);
+  if (result == nullptr) {
+    abort();
+  }
+
+  return result;
+}
+
+void operator delete(void* ptr) noexcept {
+  free(ptr);
+}
+
+namespace netconnector {
+namespace {
+
+constexpr uint32_t kDefaultIterationCount = 20000;
+constexpr uint32_t kDefaultPayloadSize = 32;
+constexpr uint32_t kInstanceCount = 8;
+constexpr uint32_t kRelayBatchSize = 1000;
+
+// The sizes of the writes used for the parse benchmarks.
+constexpr size_t kChunkSizes[] = {1, 7, 64, 1460, 65536};
+
+// These mirror the wire format described in message_transceiver.h.
+constexpr uint8_t kSentinel = 0xcc;
+constexpr uint8_t kVersionPacketType = 0;
+constexpr uint8_t kMessagePacketType = 2;
+constexpr uint32_t kVersion = 3;
+
+const std::string kServiceFullName = "_netconnector._tcp.local.";
+const std::string kHostFullName = "benchmark-host.local.";
+
+// Measures one benchmark run, reporting the elapsed time and allocations per
+// operation when |Report| is called.
+class Measurement {
+ public:
+  Measurement()
+      : start_allocation_count_(allocation_count),
+        start_time_(ftl::TimePoint::Now()) {}
+
+  // Excludes the time from here to |Resume| from the measurement.
+  void Pause() { elapsed_ += ftl::TimePoint::Now() - start_time_; }
+
+  void Resume() { start_time_ = ftl::TimePoint::Now(); }
+
+  void Report(const std::string& name, uint64_t operation_count) {
+    elapsed_ += ftl::TimePoint::Now() - start_time_;
+    uint64_t allocations = allocation_count - start_allocation_count_;
+
+    std::cout << name << ": "
+              << static_cast<double>(elapsed_.ToNanoseconds()) /
+                     operation_count
+              << " ns/op, "
+              << static_cast<double>(allocations) / operation_count
+              << " allocations/op (" << operation_count << " ops)"
+              << std::endl;
+  }
+
+ private:
+  uint64_t start_allocation_count_;
+  ftl::TimePoint start_time_;
+  ftl::TimeDelta elapsed_;
+};
+
+// A transceiver that counts the messages it receives on the primary channel.
+class BenchmarkTransceiver : public MessageTransciever {
+ public:
+  BenchmarkTransceiver(ftl::UniqueFD socket_fd,
+                       uint32_t expected_message_count,
+                       std::function<void()> done_callback)
+      : MessageTransciever(std::move(socket_fd), false),
+        expected_message_count_(expected_message_count),
+        done_callback_(done_callback) {}
+
+  ~BenchmarkTransceiver() override {}
+
+  using MessageTransciever::CloseConnection;
+
+ protected:
+  void OnVersionReceived(uint32_t version) override {}
+
+  void OnServiceNameReceived(const std::string& service_name) override {}
+
+  void OnChannelRequested(uint16_t channel_id,
+                          const std::string& service_name) override {}
+
+  void OnMessageReceived(std::vector<uint8_t> message) override {
+    if (++received_message_count_ == expected_message_count_) {
+      done_callback_();
+    }
+  }
+
+ private:
+  uint32_t expected_message_count_;
+  uint32_t received_message_count_ = 0;
+  std::function<void()> done_callback_;
+
+  FTL_DISALLOW_COPY_AND_ASSIGN(BenchmarkTransceiver);
+};
+
+bool GetNumericOption(const ftl::CommandLine& command_line,
+                      const char* name,
+                      uint32_t* value) {
+  std::string value_string;
+  if (!command_line.GetOptionValue(name, &value_string)) {
+    return true;
+  }
+
+  if (!ftl::StringToNumberWithError(value_string, value)) {
+    FTL_LOG(ERROR) << "Invalid --" << name << " value " << value_string;
+    return false;
+  }
+
+  return true;
+}
+
+// Appends a packet to |stream|.
+void AppendPacket(uint8_t type,
+                  const uint8_t* payload,
+                  uint32_t payload_size,
+                  std::vector<uint8_t>* stream) {
+  uint16_t channel = htons(0);
+  uint32_t net_byte_order_size = htonl(payload_size);
+
+  stream->push_back(kSentinel);
+  stream->push_back(type);
+  stream->insert(stream->end(), reinterpret_cast<uint8_t*>(&channel),
+                 reinterpret_cast<uint8_t*>(&channel) + sizeof(channel));
+  stream->insert(stream->end(),
+                 reinterpret_cast<uint8_t*>(&net_byte_order_size),
+                 reinterpret_cast<uint8_t*>(&net_byte_order_size) +
+                     sizeof(net_byte_order_size));
+  stream->insert(stream->end(), payload, payload + payload_size);
+}
+
+// Creates a connected pair of loopback TCP sockets. Nagle's algorithm is
+// disabled on |sender| so small writes aren't coalesced.
+bool CreateSocketPair(ftl::UniqueFD* receiver, ftl::UniqueFD* sender) {
+  ftl::UniqueFD listener(socket(AF_INET, SOCK_STREAM, 0));
+  if (!listener.is_valid()) {
+    FTL_LOG(ERROR) << "Failed to create socket, errno " << errno;
+    return false;
+  }
+
+  struct sockaddr_in address;
+  std::memset(&address, 0, sizeof(address));
+  address.sin_family = AF_INET;
+  address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+  socklen_t address_size = sizeof(address);
+
+  if (bind(listener.get(), reinterpret_cast<struct sockaddr*>(&address),
+           sizeof(address)) < 0 ||
+      listen(listener.get(), 1) < 0 ||
+      getsockname(listener.get(), reinterpret_cast<struct sockaddr*>(&address),
+                  &address_size) < 0) {
+    FTL_LOG(ERROR) << "Failed to listen, errno " << errno;
+    return false;
+  }
+
+  sender->reset(socket(AF_INET, SOCK_STREAM, 0));
+  if (!sender->is_valid() ||
+      connect(sender->get(), reinterpret_cast<struct sockaddr*>(&address),
+              sizeof(address)) < 0) {
+    FTL_LOG(ERROR) << "Failed to connect, errno " << errno;
+    return false;
+  }
+
+  int value = 1;
+  if (setsockopt(sender->get(), IPPROTO_TCP, TCP_NODELAY, &value,
+                 sizeof(value)) < 0) {
+    FTL_LOG(WARNING) << "Failed to set TCP_NODELAY, errno " << errno;
+  }
+
+  receiver->reset(accept(listener.get(), nullptr, nullptr));
+  if (!receiver->is_valid()) {
+    FTL_LOG(ERROR) << "Failed to accept, errno " << errno;
+    return false;
+  }
+
+  return true;
+}
+
+// Writes all of |stream| to |fd|, |chunk_size| bytes at a time.
+void WriteStream(int fd,
+                 const std::vector<uint8_t>& stream,
+                 size_t chunk_size) {
+  const uint8_t* bytes = stream.data();
+  size_t remaining = stream.size();
+
+  while (remaining != 0) {
+    ssize_t result = write(fd, bytes, std::min(remaining, chunk_size));
+    if (result < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+
+      FTL_LOG(ERROR) << "Failed to write, errno " << errno;
+      return;
+    }
+
+    bytes += result;
+    remaining -= result;
+  }
+}
+
+bool RunParseBenchmark(uint32_t packet_count,
+                       uint32_t payload_size,
+                       size_t chunk_size) {
+  std::vector<uint8_t> stream;
+  uint32_t version = htonl(kVersion);
+  AppendPacket(kVersionPacketType, reinterpret_cast<uint8_t*>(&version),
+               sizeof(version), &stream);
+  std::vector<uint8_t> payload(payload_size, 0x55);
+  for (uint32_t i = 0; i < packet_count; ++i) {
+    AppendPacket(kMessagePacketType, payload.data(), payload_size, &stream);
+  }
+
+  ftl::UniqueFD receiver;
+  ftl::UniqueFD sender;
+  if (!CreateSocketPair(&receiver, &sender)) {
+    return false;
+  }
+
+  mtl::MessageLoop loop;
+  Measurement measurement;
+
+  BenchmarkTransceiver transceiver(
+      std::move(receiver), packet_count, [&measurement]() {
+        measurement.Pause();
+        mtl::MessageLoop::GetCurrent()->PostQuitTask();
+      });
+
+  std::thread sender_thread([&sender, &stream, chunk_size]() {
+    WriteStream(sender.get(), stream, chunk_size);
+  });
+
+  loop.Run();
+  sender_thread.join();
+  transceiver.CloseConnection();
+
+  // The measurement was paused when the last packet arrived.
+  measurement.Resume();
+  measurement.Report("parse-" + std::to_string(chunk_size), packet_count);
+  return true;
+}
+
+// Builds a query for the service and instances of |instance_count| instances.
+mdns::DnsMessage BuildQuery(uint32_t instance_count) {
+  mdns::DnsMessage message;
+
+  message.questions_.push_back(std::make_shared<mdns::DnsQuestion>(
+      kServiceFullName, mdns::DnsType::kPtr));
+
+  for (uint32_t i = 0; i < instance_count; ++i) {
+    message.questions_.push_back(std::make_shared<mdns::DnsQuestion>(
+        "instance-" + std::to_string(i) + "." + kServiceFullName,
+        mdns::DnsType::kSrv));
+  }
+
+  message.UpdateCounts();
+  return message;
+}
+
+// Builds a response with PTR answers for |instance_count| instances and the
+// SRV, TXT and A records that go with them.
+mdns::DnsMessage BuildResponse(uint32_t instance_count) {
+  mdns::DnsMessage message;
+  message.header_.SetResponse(true);
+  message.header_.SetAuthoritativeAnswer(true);
+
+  for (uint32_t i = 0; i < instance_count; ++i) {
+    std::string instance_full_name =
+        "instance-" + std::to_string(i) + "." + kServiceFullName;
+
+    std::shared_ptr<mdns::DnsResource> ptr =
+        std::make_shared<mdns::DnsResource>(kServiceFullName,
+                                            mdns::DnsType::kPtr);
+    ptr->ptr_.pointer_domain_name_ = instance_full_name;
+    message.answers_.push_back(ptr);
+
+    std::shared_ptr<mdns::DnsResource> srv =
+        std::make_shared<mdns::DnsResource>(instance_full_name,
+                                            mdns::DnsType::kSrv);
+    srv->srv_.port_ = IpPort::From_uint16_t(static_cast<uint16_t>(6000 + i));
+    srv->srv_.target_ = kHostFullName;
+    message.additionals_.push_back(srv);
+
+    std::shared_ptr<mdns::DnsResource> txt =
+        std::make_shared<mdns::DnsResource>(instance_full_name,
+                                            mdns::DnsType::kTxt);
+    txt->txt_.strings_.push_back("version=1");
+    message.additionals_.push_back(txt);
+  }
+
+  std::shared_ptr<mdns::DnsResource> a = std::make_shared<mdns::DnsResource>(
+      kHostFullName, mdns::DnsType::kA);
+  a->a_.address_.address_ = IpAddress(192, 168, 1, 1);
+  message.additionals_.push_back(a);
+
+  message.UpdateCounts();
+  return message;
+}
+
+bool RunDnsRoundTripBenchmark(uint32_t iteration_count) {
+  mdns::DnsMessage messages[] = {BuildQuery(kInstanceCount),
+                                 BuildResponse(kInstanceCount)};
+  std::vector<uint8_t> buffer(1500);
+
+  Measurement measurement;
+
+  for (uint32_t i = 0; i < iteration_count; ++i) {
+    for (const mdns::DnsMessage& message : messages) {
+      mdns::PacketWriter writer(std::move(buffer));
+      writer << message;
+      size_t size = writer.position();
+      buffer = writer.GetPacket();
+
+      mdns::PacketReader reader(buffer.data(), size);
+      mdns::DnsMessage read_message;
+      reader >> read_message;
+      if (!reader.complete()) {
+        FTL_LOG(ERROR) << "Failed to read back a written message";
+        return false;
+      }
+    }
+  }
+
+  measurement.Report("dns-round-trip",
+                     static_cast<uint64_t>(iteration_count) *
+                         (sizeof(messages) / sizeof(messages[0])));
+  return true;
+}
+
+bool RunDnsNameBenchmark(uint32_t iteration_count) {
+  std::vector<mdns::DnsName> names;
+  names.emplace_back(kServiceFullName);
+  for (uint32_t i = 0; i < kInstanceCount; ++i) {
+    names.emplace_back("instance-" + std::to_string(i) + "." +
+                       kServiceFullName);
+  }
+
+  std::vector<uint8_t> buffer(1500);
+
+  Measurement measurement;
+
+  for (uint32_t i = 0; i < iteration_count; ++i) {
+    mdns::PacketWriter writer(std::move(buffer));
+    for (const mdns::DnsName& name : names) {
+      writer << name;
+    }
+
+    buffer = writer.GetPacket();
+  }
+
+  measurement.Report("dns-name",
+                     static_cast<uint64_t>(iteration_count) * names.size());
+  return true;
+}
+
+bool RunRelayDrainBenchmark(uint32_t iteration_count, uint32_t payload_size) {
+  mx::channel local;
+  mx::channel remote;
+  mx_status_t status = mx::channel::create(0u, &local, &remote);
+  if (status != NO_ERROR) {
+    FTL_LOG(ERROR) << "Failed to create channel, status " << status;
+    return false;
+  }
+
+  mtl::MessageLoop loop;
+
+  uint32_t expected_count = 0;
+  uint32_t received_count = 0;
+  MessageRelay relay;
+  relay.SetMessagesReceivedCallback(
+      [&expected_count,
+       &received_count](std::vector<std::vector<uint8_t>> messages) {
+        received_count += messages.size();
+        if (received_count == expected_count) {
+          mtl::MessageLoop::GetCurrent()->PostQuitTask();
+        }
+      });
+  relay.SetChannel(std::move(local));
+
+  std::vector<uint8_t> payload(payload_size, 0x55);
+
+  // Messages are queued a batch at a time, so the channel doesn't fill up.
+  // Only the draining is measured.
+  Measurement measurement;
+  measurement.Pause();
+
+  while (expected_count < iteration_count) {
+    uint32_t batch_size =
+        std::min(kRelayBatchSize, iteration_count - expected_count);
+    for (uint32_t i = 0; i < batch_size; ++i) {
+      status = remote.write(0, payload.data(), payload.size(), nullptr, 0);
+      if (status != NO_ERROR) {
+        FTL_LOG(ERROR) << "Failed to write to channel, status " << status;
+        return false;
+      }
+    }
+
+    expected_count += batch_size;
+
+    measurement.Resume();
+    loop.Run();
+    measurement.Pause();
+  }
+
+  relay.CloseChannel();
+
+  measurement.Resume();
+  measurement.Report("relay-drain", iteration_count);
+  return true;
+}
+
+int Run(const ftl::CommandLine& command_line) {
+  uint32_t iteration_count = kDefaultIterationCount;
+  uint32_t payload_size = kDefaultPayloadSize;
+  if (!GetNumericOption(command_line, "iterations", &iteration_count) ||
+      !GetNumericOption(command_line, "payload-size", &payload_size) ||
+      iteration_count == 0) {
+    return 1;
+  }
+
+  std::string prefix;
+  command_line.GetOptionValue("benchmark", &prefix);
+
+  auto selected = [&prefix](const std::string& name) {
+    return name.compare(0, prefix.size(), prefix) == 0;
+  };
+
+  for (size_t chunk_size : kChunkSizes) {
+    if (selected("parse-" + std::to_string(chunk_size)) &&
+        !RunParseBenchmark(iteration_count, payload_size, chunk_size)) {
+      return 1;
+    }
+  }
+
+  if (selected("dns-round-trip") &&
+      !RunDnsRoundTripBenchmark(iteration_count)) {
+    return 1;
+  }
+
+  if (selected("dns-name") && !RunDnsNameBenchmark(iteration_count)) {
+    return 1;
+  }
+
+  if (selected("relay-drain") &&
+      !RunRelayDrainBenchmark(iteration_count, payload_size)) {
+    return 1;
+  }
+
+  return 0;
+}
+
+}  // namespace
+}  // namespace netconnector
+
+int main(int argc, const char** argv) {
+  return netconnector::Run(ftl::CommandLineFromArgcArgv(argc, argv));
+}
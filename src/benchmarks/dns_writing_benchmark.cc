@@ -0,0 +1,121 @@
+// Copyright 2017 The Fuchsia Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+// Measures the rate at which PacketWriter serializes mDNS responses that
+// advertise a number of service instances.
+//
+// usage: netconnector_mdns_benchmarks [ --iterations=<count> ]
+//                                     [ --instances=<count> ]
+
+#include <iostream>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "apps/netconnector/src/mdns/dns_message.h"
+#include "apps/netconnector/src/mdns/dns_writing.h"
+#include "apps/netconnector/src/mdns/packet_writer.h"
+#include "lib/ftl/command_line.h"
+#include "lib/ftl/logging.h"
+#include "lib/ftl/strings/string_number_conversions.h"
+#include "lib/ftl/time/time_point.h"
+
+namespace netconnector {
+namespace mdns {
+namespace {
+
+constexpr uint32_t kDefaultIterationCount = 100000;
+constexpr uint32_t kDefaultInstanceCount = 8;
+
+const std::string kServiceFullName = "_netconnector._tcp.local.";
+const std::string kHostFullName = "benchmark-host.local.";
+
+bool GetNumericOption(const ftl::CommandLine& command_line,
+                      const char* name,
+                      uint32_t* value) {
+  std::string value_string;
+  if (!command_line.GetOptionValue(name, &value_string)) {
+    return true;
+  }
+
+  if (!ftl::StringToNumberWithError(value_string, value)) {
+    FTL_LOG(ERROR) << "Invalid --" << name << " value " << value_string;
+    return false;
+  }
+
+  return true;
+}
+
+// Builds a response with PTR answers for |instance_count| instances and the
+// SRV, TXT and A records that go with them.
+DnsMessage BuildResponse(uint32_t instance_count) {
+  DnsMessage message;
+  message.header_.SetResponse(true);
+  message.header_.SetAuthoritativeAnswer(true);
+
+  for (uint32_t i = 0; i < instance_count; ++i) {
+    std::string instance_full_name =
+        "instance-" + std::to_string(i) + "." + kServiceFullName;
+
+    std::shared_ptr<DnsResource> ptr =
+        std::make_shared<DnsResource>(kServiceFullName, DnsType::kPtr);
+    ptr->ptr_.pointer_domain_name_ = instance_full_name;
+    message.answers_.push_back(ptr);
+
+    std::shared_ptr<DnsResource> srv =
+        std::make_shared<DnsResource>(instance_full_name, DnsType::kSrv);
+    srv->srv_.port_ = IpPort::From_uint16_t(static_cast<uint16_t>(6000 + i));
+    srv->srv_.target_ = kHostFullName;
+    message.additionals_.push_back(srv);
+
+    std::shared_ptr<DnsResource> txt =
+        std::make_shared<DnsResource>(instance_full_name, DnsType::kTxt);
+    txt->txt_.strings_.push_back("version=1");
+    message.additionals_.push_back(txt);
+  }
+
+  std::shared_ptr<DnsResource> a =
+      std::make_shared<DnsResource>(kHostFullName, DnsType::kA);
+  a->a_.address_.address_ = IpAddress(192, 168, 1, 1);
+  message.additionals_.push_back(a);
+
+  message.UpdateCounts();
+  return message;
+}
+
+int Run(const ftl::CommandLine& command_line) {
+  uint32_t iteration_count = kDefaultIterationCount;
+  uint32_t instance_count = kDefaultInstanceCount;
+  if (!GetNumericOption(command_line, "iterations", &iteration_count) ||
+      !GetNumericOption(command_line, "instances", &instance_count) ||
+      iteration_count == 0) {
+    return 1;
+  }
+
+  DnsMessage message = BuildResponse(instance_count);
+
+  size_t packet_size = 0;
+  ftl::TimePoint start_time = ftl::TimePoint::Now();
+
+  for (uint32_t i = 0; i < iteration_count; ++i) {
+    packet_size = PacketWriter::Write(message).size();
+  }
+
+  double seconds = (ftl::TimePoint::Now() - start_time).ToSecondsF();
+  std::cout << iteration_count << " responses of " << packet_size
+            << " bytes with " << instance_count << " instances written in "
+            << seconds * 1000.0 << " ms, "
+            << static_cast<uint64_t>(iteration_count / seconds)
+            << " responses/sec" << std::endl;
+
+  return 0;
+}
+
+}  // namespace
+}  // namespace mdns
+}  // namespace netconnector
+
+int main(int argc, const char** argv) {
+  return netconnector::mdns::Run(ftl::CommandLineFromArgcArgv(argc, argv));
+}
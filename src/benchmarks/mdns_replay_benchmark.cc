@@ -0,0 +1,178 @@
+// Copyright 2017 The Fuchsia Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+// Measures the rate at which Mdns parses and dispatches captured mDNS
+// traffic, and the heap allocations it makes doing so. The capture is a
+// pcapng file, such as one written by netconnector --mdns-write-capture.
+// Each datagram is parsed with PacketReader and presented to Mdns, which
+// dispatches it to the cache, the resource renewer and the agents. Responses
+// are composed but not sent.
+//
+// usage: netconnector_mdns_replay_benchmark --capture=<file>
+//                                           [ --iterations=<count> ]
+//                                           [ --subscribe=<service> ]
+
+#include <stdlib.h>
+
+#include <iostream>
+#include <memory>
+#include <new>
+#include <string>
+#include <vector>
+
+#include "apps/netconnector/src/mdns/dns_reading.h"
+#include "apps/netconnector/src/mdns/mdns.h"
+#include "apps/netconnector/src/mdns/packet_capture.h"
+#include "apps/netconnector/src/mdns/packet_reader.h"
+#include "lib/ftl/command_line.h"
+#include "lib/ftl/logging.h"
+#include "lib/ftl/strings/string_number_conversions.h"
+#include "lib/ftl/time/time_point.h"
+#include "lib/mtl/tasks/message_loop.h"
+
+namespace {
+
+// Counts calls to the global allocation functions below.
+uint64_t allocation_count = 0;
+
+}  // namespace
+
+void* operator new(size_t size) {
+  ++allocation_count;
+  void* result = malloc(size == 0 ? 1 : size);
+  if (result == nullptr) {
+    abort();
+  }
+
+  return result;
+}
+
+void operator delete(void* ptr) noexcept {
+  free(ptr);
+}
+
+namespace netconnector {
+namespace mdns {
+namespace {
+
+constexpr uint32_t kDefaultIterationCount = 100;
+const std::string kDefaultServiceName = "_fuchsia._tcp.";
+const std::string kHostName = "benchmark-host";
+
+bool GetNumericOption(const ftl::CommandLine& command_line,
+                      const char* name,
+                      uint32_t* value) {
+  std::string value_string;
+  if (!command_line.GetOptionValue(name, &value_string)) {
+    return true;
+  }
+
+  if (!ftl::StringToNumberWithError(value_string, value)) {
+    FTL_LOG(ERROR) << "Invalid --" << name << " value " << value_string;
+    return false;
+  }
+
+  return true;
+}
+
+int Run(const ftl::CommandLine& command_line) {
+  std::string capture_file;
+  if (!command_line.GetOptionValue("capture", &capture_file) ||
+      capture_file.empty()) {
+    FTL_LOG(ERROR) << "--capture=<file> is required";
+    return 1;
+  }
+
+  uint32_t iteration_count = kDefaultIterationCount;
+  if (!GetNumericOption(command_line, "iterations", &iteration_count) ||
+      iteration_count == 0) {
+    return 1;
+  }
+
+  std::string service_name;
+  if (!command_line.GetOptionValue("subscribe", &service_name)) {
+    service_name = kDefaultServiceName;
+  }
+
+  std::vector<PacketCapture::Packet> packets;
+  if (!PacketCapture::ReadFile(capture_file, &packets)) {
+    return 1;
+  }
+
+  if (packets.empty()) {
+    FTL_LOG(ERROR) << "No mDNS datagrams in " << capture_file;
+    return 1;
+  }
+
+  mtl::MessageLoop message_loop;
+
+  Mdns mdns;
+  mdns.StartForReplay(kHostName);
+
+  uint64_t instance_updates = 0;
+  mdns.SubscribeToService(
+      service_name, ServiceFilter(),
+      [&instance_updates](const std::string& service,
+                          const std::string& instance,
+                          const SocketAddress& v4_address,
+                          const SocketAddress& v6_address,
+                          const std::vector<std::string>& text) {
+        ++instance_updates;
+      });
+
+  std::vector<MdnsTransceiver::InboundMessage> messages;
+  messages.reserve(1);
+  uint64_t parse_failures = 0;
+  uint64_t bytes = 0;
+
+  uint64_t start_allocation_count = allocation_count;
+  ftl::TimePoint start_time = ftl::TimePoint::Now();
+
+  for (uint32_t i = 0; i < iteration_count; ++i) {
+    for (const PacketCapture::Packet& packet : packets) {
+      bytes += packet.data_.size();
+
+      PacketReader reader(packet.data_);
+      std::unique_ptr<DnsMessage> message = std::make_unique<DnsMessage>();
+      reader >> *message.get();
+
+      if (!reader.complete()) {
+        ++parse_failures;
+        continue;
+      }
+
+      // Captures don't record hop limits, so replayed queries are taken to
+      // be on-link.
+      messages.push_back({std::move(message), packet.source_address_, true});
+      mdns.ReceiveMessages(&messages, packet.interface_index_);
+      messages.clear();
+    }
+  }
+
+  double seconds = (ftl::TimePoint::Now() - start_time).ToSecondsF();
+  uint64_t allocations = allocation_count - start_allocation_count;
+  uint64_t packet_count =
+      static_cast<uint64_t>(packets.size()) * iteration_count;
+
+  std::cout << packet_count << " datagrams (" << bytes << " bytes) replayed in "
+            << seconds * 1000.0 << " ms, "
+            << static_cast<uint64_t>(packet_count / seconds)
+            << " datagrams/sec" << std::endl;
+  std::cout << allocations << " allocations, "
+            << static_cast<double>(allocations) / packet_count
+            << " per datagram" << std::endl;
+  std::cout << parse_failures << " parse failures, " << instance_updates
+            << " " << service_name << " instance updates" << std::endl;
+
+  mdns.Stop();
+  return 0;
+}
+
+}  // namespace
+}  // namespace mdns
+}  // namespace netconnector
+
+int main(int argc, const char** argv) {
+  return netconnector::mdns::Run(ftl::CommandLineFromArgcArgv(argc, argv));
+}
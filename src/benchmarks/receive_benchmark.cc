@@ -0,0 +1,237 @@
+// Copyright 2017 The Fuchsia Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+// Measures the rate at which MessageTransciever receives and parses small
+// message packets arriving on a loopback TCP connection.
+//
+// usage: netconnector_benchmarks [ --packets=<count> ]
+//                                [ --payload-size=<bytes> ]
+
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include <cstring>
+#include <functional>
+#include <iostream>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "apps/netconnector/src/message_transceiver.h"
+#include "lib/ftl/command_line.h"
+#include "lib/ftl/files/unique_fd.h"
+#include "lib/ftl/logging.h"
+#include "lib/ftl/strings/string_number_conversions.h"
+#include "lib/ftl/time/time_point.h"
+#include "lib/mtl/tasks/message_loop.h"
+
+namespace netconnector {
+namespace {
+
+constexpr uint32_t kDefaultPacketCount = 1000000;
+constexpr uint32_t kDefaultPayloadSize = 32;
+
+// These mirror the wire format described in message_transceiver.h.
+constexpr size_t kHeaderSize = 8;
+constexpr uint8_t kSentinel = 0xcc;
+constexpr uint8_t kVersionPacketType = 0;
+constexpr uint8_t kMessagePacketType = 2;
+constexpr uint32_t kVersion = 3;
+
+// A transceiver that counts the messages it receives on the primary channel.
+class BenchmarkTransceiver : public MessageTransciever {
+ public:
+  BenchmarkTransceiver(ftl::UniqueFD socket_fd,
+                       uint32_t expected_message_count,
+                       std::function<void()> done_callback)
+      : MessageTransciever(std::move(socket_fd), false),
+        expected_message_count_(expected_message_count),
+        done_callback_(done_callback) {}
+
+  ~BenchmarkTransceiver() override {}
+
+  using MessageTransciever::CloseConnection;
+
+ protected:
+  void OnVersionReceived(uint32_t version) override {}
+
+  void OnServiceNameReceived(const std::string& service_name) override {}
+
+  void OnChannelRequested(uint16_t channel_id,
+                          const std::string& service_name) override {}
+
+  void OnMessageReceived(std::vector<uint8_t> message) override {
+    if (++received_message_count_ == expected_message_count_) {
+      done_callback_();
+    }
+  }
+
+ private:
+  uint32_t expected_message_count_;
+  uint32_t received_message_count_ = 0;
+  std::function<void()> done_callback_;
+
+  FTL_DISALLOW_COPY_AND_ASSIGN(BenchmarkTransceiver);
+};
+
+bool GetNumericOption(const ftl::CommandLine& command_line,
+                      const char* name,
+                      uint32_t* value) {
+  std::string value_string;
+  if (!command_line.GetOptionValue(name, &value_string)) {
+    return true;
+  }
+
+  if (!ftl::StringToNumberWithError(value_string, value)) {
+    FTL_LOG(ERROR) << "Invalid --" << name << " value " << value_string;
+    return false;
+  }
+
+  return true;
+}
+
+// Appends a packet to |stream|.
+void AppendPacket(uint8_t type,
+                  const uint8_t* payload,
+                  uint32_t payload_size,
+                  std::vector<uint8_t>* stream) {
+  uint16_t channel = htons(0);
+  uint32_t net_byte_order_size = htonl(payload_size);
+
+  stream->push_back(kSentinel);
+  stream->push_back(type);
+  stream->insert(stream->end(), reinterpret_cast<uint8_t*>(&channel),
+                 reinterpret_cast<uint8_t*>(&channel) + sizeof(channel));
+  stream->insert(stream->end(),
+                 reinterpret_cast<uint8_t*>(&net_byte_order_size),
+                 reinterpret_cast<uint8_t*>(&net_byte_order_size) +
+                     sizeof(net_byte_order_size));
+  stream->insert(stream->end(), payload, payload + payload_size);
+}
+
+// Creates a connected pair of loopback TCP sockets.
+bool CreateSocketPair(ftl::UniqueFD* receiver, ftl::UniqueFD* sender) {
+  ftl::UniqueFD listener(socket(AF_INET, SOCK_STREAM, 0));
+  if (!listener.is_valid()) {
+    FTL_LOG(ERROR) << "Failed to create socket, errno " << errno;
+    return false;
+  }
+
+  struct sockaddr_in address;
+  std::memset(&address, 0, sizeof(address));
+  address.sin_family = AF_INET;
+  address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+  socklen_t address_size = sizeof(address);
+
+  if (bind(listener.get(), reinterpret_cast<struct sockaddr*>(&address),
+           sizeof(address)) < 0 ||
+      listen(listener.get(), 1) < 0 ||
+      getsockname(listener.get(), reinterpret_cast<struct sockaddr*>(&address),
+                  &address_size) < 0) {
+    FTL_LOG(ERROR) << "Failed to listen, errno " << errno;
+    return false;
+  }
+
+  sender->reset(socket(AF_INET, SOCK_STREAM, 0));
+  if (!sender->is_valid() ||
+      connect(sender->get(), reinterpret_cast<struct sockaddr*>(&address),
+              sizeof(address)) < 0) {
+    FTL_LOG(ERROR) << "Failed to connect, errno " << errno;
+    return false;
+  }
+
+  receiver->reset(accept(listener.get(), nullptr, nullptr));
+  if (!receiver->is_valid()) {
+    FTL_LOG(ERROR) << "Failed to accept, errno " << errno;
+    return false;
+  }
+
+  return true;
+}
+
+// Writes all of |stream| to |fd|.
+void WriteStream(int fd, const std::vector<uint8_t>& stream) {
+  const uint8_t* bytes = stream.data();
+  size_t remaining = stream.size();
+
+  while (remaining != 0) {
+    ssize_t result = write(fd, bytes, remaining);
+    if (result < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+
+      FTL_LOG(ERROR) << "Failed to write, errno " << errno;
+      return;
+    }
+
+    bytes += result;
+    remaining -= result;
+  }
+}
+
+int Run(const ftl::CommandLine& command_line) {
+  uint32_t packet_count = kDefaultPacketCount;
+  uint32_t payload_size = kDefaultPayloadSize;
+  if (!GetNumericOption(command_line, "packets", &packet_count) ||
+      !GetNumericOption(command_line, "payload-size", &payload_size) ||
+      packet_count == 0) {
+    return 1;
+  }
+
+  // Build the byte stream in advance so the sender isn't the bottleneck.
+  std::vector<uint8_t> stream;
+  stream.reserve(kHeaderSize + sizeof(uint32_t) +
+                 static_cast<size_t>(packet_count) *
+                     (kHeaderSize + payload_size));
+  uint32_t version = htonl(kVersion);
+  AppendPacket(kVersionPacketType, reinterpret_cast<uint8_t*>(&version),
+               sizeof(version), &stream);
+  std::vector<uint8_t> payload(payload_size, 0x55);
+  for (uint32_t i = 0; i < packet_count; ++i) {
+    AppendPacket(kMessagePacketType, payload.data(), payload_size, &stream);
+  }
+
+  ftl::UniqueFD receiver;
+  ftl::UniqueFD sender;
+  if (!CreateSocketPair(&receiver, &sender)) {
+    return 1;
+  }
+
+  mtl::MessageLoop loop;
+
+  ftl::TimePoint start_time = ftl::TimePoint::Now();
+  ftl::TimePoint end_time;
+
+  BenchmarkTransceiver transceiver(std::move(receiver), packet_count,
+                                   [&end_time]() {
+                                     end_time = ftl::TimePoint::Now();
+                                     mtl::MessageLoop::GetCurrent()
+                                         ->PostQuitTask();
+                                   });
+
+  std::thread sender_thread(
+      [&sender, &stream]() { WriteStream(sender.get(), stream); });
+
+  loop.Run();
+  sender_thread.join();
+  transceiver.CloseConnection();
+
+  double seconds = (end_time - start_time).ToSecondsF();
+  std::cout << packet_count << " packets with " << payload_size
+            << "-byte payloads received in " << seconds * 1000.0 << " ms, "
+            << static_cast<uint64_t>(packet_count / seconds)
+            << " packets/sec" << std::endl;
+
+  return 0;
+}
+
+}  // namespace
+}  // namespace netconnector
+
+int main(int argc, const char** argv) {
+  return netconnector::Run(ftl::CommandLineFromArgcArgv(argc, argv));
+}
@@ -0,0 +1,103 @@
+// Copyright 2017 The Fuchsia Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#include "apps/netconnector/src/device_directory.h"
+
+#include "lib/ftl/logging.h"
+
+namespace netconnector {
+
+// static
+constexpr uint64_t DeviceDirectory::kInitialVersion;
+// static
+constexpr size_t DeviceDirectory::kMaxRetainedSnapshots;
+
+DeviceDirectory::DeviceDirectory() {
+  // The first snapshot is empty, and its version is the first one newer than
+  // |kInitialVersion|.
+  std::shared_ptr<Snapshot> snapshot = std::make_shared<Snapshot>();
+  snapshot->version_ = kInitialVersion + 1;
+  snapshots_.push_back(snapshot);
+}
+
+DeviceDirectory::~DeviceDirectory() {}
+
+void DeviceDirectory::Update(std::map<std::string, Device> devices_by_name) {
+  if (devices_by_name == current()->devices_by_name_) {
+    return;
+  }
+
+  std::shared_ptr<Snapshot> snapshot = std::make_shared<Snapshot>();
+  snapshot->version_ = current()->version_ + 1;
+  snapshot->devices_by_name_ = std::move(devices_by_name);
+  snapshots_.push_back(snapshot);
+
+  while (snapshots_.size() > kMaxRetainedSnapshots) {
+    snapshots_.pop_front();
+  }
+
+  // Callbacks may call |Get| again, so the pending list is swapped out first.
+  std::vector<std::pair<uint64_t, Callback>> pending_callbacks;
+  pending_callbacks.swap(pending_callbacks_);
+
+  for (auto& pair : pending_callbacks) {
+    pair.second(current(), Find(pair.first));
+  }
+}
+
+void DeviceDirectory::Get(uint64_t version_last_seen,
+                          const Callback& callback) {
+  FTL_DCHECK(callback);
+
+  if (version_last_seen < current()->version_) {
+    callback(current(), Find(version_last_seen));
+  } else {
+    pending_callbacks_.emplace_back(version_last_seen, callback);
+  }
+}
+
+// static
+DeviceDirectory::Changes DeviceDirectory::Diff(const Snapshot& base,
+                                               const Snapshot& current) {
+  Changes changes;
+
+  // Both maps are ordered by name, so they can be merged in one pass.
+  auto base_iter = base.devices_by_name_.begin();
+  auto current_iter = current.devices_by_name_.begin();
+
+  while (base_iter != base.devices_by_name_.end() ||
+         current_iter != current.devices_by_name_.end()) {
+    if (current_iter == current.devices_by_name_.end() ||
+        (base_iter != base.devices_by_name_.end() &&
+         base_iter->first < current_iter->first)) {
+      changes.removed_.push_back(base_iter->first);
+      ++base_iter;
+    } else if (base_iter == base.devices_by_name_.end() ||
+               current_iter->first < base_iter->first) {
+      changes.changed_.push_back(current_iter->first);
+      ++current_iter;
+    } else {
+      if (base_iter->second != current_iter->second) {
+        changes.changed_.push_back(current_iter->first);
+      }
+
+      ++base_iter;
+      ++current_iter;
+    }
+  }
+
+  return changes;
+}
+
+DeviceDirectory::SnapshotPtr DeviceDirectory::Find(uint64_t version) const {
+  for (const SnapshotPtr& snapshot : snapshots_) {
+    if (snapshot->version_ == version) {
+      return snapshot;
+    }
+  }
+
+  return nullptr;
+}
+
+}  // namespace netconnector
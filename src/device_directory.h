@@ -0,0 +1,98 @@
+// Copyright 2017 The Fuchsia Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#pragma once
+
+#include <stdint.h>
+
+#include <deque>
+#include <functional>
+#include <map>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "apps/netconnector/src/netconnector_params.h"
+#include "lib/ftl/macros.h"
+
+namespace netconnector {
+
+// Versioned snapshots of the known devices and what they advertise. Each
+// snapshot is immutable and shared by every caller that asks for that
+// version, and recent snapshots are retained so callers can be sent just the
+// changes since the version they last saw.
+class DeviceDirectory {
+ public:
+  // Version that no snapshot has, used to request the current snapshot.
+  static constexpr uint64_t kInitialVersion = 0;
+
+  // The number of snapshots retained for computing changes. Callers that are
+  // further behind than this are sent a complete snapshot.
+  static constexpr size_t kMaxRetainedSnapshots = 16;
+
+  struct Device {
+    bool operator==(const Device& other) const {
+      return addresses_.v4_ == other.addresses_.v4_ &&
+             addresses_.v6_ == other.addresses_.v6_ &&
+             services_ == other.services_ && load_ == other.load_;
+    }
+
+    bool operator!=(const Device& other) const { return !(*this == other); }
+
+    DeviceAddresses addresses_;
+    // Sorted names of the services the device advertises.
+    std::vector<std::string> services_;
+    // The number of connections the device was serving.
+    uint32_t load_ = 0;
+  };
+
+  struct Snapshot {
+    uint64_t version_;
+    std::map<std::string, Device> devices_by_name_;
+  };
+
+  using SnapshotPtr = std::shared_ptr<const Snapshot>;
+
+  // Called with the current snapshot and, if it's retained, the snapshot the
+  // caller last saw. |base| is null if the caller must take |current| whole.
+  using Callback = std::function<void(const SnapshotPtr& current,
+                                      const SnapshotPtr& base)>;
+
+  // Names of the devices added or changed and of the devices removed between
+  // two snapshots.
+  struct Changes {
+    std::vector<std::string> changed_;
+    std::vector<std::string> removed_;
+  };
+
+  DeviceDirectory();
+
+  ~DeviceDirectory();
+
+  // Returns the current snapshot.
+  const SnapshotPtr& current() const { return snapshots_.back(); }
+
+  // Makes |devices_by_name| the current snapshot and calls back the callers
+  // waiting for a new version. Does nothing if nothing has changed.
+  void Update(std::map<std::string, Device> devices_by_name);
+
+  // Calls |callback| as soon as the current version is newer than
+  // |version_last_seen|, which may be immediately.
+  void Get(uint64_t version_last_seen, const Callback& callback);
+
+  // Returns the changes from |base| to |current|.
+  static Changes Diff(const Snapshot& base, const Snapshot& current);
+
+ private:
+  // Returns the retained snapshot with version |version|, or null.
+  SnapshotPtr Find(uint64_t version) const;
+
+  // Oldest first, so the current snapshot is at the back.
+  std::deque<SnapshotPtr> snapshots_;
+  std::vector<std::pair<uint64_t, Callback>> pending_callbacks_;
+
+  FTL_DISALLOW_COPY_AND_ASSIGN(DeviceDirectory);
+};
+
+}  // namespace netconnector
@@ -7,7 +7,6 @@
 #include <memory>
 
 #include "apps/netconnector/src/netconnector_impl.h"
-#include "apps/netconnector/src/requestor_agent.h"
 #include "apps/netconnector/src/socket_address.h"
 #include "lib/ftl/logging.h"
 
@@ -17,19 +16,23 @@ namespace netconnector {
 std::unique_ptr<DeviceServiceProvider> DeviceServiceProvider::Create(
     const std::string& device_name,
     const SocketAddress& address,
+    const SocketAddress& alternate_address,
     fidl::InterfaceRequest<app::ServiceProvider> request,
     NetConnectorImpl* owner) {
-  return std::unique_ptr<DeviceServiceProvider>(new DeviceServiceProvider(
-      device_name, address, std::move(request), owner));
+  return std::unique_ptr<DeviceServiceProvider>(
+      new DeviceServiceProvider(device_name, address, alternate_address,
+                                std::move(request), owner));
 }
 
 DeviceServiceProvider::DeviceServiceProvider(
     const std::string& device_name,
     const SocketAddress& address,
+    const SocketAddress& alternate_address,
     fidl::InterfaceRequest<app::ServiceProvider> request,
     NetConnectorImpl* owner)
     : device_name_(device_name),
       address_(address),
+      alternate_address_(alternate_address),
       binding_(this, std::move(request)),
       owner_(owner) {
   FTL_DCHECK(!device_name_.empty());
@@ -47,15 +50,17 @@ DeviceServiceProvider::~DeviceServiceProvider() {}
 
 void DeviceServiceProvider::ConnectToService(const fidl::String& service_name,
                                              mx::channel channel) {
-  std::unique_ptr<RequestorAgent> requestor_agent = RequestorAgent::Create(
-      address_, service_name, std::move(channel), owner_);
-
-  if (!requestor_agent) {
-    FTL_LOG(ERROR) << "Connection failed, device " << device_name_;
+  if (!owner_->DeviceMayProvideService(device_name_, service_name)) {
+    // Dropping the channel tells the requestor right away.
+    FTL_LOG(ERROR) << "Device " << device_name_
+                   << " doesn't provide service " << service_name;
     return;
   }
 
-  owner_->AddRequestorAgent(std::move(requestor_agent));
+  if (!owner_->ConnectToRemoteService(address_, alternate_address_,
+                                      service_name, &channel)) {
+    FTL_LOG(ERROR) << "Connection failed, device " << device_name_;
+  }
 }
 
 }  // namespace netconnector
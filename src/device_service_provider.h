@@ -19,9 +19,13 @@ class NetConnectorImpl;
 // Provides services on a remote device.
 class DeviceServiceProvider : public app::ServiceProvider {
  public:
+  // Creates a service provider for the device at |address|. If
+  // |alternate_address| is valid, new connections to the device race connects
+  // to both addresses.
   static std::unique_ptr<DeviceServiceProvider> Create(
       const std::string& device_name,
       const SocketAddress& address,
+      const SocketAddress& alternate_address,
       fidl::InterfaceRequest<app::ServiceProvider> request,
       NetConnectorImpl* owner);
 
@@ -33,11 +37,13 @@ class DeviceServiceProvider : public app::ServiceProvider {
  private:
   DeviceServiceProvider(const std::string& device_name,
                         const SocketAddress& address,
+                        const SocketAddress& alternate_address,
                         fidl::InterfaceRequest<app::ServiceProvider> request,
                         NetConnectorImpl* owner);
 
   std::string device_name_;
   SocketAddress address_;
+  SocketAddress alternate_address_;
   fidl::Binding<app::ServiceProvider> binding_;
   NetConnectorImpl* owner_;
 
@@ -118,6 +118,14 @@ IpAddress::IpAddress(const sockaddr* addr) {
   }
 }
 
+bool IpAddress::is_loopback() const {
+  if (is_v4()) {
+    return as_bytes()[0] == 127;
+  }
+
+  return is_v6() && IN6_IS_ADDR_LOOPBACK(&v6_);
+}
+
 std::string IpAddress::ToString() const {
   std::ostringstream os;
   os << *this;
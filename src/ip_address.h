@@ -59,6 +59,9 @@ class IpAddress {
 
   bool is_v6() const { return family() == AF_INET6; }
 
+  // Determines whether this is a loopback address (127.0.0.0/8 or ::1).
+  bool is_loopback() const;
+
   const in_addr& as_in_addr() const {
     FTL_DCHECK(is_v4());
     return v4_;
@@ -0,0 +1,113 @@
+// Copyright 2017 The Fuchsia Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#include "apps/netconnector/src/latency_tracer.h"
+
+#include "lib/ftl/logging.h"
+
+namespace netconnector {
+
+LatencyHistogram::LatencyHistogram() {
+  for (size_t i = 0; i < kBucketCount; ++i) {
+    buckets_[i] = 0;
+  }
+}
+
+void LatencyHistogram::Record(ftl::TimeDelta latency) {
+  int64_t microseconds = latency.ToMicroseconds();
+  size_t bucket = 0;
+  while (bucket < kBucketCount - 1 && (int64_t(1) << bucket) <= microseconds) {
+    ++bucket;
+  }
+
+  ++buckets_[bucket];
+  ++count_;
+  if (max_ < latency) {
+    max_ = latency;
+  }
+}
+
+ftl::TimeDelta LatencyHistogram::Percentile(double fraction) const {
+  FTL_DCHECK(fraction >= 0.0 && fraction <= 1.0);
+
+  uint64_t threshold = static_cast<uint64_t>(count_ * fraction);
+  uint64_t seen = 0;
+  for (size_t bucket = 0; bucket < kBucketCount - 1; ++bucket) {
+    seen += buckets_[bucket];
+    if (seen > threshold || seen == count_) {
+      ftl::TimeDelta bound =
+          ftl::TimeDelta::FromMicroseconds(int64_t(1) << bucket);
+      return bound < max_ ? bound : max_;
+    }
+  }
+
+  return max_;
+}
+
+// static
+LatencyTracer* LatencyTracer::Get() {
+  static LatencyTracer* tracer = new LatencyTracer();
+  return tracer;
+}
+
+// static
+const char* LatencyTracer::StageName(Stage stage) {
+  switch (stage) {
+    case Stage::kSendQueue:
+      return "send queue";
+    case Stage::kSendWrite:
+      return "send write";
+    case Stage::kReceiveAssembly:
+      return "receive assembly";
+    case Stage::kReceiveQueue:
+      return "receive queue";
+    case Stage::kReceiveWrite:
+      return "receive write";
+    case Stage::kCount:
+      break;
+  }
+
+  FTL_NOTREACHED();
+  return "";
+}
+
+LatencyTracer::LatencyTracer() : enabled_(false) {}
+
+LatencyTracer::~LatencyTracer() {
+  FTL_NOTREACHED();
+}
+
+void LatencyTracer::Record(const std::string& service_name,
+                           Stage stage,
+                           ftl::TimeDelta latency) {
+  FTL_DCHECK(stage < Stage::kCount);
+
+  ftl::MutexLocker locker(&mutex_);
+  histograms_by_service_[service_name]
+      .histograms_[static_cast<size_t>(stage)]
+      .Record(latency);
+}
+
+std::vector<LatencyTracer::Summary> LatencyTracer::GetSummaries() {
+  std::vector<Summary> summaries;
+
+  ftl::MutexLocker locker(&mutex_);
+  for (auto& pair : histograms_by_service_) {
+    for (size_t i = 0; i < static_cast<size_t>(Stage::kCount); ++i) {
+      const LatencyHistogram& histogram = pair.second.histograms_[i];
+      if (histogram.count() == 0) {
+        continue;
+      }
+
+      summaries.push_back({pair.first, static_cast<Stage>(i),
+                           histogram.count(), histogram.Percentile(0.5),
+                           histogram.Percentile(0.9),
+                           histogram.Percentile(0.99), histogram.max()});
+    }
+  }
+
+  return summaries;
+}
+
+}  // namespace netconnector
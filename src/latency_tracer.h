@@ -0,0 +1,123 @@
+// Copyright 2017 The Fuchsia Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#pragma once
+
+#include <atomic>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include "lib/ftl/macros.h"
+#include "lib/ftl/synchronization/mutex.h"
+#include "lib/ftl/synchronization/thread_annotations.h"
+#include "lib/ftl/time/time_delta.h"
+
+namespace netconnector {
+
+// A histogram of latencies with power-of-two microsecond buckets.
+class LatencyHistogram {
+ public:
+  LatencyHistogram();
+
+  // Adds a sample.
+  void Record(ftl::TimeDelta latency);
+
+  // Returns the number of samples.
+  uint64_t count() const { return count_; }
+
+  // Returns the largest sample.
+  ftl::TimeDelta max() const { return max_; }
+
+  // Returns an upper bound on the latency of the given fraction of the
+  // samples. |fraction| must be in the range 0.0 to 1.0.
+  ftl::TimeDelta Percentile(double fraction) const;
+
+ private:
+  // Bucket n holds samples of less than 2^n microseconds. The last bucket
+  // also holds anything larger.
+  static const size_t kBucketCount = 32;
+
+  uint64_t buckets_[kBucketCount];
+  uint64_t count_ = 0;
+  ftl::TimeDelta max_;
+};
+
+// Collects the time messages spend in each stage of their trip through
+// netconnector, by service name. Tracing is off by default, in which case
+// transceivers don't take timestamps at all.
+//
+// LatencyTracer is thread-safe.
+class LatencyTracer {
+ public:
+  enum class Stage {
+    // From when a message is queued on the main thread to when the I/O
+    // thread picks it up.
+    kSendQueue,
+    // From when the I/O thread picks up a message to when the last of it is
+    // written to the socket.
+    kSendWrite,
+    // From when the first bytes of a packet are received to when the packet
+    // is complete.
+    kReceiveAssembly,
+    // From when a received message is complete to when the main thread
+    // handles it.
+    kReceiveQueue,
+    // Time taken by the main thread to hand a received message to its
+    // channel.
+    kReceiveWrite,
+    kCount
+  };
+
+  // Latency summary for a service and stage.
+  struct Summary {
+    std::string service_name_;
+    Stage stage_;
+    uint64_t count_;
+    ftl::TimeDelta p50_;
+    ftl::TimeDelta p90_;
+    ftl::TimeDelta p99_;
+    ftl::TimeDelta max_;
+  };
+
+  // Returns the process-wide tracer, creating it on first use.
+  static LatencyTracer* Get();
+
+  // Returns the name of |stage| for display.
+  static const char* StageName(Stage stage);
+
+  // Enables or disables tracing. This only affects transceivers created
+  // subsequently.
+  void SetEnabled(bool enabled) { enabled_ = enabled; }
+
+  // Indicates whether tracing is enabled.
+  bool enabled() const { return enabled_; }
+
+  // Records a latency sample.
+  void Record(const std::string& service_name,
+              Stage stage,
+              ftl::TimeDelta latency);
+
+  // Returns summaries for all the services and stages that have samples.
+  std::vector<Summary> GetSummaries();
+
+ private:
+  struct ServiceHistograms {
+    LatencyHistogram histograms_[static_cast<size_t>(Stage::kCount)];
+  };
+
+  LatencyTracer();
+
+  // The tracer lives for the life of the process, so this is never called.
+  ~LatencyTracer();
+
+  std::atomic<bool> enabled_;
+  ftl::Mutex mutex_;
+  std::unordered_map<std::string, ServiceHistograms> histograms_by_service_
+      FTL_GUARDED_BY(mutex_);
+
+  FTL_DISALLOW_COPY_AND_ASSIGN(LatencyTracer);
+};
+
+}  // namespace netconnector
@@ -6,6 +6,9 @@
 
 #include <arpa/inet.h>
 #include <errno.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <string.h>
 #include <sys/socket.h>
 
 #include "apps/netconnector/src/ip_port.h"
@@ -15,6 +18,25 @@
 #include "lib/mtl/tasks/message_loop.h"
 
 namespace netconnector {
+namespace {
+
+// Converts an address returned by accept to a |SocketAddress|. V4 addresses
+// mapped to V6 by a dual-stack socket are converted back to V4, so they match
+// the addresses devices are registered with.
+SocketAddress ToSocketAddress(const sockaddr_storage& addr) {
+  if (addr.ss_family == AF_INET6) {
+    const sockaddr_in6& v6 = reinterpret_cast<const sockaddr_in6&>(addr);
+    if (IN6_IS_ADDR_V4MAPPED(&v6.sin6_addr)) {
+      in_addr v4;
+      memcpy(&v4, &v6.sin6_addr.s6_addr[12], sizeof(v4));
+      return SocketAddress(IpAddress(v4), IpPort::From_in_port_t(v6.sin6_port));
+    }
+  }
+
+  return SocketAddress(addr);
+}
+
+}  // namespace
 
 Listener::Listener()
     : task_runner_(mtl::MessageLoop::GetCurrent()->task_runner()) {}
@@ -23,30 +45,64 @@ Listener::~Listener() {
   Stop();
 }
 
-void Listener::Start(
-    IpPort port,
-    std::function<void(ftl::UniqueFD)> new_connection_callback) {
+void Listener::Start(IpPort port,
+                     const NewConnectionCallback& new_connection_callback) {
   FTL_DCHECK(!socket_fd_.is_valid()) << "Started when already listening";
 
-  socket_fd_ = ftl::UniqueFD(socket(AF_INET, SOCK_STREAM, 0));
+  // A V6 socket that isn't V6-only accepts V4 connections too. If the stack
+  // doesn't support that, we fall back to V4 only.
+  socket_fd_ = ftl::UniqueFD(socket(AF_INET6, SOCK_STREAM, 0));
+  if (socket_fd_.is_valid()) {
+    int v6_only = 0;
+    struct sockaddr_in6 listener_address;
+    memset(&listener_address, 0, sizeof(listener_address));
+    listener_address.sin6_family = AF_INET6;
+    listener_address.sin6_addr = in6addr_any;
+    listener_address.sin6_port = port.as_in_port_t();
+
+    if (setsockopt(socket_fd_.get(), IPPROTO_IPV6, IPV6_V6ONLY, &v6_only,
+                   sizeof(v6_only)) < 0 ||
+        bind(socket_fd_.get(), (struct sockaddr*)&listener_address,
+             sizeof(listener_address)) < 0) {
+      FTL_LOG(WARNING) << "Failed to bind dual-stack listening socket, errno "
+                       << errno << ", listening on V4 only";
+      socket_fd_.reset();
+    }
+  }
 
   if (!socket_fd_.is_valid()) {
-    FTL_LOG(ERROR) << "Failed to open socket for listening, errno " << errno;
-    return;
-  }
+    socket_fd_ = ftl::UniqueFD(socket(AF_INET, SOCK_STREAM, 0));
 
-  struct sockaddr_in listener_address;
-  listener_address.sin_family = AF_INET;
-  listener_address.sin_addr.s_addr = INADDR_ANY;
-  listener_address.sin_port = port.as_in_port_t();
+    if (!socket_fd_.is_valid()) {
+      FTL_LOG(ERROR) << "Failed to open socket for listening, errno " << errno;
+      return;
+    }
 
-  if (bind(socket_fd_.get(), (struct sockaddr*)&listener_address,
-           sizeof(listener_address)) < 0) {
-    FTL_LOG(ERROR) << "Failed to bind listening socket, errno " << errno;
-    socket_fd_.reset();
-    return;
+    struct sockaddr_in listener_address;
+    listener_address.sin_family = AF_INET;
+    listener_address.sin_addr.s_addr = INADDR_ANY;
+    listener_address.sin_port = port.as_in_port_t();
+
+    if (bind(socket_fd_.get(), (struct sockaddr*)&listener_address,
+             sizeof(listener_address)) < 0) {
+      FTL_LOG(ERROR) << "Failed to bind listening socket, errno " << errno;
+      socket_fd_.reset();
+      return;
+    }
   }
 
+#ifdef TCP_FASTOPEN
+  if (fast_open_) {
+    // The option's value is the number of connections that may be waiting
+    // for the handshake to complete after their SYN data was accepted.
+    int queue_depth = kListenerQueueDepth;
+    if (setsockopt(socket_fd_.get(), IPPROTO_TCP, TCP_FASTOPEN, &queue_depth,
+                   sizeof(queue_depth)) < 0) {
+      FTL_LOG(WARNING) << "Failed to enable TCP fast open, errno " << errno;
+    }
+  }
+#endif
+
   if (listen(socket_fd_.get(), kListenerQueueDepth) < 0) {
     FTL_LOG(ERROR) << "Failed to listen on listening socket, errno " << errno;
     socket_fd_.reset();
@@ -72,7 +128,7 @@ void Listener::Stop() {
 
 void Listener::Worker() {
   while (socket_fd_.is_valid()) {
-    struct sockaddr_in connection_address;
+    struct sockaddr_storage connection_address;
     socklen_t connection_address_size = sizeof(connection_address);
 
     ftl::UniqueFD connection_fd(accept(socket_fd_.get(),
@@ -89,9 +145,11 @@ void Listener::Worker() {
       break;
     }
 
-    task_runner_->PostTask(
-        ftl::MakeCopyable([ this, fd = std::move(connection_fd) ]() mutable {
-          new_connection_callback_(std::move(fd));
+    SocketAddress address = ToSocketAddress(connection_address);
+
+    task_runner_->PostTask(ftl::MakeCopyable(
+        [ this, fd = std::move(connection_fd), address ]() mutable {
+          new_connection_callback_(std::move(fd), address);
         }));
   }
 }
@@ -8,6 +8,7 @@
 #include <thread>
 
 #include "apps/netconnector/src/ip_port.h"
+#include "apps/netconnector/src/socket_address.h"
 #include "lib/ftl/files/unique_fd.h"
 #include "lib/ftl/macros.h"
 #include "lib/ftl/tasks/task_runner.h"
@@ -24,10 +25,18 @@ class Listener {
 
   ~Listener();
 
+  // Callback to deliver a new connection with the address of the remote
+  // party.
+  using NewConnectionCallback =
+      std::function<void(ftl::UniqueFD, const SocketAddress&)>;
+
   // Starts listening on |port|. |new_connection_callback| is called when a new
   // connection is requested.
-  void Start(IpPort port,
-             std::function<void(ftl::UniqueFD)> new_connection_callback);
+  void Start(IpPort port, const NewConnectionCallback& new_connection_callback);
+
+  // Has the listening socket accept data in the SYN from requestors that use
+  // TCP fast open, if the stack supports it. Must be called before |Start|.
+  void EnableFastOpen() { fast_open_ = true; }
 
   // Stops the listener.
   void Stop();
@@ -38,8 +47,9 @@ class Listener {
   void Worker();
 
   ftl::RefPtr<ftl::TaskRunner> task_runner_;
-  std::function<void(ftl::UniqueFD)> new_connection_callback_;
+  NewConnectionCallback new_connection_callback_;
   ftl::UniqueFD socket_fd_;
+  bool fast_open_ = false;
   std::thread worker_thread_;
 
   FTL_DISALLOW_COPY_AND_ASSIGN(Listener);
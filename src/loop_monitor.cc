@@ -0,0 +1,123 @@
+// Copyright 2017 The Fuchsia Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#include "apps/netconnector/src/loop_monitor.h"
+
+#include "lib/ftl/logging.h"
+#include "lib/mtl/tasks/message_loop.h"
+
+namespace netconnector {
+
+LoopMonitor::ScopedTask::ScopedTask(Category category) : category_(category) {
+  if (LoopMonitor::Get()->task_timing_enabled()) {
+    start_time_ = ftl::TimePoint::Now();
+  }
+}
+
+LoopMonitor::ScopedTask::~ScopedTask() {
+  if (start_time_ != ftl::TimePoint()) {
+    LoopMonitor::Get()->RecordTask(category_,
+                                   ftl::TimePoint::Now() - start_time_);
+  }
+}
+
+// static
+LoopMonitor* LoopMonitor::Get() {
+  static LoopMonitor* monitor = new LoopMonitor();
+  return monitor;
+}
+
+// static
+const char* LoopMonitor::CategoryName(Category category) {
+  switch (category) {
+    case Category::kRelayRead:
+      return "relay read";
+    case Category::kRelayWrite:
+      return "relay write";
+    case Category::kHandshake:
+      return "handshake";
+    case Category::kCount:
+      break;
+  }
+
+  FTL_NOTREACHED();
+  return "";
+}
+
+LoopMonitor::LoopMonitor() : task_timing_enabled_(false) {}
+
+LoopMonitor::~LoopMonitor() {
+  FTL_NOTREACHED();
+}
+
+void LoopMonitor::StartProbing(ftl::TimeDelta interval) {
+  FTL_DCHECK(!task_runner_) << "StartProbing called twice";
+  FTL_DCHECK(interval > ftl::TimeDelta::Zero());
+
+  task_runner_ = mtl::MessageLoop::GetCurrent()->task_runner();
+  probe_interval_ = interval;
+  PostProbe();
+}
+
+void LoopMonitor::RecordTask(Category category, ftl::TimeDelta duration) {
+  FTL_DCHECK(category < Category::kCount);
+
+  ftl::MutexLocker locker(&mutex_);
+  task_histograms_[static_cast<size_t>(category)].Record(duration);
+  total_task_times_[static_cast<size_t>(category)] += duration;
+}
+
+std::vector<LoopMonitor::Summary> LoopMonitor::GetSummaries() {
+  std::vector<Summary> summaries;
+
+  ftl::MutexLocker locker(&mutex_);
+  if (lag_histogram_.count() != 0) {
+    summaries.push_back(Summarize("lag", lag_histogram_, total_lag_));
+  }
+
+  for (size_t i = 0; i < static_cast<size_t>(Category::kCount); ++i) {
+    if (task_histograms_[i].count() != 0) {
+      summaries.push_back(Summarize(CategoryName(static_cast<Category>(i)),
+                                    task_histograms_[i],
+                                    total_task_times_[i]));
+    }
+  }
+
+  return summaries;
+}
+
+void LoopMonitor::PostProbe() {
+  // The monitor is never deleted, so the task doesn't need to check for that.
+  ftl::TimePoint due_time = ftl::TimePoint::Now() + probe_interval_;
+  task_runner_->PostTaskForTime(
+      [this, due_time]() {
+        ftl::TimePoint now = ftl::TimePoint::Now();
+        ftl::TimeDelta lag =
+            now > due_time ? now - due_time : ftl::TimeDelta::Zero();
+
+        {
+          ftl::MutexLocker locker(&mutex_);
+          lag_histogram_.Record(lag);
+          total_lag_ += lag;
+        }
+
+        PostProbe();
+      },
+      due_time);
+}
+
+// static
+LoopMonitor::Summary LoopMonitor::Summarize(const std::string& name,
+                                            const LatencyHistogram& histogram,
+                                            ftl::TimeDelta total) {
+  return {name,
+          histogram.count(),
+          total,
+          histogram.Percentile(0.5),
+          histogram.Percentile(0.9),
+          histogram.Percentile(0.99),
+          histogram.max()};
+}
+
+}  // namespace netconnector
@@ -0,0 +1,117 @@
+// Copyright 2017 The Fuchsia Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#pragma once
+
+#include <atomic>
+#include <string>
+#include <vector>
+
+#include "apps/netconnector/src/latency_tracer.h"
+#include "lib/ftl/macros.h"
+#include "lib/ftl/memory/ref_ptr.h"
+#include "lib/ftl/synchronization/mutex.h"
+#include "lib/ftl/synchronization/thread_annotations.h"
+#include "lib/ftl/tasks/task_runner.h"
+#include "lib/ftl/time/time_delta.h"
+#include "lib/ftl/time/time_point.h"
+
+namespace netconnector {
+
+// Measures how responsive the main message loop is. A probe task posted at a
+// fixed interval records how late the loop runs it. Separately, tasks in the
+// categories below can be timed, so a stall can be pinned on the component
+// that caused it. Both are off by default.
+//
+// LoopMonitor is thread-safe.
+class LoopMonitor {
+ public:
+  enum class Category {
+    // Handling of messages read from a local channel by its relay.
+    kRelayRead,
+    // Handing a received message to a local channel's relay.
+    kRelayWrite,
+    // Handling of version, service name and channel request packets.
+    kHandshake,
+    kCount
+  };
+
+  // Summary of the probe's lag or of the tasks in a category.
+  struct Summary {
+    std::string name_;
+    uint64_t count_;
+    ftl::TimeDelta total_;
+    ftl::TimeDelta p50_;
+    ftl::TimeDelta p90_;
+    ftl::TimeDelta p99_;
+    ftl::TimeDelta max_;
+  };
+
+  // Times the enclosing scope as a task in |category|, if task timing is
+  // enabled.
+  class ScopedTask {
+   public:
+    explicit ScopedTask(Category category);
+
+    ~ScopedTask();
+
+   private:
+    Category category_;
+    ftl::TimePoint start_time_;
+
+    FTL_DISALLOW_COPY_AND_ASSIGN(ScopedTask);
+  };
+
+  // Returns the process-wide monitor, creating it on first use.
+  static LoopMonitor* Get();
+
+  // Returns the name of |category| for display.
+  static const char* CategoryName(Category category);
+
+  // Starts probing the message loop of the calling thread every |interval|.
+  // May be called only once.
+  void StartProbing(ftl::TimeDelta interval);
+
+  // Enables or disables task timing.
+  void SetTaskTimingEnabled(bool enabled) { task_timing_enabled_ = enabled; }
+
+  // Indicates whether task timing is enabled.
+  bool task_timing_enabled() const { return task_timing_enabled_; }
+
+  // Records a task in |category| that took |duration|.
+  void RecordTask(Category category, ftl::TimeDelta duration);
+
+  // Returns a summary of the probe's lag, named "lag", followed by summaries
+  // of the categories that have samples.
+  std::vector<Summary> GetSummaries();
+
+ private:
+  LoopMonitor();
+
+  // The monitor lives for the life of the process, so this is never called.
+  ~LoopMonitor();
+
+  // Posts the next probe task.
+  void PostProbe();
+
+  static Summary Summarize(const std::string& name,
+                           const LatencyHistogram& histogram,
+                           ftl::TimeDelta total);
+
+  ftl::RefPtr<ftl::TaskRunner> task_runner_;
+  ftl::TimeDelta probe_interval_;
+  std::atomic<bool> task_timing_enabled_;
+
+  ftl::Mutex mutex_;
+  LatencyHistogram lag_histogram_ FTL_GUARDED_BY(mutex_);
+  ftl::TimeDelta total_lag_ FTL_GUARDED_BY(mutex_);
+  LatencyHistogram task_histograms_[static_cast<size_t>(Category::kCount)]
+      FTL_GUARDED_BY(mutex_);
+  ftl::TimeDelta total_task_times_[static_cast<size_t>(Category::kCount)]
+      FTL_GUARDED_BY(mutex_);
+
+  FTL_DISALLOW_COPY_AND_ASSIGN(LoopMonitor);
+};
+
+}  // namespace netconnector
@@ -20,14 +20,31 @@ AddressResponder::AddressResponder(MdnsAgent::Host* host,
 
 AddressResponder::~AddressResponder() {}
 
-void AddressResponder::Start() {}
+void AddressResponder::Start() {
+  host_->AddInterest(shared_from_this(), host_full_name_);
+}
 
 void AddressResponder::Wake() {}
 
 void AddressResponder::ReceiveQuestion(const DnsQuestion& question) {
-  if ((question.type_ == DnsType::kA || question.type_ == DnsType::kAaaa) &&
-      question.name_.dotted_string_ == host_full_name_) {
-    host_->SendAddresses(MdnsResourceSection::kAnswer, ftl::TimePoint::Now());
+  if (question.name_ != host_full_name_) {
+    return;
+  }
+
+  switch (question.type_) {
+    case DnsType::kA:
+    case DnsType::kAaaa:
+    case DnsType::kAny:
+      host_->SendAddresses(MdnsResourceSection::kAnswer,
+                           ftl::TimePoint::Now());
+      break;
+    default:
+      // The host name has no records of this type. The interface transceiver
+      // sends an NSEC record saying so along with the addresses (RFC 6762
+      // section 6.1).
+      host_->SendAddresses(MdnsResourceSection::kAdditional,
+                           ftl::TimePoint::Now());
+      break;
   }
 }
 
@@ -41,7 +41,7 @@ class AddressResponder : public MdnsAgent,
 
  private:
   MdnsAgent::Host* host_;
-  std::string host_full_name_;
+  DnsName host_full_name_;
 };
 
 }  // namespace mdns
@@ -132,7 +132,7 @@ std::ostream& operator<<(std::ostream& os, DnsClass value) {
 }
 
 std::ostream& operator<<(std::ostream& os, const DnsName& value) {
-  return os << value.dotted_string_;
+  return os << value.dotted_string();
 }
 
 std::ostream& operator<<(std::ostream& os, const DnsV4Address& value) {
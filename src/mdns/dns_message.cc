@@ -4,8 +4,104 @@
 
 #include "apps/netconnector/src/mdns/dns_message.h"
 
+#include <unordered_map>
+#include <utility>
+
+#include "lib/ftl/logging.h"
+#include "lib/ftl/synchronization/mutex.h"
+#include "lib/ftl/synchronization/thread_annotations.h"
+
 namespace netconnector {
 namespace mdns {
+namespace {
+
+// Table of interned names. The table holds weak references, so a name's
+// string is freed when the last |DnsName| using it goes away. Entries for
+// freed names are purged whenever the table doubles in size. Names are
+// parsed on the mDNS receive threads as well as the main thread, so the
+// table is locked.
+class NameTable {
+ public:
+  static NameTable* Get() {
+    static NameTable* table = new NameTable();
+    return table;
+  }
+
+  std::shared_ptr<const std::string> Intern(const char* chars, size_t size) {
+    ftl::MutexLocker locker(&mutex_);
+
+    // |key_| keeps its buffer from call to call, so looking up a name that's
+    // already in the table doesn't allocate.
+    key_.assign(chars, size);
+
+    auto iter = names_.find(key_);
+    if (iter != names_.end()) {
+      std::shared_ptr<const std::string> value = iter->second.lock();
+      if (!value) {
+        value = std::make_shared<const std::string>(key_);
+        iter->second = value;
+      }
+
+      return value;
+    }
+
+    if (names_.size() >= purge_size_) {
+      Purge();
+    }
+
+    std::shared_ptr<const std::string> value =
+        std::make_shared<const std::string>(key_);
+    names_.emplace(key_, value);
+    return value;
+  }
+
+ private:
+  static constexpr size_t kMinPurgeSize = 256;
+
+  NameTable() {}
+
+  void Purge() FTL_EXCLUSIVE_LOCKS_REQUIRED(mutex_) {
+    for (auto iter = names_.begin(); iter != names_.end();) {
+      if (iter->second.expired()) {
+        iter = names_.erase(iter);
+      } else {
+        ++iter;
+      }
+    }
+
+    purge_size_ = names_.size() * 2;
+    if (purge_size_ < kMinPurgeSize) {
+      purge_size_ = kMinPurgeSize;
+    }
+  }
+
+  ftl::Mutex mutex_;
+  std::unordered_map<std::string, std::weak_ptr<const std::string>> names_
+      FTL_GUARDED_BY(mutex_);
+  std::string key_ FTL_GUARDED_BY(mutex_);
+  size_t purge_size_ FTL_GUARDED_BY(mutex_) = kMinPurgeSize;
+};
+
+}  // namespace
+
+DnsName::DnsName(const std::string& dotted_string) {
+  if (!dotted_string.empty()) {
+    value_ =
+        NameTable::Get()->Intern(dotted_string.data(), dotted_string.size());
+  }
+}
+
+DnsName::DnsName(const char* chars, size_t size) {
+  FTL_DCHECK(chars != nullptr || size == 0);
+  if (size != 0) {
+    value_ = NameTable::Get()->Intern(chars, size);
+  }
+}
+
+const std::string& DnsName::dotted_string() const {
+  static const std::string* empty = new std::string();
+  return value_ ? *value_ : *empty;
+}
 
 void DnsHeader::SetResponse(bool value) {
   if (value) {
@@ -59,13 +155,58 @@ void DnsHeader::SetResponseCode(DnsResponseCode response_code) {
 
 DnsQuestion::DnsQuestion() {}
 
-DnsQuestion::DnsQuestion(const std::string& name, DnsType type)
-    : name_(DnsName(name)), type_(type) {}
+DnsQuestion::DnsQuestion(const DnsName& name, DnsType type)
+    : name_(name), type_(type) {}
+
+void DnsResourceDataNSec::AddType(DnsType type) {
+  uint8_t window = static_cast<uint16_t>(type) >> 8;
+  uint8_t bit = static_cast<uint16_t>(type) & 0xff;
+  size_t byte_count = bit / 8 + 1;
+
+  // The bitmap is a sequence of windows in ascending order, each a window
+  // number, a byte count and up to 32 bytes of bits.
+  size_t index = 0;
+  while (index + 1 < bits_.size() && bits_[index] < window) {
+    index += 2 + bits_[index + 1];
+  }
+
+  if (index + 1 >= bits_.size() || bits_[index] != window) {
+    uint8_t header[] = {window, 0};
+    bits_.insert(bits_.begin() + index, header, header + 2);
+  }
+
+  size_t window_byte_count = bits_[index + 1];
+  if (window_byte_count < byte_count) {
+    bits_.insert(bits_.begin() + index + 2 + window_byte_count,
+                 byte_count - window_byte_count, 0);
+    bits_[index + 1] = static_cast<uint8_t>(byte_count);
+  }
+
+  bits_[index + 2 + bit / 8] |= 0x80 >> (bit % 8);
+}
+
+bool DnsResourceDataNSec::HasType(DnsType type) const {
+  uint8_t window = static_cast<uint16_t>(type) >> 8;
+  uint8_t bit = static_cast<uint16_t>(type) & 0xff;
+
+  for (size_t index = 0; index + 1 < bits_.size();
+       index += 2 + bits_[index + 1]) {
+    if (bits_[index] != window) {
+      continue;
+    }
+
+    size_t byte_index = index + 2 + bit / 8;
+    return bit / 8 < bits_[index + 1] && byte_index < bits_.size() &&
+           (bits_[byte_index] & (0x80 >> (bit % 8))) != 0;
+  }
+
+  return false;
+}
 
 DnsResource::DnsResource(){};
 
-DnsResource::DnsResource(const std::string& name, DnsType type)
-    : name_(DnsName(name)), type_(type) {
+DnsResource::DnsResource(const DnsName& name, DnsType type)
+    : name_(name), type_(type) {
   switch (type_) {
     case DnsType::kA:
       new (&a_) DnsResourceDataA();
@@ -117,89 +258,158 @@ DnsResource::DnsResource(const std::string& name, DnsType type)
   }
 }
 
-DnsResource::DnsResource(const DnsResource& other) {
-  name_ = other.name_;
-  type_ = other.type_;
-  class_ = other.class_;
-  cache_flush_ = other.cache_flush_;
-  time_to_live_ = other.time_to_live_;
+DnsResource::DnsResource(const DnsResource& other)
+    : name_(other.name_),
+      type_(other.type_),
+      class_(other.class_),
+      cache_flush_(other.cache_flush_),
+      time_to_live_(other.time_to_live_) {
+  ConstructDataFrom(other);
+}
+
+DnsResource::DnsResource(DnsResource&& other)
+    : name_(std::move(other.name_)),
+      type_(other.type_),
+      class_(other.class_),
+      cache_flush_(other.cache_flush_),
+      time_to_live_(other.time_to_live_) {
+  ConstructDataFrom(std::move(other));
+}
+
+DnsResource& DnsResource::operator=(const DnsResource& other) {
+  if (this != &other) {
+    DestroyData();
+    name_ = other.name_;
+    type_ = other.type_;
+    class_ = other.class_;
+    cache_flush_ = other.cache_flush_;
+    time_to_live_ = other.time_to_live_;
+    ConstructDataFrom(other);
+  }
+
+  return *this;
+}
+
+DnsResource& DnsResource::operator=(DnsResource&& other) {
+  if (this != &other) {
+    DestroyData();
+    name_ = std::move(other.name_);
+    type_ = other.type_;
+    class_ = other.class_;
+    cache_flush_ = other.cache_flush_;
+    time_to_live_ = other.time_to_live_;
+    ConstructDataFrom(std::move(other));
+  }
+
+  return *this;
+}
+
+bool DnsResource::IsSameRecord(const DnsResource& other) const {
+  if (type_ != other.type_ || class_ != other.class_ || name_ != other.name_) {
+    return false;
+  }
 
   switch (type_) {
     case DnsType::kA:
-      a_ = other.a_;
+      return a_.address_.address_ == other.a_.address_.address_;
+    case DnsType::kNs:
+      return ns_.name_server_domain_name_ == other.ns_.name_server_domain_name_;
+    case DnsType::kCName:
+      return cname_.canonical_name_ == other.cname_.canonical_name_;
+    case DnsType::kPtr:
+      return ptr_.pointer_domain_name_ == other.ptr_.pointer_domain_name_;
+    case DnsType::kTxt:
+      return txt_.strings_ == other.txt_.strings_;
+    case DnsType::kAaaa:
+      return aaaa_.address_.address_ == other.aaaa_.address_.address_;
+    case DnsType::kSrv:
+      return srv_.priority_ == other.srv_.priority_ &&
+             srv_.weight_ == other.srv_.weight_ &&
+             srv_.port_ == other.srv_.port_ &&
+             srv_.target_ == other.srv_.target_;
+    case DnsType::kOpt:
+      return opt_.options_ == other.opt_.options_;
+    case DnsType::kNSec:
+      return nsec_.next_domain_ == other.nsec_.next_domain_ &&
+             nsec_.bits_ == other.nsec_.bits_;
+    default:
+      return false;
+  }
+}
+
+DnsResource::~DnsResource() {
+  DestroyData();
+}
+
+void DnsResource::ConstructDataFrom(const DnsResource& other) {
+  switch (type_) {
+    case DnsType::kA:
+      new (&a_) DnsResourceDataA(other.a_);
       break;
     case DnsType::kNs:
-      ns_ = other.ns_;
+      new (&ns_) DnsResourceDataNs(other.ns_);
       break;
     case DnsType::kCName:
-      cname_ = other.cname_;
+      new (&cname_) DnsResourceDataCName(other.cname_);
       break;
     case DnsType::kPtr:
-      ptr_ = other.ptr_;
+      new (&ptr_) DnsResourceDataPtr(other.ptr_);
       break;
     case DnsType::kTxt:
-      txt_ = other.txt_;
+      new (&txt_) DnsResourceDataTxt(other.txt_);
       break;
     case DnsType::kAaaa:
-      aaaa_ = other.aaaa_;
+      new (&aaaa_) DnsResourceDataAaaa(other.aaaa_);
       break;
     case DnsType::kSrv:
-      srv_ = other.srv_;
+      new (&srv_) DnsResourceDataSrv(other.srv_);
       break;
     case DnsType::kOpt:
-      opt_ = other.opt_;
+      new (&opt_) DnsResourceDataOpt(other.opt_);
       break;
     case DnsType::kNSec:
-      nsec_ = other.nsec_;
+      new (&nsec_) DnsResourceDataNSec(other.nsec_);
       break;
     default:
       break;
   }
-};
-
-DnsResource& DnsResource::operator=(const DnsResource& other) {
-  name_ = other.name_;
-  type_ = other.type_;
-  class_ = other.class_;
-  cache_flush_ = other.cache_flush_;
-  time_to_live_ = other.time_to_live_;
+}
 
+void DnsResource::ConstructDataFrom(DnsResource&& other) {
   switch (type_) {
     case DnsType::kA:
-      a_ = other.a_;
+      new (&a_) DnsResourceDataA(std::move(other.a_));
       break;
     case DnsType::kNs:
-      ns_ = other.ns_;
+      new (&ns_) DnsResourceDataNs(std::move(other.ns_));
       break;
     case DnsType::kCName:
-      cname_ = other.cname_;
+      new (&cname_) DnsResourceDataCName(std::move(other.cname_));
       break;
     case DnsType::kPtr:
-      ptr_ = other.ptr_;
+      new (&ptr_) DnsResourceDataPtr(std::move(other.ptr_));
       break;
     case DnsType::kTxt:
-      txt_ = other.txt_;
+      new (&txt_) DnsResourceDataTxt(std::move(other.txt_));
       break;
     case DnsType::kAaaa:
-      aaaa_ = other.aaaa_;
+      new (&aaaa_) DnsResourceDataAaaa(std::move(other.aaaa_));
       break;
     case DnsType::kSrv:
-      srv_ = other.srv_;
+      new (&srv_) DnsResourceDataSrv(std::move(other.srv_));
       break;
     case DnsType::kOpt:
-      opt_ = other.opt_;
+      new (&opt_) DnsResourceDataOpt(std::move(other.opt_));
       break;
     case DnsType::kNSec:
-      nsec_ = other.nsec_;
+      new (&nsec_) DnsResourceDataNSec(std::move(other.nsec_));
       break;
     default:
       break;
   }
+}
 
-  return *this;
-};
-
-DnsResource::~DnsResource() {
+void DnsResource::DestroyData() {
   switch (type_) {
     case DnsType::kA:
       a_.~DnsResourceDataA();
@@ -231,7 +441,7 @@ DnsResource::~DnsResource() {
     default:
       break;
   }
-};
+}
 
 }  // namespace mdns
 }  // namespace netconnector
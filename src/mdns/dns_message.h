@@ -4,6 +4,7 @@
 
 #pragma once
 
+#include <functional>
 #include <memory>
 #include <string>
 #include <vector>
@@ -102,12 +103,35 @@ struct DnsClassAndFlag {
   bool flag_;
 };
 
-// Domain name.
-struct DnsName {
+// Domain name. Names are interned, so all names with the same dotted string
+// share one copy of it, and comparing or hashing names doesn't look at the
+// characters. Names may be created and destroyed on any thread.
+class DnsName {
+ public:
+  // Hashes names for use as keys in unordered containers.
+  struct Hash {
+    size_t operator()(const DnsName& name) const {
+      return std::hash<const std::string*>()(name.value_.get());
+    }
+  };
+
   DnsName() {}
-  DnsName(const std::string dotted_string) : dotted_string_(dotted_string) {}
 
-  std::string dotted_string_;
+  DnsName(const std::string& dotted_string);
+
+  DnsName(const char* chars, size_t size);
+
+  const std::string& dotted_string() const;
+
+  bool empty() const { return !value_; }
+
+  bool operator==(const DnsName& other) const { return value_ == other.value_; }
+
+  bool operator!=(const DnsName& other) const { return value_ != other.value_; }
+
+ private:
+  // Null for the empty name.
+  std::shared_ptr<const std::string> value_;
 };
 
 // IPV4 address.
@@ -154,23 +178,27 @@ struct DnsHeader {
   uint16_t authority_count_ = 0;
   uint16_t additional_count_ = 0;
 
-  bool response() { return (flags_ & kQueryResponseMask) != 0; }
+  bool response() const { return (flags_ & kQueryResponseMask) != 0; }
 
-  DnsOpCode op_code() {
+  DnsOpCode op_code() const {
     return static_cast<DnsOpCode>((flags_ & kOpCodeMask) >> kOpCodeShift);
   }
 
-  bool authoritative_answer() {
+  bool authoritative_answer() const {
     return (flags_ & kAuthoritativeAnswerMask) != 0;
   }
 
-  bool truncated() { return (flags_ & kTruncationMask) != 0; }
+  bool truncated() const { return (flags_ & kTruncationMask) != 0; }
 
-  bool recursion_desired() { return (flags_ & kRecursionDesiredMask) != 0; }
+  bool recursion_desired() const {
+    return (flags_ & kRecursionDesiredMask) != 0;
+  }
 
-  bool recursion_available() { return (flags_ & kRecursionAvailableMask) != 0; }
+  bool recursion_available() const {
+    return (flags_ & kRecursionAvailableMask) != 0;
+  }
 
-  DnsResponseCode response_code() {
+  DnsResponseCode response_code() const {
     return static_cast<DnsResponseCode>(flags_ & kResponseCodeMask);
   }
 
@@ -196,7 +224,7 @@ struct DnsHeader {
 // DNS question record.
 struct DnsQuestion {
   DnsQuestion();
-  DnsQuestion(const std::string& name, DnsType type);
+  DnsQuestion(const DnsName& name, DnsType type);
 
   DnsName name_;
   DnsType type_;
@@ -247,8 +275,17 @@ struct DnsResourceDataOpt {
   std::vector<uint8_t> options_;
 };
 
-// Additional data for type 'NSEC' resource records.
+// Additional data for type 'NSEC' resource records. mDNS uses NSEC records
+// to assert which types exist for a name, so queriers needn't wait for
+// records of the other types (RFC 6762 section 6.1). |bits_| is the type
+// bitmap as it appears in the record (RFC 4034 section 4.1.2).
 struct DnsResourceDataNSec {
+  // Adds |type| to the type bitmap.
+  void AddType(DnsType type);
+
+  // Determines whether the type bitmap includes |type|.
+  bool HasType(DnsType type) const;
+
   DnsName next_domain_;
   std::vector<uint8_t> bits_;
 };
@@ -259,11 +296,18 @@ struct DnsResource {
   static constexpr uint32_t kLongTimeToLive = 75 * 60;
 
   DnsResource();
-  DnsResource(const std::string& name, DnsType type);
+  DnsResource(const DnsName& name, DnsType type);
   DnsResource(const DnsResource& other);
+  DnsResource(DnsResource&& other);
   ~DnsResource();
 
   DnsResource& operator=(const DnsResource& other);
+  DnsResource& operator=(DnsResource&& other);
+
+  // Determines whether |other| is the same record as this one, that is, has
+  // the same name, type, class and data. TTLs and cache flush bits aren't
+  // compared.
+  bool IsSameRecord(const DnsResource& other) const;
 
   DnsName name_;
   DnsType type_ = DnsType::kInvalid;
@@ -281,6 +325,14 @@ struct DnsResource {
     DnsResourceDataOpt opt_;
     DnsResourceDataNSec nsec_;
   };
+
+ private:
+  // Constructs the union member for |type_| from the same member of |other|.
+  void ConstructDataFrom(const DnsResource& other);
+  void ConstructDataFrom(DnsResource&& other);
+
+  // Destroys the union member for |type_|.
+  void DestroyData();
 };
 
 // DNS message.
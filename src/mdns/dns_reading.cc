@@ -18,26 +18,73 @@ static constexpr size_t kMaxAnswers = 1024;
 static constexpr size_t kMaxAuthorities = 1024;
 static constexpr size_t kMaxAdditionals = 1024;
 
-void ReadNameLabels(PacketReader& reader, std::vector<char>& chars) {
+// Max size of a name in dotted form. Names are at most 255 bytes on the wire
+// (RFC 1035 section 3.1), which is less than that in dotted form.
+static constexpr size_t kMaxNameSize = 255;
+
+// Max number of labels in a name. Each label takes at least two characters
+// in dotted form.
+static constexpr size_t kMaxNameLabels = kMaxNameSize / 2;
+
+// Max number of compression pointers followed while reading a name. Pointers
+// must point backward, so they can't loop, but a chain of them could still
+// cost a lot to follow. Legitimate names need one or two.
+static constexpr size_t kMaxPointerHops = 16;
+
+// Reads the labels of a name into |chars|, which has room for |kMaxNameSize|
+// characters, appending at |*size|. Suffixes decoded earlier in the packet are
+// copied from the reader's cache rather than decoded again, and the suffixes
+// decoded here are added to the cache.
+void ReadNameLabels(PacketReader& reader, char* chars, size_t* size) {
+  // Offsets in the packet of the labels read from the packet, and their
+  // positions in |chars|.
+  uint16_t label_offsets[kMaxNameLabels];
+  uint8_t label_positions[kMaxNameLabels];
+  size_t label_count = 0;
+
+  // Where to resume reading after the name, if a pointer was followed.
+  size_t resume_position = 0;
+  size_t hops = 0;
+
   while (reader.healthy()) {
+    size_t label_offset = reader.bytes_consumed();
     uint8_t label_size;
     reader >> label_size;
 
-    if (label_size & 0xc0) {
+    if ((label_size & 0xc0) == 0xc0) {
       // We have an offset rather than the actual name. The offset is in the
       // 14 bits following two 1's.
       uint16_t offset = (label_size & 0x3f) << 8;
       reader >> label_size;
       offset |= label_size;
 
-      // Set the read position to that offset and rest of the name.
-      size_t bytes_consumed = reader.bytes_consumed();
-      reader.SetBytesConsumed(offset);
-      ReadNameLabels(reader, chars);
+      // Offsets must point to an earlier position in the packet, which
+      // prevents pointer loops.
+      if (offset >= label_offset || ++hops > kMaxPointerHops) {
+        reader.MarkUnhealthy();
+        break;
+      }
 
-      // Restore the read position.
-      reader.SetBytesConsumed(bytes_consumed);
-      break;
+      if (resume_position == 0) {
+        resume_position = reader.bytes_consumed();
+      }
+
+      size_t suffix_size;
+      const char* suffix = reader.FindNameSuffix(offset, &suffix_size);
+      if (suffix != nullptr) {
+        if (*size + suffix_size > kMaxNameSize) {
+          reader.MarkUnhealthy();
+          break;
+        }
+
+        std::memcpy(chars + *size, suffix, suffix_size);
+        *size += suffix_size;
+        break;
+      }
+
+      // Continue reading at the offset.
+      reader.SetBytesConsumed(offset);
+      continue;
     }
 
     if (label_size > 63) {
@@ -49,25 +96,57 @@ void ReadNameLabels(PacketReader& reader, std::vector<char>& chars) {
       break;
     }
 
-    size_t old_size = chars.size();
-    chars.resize(old_size + label_size + 1);
-    if (!reader.GetBytes(label_size, chars.data() + old_size)) {
+    if (*size + label_size + 1 > kMaxNameSize) {
+      reader.MarkUnhealthy();
       break;
     }
 
-    chars[chars.size() - 1] = '.';
+    FTL_DCHECK(label_count < kMaxNameLabels);
+    label_offsets[label_count] = static_cast<uint16_t>(label_offset);
+    label_positions[label_count] = static_cast<uint8_t>(*size);
+    ++label_count;
+
+    if (!reader.GetBytes(label_size, chars + *size)) {
+      break;
+    }
+
+    *size += label_size;
+    chars[(*size)++] = '.';
+  }
+
+  if (!reader.healthy()) {
+    return;
+  }
+
+  if (resume_position != 0) {
+    reader.SetBytesConsumed(resume_position);
+  }
+
+  if (label_count == 0) {
+    return;
+  }
+
+  // Each label read from the packet starts a suffix of the name. They share
+  // one copy of the characters.
+  size_t position = reader.AddNameChars(chars + label_positions[0],
+                                        *size - label_positions[0]);
+  for (size_t i = 0; i < label_count; ++i) {
+    reader.AddNameSuffix(label_offsets[i],
+                         position + label_positions[i] - label_positions[0],
+                         *size - label_positions[i]);
   }
 }
 
 }  // namespace
 
 PacketReader& operator>>(PacketReader& reader, DnsName& value) {
-  std::vector<char> chars;
+  char chars[kMaxNameSize];
+  size_t size = 0;
 
-  ReadNameLabels(reader, chars);
+  ReadNameLabels(reader, chars, &size);
 
   if (reader.healthy()) {
-    value.dotted_string_ = std::string(chars.data(), chars.size());
+    value = DnsName(chars, size);
   }
 
   return reader;
@@ -158,8 +237,7 @@ PacketReader& operator>>(PacketReader& reader, DnsResourceDataTxt& value) {
 
     const char* start = reinterpret_cast<const char*>(reader.Bytes(length));
 
-    std::string s(start, length);
-    value.strings_.emplace_back(s);
+    value.strings_.emplace_back(start, length);
   }
 
   FTL_DCHECK(reader.healthy());
@@ -271,7 +349,7 @@ PacketReader& operator>>(PacketReader& reader, DnsResource& value) {
       }
     } break;
     case DnsType::kNSec: {
-      new (&value.txt_) DnsResourceDataNSec();
+      new (&value.nsec_) DnsResourceDataNSec();
       size_t bytes_remaining = reader.bytes_remaining();
       reader.SetBytesRemaining(data_size);
       reader >> value.nsec_;
@@ -10,32 +10,78 @@
 namespace netconnector {
 namespace mdns {
 
+namespace {
+
+// Max number of labels in a name. Names are at most 255 bytes on the wire
+// (RFC 1035 section 3.1), and each label takes at least two.
+static constexpr size_t kMaxLabels = 128;
+
+}  // namespace
+
 PacketWriter& operator<<(PacketWriter& writer, const DnsName& value) {
-  std::string s = value.dotted_string_;
-
-  while (!s.empty()) {
-    size_t position = writer.GetBookmarkPosition(s);
-    if (position != PacketWriter::npos) {
-      // Write a name offset.
-      uint16_t offset = static_cast<uint16_t>(position) | 0xc000;
-      writer << offset;
-      return writer;
+  const std::string& name = value.dotted_string();
+
+  // Find the labels.
+  size_t label_starts[kMaxLabels];
+  size_t label_sizes[kMaxLabels];
+  size_t label_count = 0;
+
+  for (size_t start = 0; start < name.size(); ++label_count) {
+    if (label_count == kMaxLabels) {
+      FTL_DLOG(ERROR) << "Name has too many labels: " << name;
+      break;
     }
 
-    writer.CreateBookmark(s);
+    // If there's no dot at the end (there really should be), the last label
+    // ends at the end of the string.
+    size_t dot_pos = start;
+    while (dot_pos < name.size() && name[dot_pos] != '.') {
+      ++dot_pos;
+    }
 
-    size_t dot_pos = s.find('.');
+    label_starts[label_count] = start;
+    label_sizes[label_count] = dot_pos - start;
+    start = dot_pos + 1;
+  }
 
-    if (dot_pos == std::string::npos) {
-      // There really should be a dot at the end, but there is not.
-      writer << static_cast<uint8_t>(s.size());
-      writer.PutBytes(s.size(), s.data());
+  // Find the longest suffix that's already in the packet, working back from
+  // the last label.
+  size_t suffix_position = 0;
+  size_t labels_to_write = label_count;
+  while (labels_to_write != 0) {
+    size_t index = labels_to_write - 1;
+    size_t position =
+        writer.FindLabel(name.data() + label_starts[index],
+                         label_sizes[index], suffix_position);
+    if (position == PacketWriter::npos) {
       break;
     }
 
-    writer << static_cast<uint8_t>(dot_pos);
-    writer.PutBytes(dot_pos, s.data());
-    s = s.substr(dot_pos + 1);
+    suffix_position = position;
+    labels_to_write = index;
+  }
+
+  // Write the labels preceding the suffix.
+  size_t label_positions[kMaxLabels];
+  for (size_t index = 0; index < labels_to_write; ++index) {
+    label_positions[index] = writer.position();
+    writer << static_cast<uint8_t>(label_sizes[index]);
+    writer.PutBytes(label_sizes[index], name.data() + label_starts[index]);
+  }
+
+  // Make the new labels available to later names. This goes from the last
+  // label backward, so each label's parent position is known.
+  size_t parent_position = suffix_position;
+  for (size_t index = labels_to_write; index-- != 0;) {
+    writer.AddLabel(name.data() + label_starts[index], label_sizes[index],
+                    parent_position, label_positions[index]);
+    parent_position = label_positions[index];
+  }
+
+  if (suffix_position != 0) {
+    // Write a name offset.
+    uint16_t offset = static_cast<uint16_t>(suffix_position) | 0xc000;
+    return writer << offset;
   }
 
   return writer << static_cast<uint8_t>(0);
@@ -17,40 +17,69 @@ HostNameResolver::HostNameResolver(
     const std::string& host_full_name,
     ftl::TimePoint timeout,
     const Mdns::ResolveHostNameCallback& callback)
-    : host_(host),
-      host_name_(host_name),
-      host_full_name_(host_full_name),
-      timeout_(timeout),
-      callback_(callback) {
-  FTL_DCHECK(callback_);
+    : host_(host), host_name_(host_name), host_full_name_(host_full_name) {
+  FTL_DCHECK(callback);
+  requests_.emplace_back(timeout, callback);
 }
 
 HostNameResolver::~HostNameResolver() {}
 
+bool HostNameResolver::AddCallback(
+    ftl::TimePoint timeout,
+    const Mdns::ResolveHostNameCallback& callback) {
+  FTL_DCHECK(callback);
+
+  if (requests_.empty()) {
+    return false;
+  }
+
+  bool sooner = timeout < NextTimeout();
+  requests_.emplace_back(timeout, callback);
+
+  if (sooner) {
+    host_->WakeAt(shared_from_this(), timeout);
+  }
+
+  return true;
+}
+
 void HostNameResolver::Start() {
-  host_->SendQuestion(
-      std::make_shared<DnsQuestion>(host_full_name_, DnsType::kA),
-      ftl::TimePoint::Now());
-  host_->SendQuestion(
-      std::make_shared<DnsQuestion>(host_full_name_, DnsType::kAaaa),
-      ftl::TimePoint::Now());
-
-  host_->WakeAt(shared_from_this(), timeout_);
+  host_->AddInterest(shared_from_this(), host_full_name_);
+
+  if (requests_.empty()) {
+    // Resolved from the cache.
+    return;
+  }
+
+  // These are our only queries, so they ask for unicast responses (RFC 6762
+  // section 5.4).
+  std::shared_ptr<DnsQuestion> v4_question =
+      std::make_shared<DnsQuestion>(host_full_name_, DnsType::kA);
+  v4_question->unicast_response_ = true;
+  host_->SendQuestion(v4_question, ftl::TimePoint::Now());
+
+  std::shared_ptr<DnsQuestion> v6_question =
+      std::make_shared<DnsQuestion>(host_full_name_, DnsType::kAaaa);
+  v6_question->unicast_response_ = true;
+  host_->SendQuestion(v6_question, ftl::TimePoint::Now());
+
+  host_->WakeAt(shared_from_this(), NextTimeout());
 }
 
 void HostNameResolver::Wake() {
-  if (callback_) {
-    callback_(host_name_, v4_address_, v6_address_);
-    callback_ = nullptr;
-    host_->RemoveAgent(host_full_name_);
-  }
+  CompleteRequests(ftl::TimePoint::Now());
 }
 
 void HostNameResolver::ReceiveQuestion(const DnsQuestion& question) {}
 
 void HostNameResolver::ReceiveResource(const DnsResource& resource,
                                        MdnsResourceSection section) {
-  if (resource.name_.dotted_string_ != host_full_name_) {
+  if (resource.name_ != host_full_name_) {
+    return;
+  }
+
+  // Goodbyes, expirations and flushed records don't supply addresses.
+  if (resource.time_to_live_ == 0) {
     return;
   }
 
@@ -58,25 +87,62 @@ void HostNameResolver::ReceiveResource(const DnsResource& resource,
     v4_address_ = resource.a_.address_.address_;
   } else if (resource.type_ == DnsType::kAaaa) {
     v6_address_ = resource.aaaa_.address_.address_;
+  } else if (resource.type_ == DnsType::kNSec &&
+             !resource.nsec_.HasType(DnsType::kA) &&
+             !resource.nsec_.HasType(DnsType::kAaaa)) {
+    // The answer is definitive, so there's no point waiting for the timeout.
+    addresses_denied_ = true;
   }
 }
 
 void HostNameResolver::EndOfMessage() {
-  FTL_DCHECK(callback_);
+  FTL_DCHECK(!requests_.empty());
 
-  if (v4_address_ || v6_address_) {
-    callback_(host_name_, v4_address_, v6_address_);
-    callback_ = nullptr;
-    host_->RemoveAgent(host_full_name_);
+  if (v4_address_ || v6_address_ || addresses_denied_) {
+    CompleteRequests(ftl::TimePoint::Max());
   }
 }
 
 void HostNameResolver::Quit() {
-  FTL_DCHECK(callback_);
-  callback_(host_name_, v4_address_, v6_address_);
-  callback_ = nullptr;
+  FTL_DCHECK(!requests_.empty());
+  CompleteRequests(ftl::TimePoint::Max());
+}
+
+ftl::TimePoint HostNameResolver::NextTimeout() const {
+  ftl::TimePoint next_timeout = ftl::TimePoint::Max();
+  for (auto& request : requests_) {
+    if (next_timeout > request.timeout_) {
+      next_timeout = request.timeout_;
+    }
+  }
 
-  host_->RemoveAgent(host_full_name_);
+  return next_timeout;
+}
+
+void HostNameResolver::CompleteRequests(ftl::TimePoint now) {
+  // Removing the agent may release the last reference to it.
+  std::shared_ptr<HostNameResolver> self = shared_from_this();
+
+  // Callbacks may add requests, so the completed ones are taken out first.
+  std::vector<Request> completed;
+  for (auto iter = requests_.begin(); iter != requests_.end();) {
+    if (iter->timeout_ <= now || now == ftl::TimePoint::Max()) {
+      completed.push_back(std::move(*iter));
+      iter = requests_.erase(iter);
+    } else {
+      ++iter;
+    }
+  }
+
+  if (requests_.empty()) {
+    host_->RemoveAgent(host_full_name_.dotted_string());
+  } else {
+    host_->WakeAt(shared_from_this(), NextTimeout());
+  }
+
+  for (auto& request : completed) {
+    request.callback_(host_name_, v4_address_, v6_address_);
+  }
 }
 
 }  // namespace mdns
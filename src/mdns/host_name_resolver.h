@@ -6,6 +6,7 @@
 
 #include <memory>
 #include <string>
+#include <vector>
 
 #include "apps/netconnector/src/ip_address.h"
 #include "apps/netconnector/src/mdns/mdns.h"
@@ -15,7 +16,8 @@
 namespace netconnector {
 namespace mdns {
 
-// Requests host name resolution.
+// Requests host name resolution. Callers resolving the same host name at the
+// same time share one resolver, each with its own timeout.
 class HostNameResolver : public MdnsAgent,
                          public std::enable_shared_from_this<HostNameResolver> {
  public:
@@ -28,6 +30,11 @@ class HostNameResolver : public MdnsAgent,
 
   ~HostNameResolver() override;
 
+  // Adds a caller to a resolution that's in progress. Returns false if the
+  // resolution is already complete, in which case a new resolver is needed.
+  bool AddCallback(ftl::TimePoint timeout,
+                   const Mdns::ResolveHostNameCallback& callback);
+
   // MdnsAgent implementation.
   void Start() override;
 
@@ -43,13 +50,32 @@ class HostNameResolver : public MdnsAgent,
   void Quit() override;
 
  private:
+  struct Request {
+    Request(ftl::TimePoint timeout,
+            const Mdns::ResolveHostNameCallback& callback)
+        : timeout_(timeout), callback_(callback) {}
+
+    ftl::TimePoint timeout_;
+    Mdns::ResolveHostNameCallback callback_;
+  };
+
+  // Calls back the requests that time out by |now|, or all of them if |now|
+  // is |ftl::TimePoint::Max()|. Removes this agent if none are left, and
+  // otherwise wakes it at the next timeout.
+  void CompleteRequests(ftl::TimePoint now);
+
+  // Returns the earliest timeout of the pending requests.
+  ftl::TimePoint NextTimeout() const;
+
   MdnsAgent::Host* host_;
   std::string host_name_;
-  std::string host_full_name_;
-  ftl::TimePoint timeout_;
-  Mdns::ResolveHostNameCallback callback_;
+  DnsName host_full_name_;
+  // Empty once the resolution is complete.
+  std::vector<Request> requests_;
   IpAddress v4_address_;
   IpAddress v6_address_;
+  // Set when an NSEC record says the host has no addresses.
+  bool addresses_denied_ = false;
 };
 
 }  // namespace mdns
@@ -4,6 +4,8 @@
 
 #include "apps/netconnector/src/mdns/instance_publisher.h"
 
+#include <algorithm>
+
 #include "lib/ftl/logging.h"
 #include "lib/ftl/time/time_point.h"
 
@@ -31,15 +33,18 @@ InstancePublisher::InstancePublisher(MdnsAgent::Host* host,
   additionals_.push_back(
       std::make_shared<DnsResource>(instance_full_name_, DnsType::kTxt));
   additionals_.back()->txt_.strings_ = text;
+
+  nsec_ = std::make_shared<DnsResource>(instance_full_name_, DnsType::kNSec);
+  nsec_->time_to_live_ = DnsResource::kShortTimeToLive;
+  nsec_->nsec_.next_domain_ = instance_full_name_;
+  nsec_->nsec_.AddType(DnsType::kSrv);
+  nsec_->nsec_.AddType(DnsType::kTxt);
 }
 
 InstancePublisher::~InstancePublisher() {}
 
 void InstancePublisher::Start() {
-  SendRecords(ftl::TimePoint::Now());
-  SendRecords(ftl::TimePoint::Now() + ftl::TimeDelta::FromSeconds(1));
-  SendRecords(ftl::TimePoint::Now() + ftl::TimeDelta::FromSeconds(3));
-  SendRecords(ftl::TimePoint::Now() + ftl::TimeDelta::FromSeconds(7));
+  StartAt(ftl::TimePoint::Now());
 }
 
 void InstancePublisher::Wake() {}
@@ -47,27 +52,82 @@ void InstancePublisher::Wake() {}
 void InstancePublisher::ReceiveQuestion(const DnsQuestion& question) {
   switch (question.type_) {
     case DnsType::kPtr:
-      if (question.name_.dotted_string_ == service_full_name_) {
-        SendRecords(ftl::TimePoint::Now());
+      if (question.name_ == service_full_name_) {
+        AddRequestedResource(answer_);
       }
       break;
     case DnsType::kSrv:
     case DnsType::kTxt:
-      if (question.name_.dotted_string_ == instance_full_name_) {
-        SendRecords(ftl::TimePoint::Now());
+    case DnsType::kAny:
+      if (question.name_ == instance_full_name_) {
+        for (auto& additional : additionals_) {
+          if (question.type_ == DnsType::kAny ||
+              additional->type_ == question.type_) {
+            AddRequestedResource(additional);
+          }
+        }
       }
       break;
     default:
+      // The instance has no records of this type. Saying so spares the
+      // querier its retries.
+      if (question.name_ == instance_full_name_) {
+        AddRequestedResource(nsec_);
+      }
       break;
   }
 }
 
 void InstancePublisher::ReceiveResource(const DnsResource& resource,
-                                        MdnsResourceSection section) {}
+                                        MdnsResourceSection section) {
+  if (section != MdnsResourceSection::kAnswer ||
+      requested_resources_.empty()) {
+    return;
+  }
+
+  // A known answer suppresses our response if its TTL is at least half of
+  // ours (RFC 6762 section 7.1). Known answers also keep their records out
+  // of the additional section.
+  auto suppress = [this, &resource](const std::shared_ptr<DnsResource>& ours) {
+    if (!resource.IsSameRecord(*ours) ||
+        resource.time_to_live_ < ours->time_to_live_ / 2) {
+      return false;
+    }
+
+    if (!Contains(known_resources_, ours)) {
+      known_resources_.push_back(ours);
+    }
+
+    requested_resources_.erase(std::remove(requested_resources_.begin(),
+                                           requested_resources_.end(), ours),
+                               requested_resources_.end());
+    return true;
+  };
+
+  if (suppress(answer_)) {
+    return;
+  }
+
+  for (auto& additional : additionals_) {
+    if (suppress(additional)) {
+      return;
+    }
+  }
+}
 
-void InstancePublisher::EndOfMessage() {}
+void InstancePublisher::EndOfMessage() {
+  if (!requested_resources_.empty()) {
+    SendRequestedRecords(ftl::TimePoint::Now());
+  }
+
+  requested_resources_.clear();
+  known_resources_.clear();
+}
 
 void InstancePublisher::Quit() {
+  // Removing the agent may release the last reference to it.
+  std::shared_ptr<InstancePublisher> self = shared_from_this();
+
   answer_->time_to_live_ = 0;
 
   for (auto& additional : additionals_) {
@@ -76,7 +136,105 @@ void InstancePublisher::Quit() {
 
   SendRecords(ftl::TimePoint::Now());
 
-  host_->RemoveAgent(service_full_name_);
+  host_->RemoveAgent(instance_full_name_.dotted_string());
+}
+
+void InstancePublisher::StartAt(ftl::TimePoint when) {
+  started_ = true;
+
+  host_->AddInterest(shared_from_this(), service_full_name_);
+  host_->AddInterest(shared_from_this(), instance_full_name_);
+
+  SendRecords(when);
+  SendRecords(when + ftl::TimeDelta::FromSeconds(1));
+  SendRecords(when + ftl::TimeDelta::FromSeconds(3));
+  SendRecords(when + ftl::TimeDelta::FromSeconds(7));
+}
+
+void InstancePublisher::Update(IpPort port,
+                               const std::vector<std::string>& text) {
+  std::vector<std::shared_ptr<DnsResource>> changed;
+
+  const std::shared_ptr<DnsResource>& srv = additionals_[0];
+  if (srv->srv_.port_ != port) {
+    srv->srv_.port_ = port;
+    changed.push_back(srv);
+  }
+
+  const std::shared_ptr<DnsResource>& txt = additionals_[1];
+  if (txt->txt_.strings_ != text) {
+    txt->txt_.strings_ = text;
+    changed.push_back(txt);
+  }
+
+  if (!started_ || changed.empty()) {
+    return;
+  }
+
+  // The records have the cache-flush bit, so the new data replaces the old
+  // in other hosts' caches. Like the initial announcements, these are sent
+  // twice, a second apart.
+  ftl::TimePoint now = ftl::TimePoint::Now();
+  for (auto& resource : changed) {
+    host_->SendResource(resource, MdnsResourceSection::kAnswer, now);
+    host_->SendResource(resource, MdnsResourceSection::kAnswer,
+                        now + ftl::TimeDelta::FromSeconds(1));
+  }
+}
+
+// static
+bool InstancePublisher::Contains(
+    const std::vector<std::shared_ptr<DnsResource>>& resources,
+    const std::shared_ptr<DnsResource>& resource) {
+  return std::find(resources.begin(), resources.end(), resource) !=
+         resources.end();
+}
+
+void InstancePublisher::AddRequestedResource(
+    const std::shared_ptr<DnsResource>& resource) {
+  if (!Contains(requested_resources_, resource)) {
+    requested_resources_.push_back(resource);
+  }
+}
+
+void InstancePublisher::SendRequestedRecords(ftl::TimePoint when) {
+  // We schedule these a nanosecond apart to ensure proper sequence.
+  int64_t sequence = 0;
+  bool positive = false;
+
+  for (auto& resource : requested_resources_) {
+    host_->SendResource(resource, MdnsResourceSection::kAnswer,
+                        when + ftl::TimeDelta::FromNanoseconds(sequence++));
+    positive = positive || resource != nsec_;
+  }
+
+  if (!positive) {
+    return;
+  }
+
+  // A PTR answer brings the SRV and TXT records, and PTR and SRV answers
+  // bring the target's addresses (RFC 6763 section 12). Records that are
+  // answers already or that the querier knows are left out.
+  if (Contains(requested_resources_, answer_)) {
+    for (auto& additional : additionals_) {
+      if (!Contains(requested_resources_, additional) &&
+          !Contains(known_resources_, additional)) {
+        host_->SendResource(additional, MdnsResourceSection::kAdditional,
+                            when + ftl::TimeDelta::FromNanoseconds(sequence++));
+      }
+    }
+  }
+
+  if (!Contains(requested_resources_, nsec_)) {
+    host_->SendResource(nsec_, MdnsResourceSection::kAdditional,
+                        when + ftl::TimeDelta::FromNanoseconds(sequence++));
+  }
+
+  if (Contains(requested_resources_, answer_) ||
+      Contains(requested_resources_, additionals_[0])) {
+    host_->SendAddresses(MdnsResourceSection::kAdditional,
+                         when + ftl::TimeDelta::FromNanoseconds(sequence++));
+  }
 }
 
 void InstancePublisher::SendRecords(ftl::TimePoint when) {
@@ -90,6 +248,12 @@ void InstancePublisher::SendRecords(ftl::TimePoint when) {
                         when + ftl::TimeDelta::FromNanoseconds(++sequence));
   }
 
+  // Goodbyes aren't accompanied by an NSEC record.
+  if (answer_->time_to_live_ != 0) {
+    host_->SendResource(nsec_, MdnsResourceSection::kAdditional,
+                        when + ftl::TimeDelta::FromNanoseconds(++sequence));
+  }
+
   host_->SendAddresses(MdnsResourceSection::kAdditional,
                        when + ftl::TimeDelta::FromNanoseconds(++sequence));
 }
@@ -43,14 +43,46 @@ class InstancePublisher
 
   void Quit() override;
 
+  // Starts the agent with its announcements scheduled relative to |when|.
+  // Publishers started at the same time announce together.
+  void StartAt(ftl::TimePoint when);
+
+  // Changes the port and text of the instance. Changed records are announced
+  // if the agent has started (RFC 6762 section 8.4).
+  void Update(IpPort port, const std::vector<std::string>& text);
+
  private:
+  // Determines whether |resources| contains |resource|.
+  static bool Contains(
+      const std::vector<std::shared_ptr<DnsResource>>& resources,
+      const std::shared_ptr<DnsResource>& resource);
+
+  // Notes that |resource| was asked for in the message being received.
+  void AddRequestedResource(const std::shared_ptr<DnsResource>& resource);
+
+  // Sends all the instance's records, as announcements and goodbyes do.
   void SendRecords(ftl::TimePoint when);
 
+  // Answers the message being received with |requested_resources_| and the
+  // additional records those answers call for.
+  void SendRequestedRecords(ftl::TimePoint when);
+
   MdnsAgent::Host* host_;
-  std::string instance_full_name_;
-  std::string service_full_name_;
+  bool started_ = false;
+  DnsName instance_full_name_;
+  DnsName service_full_name_;
   std::shared_ptr<DnsResource> answer_;
+  // The SRV record followed by the TXT record.
   std::vector<std::shared_ptr<DnsResource>> additionals_;
+  // Asserts that the instance name has no records but SRV and TXT (RFC 6762
+  // section 6.1).
+  std::shared_ptr<DnsResource> nsec_;
+  // Records asked for in the message being received that the querier didn't
+  // list as known answers.
+  std::vector<std::shared_ptr<DnsResource>> requested_resources_;
+  // Records of ours that the querier listed as known answers in the message
+  // being received.
+  std::vector<std::shared_ptr<DnsResource>> known_resources_;
 };
 
 }  // namespace mdns
@@ -11,36 +11,61 @@ namespace netconnector {
 namespace mdns {
 namespace {
 
+// static
+static constexpr ftl::TimeDelta kMinQueryInterval =
+    ftl::TimeDelta::FromSeconds(1);
 // static
 static constexpr ftl::TimeDelta kMaxQueryInterval =
     ftl::TimeDelta::FromSeconds(60 * 60);
 
+// Responders answer within half a second or so (RFC 6762 section 6), so
+// answers arriving later than this after our query were asked for by someone
+// else.
+static constexpr ftl::TimeDelta kResponseWindow =
+    ftl::TimeDelta::FromSeconds(1);
+
 }  // namespace
 
 InstanceSubscriber::InstanceSubscriber(MdnsAgent::Host* host,
+                                       const std::string& agent_name,
                                        const std::string& service_name,
-                                       const std::string& service_full_name,
+                                       const std::string& query_full_name,
+                                       const ServiceFilter& filter,
                                        const ServiceInstanceCallback& callback)
     : host_(host),
+      agent_name_(agent_name),
       service_name_(service_name),
-      service_full_name_(service_full_name),
+      query_full_name_(query_full_name),
+      filter_(filter),
       callback_(callback),
       question_(
-          std::make_shared<DnsQuestion>(service_full_name_, DnsType::kPtr)) {
+          std::make_shared<DnsQuestion>(query_full_name_, DnsType::kPtr)) {
   FTL_DCHECK(callback_);
 }
 
 InstanceSubscriber::~InstanceSubscriber() {}
 
 void InstanceSubscriber::Start() {
+  host_->AddInterest(shared_from_this(), query_full_name_);
   Wake();
 }
 
 void InstanceSubscriber::Wake() {
-  host_->SendQuestion(question_, ftl::TimePoint::Now());
+  ftl::TimePoint now = ftl::TimePoint::Now();
+  bool first_query = query_delay_ == ftl::TimeDelta::Zero();
+
+  // The first query is always sent, because what's cached at startup may be
+  // stale.
+  if (first_query || !AnswersOverheardRecently(now)) {
+    // The first query asks for unicast responses, which spares the network a
+    // round of multicast responses when we start up (RFC 6762 section 5.4).
+    question_->unicast_response_ = first_query;
+    host_->SendQuestion(question_, now);
+    last_query_time_ = now;
+  }
 
-  if (query_delay_ == ftl::TimeDelta::Zero()) {
-    query_delay_ = ftl::TimeDelta::FromSeconds(1);
+  if (first_query) {
+    query_delay_ = kMinQueryInterval;
   } else {
     query_delay_ = query_delay_ * 2;
     if (query_delay_ > kMaxQueryInterval) {
@@ -48,7 +73,7 @@ void InstanceSubscriber::Wake() {
     }
   }
 
-  host_->WakeAt(shared_from_this(), ftl::TimePoint::Now() + query_delay_);
+  host_->WakeAt(shared_from_this(), now + query_delay_);
 }
 
 void InstanceSubscriber::ReceiveQuestion(const DnsQuestion& question) {}
@@ -57,47 +82,67 @@ void InstanceSubscriber::ReceiveResource(const DnsResource& resource,
                                          MdnsResourceSection section) {
   switch (resource.type_) {
     case DnsType::kPtr:
-      if (resource.name_.dotted_string_ == service_full_name_) {
+      if (resource.name_ == query_full_name_) {
         ReceivePtrResource(resource, section);
       }
       break;
     case DnsType::kSrv: {
-      auto iter =
-          instance_infos_by_full_name_.find(resource.name_.dotted_string_);
+      auto iter = instance_infos_by_full_name_.find(resource.name_);
       if (iter != instance_infos_by_full_name_.end()) {
         ReceiveSrvResource(resource, section, &iter->second);
       }
     } break;
     case DnsType::kTxt: {
-      auto iter =
-          instance_infos_by_full_name_.find(resource.name_.dotted_string_);
+      auto iter = instance_infos_by_full_name_.find(resource.name_);
       if (iter != instance_infos_by_full_name_.end()) {
         ReceiveTxtResource(resource, section, &iter->second);
       }
     } break;
     case DnsType::kA: {
-      auto iter =
-          target_infos_by_full_name_.find(resource.name_.dotted_string_);
+      auto iter = target_infos_by_full_name_.find(resource.name_);
       if (iter != target_infos_by_full_name_.end()) {
         ReceiveAResource(resource, section, &iter->second);
       }
     } break;
     case DnsType::kAaaa: {
-      auto iter =
-          target_infos_by_full_name_.find(resource.name_.dotted_string_);
+      auto iter = target_infos_by_full_name_.find(resource.name_);
       if (iter != target_infos_by_full_name_.end()) {
         ReceiveAaaaResource(resource, section, &iter->second);
       }
     } break;
+    case DnsType::kNSec:
+      ReceiveNSecResource(resource, section);
+      break;
     default:
       break;
   }
 }
 
 void InstanceSubscriber::EndOfMessage() {
-  // Use the callback to report updates.
-  for (auto& pair : instance_infos_by_full_name_) {
-    InstanceInfo& instance_info = pair.second;
+  // Instances are reported when their targets' addresses change.
+  for (auto& target_full_name : dirty_targets_) {
+    auto iter = target_infos_by_full_name_.find(target_full_name);
+    if (iter != target_infos_by_full_name_.end()) {
+      dirty_instances_.insert(iter->second.instance_full_names_.begin(),
+                              iter->second.instance_full_names_.end());
+    }
+  }
+
+  dirty_targets_.clear();
+
+  // Use the callback to report updates. The callback may cause more changes,
+  // so we work from a local copy.
+  std::unordered_set<DnsName, DnsName::Hash> dirty_instances;
+  dirty_instances.swap(dirty_instances_);
+
+  for (auto& instance_full_name : dirty_instances) {
+    auto instance_iter = instance_infos_by_full_name_.find(instance_full_name);
+    if (instance_iter == instance_infos_by_full_name_.end()) {
+      // Removed.
+      continue;
+    }
+
+    InstanceInfo& instance_info = instance_iter->second;
 
     if (instance_info.target_.empty()) {
       // We haven't yet seen an SRV record for this instance.
@@ -108,54 +153,55 @@ void InstanceSubscriber::EndOfMessage() {
     FTL_DCHECK(iter != target_infos_by_full_name_.end());
     TargetInfo& target_info = iter->second;
 
-    // Keep this target info around.
-    target_info.keep_ = true;
-
-    if (!instance_info.dirty_ && !target_info.dirty_) {
-      // Both the instance info and target info are clean.
+    if (!target_info.v4_address_ && !target_info.v6_address_) {
+      // No addresses yet. The instance will be reported when they arrive.
       continue;
     }
 
-    if (!target_info.v4_address_ && !target_info.v6_address_) {
-      // No addresses yet.
+    if (!filter_.MatchesText(instance_info.text_)) {
+      // Instances that stop passing the filter are reported as removed.
+      if (instance_info.reported_) {
+        instance_info.reported_ = false;
+        callback_(service_name_, instance_info.instance_name_,
+                  SocketAddress::kInvalid, SocketAddress::kInvalid,
+                  std::vector<std::string>());
+      }
+
       continue;
     }
 
     // Something has changed.
+    instance_info.reported_ = true;
     callback_(service_name_, instance_info.instance_name_,
               SocketAddress(target_info.v4_address_, instance_info.port_),
               SocketAddress(target_info.v6_address_, instance_info.port_),
               instance_info.text_);
-
-    instance_info.dirty_ = false;
   }
 
-  // Clean up |target_infos_by_full_name_|.
-  for (auto iter = target_infos_by_full_name_.begin();
-       iter != target_infos_by_full_name_.end();) {
-    if (iter->second.keep_) {
-      iter->second.dirty_ = false;
-      iter->second.keep_ = false;
-      ++iter;
-    } else {
-      // No instances reference this target. Get rid of it.
-      iter = target_infos_by_full_name_.erase(iter);
+  // Get rid of targets no instances refer to.
+  for (auto& target_full_name : unreferenced_targets_) {
+    auto iter = target_infos_by_full_name_.find(target_full_name);
+    if (iter != target_infos_by_full_name_.end() &&
+        iter->second.instance_full_names_.empty()) {
+      host_->RemoveInterest(shared_from_this(), target_full_name);
+      target_infos_by_full_name_.erase(iter);
     }
   }
+
+  unreferenced_targets_.clear();
 }
 
 void InstanceSubscriber::Quit() {
-  host_->RemoveAgent(service_full_name_);
+  host_->RemoveAgent(agent_name_);
 }
 
 void InstanceSubscriber::ReceivePtrResource(const DnsResource& resource,
                                             MdnsResourceSection section) {
-  const std::string& instance_full_name =
-      resource.ptr_.pointer_domain_name_.dotted_string_;
+  const DnsName& instance_full_name = resource.ptr_.pointer_domain_name_;
 
   std::string instance_name;
-  if (!MdnsNames::ExtractInstanceName(instance_full_name, service_name_,
-                                      &instance_name)) {
+  if (!MdnsNames::ExtractInstanceName(instance_full_name.dotted_string(),
+                                      service_name_, &instance_name)) {
     return;
   }
 
@@ -164,50 +210,74 @@ void InstanceSubscriber::ReceivePtrResource(const DnsResource& resource,
     return;
   }
 
+  if (section == MdnsResourceSection::kAnswer) {
+    ftl::TimePoint now = ftl::TimePoint::Now();
+    if (now - last_query_time_ > kResponseWindow) {
+      last_overheard_answer_time_ = now;
+    }
+  }
+
   if (instance_infos_by_full_name_.find(instance_full_name) ==
       instance_infos_by_full_name_.end()) {
     auto pair = instance_infos_by_full_name_.emplace(instance_full_name,
                                                      InstanceInfo{});
     FTL_DCHECK(pair.second);
     pair.first->second.instance_name_ = instance_name;
+    dirty_instances_.insert(instance_full_name);
+    host_->AddInterest(shared_from_this(), instance_full_name);
   }
-
-  host_->Renew(resource);
 }
 
 void InstanceSubscriber::ReceiveSrvResource(const DnsResource& resource,
                                             MdnsResourceSection section,
                                             InstanceInfo* instance_info) {
   if (resource.time_to_live_ == 0) {
-    RemoveInstance(resource.name_.dotted_string_);
+    // Goodbyes and flushed records for an SRV record we've since replaced
+    // don't remove the instance. Expirations carry no data and always do.
+    if (resource.srv_.target_.empty() ||
+        (resource.srv_.target_ == instance_info->target_ &&
+         resource.srv_.port_ == instance_info->port_)) {
+      RemoveInstance(resource.name_);
+    }
+
     return;
   }
 
-  if (instance_info->target_ != resource.srv_.target_.dotted_string_) {
-    instance_info->target_ = resource.srv_.target_.dotted_string_;
-    instance_info->dirty_ = true;
+  if (instance_info->target_ != resource.srv_.target_) {
+    if (!instance_info->target_.empty()) {
+      ReleaseTarget(instance_info->target_, resource.name_);
+    }
+
+    instance_info->target_ = resource.srv_.target_;
+    dirty_instances_.insert(resource.name_);
 
-    if (target_infos_by_full_name_.find(instance_info->target_) ==
-        target_infos_by_full_name_.end()) {
-      target_infos_by_full_name_.emplace(instance_info->target_, TargetInfo{});
+    auto iter = target_infos_by_full_name_.find(instance_info->target_);
+    if (iter != target_infos_by_full_name_.end()) {
+      iter->second.instance_full_names_.insert(resource.name_);
+    } else {
+      iter = target_infos_by_full_name_
+                 .emplace(instance_info->target_, TargetInfo{})
+                 .first;
+      iter->second.instance_full_names_.insert(resource.name_);
+      host_->AddInterest(shared_from_this(), instance_info->target_);
     }
   }
 
   if (instance_info->port_ != resource.srv_.port_) {
     instance_info->port_ = resource.srv_.port_;
-    instance_info->dirty_ = true;
+    dirty_instances_.insert(resource.name_);
   }
-
-  host_->Renew(resource);
 }
 
 void InstanceSubscriber::ReceiveTxtResource(const DnsResource& resource,
                                             MdnsResourceSection section,
                                             InstanceInfo* instance_info) {
   if (resource.time_to_live_ == 0) {
-    if (!instance_info->text_.empty()) {
+    if (!instance_info->text_.empty() &&
+        (resource.txt_.strings_.empty() ||
+         resource.txt_.strings_ == instance_info->text_)) {
       instance_info->text_.clear();
-      instance_info->dirty_ = true;
+      dirty_instances_.insert(resource.name_);
     }
 
     return;
@@ -215,26 +285,26 @@ void InstanceSubscriber::ReceiveTxtResource(const DnsResource& resource,
 
   if (instance_info->text_.size() != resource.txt_.strings_.size()) {
     instance_info->text_.resize(resource.txt_.strings_.size());
-    instance_info->dirty_ = true;
+    dirty_instances_.insert(resource.name_);
   }
 
   for (size_t i = 0; i < instance_info->text_.size(); ++i) {
     if (instance_info->text_[i] != resource.txt_.strings_[i]) {
       instance_info->text_[i] = resource.txt_.strings_[i];
-      instance_info->dirty_ = true;
+      dirty_instances_.insert(resource.name_);
     }
   }
-
-  host_->Renew(resource);
 }
 
 void InstanceSubscriber::ReceiveAResource(const DnsResource& resource,
                                           MdnsResourceSection section,
                                           TargetInfo* target_info) {
   if (resource.time_to_live_ == 0) {
-    if (target_info->v4_address_) {
+    if (target_info->v4_address_ &&
+        (!resource.a_.address_.address_ ||
+         resource.a_.address_.address_ == target_info->v4_address_)) {
       target_info->v4_address_ = IpAddress::kInvalid;
-      target_info->dirty_ = true;
+      dirty_targets_.insert(resource.name_);
     }
 
     return;
@@ -242,19 +312,19 @@ void InstanceSubscriber::ReceiveAResource(const DnsResource& resource,
 
   if (target_info->v4_address_ != resource.a_.address_.address_) {
     target_info->v4_address_ = resource.a_.address_.address_;
-    target_info->dirty_ = true;
+    dirty_targets_.insert(resource.name_);
   }
-
-  host_->Renew(resource);
 }
 
 void InstanceSubscriber::ReceiveAaaaResource(const DnsResource& resource,
                                              MdnsResourceSection section,
                                              TargetInfo* target_info) {
   if (resource.time_to_live_ == 0) {
-    if (target_info->v6_address_) {
+    if (target_info->v6_address_ &&
+        (!resource.aaaa_.address_.address_ ||
+         resource.aaaa_.address_.address_ == target_info->v6_address_)) {
       target_info->v6_address_ = IpAddress::kInvalid;
-      target_info->dirty_ = true;
+      dirty_targets_.insert(resource.name_);
     }
 
     return;
@@ -262,19 +332,91 @@ void InstanceSubscriber::ReceiveAaaaResource(const DnsResource& resource,
 
   if (target_info->v6_address_ != resource.aaaa_.address_.address_) {
     target_info->v6_address_ = resource.aaaa_.address_.address_;
-    target_info->dirty_ = true;
+    dirty_targets_.insert(resource.name_);
+  }
+}
+
+void InstanceSubscriber::ReceiveNSecResource(const DnsResource& resource,
+                                             MdnsResourceSection section) {
+  if (resource.time_to_live_ == 0) {
+    return;
+  }
+
+  auto instance_iter = instance_infos_by_full_name_.find(resource.name_);
+  if (instance_iter != instance_infos_by_full_name_.end()) {
+    if (!resource.nsec_.HasType(DnsType::kSrv)) {
+      RemoveInstance(resource.name_);
+    } else if (!resource.nsec_.HasType(DnsType::kTxt) &&
+               !instance_iter->second.text_.empty()) {
+      instance_iter->second.text_.clear();
+      dirty_instances_.insert(resource.name_);
+    }
   }
 
-  host_->Renew(resource);
+  auto target_iter = target_infos_by_full_name_.find(resource.name_);
+  if (target_iter != target_infos_by_full_name_.end()) {
+    TargetInfo& target_info = target_iter->second;
+
+    if (!resource.nsec_.HasType(DnsType::kA) && target_info.v4_address_) {
+      target_info.v4_address_ = IpAddress::kInvalid;
+      dirty_targets_.insert(resource.name_);
+    }
+
+    if (!resource.nsec_.HasType(DnsType::kAaaa) && target_info.v6_address_) {
+      target_info.v6_address_ = IpAddress::kInvalid;
+      dirty_targets_.insert(resource.name_);
+    }
+  }
 }
 
-void InstanceSubscriber::RemoveInstance(const std::string& instance_full_name) {
+void InstanceSubscriber::RemoveInstance(const DnsName& instance_full_name) {
   auto iter = instance_infos_by_full_name_.find(instance_full_name);
   if (iter != instance_infos_by_full_name_.end()) {
-    callback_(service_name_, iter->second.instance_name_,
-              SocketAddress::kInvalid, SocketAddress::kInvalid,
-              std::vector<std::string>());
+    if (iter->second.reported_) {
+      callback_(service_name_, iter->second.instance_name_,
+                SocketAddress::kInvalid, SocketAddress::kInvalid,
+                std::vector<std::string>());
+    }
+
+    host_->RemoveInterest(shared_from_this(), instance_full_name);
+
+    if (!iter->second.target_.empty()) {
+      ReleaseTarget(iter->second.target_, instance_full_name);
+    }
+
     instance_infos_by_full_name_.erase(iter);
+    ResetQueryBackoff();
+  }
+}
+
+void InstanceSubscriber::ResetQueryBackoff() {
+  if (query_delay_ <= kMinQueryInterval) {
+    // Not started, or already querying as often as we do.
+    return;
+  }
+
+  // The next query goes out in a second and the backoff doubles from there.
+  // |WakeAt| keeps the earlier of this and the wakeup already scheduled.
+  query_delay_ = kMinQueryInterval;
+  host_->WakeAt(shared_from_this(), ftl::TimePoint::Now() + query_delay_);
+}
+
+bool InstanceSubscriber::AnswersOverheardRecently(ftl::TimePoint now) const {
+  // Answers heard in the latter half of the interval since our last query
+  // are recent enough. Any earlier, and an instance could have appeared since
+  // without our hearing about it.
+  return last_overheard_answer_time_ > last_query_time_ &&
+         now - last_overheard_answer_time_ < query_delay_ / 2;
+}
+
+void InstanceSubscriber::ReleaseTarget(const DnsName& target_full_name,
+                                       const DnsName& instance_full_name) {
+  auto iter = target_infos_by_full_name_.find(target_full_name);
+  FTL_DCHECK(iter != target_infos_by_full_name_.end());
+
+  iter->second.instance_full_names_.erase(instance_full_name);
+  if (iter->second.instance_full_names_.empty()) {
+    unreferenced_targets_.insert(target_full_name);
   }
 }
 
@@ -7,15 +7,25 @@
 #include <memory>
 #include <string>
 #include <unordered_map>
+#include <unordered_set>
 
 #include "apps/netconnector/src/mdns/mdns_agent.h"
+#include "apps/netconnector/src/mdns/service_filter.h"
 #include "apps/netconnector/src/socket_address.h"
 #include "lib/ftl/time/time_delta.h"
+#include "lib/ftl/time/time_point.h"
 
 namespace netconnector {
 namespace mdns {
 
-// Searches for instances of a service type.
+// Searches for instances of a service type. Only instances that pass the
+// filter are reported.
+//
+// Queries back off from one second to an hour, doubling each time. A query is
+// skipped if answers to another host's query for the same name were heard
+// recently, since every responder will have answered that query too. The
+// backoff starts over when an instance says goodbye or its records expire,
+// because that suggests the network is changing.
 class InstanceSubscriber
     : public MdnsAgent,
       public std::enable_shared_from_this<InstanceSubscriber> {
@@ -27,10 +37,14 @@ class InstanceSubscriber
                          const SocketAddress& v6_address,
                          const std::vector<std::string>& text)>;
 
-  // Creates an |InstanceSubscriber|.
+  // Creates an |InstanceSubscriber|. |agent_name| is the name under which
+  // the subscriber is added to |host|. |query_full_name| is the full name of
+  // the service or, if |filter| has a subtype, the subtype.
   InstanceSubscriber(MdnsAgent::Host* host,
+                     const std::string& agent_name,
                      const std::string& service_name,
-                     const std::string& service_full_name,
+                     const std::string& query_full_name,
+                     const ServiceFilter& filter,
                      const ServiceInstanceCallback& callback);
 
   ~InstanceSubscriber() override;
@@ -52,17 +66,18 @@ class InstanceSubscriber
  private:
   struct InstanceInfo {
     std::string instance_name_;
-    std::string target_;
+    // Indicates the instance was reported and not since reported removed.
+    bool reported_ = false;
+    DnsName target_;
     IpPort port_;
     std::vector<std::string> text_;
-    bool dirty_ = true;
   };
 
   struct TargetInfo {
     IpAddress v4_address_;
     IpAddress v6_address_;
-    bool keep_ = false;
-    bool dirty_ = false;
+    // The instances whose SRV records refer to this target.
+    std::unordered_set<DnsName, DnsName::Hash> instance_full_names_;
   };
 
   void ReceivePtrResource(const DnsResource& resource,
@@ -84,15 +99,47 @@ class InstanceSubscriber
                            MdnsResourceSection section,
                            TargetInfo* target_info);
 
-  void RemoveInstance(const std::string& instance_full_name);
+  // Applies an NSEC record, which says the types it doesn't list don't exist
+  // for its name (RFC 6762 section 6.1).
+  void ReceiveNSecResource(const DnsResource& resource,
+                           MdnsResourceSection section);
+
+  // Reports the instance removed and forgets it. Removing an instance
+  // restarts the query backoff.
+  void RemoveInstance(const DnsName& instance_full_name);
+
+  // Returns to querying once a second unless we're already doing so.
+  void ResetQueryBackoff();
+
+  // Determines whether answers to our question that we didn't ask for were
+  // received recently enough that a query now would add nothing.
+  bool AnswersOverheardRecently(ftl::TimePoint now) const;
+
+  // Notes that the instance no longer refers to the target. Targets that
+  // no instance refers to are removed at the end of the message.
+  void ReleaseTarget(const DnsName& target_full_name,
+                     const DnsName& instance_full_name);
 
   MdnsAgent::Host* host_;
+  std::string agent_name_;
   std::string service_name_;
-  std::string service_full_name_;
+  DnsName query_full_name_;
+  ServiceFilter filter_;
   ServiceInstanceCallback callback_;
-  std::unordered_map<std::string, InstanceInfo> instance_infos_by_full_name_;
-  std::unordered_map<std::string, TargetInfo> target_infos_by_full_name_;
+  std::unordered_map<DnsName, InstanceInfo, DnsName::Hash>
+      instance_infos_by_full_name_;
+  std::unordered_map<DnsName, TargetInfo, DnsName::Hash>
+      target_infos_by_full_name_;
+  // Instances and targets changed by the current message, and targets that
+  // lost their last instance. |EndOfMessage| looks at just these.
+  std::unordered_set<DnsName, DnsName::Hash> dirty_instances_;
+  std::unordered_set<DnsName, DnsName::Hash> dirty_targets_;
+  std::unordered_set<DnsName, DnsName::Hash> unreferenced_targets_;
   ftl::TimeDelta query_delay_;
+  // When we last sent our question, and when we last received an answer to
+  // it that didn't arrive in response.
+  ftl::TimePoint last_query_time_;
+  ftl::TimePoint last_overheard_answer_time_;
   std::shared_ptr<DnsQuestion> question_;
 };
 
@@ -2,7 +2,7 @@
 // Use of this source code is governed by a BSD-style license that can be
 // found in the LICENSE file.
 
-#include <limits>
+#include <algorithm>
 #include <unordered_set>
 
 #include "apps/netconnector/src/mdns/mdns.h"
@@ -15,6 +15,7 @@
 #include "apps/netconnector/src/mdns/mdns_addresses.h"
 #include "apps/netconnector/src/mdns/mdns_names.h"
 #include "apps/netconnector/src/mdns/resource_renewer.h"
+#include "lib/ftl/files/file.h"
 #include "lib/ftl/logging.h"
 #include "lib/ftl/time/time_delta.h"
 #include "lib/mtl/tasks/message_loop.h"
@@ -23,15 +24,43 @@ namespace netconnector {
 namespace mdns {
 namespace {
 
-static constexpr uint32_t kCancelTimeToLive =
-    std::numeric_limits<uint32_t>::max();
+static const ftl::TimeDelta kDefaultAggregationWindow =
+    ftl::TimeDelta::FromMilliseconds(100);
 
-static const ftl::TimeDelta kMessageAggregationWindowSize =
+// Responses to queries for shared records are delayed 20-120ms (RFC 6762
+// section 6), so sending queued records more than 100ms early could answer
+// sooner than the RFC allows.
+static const ftl::TimeDelta kMaxAggregationWindow =
     ftl::TimeDelta::FromMilliseconds(100);
 
+// How often the adaptive aggregation window is recomputed, and the rate of
+// sent records at which it reaches its maximum.
+static const ftl::TimeDelta kRecordRateSampleInterval =
+    ftl::TimeDelta::FromSeconds(1);
+static constexpr double kHighRecordsPerSecond = 100.0;
+
+// Max TTL for records sent to legacy queriers (RFC 6762 section 6.7).
+static constexpr uint32_t kLegacyMaxTimeToLive = 10;
+
+// Max TTL for records loaded from the cache file. This gives the resource
+// renewer time to confirm them before they expire.
+static constexpr uint32_t kProvisionalMaxTimeToLive = 30;
+
+static const ftl::TimeDelta kCacheSaveInterval =
+    ftl::TimeDelta::FromSeconds(60);
+
+// Min time between multicasts of the same record (RFC 6762 section 6), which
+// keeps a querier asking in a tight loop from multiplying our traffic.
+static const ftl::TimeDelta kMinMulticastInterval =
+    ftl::TimeDelta::FromSeconds(1);
+
 }  // namespace
 
-Mdns::Mdns() : task_runner_(mtl::MessageLoop::GetCurrent()->task_runner()) {}
+Mdns::Mdns()
+    : task_runner_(mtl::MessageLoop::GetCurrent()->task_runner()),
+      min_aggregation_window_(kDefaultAggregationWindow),
+      max_aggregation_window_(kDefaultAggregationWindow),
+      aggregation_window_(kDefaultAggregationWindow) {}
 
 Mdns::~Mdns() {}
 
@@ -43,69 +72,112 @@ void Mdns::SetVerbose(bool verbose) {
   verbose_ = verbose;
 }
 
-bool Mdns::Start(const std::string& host_name) {
-  host_full_name_ = MdnsNames::LocalHostFullName(host_name);
+void Mdns::SetAggregationWindow(ftl::TimeDelta min, ftl::TimeDelta max) {
+  FTL_DCHECK(min >= ftl::TimeDelta::Zero());
+  FTL_DCHECK(min <= max);
 
-  address_placeholder_ =
-      std::make_shared<DnsResource>(host_full_name_, DnsType::kA);
+  if (max > kMaxAggregationWindow) {
+    max = kMaxAggregationWindow;
+  }
 
-  // Create an address responder agent to respond to simple address queries.
-  AddAgent(AddressResponder::kName,
-           std::make_shared<AddressResponder>(this, host_full_name_));
+  if (min > max) {
+    min = max;
+  }
 
-  // Create a resource renewer agent to keep resources alive.
-  resource_renewer_ = std::make_shared<ResourceRenewer>(this);
+  min_aggregation_window_ = min;
+  max_aggregation_window_ = max;
+  aggregation_window_ = min;
+  sent_record_count_ = 0;
+  sent_records_per_second_ = 0.0;
+  record_rate_sample_time_ = ftl::TimePoint::Now();
+}
 
-  started_ = transceiver_.Start(
-      host_full_name_,
-      [this](std::unique_ptr<DnsMessage> message,
-             const SocketAddress& source_address, uint32_t interface_index) {
-        if (verbose_) {
-          FTL_LOG(INFO) << "Inbound message from " << source_address
-                        << " through interface " << interface_index << ":"
-                        << *message;
-        }
+void Mdns::EnableReceiveThreads() {
+  FTL_DCHECK(!started_);
+  transceiver_.EnableReceiveThreads();
+}
 
-        for (auto& question : message->questions_) {
-          ReceiveQuestion(*question);
-        }
+void Mdns::SetCacheFile(const std::string& path) {
+  FTL_DCHECK(!started_);
+  FTL_DCHECK(!path.empty());
 
-        for (auto& resource : message->answers_) {
-          ReceiveResource(*resource, MdnsResourceSection::kAnswer);
-        }
+  cache_file_ = path;
 
-        for (auto& resource : message->authorities_) {
-          ReceiveResource(*resource, MdnsResourceSection::kAuthority);
-        }
+  if (files::IsFile(path) &&
+      cache_.Load(path, ftl::TimePoint::Now(), kProvisionalMaxTimeToLive)) {
+    FTL_LOG(INFO) << "Loaded mDNS cache from " << path;
+  }
 
-        for (auto& resource : message->additionals_) {
-          ReceiveResource(*resource, MdnsResourceSection::kAdditional);
-        }
+  saved_cache_change_count_ = cache_.change_count();
+}
 
-        resource_renewer_->EndOfMessage();
-        for (auto& pair : agents_by_name_) {
-          pair.second->EndOfMessage();
-        }
+bool Mdns::Start(const std::string& host_name) {
+  CreateStandardAgents(host_name);
 
-        SendMessage();
-        PostTask();
+  started_ = transceiver_.Start(
+      host_full_name_,
+      [this](std::vector<MdnsTransceiver::InboundMessage>* messages,
+             uint32_t interface_index) {
+        ReceiveMessages(messages, interface_index);
       });
 
   if (started_) {
-    for (auto pair : agents_by_name_) {
-      pair.second->Start();
-    }
+    StartAgents();
 
-    SendMessage();
-    PostTask();
+    if (!cache_file_.empty()) {
+      SaveCacheLater();
+    }
   }
 
   return started_;
 }
 
+void Mdns::StartForReplay(const std::string& host_name) {
+  CreateStandardAgents(host_name);
+  replaying_ = true;
+  started_ = true;
+  StartAgents();
+}
+
+void Mdns::ReceiveMessages(
+    std::vector<MdnsTransceiver::InboundMessage>* messages,
+    uint32_t interface_index) {
+  FTL_DCHECK(messages);
+
+  for (auto& inbound : *messages) {
+    ReceiveMessage(*inbound.message_, inbound.source_address_,
+                   interface_index, inbound.on_link_);
+  }
+
+  EndOfMessages();
+
+  if (!flushed_resources_.empty()) {
+    ExpireFlushedResourcesLater();
+  }
+
+  SendMessage();
+  PostTask();
+}
+
+void Mdns::SetCaptureCapacity(size_t capacity) {
+  transceiver_.capture().SetCapacity(capacity);
+}
+
+bool Mdns::WriteCapture(const std::string& path) {
+  return transceiver_.capture().WriteFile(path);
+}
+
 void Mdns::Stop() {
+  if (started_) {
+    SendGoodbyes();
+  }
+
   transceiver_.Stop();
   started_ = false;
+
+  if (!cache_file_.empty()) {
+    SaveCache();
+  }
 }
 
 void Mdns::ResolveHostName(const std::string& host_name,
@@ -115,61 +187,172 @@ void Mdns::ResolveHostName(const std::string& host_name,
 
   std::string host_full_name = MdnsNames::LocalHostFullName(host_name);
 
-  AddAgent(host_full_name,
-           std::make_shared<HostNameResolver>(this, host_name, host_full_name,
-                                              timeout, callback));
+  // Concurrent resolutions of the same name share a resolver. Resolutions
+  // after one completes start a new resolver, which answers from the cache
+  // if the records from the last one are still alive.
+  for (auto iter = resolvers_by_host_full_name_.begin();
+       iter != resolvers_by_host_full_name_.end();) {
+    if (iter->second.expired()) {
+      iter = resolvers_by_host_full_name_.erase(iter);
+    } else {
+      ++iter;
+    }
+  }
+
+  auto iter = resolvers_by_host_full_name_.find(host_full_name);
+  if (iter != resolvers_by_host_full_name_.end()) {
+    std::shared_ptr<HostNameResolver> resolver = iter->second.lock();
+    FTL_DCHECK(resolver);
+    if (resolver->AddCallback(timeout, callback)) {
+      return;
+    }
+  }
+
+  std::shared_ptr<HostNameResolver> resolver = std::make_shared<
+      HostNameResolver>(this, host_name, host_full_name, timeout, callback);
+  resolvers_by_host_full_name_[host_full_name] = resolver;
+  AddAgent(host_full_name, resolver);
 }
 
 void Mdns::SubscribeToService(const std::string& service_name,
+                              const ServiceFilter& filter,
                               const ServiceInstanceCallback& callback) {
   FTL_DCHECK(MdnsNames::IsValidServiceName(service_name));
+  FTL_DCHECK(filter.subtype_.empty() ||
+             MdnsNames::IsValidSubtypeName(filter.subtype_));
   FTL_DCHECK(callback);
 
-  std::string service_full_name = MdnsNames::LocalServiceFullName(service_name);
-
-  AddAgent(service_full_name,
-           std::make_shared<InstanceSubscriber>(this, service_name,
-                                                service_full_name, callback));
+  // Asking for the subtype means only instances of the subtype respond.
+  std::string query_full_name =
+      filter.subtype_.empty()
+          ? MdnsNames::LocalServiceFullName(service_name)
+          : MdnsNames::LocalSubtypeFullName(filter.subtype_, service_name);
+  std::string agent_name =
+      MdnsNames::LocalServiceFullName(service_name) + filter.ToString();
+
+  AddAgent(agent_name, std::make_shared<InstanceSubscriber>(
+                           this, agent_name, service_name, query_full_name,
+                           filter, callback));
 }
 
-void Mdns::UnsubscribeToService(const std::string& service_name) {
+void Mdns::UnsubscribeToService(const std::string& service_name,
+                                const ServiceFilter& filter) {
   FTL_DCHECK(MdnsNames::IsValidServiceName(service_name));
 
-  TellAgentToQuit(MdnsNames::LocalServiceFullName(service_name));
+  TellAgentToQuit(MdnsNames::LocalServiceFullName(service_name) +
+                  filter.ToString());
 }
 
 void Mdns::PublishServiceInstance(const std::string& service_name,
                                   const std::string& instance_name,
                                   IpPort port,
                                   const std::vector<std::string>& text) {
-  FTL_DCHECK(MdnsNames::IsValidServiceName(service_name));
+  PublishServiceInstances({{service_name, instance_name, port, text}});
+}
 
-  std::string instance_full_name =
-      MdnsNames::LocalInstanceFullName(instance_name, service_name);
+void Mdns::UnpublishServiceInstance(const std::string& service_name,
+                                    const std::string& instance_name) {
+  UnpublishServiceInstances({{service_name, instance_name, IpPort(), {}}});
+}
+
+void Mdns::PublishServiceInstances(
+    const std::vector<ServiceInstance>& instances) {
+  // All the publishers get the same start time, so their announcements are
+  // due together and go out in the same messages.
+  ftl::TimePoint now = ftl::TimePoint::Now();
+
+  for (const ServiceInstance& instance : instances) {
+    FTL_DCHECK(MdnsNames::IsValidServiceName(instance.service_name_));
 
-  std::string service_full_name = MdnsNames::LocalServiceFullName(service_name);
+    std::string instance_full_name = MdnsNames::LocalInstanceFullName(
+        instance.instance_name_, instance.service_name_);
+
+    if (instance_publisher_names_.count(instance_full_name) != 0) {
+      auto iter = agents_by_name_.find(instance_full_name);
+      FTL_DCHECK(iter != agents_by_name_.end());
+      std::static_pointer_cast<InstancePublisher>(iter->second)
+          ->Update(instance.port_, instance.text_);
+      continue;
+    }
+
+    std::string service_full_name =
+        MdnsNames::LocalServiceFullName(instance.service_name_);
+
+    std::shared_ptr<InstancePublisher> publisher =
+        std::make_shared<InstancePublisher>(
+            this, host_full_name_, instance_full_name, service_full_name,
+            instance.port_, instance.text_);
+
+    instance_publisher_names_.insert(instance_full_name);
+    RegisterAgent(instance_full_name, publisher);
+
+    if (started_) {
+      publisher->StartAt(now);
+    }
+  }
 
-  AddAgent(instance_full_name, std::make_shared<InstancePublisher>(
-                                   this, host_full_name_, instance_full_name,
-                                   service_full_name, port, text));
+  if (started_) {
+    SendMessage();
+    PostTask();
+  }
 }
 
-void Mdns::UnpublishServiceInstance(const std::string& instance_name,
-                                    const std::string& service_name) {
-  FTL_DCHECK(MdnsNames::IsValidServiceName(service_name));
-  TellAgentToQuit(
-      MdnsNames::LocalInstanceFullName(instance_name, service_name));
+void Mdns::UnpublishServiceInstances(
+    const std::vector<ServiceInstance>& instances) {
+  for (const ServiceInstance& instance : instances) {
+    FTL_DCHECK(MdnsNames::IsValidServiceName(instance.service_name_));
+    TellAgentToQuit(MdnsNames::LocalInstanceFullName(instance.instance_name_,
+                                                     instance.service_name_));
+  }
+
+  // The goodbyes are due now.
+  if (started_) {
+    SendMessage();
+    PostTask();
+  }
+}
+
+void Mdns::GetStats(MdnsStats* stats) {
+  FTL_DCHECK(stats);
+
+  transceiver_.GetInterfaceStats(&stats->interfaces_);
+  stats->types_ = type_stats_;
+  stats->suppressed_questions_ = suppressed_questions_;
+  stats->suppressed_records_ = suppressed_records_;
+  stats->coalesced_questions_ = coalesced_questions_;
+  stats->rate_limited_records_ = rate_limited_records_;
+  stats->cache_records_ = cache_.record_count();
+  stats->cache_bytes_ = cache_.byte_count();
+  stats->cache_evictions_ = cache_.eviction_count();
+  stats->question_queue_size_ = question_queue_.size();
+  stats->resource_queue_size_ = resource_queue_.size();
+  stats->wake_queue_size_ = wake_queue_.size();
+
+  for (auto& pair : agent_stats_) {
+    stats->agents_.push_back(pair.second);
+  }
 }
 
 void Mdns::WakeAt(std::shared_ptr<MdnsAgent> agent, ftl::TimePoint when) {
   FTL_DCHECK(agent);
-  wake_queue_.emplace(when, agent);
+
+  auto iter = wake_ids_by_agent_.find(agent.get());
+  if (iter == wake_ids_by_agent_.end()) {
+    wake_ids_by_agent_.emplace(agent.get(), wake_queue_.Schedule(when, agent));
+    return;
+  }
+
+  // An agent has at most one wakeup scheduled. Agents reschedule when they
+  // wake, so the earlier time is the one that matters.
+  if (when < wake_queue_.time(iter->second)) {
+    wake_queue_.Reschedule(iter->second, when);
+  }
 }
 
 void Mdns::SendQuestion(std::shared_ptr<DnsQuestion> question,
                         ftl::TimePoint when) {
   FTL_DCHECK(question);
-  question_queue_.emplace(when, question);
+  question_queue_.Schedule(when, question);
 }
 
 void Mdns::SendResource(std::shared_ptr<DnsResource> resource,
@@ -179,31 +362,117 @@ void Mdns::SendResource(std::shared_ptr<DnsResource> resource,
 
   if (section == MdnsResourceSection::kExpired) {
     // Expirations are distributed to local agents.
-    for (auto& pair : agents_by_name_) {
-      pair.second->ReceiveResource(*resource, MdnsResourceSection::kExpired);
+    cache_.Remove(resource->name_, resource->type_);
+    for (auto& agent : InterestedAgents(resource->name_)) {
+      PresentResource(agent.get(), *resource, MdnsResourceSection::kExpired);
     }
 
     return;
   }
 
-  resource_queue_.emplace(when, resource, section);
+  if (unicast_reply_ && resource->time_to_live_ != 0 &&
+      when <= ftl::TimePoint::Now() + aggregation_window_) {
+    // This is a response to the query being received.
+    AddToUnicastReply(resource, section);
+    return;
+  }
+
+  if (resource->time_to_live_ == 0) {
+    // This is a goodbye. Earlier sends of the resource that haven't happened
+    // yet are cancelled.
+    resource_queue_.RemoveIf(
+        [&resource](ftl::TimePoint time, const ResourceQueueEntry& entry) {
+          return entry.resource_ == resource;
+        });
+  }
+
+  resource_queue_.Schedule(when, ResourceQueueEntry(resource, section));
 }
 
 void Mdns::SendAddresses(MdnsResourceSection section, ftl::TimePoint when) {
+  if (unicast_reply_ &&
+      when <= ftl::TimePoint::Now() + aggregation_window_) {
+    AddToUnicastReply(address_placeholder_, section);
+    return;
+  }
+
   // Placeholder for address resource record.
-  resource_queue_.emplace(when, address_placeholder_, section);
+  resource_queue_.Schedule(when,
+                           ResourceQueueEntry(address_placeholder_, section));
+}
+
+void Mdns::RemoveAgent(const std::string& name) {
+  auto iter = agents_by_name_.find(name);
+  if (iter == agents_by_name_.end()) {
+    return;
+  }
+
+  std::shared_ptr<MdnsAgent> agent = iter->second;
+
+  for (auto interest_iter = interested_agents_by_name_.begin();
+       interest_iter != interested_agents_by_name_.end();) {
+    std::vector<std::shared_ptr<MdnsAgent>>& agents = interest_iter->second;
+    agents.erase(std::remove(agents.begin(), agents.end(), agent),
+                 agents.end());
+
+    if (agents.empty()) {
+      interest_iter = interested_agents_by_name_.erase(interest_iter);
+    } else {
+      ++interest_iter;
+    }
+  }
+
+  auto wake_iter = wake_ids_by_agent_.find(agent.get());
+  if (wake_iter != wake_ids_by_agent_.end()) {
+    wake_queue_.Cancel(wake_iter->second);
+    wake_ids_by_agent_.erase(wake_iter);
+  }
+
+  agents_to_notify_.erase(agent);
+  agent_stats_.erase(agent.get());
+  instance_publisher_names_.erase(name);
+  agents_by_name_.erase(iter);
 }
 
-void Mdns::Renew(const DnsResource& resource) {
-  resource_renewer_->Renew(resource);
+void Mdns::AddInterest(std::shared_ptr<MdnsAgent> agent,
+                       const DnsName& name) {
+  FTL_DCHECK(agent);
+
+  std::vector<std::shared_ptr<MdnsAgent>>& agents =
+      interested_agents_by_name_[name];
+  if (std::find(agents.begin(), agents.end(), agent) != agents.end()) {
+    return;
+  }
+
+  bool first_interest = agents.empty();
+  agents.push_back(agent);
+  PresentCachedResources(agent, name, first_interest);
 }
 
-void Mdns::RemoveAgent(const std::string& name) {
-  agents_by_name_.erase(name);
+void Mdns::RemoveInterest(std::shared_ptr<MdnsAgent> agent,
+                          const DnsName& name) {
+  FTL_DCHECK(agent);
+
+  auto iter = interested_agents_by_name_.find(name);
+  if (iter == interested_agents_by_name_.end()) {
+    return;
+  }
+
+  std::vector<std::shared_ptr<MdnsAgent>>& agents = iter->second;
+  agents.erase(std::remove(agents.begin(), agents.end(), agent), agents.end());
+
+  if (agents.empty()) {
+    interested_agents_by_name_.erase(iter);
+  }
+}
+
+bool Mdns::HasInterest(const DnsName& name) {
+  return interested_agents_by_name_.find(name) !=
+         interested_agents_by_name_.end();
 }
 
 void Mdns::AddAgent(const std::string& name, std::shared_ptr<MdnsAgent> agent) {
-  agents_by_name_.emplace(name, agent);
+  RegisterAgent(name, agent);
   if (started_) {
     agent->Start();
     SendMessage();
@@ -211,65 +480,147 @@ void Mdns::AddAgent(const std::string& name, std::shared_ptr<MdnsAgent> agent) {
   }
 }
 
+void Mdns::RegisterAgent(const std::string& name,
+                         std::shared_ptr<MdnsAgent> agent) {
+  agents_by_name_.emplace(name, agent);
+  agent_stats_[agent.get()].name_ = name;
+}
+
+void Mdns::CreateStandardAgents(const std::string& host_name) {
+  host_full_name_ = MdnsNames::LocalHostFullName(host_name);
+
+  address_placeholder_ =
+      std::make_shared<DnsResource>(host_full_name_, DnsType::kA);
+
+  // Create an address responder agent to respond to simple address queries.
+  AddAgent(AddressResponder::kName,
+           std::make_shared<AddressResponder>(this, host_full_name_));
+
+  // Create a resource renewer agent to keep resources alive.
+  resource_renewer_ = std::make_shared<ResourceRenewer>(this);
+  agent_stats_[resource_renewer_.get()].name_ = "resource renewer";
+}
+
+void Mdns::StartAgents() {
+  for (auto pair : agents_by_name_) {
+    pair.second->Start();
+  }
+
+  SendMessage();
+  PostTask();
+}
+
 void Mdns::SendMessage() {
   // It's acceptable to send records a bit early, and this provides two
   // advantages:
   // 1) We get more records per message, which is more efficient.
   // 2) Agents can schedule records in short sequences if sequence is important.
-  ftl::TimePoint now = ftl::TimePoint::Now() + kMessageAggregationWindowSize;
+  ftl::TimePoint now = ftl::TimePoint::Now() + aggregation_window_;
 
   DnsMessage message;
 
   bool empty = true;
 
-  while (!question_queue_.empty() && question_queue_.top().time_ <= now) {
-    message.questions_.push_back(question_queue_.top().question_);
-    question_queue_.pop();
+  while (!question_queue_.empty() && question_queue_.top_time() <= now) {
+    std::shared_ptr<DnsQuestion> question = question_queue_.Pop();
     empty = false;
+
+    // Agents that subscribe to the same name ask the same question, and one
+    // copy per message gets all of them their answers.
+    bool coalesced = false;
+    for (auto& other : message.questions_) {
+      if (other->type_ == question->type_ &&
+          other->class_ == question->class_ &&
+          other->name_ == question->name_) {
+        // A multicast response reaches everyone, so it's requested if any of
+        // the copies asks for one.
+        if (!question->unicast_response_ && other->unicast_response_) {
+          other = question;
+        }
+
+        coalesced = true;
+        ++coalesced_questions_;
+        break;
+      }
+    }
+
+    if (!coalesced) {
+      message.questions_.push_back(std::move(question));
+    }
   }
 
-  // TODO(dalesat): Fully implement traffic mitigation.
-  // For now, we just make sure we don't send the same record instance twice.
+  // Duplicates on the network are suppressed as they're received. Here, we
+  // just make sure we don't send the same record instance twice.
   std::unordered_set<DnsResource*> resources_added;
 
-  while (!resource_queue_.empty() && resource_queue_.top().time_ <= now) {
-    if (resource_queue_.top().resource_->time_to_live_ == kCancelTimeToLive) {
-      // Cancelled while in the queue.
-      resource_queue_.pop();
-      continue;
-    }
+  // Records multicast less than |kMinMulticastInterval| ago are put back in
+  // the queue for when the interval is up. Goodbyes aren't held back. Probe
+  // defense would be exempt, too, but we don't probe.
+  ftl::TimePoint multicast_time = ftl::TimePoint::Now();
+  std::vector<std::pair<ftl::TimePoint, ResourceQueueEntry>> deferred_entries;
+
+  while (!resource_queue_.empty() && resource_queue_.top_time() <= now) {
+    ResourceQueueEntry entry = resource_queue_.Pop();
 
-    if (resources_added.count(resource_queue_.top().resource_.get()) != 0) {
+    if (!resources_added.insert(entry.resource_.get()).second) {
       // Already added to this message.
-      resource_queue_.pop();
       continue;
     }
 
-    resources_added.insert(resource_queue_.top().resource_.get());
+    if (entry.resource_->time_to_live_ != 0) {
+      auto iter = last_multicast_times_.find(entry.resource_);
+      if (iter != last_multicast_times_.end() &&
+          iter->second + kMinMulticastInterval > multicast_time) {
+        deferred_entries.emplace_back(iter->second + kMinMulticastInterval,
+                                      std::move(entry));
+        ++rate_limited_records_;
+        continue;
+      }
+    }
 
-    switch (resource_queue_.top().section_) {
+    switch (entry.section_) {
       case MdnsResourceSection::kAnswer:
-        message.answers_.push_back(resource_queue_.top().resource_);
+        message.answers_.push_back(std::move(entry.resource_));
         break;
       case MdnsResourceSection::kAuthority:
-        message.authorities_.push_back(resource_queue_.top().resource_);
+        message.authorities_.push_back(std::move(entry.resource_));
         break;
       case MdnsResourceSection::kAdditional:
-        message.additionals_.push_back(resource_queue_.top().resource_);
+        message.additionals_.push_back(std::move(entry.resource_));
         break;
       case MdnsResourceSection::kExpired:
         FTL_DCHECK(false);
         break;
     }
 
-    resource_queue_.pop();
     empty = false;
   }
 
+  // Deferred entries are scheduled only now, so they aren't popped again in
+  // the loop above.
+  for (auto& pair : deferred_entries) {
+    resource_queue_.Schedule(pair.first, std::move(pair.second));
+  }
+
+  RecordMulticastTimes(message, multicast_time);
+
   if (empty) {
     return;
   }
 
+  CountMessage(message, true);
+
+  sent_record_count_ += message.questions_.size() + message.answers_.size() +
+                        message.authorities_.size() +
+                        message.additionals_.size();
+  UpdateAggregationWindow();
+
+  // List the answers we already have, so responders don't send them again.
+  ftl::TimePoint cache_now = ftl::TimePoint::Now();
+  for (auto& question : message.questions_) {
+    cache_.GetKnownAnswers(*question, cache_now, &message.answers_);
+  }
+
   message.UpdateCounts();
 
   if (message.questions_.empty()) {
@@ -281,41 +632,470 @@ void Mdns::SendMessage() {
     FTL_LOG(INFO) << "Outbound message: " << message;
   }
 
+  if (replaying_) {
+    return;
+  }
+
   // V6 interface transceivers will treat this as |kV6Multicast|.
   transceiver_.SendMessage(&message, MdnsAddresses::kV4Multicast, 0);
+}
+
+void Mdns::RecordMulticastTimes(const DnsMessage& message,
+                                ftl::TimePoint multicast_time) {
+  for (auto iter = last_multicast_times_.begin();
+       iter != last_multicast_times_.end();) {
+    if (iter->second + kMinMulticastInterval <= multicast_time) {
+      iter = last_multicast_times_.erase(iter);
+    } else {
+      ++iter;
+    }
+  }
+
+  for (auto resources :
+       {&message.answers_, &message.authorities_, &message.additionals_}) {
+    for (auto& resource : *resources) {
+      if (resource->time_to_live_ != 0) {
+        last_multicast_times_[resource] = multicast_time;
+      }
+    }
+  }
+}
+
+void Mdns::UpdateAggregationWindow() {
+  if (min_aggregation_window_ == max_aggregation_window_) {
+    return;
+  }
+
+  ftl::TimePoint now = ftl::TimePoint::Now();
+  ftl::TimeDelta elapsed = now - record_rate_sample_time_;
+  if (elapsed < kRecordRateSampleInterval) {
+    return;
+  }
+
+  // Smooth the rate so one burst doesn't swing the window, but let idle
+  // periods, which show up as one long sample, narrow it quickly.
+  double sample = sent_record_count_ / elapsed.ToSecondsF();
+  sent_records_per_second_ = elapsed > kRecordRateSampleInterval * 2
+                                 ? sample
+                                 : (sent_records_per_second_ * 3 + sample) / 4;
+  sent_record_count_ = 0;
+  record_rate_sample_time_ = now;
+
+  double load =
+      std::min(sent_records_per_second_ / kHighRecordsPerSecond, 1.0);
+  aggregation_window_ =
+      min_aggregation_window_ +
+      ftl::TimeDelta::FromNanoseconds(static_cast<int64_t>(
+          (max_aggregation_window_ - min_aggregation_window_).ToNanoseconds() *
+          load));
+}
+
+void Mdns::ReceiveMessage(const DnsMessage& message,
+                          const SocketAddress& source_address,
+                          uint32_t interface_index,
+                          bool on_link) {
+  if (verbose_) {
+    FTL_LOG(INFO) << "Inbound message from " << source_address
+                  << " through interface " << interface_index << ":"
+                  << message;
+  }
+
+  CountMessage(message, false);
+  SuppressDuplicates(message);
+  BeginUnicastReply(message, source_address, interface_index, on_link);
+
+  presenting_resources_ = true;
+
+  for (auto& question : message.questions_) {
+    ReceiveQuestion(*question);
+  }
+
+  for (auto& resource : message.answers_) {
+    ReceiveResource(*resource, MdnsResourceSection::kAnswer);
+  }
+
+  for (auto& resource : message.authorities_) {
+    ReceiveResource(*resource, MdnsResourceSection::kAuthority);
+  }
+
+  for (auto& resource : message.additionals_) {
+    ReceiveResource(*resource, MdnsResourceSection::kAdditional);
+  }
+
+  if (unicast_reply_) {
+    // What agents send in |EndOfMessage| belongs in the reply, so this
+    // message can't share its sweep with the rest of the batch.
+    EndOfMessages();
+    EndUnicastReply(message);
+  }
+}
+
+void Mdns::EndOfMessages() {
+  PresentEndOfMessage(resource_renewer_.get());
+  presenting_resources_ = false;
+  NotifyEndOfMessage();
+}
+
+void Mdns::SaveCache() {
+  FTL_DCHECK(!cache_file_.empty());
+
+  if (cache_.change_count() == saved_cache_change_count_) {
+    return;
+  }
+
+  if (!cache_.Save(cache_file_, ftl::TimePoint::Now())) {
+    FTL_LOG(ERROR) << "Failed to save mDNS cache to " << cache_file_;
+  }
+
+  // Failures aren't retried until the cache changes again.
+  saved_cache_change_count_ = cache_.change_count();
+}
+
+void Mdns::SaveCacheLater() {
+  if (cache_save_pending_) {
+    return;
+  }
+
+  cache_save_pending_ = true;
+  task_runner_->PostDelayedTask(
+      [this]() {
+        cache_save_pending_ = false;
+
+        if (started_) {
+          SaveCache();
+          SaveCacheLater();
+        }
+      },
+      kCacheSaveInterval);
+}
+
+void Mdns::BeginUnicastReply(const DnsMessage& message,
+                             const SocketAddress& source_address,
+                             uint32_t interface_index,
+                             bool on_link) {
+  FTL_DCHECK(!unicast_reply_);
+
+  if (message.header_.response() || message.questions_.empty()) {
+    return;
+  }
+
+  if (!on_link) {
+    // Unicast replies to off-link sources would let anyone use us as a
+    // reflector (RFC 6762 section 11). Such queries are still seen by the
+    // agents, so a QU query may be answered by multicast instead.
+    if (verbose_) {
+      FTL_LOG(INFO) << "Not replying by unicast to off-link querier "
+                    << source_address;
+    }
+
+    return;
+  }
+
+  bool legacy = source_address.port() != MdnsAddresses::kV4Multicast.port();
+
+  if (!legacy) {
+    // Queriers that want unicast responses set the QU bit in all their
+    // questions. If any question is QM, the response is multicast.
+    for (auto& question : message.questions_) {
+      if (!question->unicast_response_) {
+        return;
+      }
+    }
+  }
+
+  // Agents finish with the earlier messages in the batch first, so nothing
+  // they send for those ends up in the reply.
+  EndOfMessages();
+
+  unicast_reply_ =
+      std::make_unique<UnicastReply>(source_address, interface_index, legacy);
+}
+
+void Mdns::AddToUnicastReply(std::shared_ptr<DnsResource> resource,
+                             MdnsResourceSection section) {
+  FTL_DCHECK(unicast_reply_);
+
+  std::vector<std::shared_ptr<DnsResource>>* resources;
+  switch (section) {
+    case MdnsResourceSection::kAnswer:
+      resources = &unicast_reply_->message_.answers_;
+      break;
+    case MdnsResourceSection::kAuthority:
+      resources = &unicast_reply_->message_.authorities_;
+      break;
+    case MdnsResourceSection::kAdditional:
+      resources = &unicast_reply_->message_.additionals_;
+      break;
+    case MdnsResourceSection::kExpired:
+      FTL_DCHECK(false);
+      return;
+  }
+
+  if (std::find(resources->begin(), resources->end(), resource) !=
+      resources->end()) {
+    return;
+  }
+
+  if (unicast_reply_->legacy_ && resource != address_placeholder_) {
+    // Legacy queriers get records with short TTLs and no cache flush bits.
+    // The address placeholder is filled in by the interface transceiver,
+    // so it keeps its usual TTL.
+    std::shared_ptr<DnsResource> copy =
+        std::make_shared<DnsResource>(*resource);
+    if (copy->time_to_live_ > kLegacyMaxTimeToLive) {
+      copy->time_to_live_ = kLegacyMaxTimeToLive;
+    }
+
+    copy->cache_flush_ = false;
+    resource = copy;
+  }
+
+  resources->push_back(resource);
+}
+
+void Mdns::EndUnicastReply(const DnsMessage& query) {
+  if (!unicast_reply_) {
+    return;
+  }
+
+  std::unique_ptr<UnicastReply> reply = std::move(unicast_reply_);
+  DnsMessage& message = reply->message_;
+
+  if (message.answers_.empty() && message.authorities_.empty() &&
+      message.additionals_.empty()) {
+    return;
+  }
+
+  if (reply->legacy_) {
+    // Legacy queriers expect the query ID and questions to be echoed.
+    message.header_.id_ = query.header_.id_;
+    message.questions_ = query.questions_;
+  }
 
-  for (auto resource : message.answers_) {
-    if (resource->time_to_live_ == 0) {
-      resource->time_to_live_ = kCancelTimeToLive;
+  message.header_.SetResponse(true);
+  message.header_.SetAuthoritativeAnswer(true);
+  message.UpdateCounts();
+
+  if (verbose_) {
+    FTL_LOG(INFO) << "Outbound message to " << reply->address_
+                  << " through interface " << reply->interface_index_ << ":"
+                  << message;
+  }
+
+  CountMessage(message, true);
+
+  if (replaying_) {
+    return;
+  }
+
+  transceiver_.SendMessage(&message, reply->address_,
+                           reply->interface_index_);
+}
+
+void Mdns::SuppressDuplicates(const DnsMessage& message) {
+  // Only queued records that would go out in the next message are affected.
+  // Records scheduled further out, like repeated announcements, are still
+  // sent.
+  ftl::TimePoint horizon =
+      ftl::TimePoint::Now() + aggregation_window_;
+
+  if (!message.header_.response()) {
+    if (message.questions_.empty()) {
+      return;
     }
+
+    question_queue_.RemoveIf([this, &message, horizon](
+        ftl::TimePoint time, const std::shared_ptr<DnsQuestion>& question) {
+      if (time > horizon || !IsDuplicateQuestion(*question, message)) {
+        return false;
+      }
+
+      ++suppressed_questions_;
+      return true;
+    });
+
+    return;
   }
 
-  for (auto resource : message.authorities_) {
-    if (resource->time_to_live_ == 0) {
-      resource->time_to_live_ = kCancelTimeToLive;
+  if (message.answers_.empty()) {
+    return;
+  }
+
+  // Another responder has sent an answer we were about to send, with a TTL
+  // at least as large as ours.
+  resource_queue_.RemoveIf(
+      [this, &message, horizon](ftl::TimePoint time,
+                                const ResourceQueueEntry& entry) {
+        if (time > horizon || entry.section_ != MdnsResourceSection::kAnswer) {
+          return false;
+        }
+
+        for (auto& answer : message.answers_) {
+          if (answer->IsSameRecord(*entry.resource_) &&
+              answer->time_to_live_ >= entry.resource_->time_to_live_) {
+            ++suppressed_records_;
+            return true;
+          }
+        }
+
+        return false;
+      });
+}
+
+bool Mdns::IsDuplicateQuestion(const DnsQuestion& question,
+                               const DnsMessage& message) {
+  bool asked = false;
+
+  for (auto& other : message.questions_) {
+    // A question asking for a unicast response won't get an answer we can
+    // hear.
+    if (!other->unicast_response_ && other->type_ == question.type_ &&
+        other->class_ == question.class_ && other->name_ == question.name_) {
+      asked = true;
+      break;
     }
   }
 
-  for (auto resource : message.additionals_) {
-    if (resource->time_to_live_ == 0) {
-      resource->time_to_live_ = kCancelTimeToLive;
+  if (!asked) {
+    return false;
+  }
+
+  // The other querier must already know everything we know. Otherwise, the
+  // responses it gets won't include the answers we're missing.
+  std::vector<std::shared_ptr<DnsResource>> known_answers;
+  cache_.GetKnownAnswers(question, ftl::TimePoint::Now(), &known_answers);
+
+  for (auto& known_answer : known_answers) {
+    bool found = false;
+    for (auto& answer : message.answers_) {
+      if (answer->IsSameRecord(*known_answer)) {
+        found = true;
+        break;
+      }
+    }
+
+    if (!found) {
+      return false;
     }
   }
+
+  return true;
 }
 
 void Mdns::ReceiveQuestion(const DnsQuestion& question) {
   // Renewer doesn't need questions.
-  for (auto& pair : agents_by_name_) {
-    pair.second->ReceiveQuestion(question);
+  for (auto& agent : InterestedAgents(question.name_)) {
+    agent->ReceiveQuestion(question);
+    agents_to_notify_.insert(agent);
   }
 }
 
 void Mdns::ReceiveResource(const DnsResource& resource,
                            MdnsResourceSection section) {
-  // Renewer is always first.
-  resource_renewer_->ReceiveResource(resource, section);
-  for (auto& pair : agents_by_name_) {
-    pair.second->ReceiveResource(resource, section);
+  cache_.Add(resource, ftl::TimePoint::Now(), &flushed_resources_);
+
+  // Renewer is always first, and it gets every resource.
+  PresentResource(resource_renewer_.get(), resource, section);
+  // NSEC records aren't queried for, so they aren't renewed.
+  if (resource.time_to_live_ != 0 && resource.type_ != DnsType::kNSec &&
+      HasInterest(resource.name_)) {
+    resource_renewer_->Renew(resource);
+  }
+
+  for (auto& agent : InterestedAgents(resource.name_)) {
+    PresentResource(agent.get(), resource, section);
+    agents_to_notify_.insert(agent);
+  }
+}
+
+void Mdns::PresentCachedResources(std::shared_ptr<MdnsAgent> agent,
+                                  const DnsName& name,
+                                  bool renew) {
+  std::vector<std::shared_ptr<DnsResource>> resources;
+  cache_.Get(name, ftl::TimePoint::Now(), &resources);
+  if (resources.empty()) {
+    return;
+  }
+
+  // The agent may register more interests while we're doing this. Those
+  // get presented as part of the same pseudo-message.
+  bool presenting_resources = presenting_resources_;
+  presenting_resources_ = true;
+
+  for (auto& resource : resources) {
+    if (renew && resource->type_ != DnsType::kNSec) {
+      resource_renewer_->Renew(*resource);
+    }
+
+    PresentResource(agent.get(), *resource, MdnsResourceSection::kAnswer);
+  }
+
+  agents_to_notify_.insert(agent);
+  presenting_resources_ = presenting_resources;
+
+  if (!presenting_resources_) {
+    NotifyEndOfMessage();
+  }
+}
+
+std::vector<std::shared_ptr<MdnsAgent>> Mdns::InterestedAgents(
+    const DnsName& name) {
+  auto iter = interested_agents_by_name_.find(name);
+  if (iter == interested_agents_by_name_.end()) {
+    return std::vector<std::shared_ptr<MdnsAgent>>();
+  }
+
+  return iter->second;
+}
+
+void Mdns::NotifyEndOfMessage() {
+  // Agents may remove themselves (and therefore other entries) in
+  // |EndOfMessage|, so we work from a local copy.
+  std::unordered_set<std::shared_ptr<MdnsAgent>> agents;
+  agents.swap(agents_to_notify_);
+
+  for (auto& agent : agents) {
+    PresentEndOfMessage(agent.get());
+  }
+}
+
+void Mdns::PresentResource(MdnsAgent* agent,
+                           const DnsResource& resource,
+                           MdnsResourceSection section) {
+  ftl::TimePoint start = ftl::TimePoint::Now();
+  agent->ReceiveResource(resource, section);
+
+  // The agent may have removed itself, in which case its stats are gone.
+  auto iter = agent_stats_.find(agent);
+  if (iter != agent_stats_.end()) {
+    ++iter->second.resources_received_;
+    iter->second.receive_resource_time_ += ftl::TimePoint::Now() - start;
+  }
+}
+
+void Mdns::PresentEndOfMessage(MdnsAgent* agent) {
+  ftl::TimePoint start = ftl::TimePoint::Now();
+  agent->EndOfMessage();
+
+  auto iter = agent_stats_.find(agent);
+  if (iter != agent_stats_.end()) {
+    ++iter->second.end_of_message_count_;
+    iter->second.end_of_message_time_ += ftl::TimePoint::Now() - start;
+  }
+}
+
+void Mdns::CountMessage(const DnsMessage& message, bool sent) {
+  for (auto& question : message.questions_) {
+    MdnsTypeStats& type_stats = type_stats_[question->type_];
+    ++(sent ? type_stats.questions_sent_ : type_stats.questions_received_);
+  }
+
+  for (auto* resources :
+       {&message.answers_, &message.authorities_, &message.additionals_}) {
+    for (auto& resource : *resources) {
+      MdnsTypeStats& type_stats = type_stats_[resource->type_];
+      ++(sent ? type_stats.records_sent_ : type_stats.records_received_);
+    }
   }
 }
 
@@ -323,39 +1103,39 @@ void Mdns::PostTask() {
   ftl::TimePoint when = ftl::TimePoint::Max();
 
   if (!wake_queue_.empty()) {
-    when = wake_queue_.top().time_;
+    when = wake_queue_.top_time();
   }
 
-  if (!question_queue_.empty() && when > question_queue_.top().time_) {
-    when = question_queue_.top().time_;
+  if (!question_queue_.empty() && when > question_queue_.top_time()) {
+    when = question_queue_.top_time();
   }
 
-  if (!resource_queue_.empty() && when > resource_queue_.top().time_) {
-    when = resource_queue_.top().time_;
+  if (!resource_queue_.empty() && when > resource_queue_.top_time()) {
+    when = resource_queue_.top_time();
   }
 
   if (when == ftl::TimePoint::Max()) {
     return;
   }
 
-  if (!post_task_queue_.empty() && post_task_queue_.top() <= when) {
+  if (posted_task_time_ <= when) {
     // We're already scheduled to wake up by |when|.
     return;
   }
 
-  post_task_queue_.push(when);
+  posted_task_time_ = when;
 
   task_runner_->PostTaskForTime(
       [this, when]() {
-        while (!post_task_queue_.empty() && post_task_queue_.top() <= when) {
-          post_task_queue_.pop();
+        if (posted_task_time_ == when) {
+          posted_task_time_ = ftl::TimePoint::Max();
         }
 
         ftl::TimePoint now = ftl::TimePoint::Now();
 
-        while (!wake_queue_.empty() && wake_queue_.top().time_ <= now) {
-          std::shared_ptr<MdnsAgent> agent = wake_queue_.top().agent_;
-          wake_queue_.pop();
+        while (!wake_queue_.empty() && wake_queue_.top_time() <= now) {
+          std::shared_ptr<MdnsAgent> agent = wake_queue_.Pop();
+          wake_ids_by_agent_.erase(agent.get());
           agent->Wake();
         }
 
@@ -365,6 +1145,53 @@ void Mdns::PostTask() {
       when);
 }
 
+void Mdns::SendGoodbyes() {
+  // Publishers queue their goodbyes and remove themselves when they quit, so
+  // we work from a copy of the names.
+  std::vector<std::string> names(instance_publisher_names_.begin(),
+                                 instance_publisher_names_.end());
+  for (auto& name : names) {
+    TellAgentToQuit(name);
+  }
+
+  // The goodbyes are all due now, so they go out in one message.
+  SendMessage();
+}
+
+void Mdns::ExpireFlushedResourcesLater() {
+  std::vector<std::shared_ptr<DnsResource>> resources;
+  resources.swap(flushed_resources_);
+
+  task_runner_->PostDelayedTask(
+      [this, resources]() { ExpireFlushedResources(resources); },
+      MdnsCache::kCacheFlushGracePeriod);
+}
+
+void Mdns::ExpireFlushedResources(
+    const std::vector<std::shared_ptr<DnsResource>>& resources) {
+  ftl::TimePoint now = ftl::TimePoint::Now();
+
+  presenting_resources_ = true;
+
+  for (auto& resource : resources) {
+    // Records received again during the grace period are still current.
+    if (cache_.Contains(*resource, now)) {
+      continue;
+    }
+
+    for (auto& agent : InterestedAgents(resource->name_)) {
+      PresentResource(agent.get(), *resource, MdnsResourceSection::kExpired);
+      agents_to_notify_.insert(agent);
+    }
+  }
+
+  presenting_resources_ = false;
+  NotifyEndOfMessage();
+
+  SendMessage();
+  PostTask();
+}
+
 void Mdns::TellAgentToQuit(const std::string& name) {
   auto iter = agents_by_name_.find(name);
 
@@ -4,25 +4,34 @@
 
 #pragma once
 
+#include <map>
 #include <memory>
-#include <queue>
 #include <string>
 #include <unordered_map>
+#include <unordered_set>
 #include <vector>
 
 #include "apps/netconnector/src/mdns/dns_message.h"
 #include "apps/netconnector/src/mdns/mdns_agent.h"
+#include "apps/netconnector/src/mdns/mdns_cache.h"
+#include "apps/netconnector/src/mdns/mdns_stats.h"
 #include "apps/netconnector/src/mdns/mdns_transceiver.h"
 #include "apps/netconnector/src/mdns/resource_renewer.h"
+#include "apps/netconnector/src/mdns/service_filter.h"
+#include "apps/netconnector/src/mdns/timer_queue.h"
 #include "apps/netconnector/src/socket_address.h"
 #include "lib/ftl/macros.h"
 #include "lib/ftl/tasks/task_runner.h"
+#include "lib/ftl/time/time_delta.h"
 #include "lib/ftl/time/time_point.h"
 
 namespace netconnector {
 namespace mdns {
 
-// Implements mDNS.
+class HostNameResolver;
+
+// Implements mDNS. |Mdns| isn't thread-safe. It must be created, used and
+// destroyed on one thread, which must have a message loop.
 class Mdns : public MdnsAgent::Host {
  public:
   using ResolveHostNameCallback =
@@ -36,6 +45,15 @@ class Mdns : public MdnsAgent::Host {
                          const SocketAddress& v6_address,
                          const std::vector<std::string>& text)>;
 
+  // Describes a service instance for |PublishServiceInstances| and
+  // |UnpublishServiceInstances|.
+  struct ServiceInstance {
+    std::string service_name_;
+    std::string instance_name_;
+    IpPort port_;
+    std::vector<std::string> text_;
+  };
+
   Mdns();
 
   virtual ~Mdns() override;
@@ -49,18 +67,58 @@ class Mdns : public MdnsAgent::Host {
   // Determines whether message traffic will be logged.
   void SetVerbose(bool verbose);
 
+  // Sets the range of the aggregation window. Queued questions and records
+  // due within the window are sent together, early, so messages carry more
+  // records. If |min| and |max| are the same, the window is fixed. Otherwise,
+  // it widens toward |max| as the rate of sent records rises and narrows
+  // toward |min| when traffic is light. |max| is limited to 100ms. Defaults
+  // to a fixed 100ms window.
+  void SetAggregationWindow(ftl::TimeDelta min, ftl::TimeDelta max);
+
+  // Loads the record cache from the file at |path|, if there is one, and
+  // saves the cache there periodically and on |Stop|. Loaded records are
+  // provisional: they're presented to agents as usual, but expire soon unless
+  // the network confirms them. Should be called before calling |Start|.
+  void SetCacheFile(const std::string& path);
+
+  // Has each interface receive and parse its datagrams on a thread of its
+  // own. Messages are still processed on the calling thread, in batches.
+  // Should be called before calling |Start|.
+  void EnableReceiveThreads();
+
   // Starts the transceiver. Returns true if successful.
   bool Start(const std::string& host_name);
 
-  // Stops the transceiver.
+  // Sends goodbyes for the published service instances, all in one message,
+  // and stops the transceiver.
   void Stop();
 
+  // Starts without the transceiver, so captured traffic can be replayed
+  // through |ReceiveMessages|. Outbound messages are composed as usual and
+  // then discarded. Used by benchmarks.
+  void StartForReplay(const std::string& host_name);
+
+  // Presents |messages|, received together on the interface with index
+  // |interface_index|, to the agents, and sends what the agents queue in
+  // response. The transceiver calls this, as do replays.
+  void ReceiveMessages(std::vector<MdnsTransceiver::InboundMessage>* messages,
+                       uint32_t interface_index);
+
+  // Sets the number of recent datagrams kept for |WriteCapture|. Zero, the
+  // default, turns capture off.
+  void SetCaptureCapacity(size_t capacity);
+
+  // Writes the captured datagrams to a pcapng file at |path|. Returns false
+  // if the file couldn't be written.
+  bool WriteCapture(const std::string& path);
+
   // Resolves |host_name| to one or two |IpAddress|es.
   void ResolveHostName(const std::string& host_name,
                        ftl::TimePoint timeout,
                        const ResolveHostNameCallback& callback);
 
-  // Starts publishing the indicated service instance.
+  // Starts publishing the indicated service instance. If the instance is
+  // already published, its port and text are updated.
   void PublishServiceInstance(const std::string& service_name,
                               const std::string& instance_name,
                               IpPort port,
@@ -70,56 +128,56 @@ class Mdns : public MdnsAgent::Host {
   void UnpublishServiceInstance(const std::string& service_name,
                                 const std::string& instance_name);
 
-  // Registers interest in the specified service.
-  void SubscribeToService(const std::string& service_name,
-                          const ServiceInstanceCallback& callback);
-
-  // Registers disinterest in the specified service.
-  void UnsubscribeToService(const std::string& service_name);
-
- private:
-  template <typename T>
-  class reverse_priority_queue
-      : public std::priority_queue<T, std::vector<T>, std::greater<T>> {};
-
-  struct WakeQueueEntry {
-    WakeQueueEntry(ftl::TimePoint time, std::shared_ptr<MdnsAgent> agent)
-        : time_(time), agent_(agent) {}
-
-    ftl::TimePoint time_;
-    std::shared_ptr<MdnsAgent> agent_;
+  // Starts publishing |instances|. The instances are announced on one
+  // schedule, so each announcement carries all of them and one set of
+  // address records. Instances that are already published are updated.
+  void PublishServiceInstances(const std::vector<ServiceInstance>& instances);
 
-    bool operator>(const WakeQueueEntry& other) const {
-      return time_ > other.time_;
-    }
-  };
+  // Stops publishing |instances|, sending their goodbyes together. Only the
+  // service and instance names are used.
+  void UnpublishServiceInstances(
+      const std::vector<ServiceInstance>& instances);
 
-  struct QuestionQueueEntry {
-    QuestionQueueEntry(ftl::TimePoint time,
-                       std::shared_ptr<DnsQuestion> question)
-        : time_(time), question_(question) {}
+  // Registers interest in the instances of the specified service that pass
+  // |filter|. Subscriptions to the same service with different filters are
+  // independent.
+  void SubscribeToService(const std::string& service_name,
+                          const ServiceFilter& filter,
+                          const ServiceInstanceCallback& callback);
 
-    ftl::TimePoint time_;
-    std::shared_ptr<DnsQuestion> question_;
+  // Registers disinterest in the specified service, ending the subscription
+  // made with |filter|.
+  void UnsubscribeToService(const std::string& service_name,
+                            const ServiceFilter& filter);
 
-    bool operator>(const QuestionQueueEntry& other) const {
-      return time_ > other.time_;
-    }
-  };
+  // Gets traffic counters, queue depths and agent costs.
+  void GetStats(MdnsStats* stats);
 
+ private:
   struct ResourceQueueEntry {
-    ResourceQueueEntry(ftl::TimePoint time,
-                       std::shared_ptr<DnsResource> resource,
+    ResourceQueueEntry(std::shared_ptr<DnsResource> resource,
                        MdnsResourceSection section)
-        : time_(time), resource_(resource), section_(section) {}
+        : resource_(resource), section_(section) {}
 
-    ftl::TimePoint time_;
     std::shared_ptr<DnsResource> resource_;
     MdnsResourceSection section_;
+  };
 
-    bool operator>(const ResourceQueueEntry& other) const {
-      return time_ > other.time_;
-    }
+  // A response to be sent directly to a querier, rather than multicast.
+  struct UnicastReply {
+    UnicastReply(const SocketAddress& address,
+                 uint32_t interface_index,
+                 bool legacy)
+        : address_(address),
+          interface_index_(interface_index),
+          legacy_(legacy) {}
+
+    SocketAddress address_;
+    uint32_t interface_index_;
+    // Indicates the querier isn't a full mDNS implementation, because it
+    // didn't send from the mDNS port (RFC 6762 section 6.7).
+    bool legacy_;
+    DnsMessage message_;
   };
 
   // MdnsAgent::Host implementation.
@@ -134,35 +192,188 @@ class Mdns : public MdnsAgent::Host {
 
   void SendAddresses(MdnsResourceSection section, ftl::TimePoint when) override;
 
-  void Renew(const DnsResource& resource) override;
-
   void RemoveAgent(const std::string& name) override;
 
+  void AddInterest(std::shared_ptr<MdnsAgent> agent,
+                   const DnsName& name) override;
+
+  void RemoveInterest(std::shared_ptr<MdnsAgent> agent,
+                      const DnsName& name) override;
+
+  bool HasInterest(const DnsName& name) override;
+
   // Misc private.
   void AddAgent(const std::string& name, std::shared_ptr<MdnsAgent> agent);
 
+  // Adds |agent| without starting it.
+  void RegisterAgent(const std::string& name,
+                     std::shared_ptr<MdnsAgent> agent);
+
+  // Creates the address responder and the resource renewer.
+  void CreateStandardAgents(const std::string& host_name);
+
+  // Starts the agents added so far and sends what they queue.
+  void StartAgents();
+
   void SendMessage();
 
+  // Notes that the records in |message| were multicast at |multicast_time|
+  // and forgets records multicast longer than the min interval ago.
+  void RecordMulticastTimes(const DnsMessage& message,
+                            ftl::TimePoint multicast_time);
+
+  // Recomputes |aggregation_window_| from the rate of sent records, if the
+  // window is adaptive and the current sample is complete.
+  void UpdateAggregationWindow();
+
+  // Saves the cache to |cache_file_| if it has changed since it was last
+  // saved.
+  void SaveCache();
+
+  // Schedules a call to |SaveCache|, repeating while |Mdns| is started.
+  void SaveCacheLater();
+
+  // Presents |message| to the agents. Agents that receive part of the message
+  // aren't notified of its end until |EndOfMessages| is called, so messages
+  // received together share one |EndOfMessage| sweep. Queries that are
+  // answered by unicast are the exception and get a sweep of their own.
+  void ReceiveMessage(const DnsMessage& message,
+                      const SocketAddress& source_address,
+                      uint32_t interface_index,
+                      bool on_link);
+
+  // Notifies the agents that received part of the messages presented since
+  // the last call that those messages have ended.
+  void EndOfMessages();
+
+  // Prepares to reply directly to the querier if |message| is a query that
+  // should be answered by unicast (RFC 6762 sections 5.4 and 6.7) and
+  // |on_link| indicates the querier is on the link the query arrived on.
+  void BeginUnicastReply(const DnsMessage& message,
+                         const SocketAddress& source_address,
+                         uint32_t interface_index,
+                         bool on_link);
+
+  // Adds |resource| to the unicast reply.
+  void AddToUnicastReply(std::shared_ptr<DnsResource> resource,
+                         MdnsResourceSection section);
+
+  // Sends the unicast reply, if there is one and it isn't empty.
+  void EndUnicastReply(const DnsMessage& query);
+
+  // Drops queued questions and answers that |message| makes redundant
+  // (RFC 6762 sections 7.3 and 7.4).
+  void SuppressDuplicates(const DnsMessage& message);
+
+  // Determines whether |message| asks |question| in a way that makes asking
+  // it ourselves redundant.
+  bool IsDuplicateQuestion(const DnsQuestion& question,
+                           const DnsMessage& message);
+
   void ReceiveQuestion(const DnsQuestion& question);
 
   void ReceiveResource(const DnsResource& resource,
                        MdnsResourceSection section);
+
+  // Presents the cached resources named |name| to |agent|. If |renew| is
+  // true, the resources are registered for renewal.
+  void PresentCachedResources(std::shared_ptr<MdnsAgent> agent,
+                              const DnsName& name,
+                              bool renew);
+
+  // Returns the agents interested in |name|. A copy is returned, because
+  // agents may add or remove interests while they're being called.
+  std::vector<std::shared_ptr<MdnsAgent>> InterestedAgents(
+      const DnsName& name);
+
+  // Calls |EndOfMessage| on the agents that received part of the message.
+  void NotifyEndOfMessage();
+
+  // Calls |agent->ReceiveResource|, charging the time to the agent's stats.
+  void PresentResource(MdnsAgent* agent,
+                       const DnsResource& resource,
+                       MdnsResourceSection section);
+
+  // Calls |agent->EndOfMessage|, charging the time to the agent's stats.
+  void PresentEndOfMessage(MdnsAgent* agent);
+
+  // Adds the questions and records in |message| to |type_stats_|.
+  void CountMessage(const DnsMessage& message, bool sent);
+
   void PostTask();
 
+  // Tells the instance publishers to quit and sends their goodbyes
+  // (RFC 6762 section 10.1).
+  void SendGoodbyes();
+
+  // Schedules the expiration of |flushed_resources_| once the cache flush
+  // grace period has passed.
+  void ExpireFlushedResourcesLater();
+
+  // Presents the records in |resources| that haven't been received again
+  // since they were flushed to the interested agents as expired.
+  void ExpireFlushedResources(
+      const std::vector<std::shared_ptr<DnsResource>>& resources);
+
   void TellAgentToQuit(const std::string& name);
 
   ftl::RefPtr<ftl::TaskRunner> task_runner_;
   MdnsTransceiver transceiver_;
   std::string host_full_name_;
   bool started_ = false;
-  reverse_priority_queue<ftl::TimePoint> post_task_queue_;
-  reverse_priority_queue<WakeQueueEntry> wake_queue_;
-  reverse_priority_queue<QuestionQueueEntry> question_queue_;
-  reverse_priority_queue<ResourceQueueEntry> resource_queue_;
+  // Indicates |StartForReplay| was called, so nothing is sent.
+  bool replaying_ = false;
+  // The time for which a task was most recently posted, or
+  // |ftl::TimePoint::Max()| if no task is pending.
+  ftl::TimePoint posted_task_time_ = ftl::TimePoint::Max();
+  ftl::TimeDelta min_aggregation_window_;
+  ftl::TimeDelta max_aggregation_window_;
+  ftl::TimeDelta aggregation_window_;
+  // Records sent since |record_rate_sample_time_| and the smoothed rate.
+  size_t sent_record_count_ = 0;
+  double sent_records_per_second_ = 0.0;
+  ftl::TimePoint record_rate_sample_time_;
+  TimerQueue<std::shared_ptr<MdnsAgent>> wake_queue_;
+  std::unordered_map<MdnsAgent*, TimerQueue<std::shared_ptr<MdnsAgent>>::Id>
+      wake_ids_by_agent_;
+  TimerQueue<std::shared_ptr<DnsQuestion>> question_queue_;
+  TimerQueue<ResourceQueueEntry> resource_queue_;
   std::unordered_map<std::string, std::shared_ptr<MdnsAgent>> agents_by_name_;
+  // The names of the agents in |agents_by_name_| that publish instances.
+  std::unordered_set<std::string> instance_publisher_names_;
+  std::unordered_map<std::string, std::weak_ptr<HostNameResolver>>
+      resolvers_by_host_full_name_;
+  std::unordered_map<DnsName,
+                     std::vector<std::shared_ptr<MdnsAgent>>,
+                     DnsName::Hash>
+      interested_agents_by_name_;
+  std::unordered_set<std::shared_ptr<MdnsAgent>> agents_to_notify_;
+  // Indicates that resources are being presented to agents, so
+  // |EndOfMessage| calls should be deferred.
+  bool presenting_resources_ = false;
+  MdnsCache cache_;
+  // Records flushed from |cache_| by the messages being received, with their
+  // TTLs set to zero.
+  std::vector<std::shared_ptr<DnsResource>> flushed_resources_;
+  std::string cache_file_;
+  uint64_t saved_cache_change_count_ = 0;
+  bool cache_save_pending_ = false;
   std::shared_ptr<DnsResource> address_placeholder_;
+  // The reply to the query being received, if it's to be sent by unicast.
+  // Resources agents send while the query is being received go here rather
+  // than to |resource_queue_|.
+  std::unique_ptr<UnicastReply> unicast_reply_;
   bool verbose_ = false;
   std::shared_ptr<ResourceRenewer> resource_renewer_;
+  std::map<DnsType, MdnsTypeStats> type_stats_;
+  uint64_t suppressed_questions_ = 0;
+  uint64_t suppressed_records_ = 0;
+  uint64_t coalesced_questions_ = 0;
+  uint64_t rate_limited_records_ = 0;
+  // When records were last multicast, kept for the min multicast interval.
+  std::unordered_map<std::shared_ptr<DnsResource>, ftl::TimePoint>
+      last_multicast_times_;
+  std::unordered_map<MdnsAgent*, MdnsAgentStats> agent_stats_;
 
   FTL_DISALLOW_COPY_AND_ASSIGN(Mdns);
 };
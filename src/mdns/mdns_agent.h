@@ -23,7 +23,9 @@ class MdnsAgent {
    public:
     virtual ~Host() {}
 
-    // Schedules a call to |agent->Wake| at the specified time.
+    // Schedules a call to |agent->Wake| at the specified time. An agent has at
+    // most one wakeup scheduled at a time. If one is already scheduled, the
+    // earlier of the two times is used.
     virtual void WakeAt(std::shared_ptr<MdnsAgent> agent,
                         ftl::TimePoint when) = 0;
 
@@ -31,11 +33,15 @@ class MdnsAgent {
     virtual void SendQuestion(std::shared_ptr<DnsQuestion> question,
                               ftl::TimePoint when) = 0;
 
-    // Sends a resource to the multicast address at the specified time. After
-    // a resource is sent with a TTL of zero, the resource is marked so that
-    // it won't get resent. This is useful if the agent has queued up resources
-    // to send in the future and later decides to cancel them by setting their
-    // TTLs to zero and resending.
+    // Sends a resource to the multicast address at the specified time. Sending
+    // a resource with a TTL of zero cancels any sends of the same resource
+    // that are still queued. This is useful if the agent has queued up
+    // resources to send in the future and later decides to cancel them by
+    // setting their TTLs to zero and resending.
+    //
+    // Resources sent for immediate delivery while a query is being received
+    // are sent directly to the querier instead if it asked for a unicast
+    // response or is a legacy querier. This also applies to |SendAddresses|.
     virtual void SendResource(std::shared_ptr<DnsResource> resource,
                               MdnsResourceSection section,
                               ftl::TimePoint when) = 0;
@@ -44,21 +50,30 @@ class MdnsAgent {
     virtual void SendAddresses(MdnsResourceSection section,
                                ftl::TimePoint when) = 0;
 
-    // Registers the resource for renewal. Before the resource's TTL expires,
-    // an attempt will be made to renew the resource by issuing queries for it.
-    // If the renewal is successful, the agent will receive the renewed resource
-    // (via |ReceiveResource|) and may choose to renew the resource again.
-    // If the renewal fails, the agent will receive a resource record with the
-    // same name and type but with a TTL of zero. The section parameter
-    // accompanying that resource record will be kExpired.
-    //
-    // The effect if this call is transient, and there is no way to cancel the
-    // renewal. When an agent loses interest in a particular resource, it should
-    // simply refrain from renewing the incoming records.
-    virtual void Renew(const DnsResource& resource) = 0;
-
     // Removes the agent with the specified name.
     virtual void RemoveAgent(const std::string& name) = 0;
+
+    // Registers the agent's interest in questions and resources named |name|.
+    // An agent only receives questions and resources for names it has
+    // registered. Registering the same name twice has no additional effect.
+    //
+    // Resources for |name| that are already cached are presented to the agent
+    // before this method returns, as though they had arrived in a message.
+    // While any agent is interested in a name, resources with that name are
+    // renewed before their TTLs expire. If a renewal fails, interested agents
+    // receive a resource with the same name and type but a TTL of zero, and
+    // the section parameter accompanying it is kExpired. Records displaced by
+    // a cache flush record and not received again within a second are
+    // delivered the same way, but with their data intact.
+    virtual void AddInterest(std::shared_ptr<MdnsAgent> agent,
+                             const DnsName& name) = 0;
+
+    // Cancels the agent's interest in |name|.
+    virtual void RemoveInterest(std::shared_ptr<MdnsAgent> agent,
+                                const DnsName& name) = 0;
+
+    // Determines whether any agent is interested in |name|.
+    virtual bool HasInterest(const DnsName& name) = 0;
   };
 
   virtual ~MdnsAgent() {}
@@ -70,14 +85,15 @@ class MdnsAgent {
   // Wakes the agent as requested via |Host::WakeAt|.
   virtual void Wake() = 0;
 
-  // Presents a received question.
+  // Presents a received question with a name the agent is interested in.
   virtual void ReceiveQuestion(const DnsQuestion& question) = 0;
 
-  // Presents a received resource.
+  // Presents a received resource with a name the agent is interested in.
   virtual void ReceiveResource(const DnsResource& resource,
                                MdnsResourceSection section) = 0;
 
-  // Signals the end of a message.
+  // Signals the end of a message that presented the agent with at least one
+  // question or resource.
   virtual void EndOfMessage() = 0;
 
   // Tells the agent to quit. The agent should call |Host::RemoveAgent| shortly
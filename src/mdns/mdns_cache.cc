@@ -0,0 +1,422 @@
+// Copyright 2017 The Fuchsia Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#include "apps/netconnector/src/mdns/mdns_cache.h"
+
+#include <errno.h>
+#include <stdio.h>
+#include <time.h>
+
+#include "apps/netconnector/src/mdns/dns_reading.h"
+#include "apps/netconnector/src/mdns/dns_writing.h"
+#include "apps/netconnector/src/mdns/packet_reader.h"
+#include "apps/netconnector/src/mdns/packet_writer.h"
+#include "lib/ftl/files/file.h"
+#include "lib/ftl/logging.h"
+
+namespace netconnector {
+namespace mdns {
+namespace {
+
+// Identifies the format of files written by |MdnsCache::Save|. A file is the
+// version, the wall-clock time in seconds at which it was written and a DNS
+// message whose answers are the records.
+constexpr uint32_t kFileVersion = 1;
+
+// A DNS message has at most this many answers.
+constexpr size_t kMaxFileRecordCount = 0xffff;
+
+// Limits on the size of the cache. The cache doesn't hold more records or
+// bytes than these, or keep records longer than the longest TTL we'd
+// publish, whatever TTL the sender asks for.
+constexpr size_t kMaxRecordCount = 2048;
+constexpr size_t kMaxByteCount = 1024 * 1024;
+constexpr uint32_t kMaxTimeToLive = DnsResource::kLongTimeToLive;
+
+}  // namespace
+
+// static
+const ftl::TimeDelta MdnsCache::kCacheFlushGracePeriod =
+    ftl::TimeDelta::FromSeconds(1);
+
+// static
+const ftl::TimeDelta MdnsCache::kPurgeInterval =
+    ftl::TimeDelta::FromSeconds(60);
+
+MdnsCache::MdnsCache() {}
+
+MdnsCache::~MdnsCache() {}
+
+void MdnsCache::Add(const DnsResource& resource,
+                    ftl::TimePoint now,
+                    std::vector<std::shared_ptr<DnsResource>>* flushed) {
+  if (now >= next_purge_time_) {
+    Purge(now);
+    next_purge_time_ = now + kPurgeInterval;
+  }
+
+  const DnsName& name = resource.name_;
+  std::vector<Entry>& entries = entries_by_name_[name];
+  bool found = false;
+
+  for (auto iter = entries.begin(); iter != entries.end();) {
+    if (iter->resource_->IsSameRecord(resource)) {
+      found = true;
+
+      if (resource.time_to_live_ == 0) {
+        // Goodbye.
+        --record_count_;
+        byte_count_ -= iter->size_;
+        iter = entries.erase(iter);
+        ++change_count_;
+      } else {
+        byte_count_ -= iter->size_;
+        *iter = Entry(resource, now);
+        byte_count_ += iter->size_;
+        ++iter;
+      }
+
+      continue;
+    }
+
+    // Records that arrive together with a cache flush record (that is, within
+    // the grace period) are part of the same RRSet and are kept. Older ones
+    // get the grace period to be received again, in case the RRSet spans
+    // several messages.
+    if (resource.cache_flush_ && resource.time_to_live_ != 0 &&
+        iter->resource_->type_ == resource.type_ &&
+        iter->resource_->class_ == resource.class_ &&
+        now - iter->receive_time_ > kCacheFlushGracePeriod &&
+        iter->expiration_time_ > now + kCacheFlushGracePeriod) {
+      iter->expiration_time_ = now + kCacheFlushGracePeriod;
+      ++change_count_;
+
+      if (flushed != nullptr) {
+        flushed->push_back(iter->Copy(now));
+        flushed->back()->time_to_live_ = 0;
+      }
+    }
+
+    ++iter;
+  }
+
+  if (entries.empty()) {
+    entries_by_name_.erase(name);
+  }
+
+  if (!found && resource.time_to_live_ != 0) {
+    Insert(Entry(resource, now), now);
+  }
+}
+
+void MdnsCache::Remove(const DnsName& name, DnsType type) {
+  auto iter = entries_by_name_.find(name);
+  if (iter == entries_by_name_.end()) {
+    return;
+  }
+
+  std::vector<Entry>& entries = iter->second;
+  for (auto entry_iter = entries.begin(); entry_iter != entries.end();) {
+    if (entry_iter->resource_->type_ == type) {
+      --record_count_;
+      byte_count_ -= entry_iter->size_;
+      entry_iter = entries.erase(entry_iter);
+      ++change_count_;
+    } else {
+      ++entry_iter;
+    }
+  }
+
+  if (entries.empty()) {
+    entries_by_name_.erase(iter);
+  }
+}
+
+bool MdnsCache::Contains(const DnsResource& resource,
+                         ftl::TimePoint now) const {
+  auto iter = entries_by_name_.find(resource.name_);
+  if (iter == entries_by_name_.end()) {
+    return false;
+  }
+
+  for (const Entry& entry : iter->second) {
+    if (entry.expiration_time_ > now &&
+        entry.resource_->IsSameRecord(resource)) {
+      return true;
+    }
+  }
+
+  return false;
+}
+
+void MdnsCache::Get(const DnsName& name,
+                    ftl::TimePoint now,
+                    std::vector<std::shared_ptr<DnsResource>>* resources) {
+  FTL_DCHECK(resources);
+
+  auto iter = entries_by_name_.find(name);
+  if (iter == entries_by_name_.end()) {
+    return;
+  }
+
+  for (const Entry& entry : iter->second) {
+    if (entry.TimeToLive(now) != 0) {
+      resources->push_back(entry.Copy(now));
+    }
+  }
+}
+
+void MdnsCache::GetKnownAnswers(
+    const DnsQuestion& question,
+    ftl::TimePoint now,
+    std::vector<std::shared_ptr<DnsResource>>* known_answers) {
+  FTL_DCHECK(known_answers);
+
+  auto iter = entries_by_name_.find(question.name_);
+  if (iter == entries_by_name_.end()) {
+    return;
+  }
+
+  for (const Entry& entry : iter->second) {
+    const DnsResource& resource = *entry.resource_;
+
+    if ((question.type_ != DnsType::kAny && question.type_ != resource.type_) ||
+        (question.class_ != DnsClass::kAny &&
+         question.class_ != resource.class_)) {
+      continue;
+    }
+
+    if (entry.TimeToLive(now) > resource.time_to_live_ / 2) {
+      known_answers->push_back(entry.Copy(now));
+    }
+  }
+}
+
+bool MdnsCache::Save(const std::string& path, ftl::TimePoint now) {
+  DnsMessage message;
+
+  for (auto& pair : entries_by_name_) {
+    for (const Entry& entry : pair.second) {
+      if (message.answers_.size() == kMaxFileRecordCount) {
+        break;
+      }
+
+      if (entry.TimeToLive(now) != 0) {
+        message.answers_.push_back(entry.Copy(now));
+      }
+    }
+  }
+
+  message.UpdateCounts();
+
+  PacketWriter writer;
+  writer << kFileVersion << static_cast<uint64_t>(time(nullptr)) << message;
+  std::vector<uint8_t> contents = writer.GetResizedPacket();
+
+  // The file is replaced in one step, so a crash while writing doesn't leave
+  // a torn file behind.
+  std::string temp_path = path + ".tmp";
+  if (!files::WriteFile(temp_path,
+                        reinterpret_cast<const char*>(contents.data()),
+                        contents.size())) {
+    return false;
+  }
+
+  if (rename(temp_path.c_str(), path.c_str()) != 0) {
+    FTL_LOG(ERROR) << "Failed to rename " << temp_path << ", errno " << errno;
+    return false;
+  }
+
+  return true;
+}
+
+bool MdnsCache::Load(const std::string& path,
+                     ftl::TimePoint now,
+                     uint32_t max_time_to_live) {
+  std::string contents;
+  if (!files::ReadFileToString(path, &contents)) {
+    return false;
+  }
+
+  PacketReader reader(reinterpret_cast<const uint8_t*>(contents.data()),
+                      contents.size());
+  uint32_t version;
+  reader >> version;
+  if (!reader.healthy() || version != kFileVersion) {
+    FTL_LOG(ERROR) << "Unrecognized mDNS cache file " << path;
+    return false;
+  }
+
+  uint64_t save_time;
+  DnsMessage message;
+  reader >> save_time >> message;
+  if (!reader.complete()) {
+    FTL_LOG(ERROR) << "Couldn't parse mDNS cache file " << path;
+    return false;
+  }
+
+  // If the clock has gone backwards (e.g. it hasn't been set since boot),
+  // the records are loaded as though no time had passed. They're capped at
+  // |max_time_to_live| regardless.
+  uint64_t current_time = static_cast<uint64_t>(time(nullptr));
+  uint64_t elapsed = current_time > save_time ? current_time - save_time : 0;
+
+  for (auto& resource : message.answers_) {
+    if (resource->time_to_live_ <= elapsed) {
+      continue;
+    }
+
+    resource->time_to_live_ -= static_cast<uint32_t>(elapsed);
+    if (resource->time_to_live_ > max_time_to_live) {
+      resource->time_to_live_ = max_time_to_live;
+    }
+
+    // Records in the file are all current, so none of them should flush the
+    // others.
+    resource->cache_flush_ = false;
+    Add(*resource, now);
+  }
+
+  return true;
+}
+
+// static
+size_t MdnsCache::ResourceSize(const DnsResource& resource) {
+  size_t size = sizeof(Entry) + sizeof(DnsResource) +
+                resource.name_.dotted_string().size();
+
+  switch (resource.type_) {
+    case DnsType::kNs:
+      size += resource.ns_.name_server_domain_name_.dotted_string().size();
+      break;
+    case DnsType::kCName:
+      size += resource.cname_.canonical_name_.dotted_string().size();
+      break;
+    case DnsType::kPtr:
+      size += resource.ptr_.pointer_domain_name_.dotted_string().size();
+      break;
+    case DnsType::kTxt:
+      for (const std::string& string : resource.txt_.strings_) {
+        size += sizeof(std::string) + string.size();
+      }
+      break;
+    case DnsType::kSrv:
+      size += resource.srv_.target_.dotted_string().size();
+      break;
+    case DnsType::kOpt:
+      size += resource.opt_.options_.size();
+      break;
+    case DnsType::kNSec:
+      size += resource.nsec_.next_domain_.dotted_string().size() +
+              resource.nsec_.bits_.size();
+      break;
+    default:
+      break;
+  }
+
+  return size;
+}
+
+void MdnsCache::Insert(Entry entry, ftl::TimePoint now) {
+  auto full = [this, &entry]() {
+    return record_count_ >= kMaxRecordCount ||
+           byte_count_ + entry.size_ > kMaxByteCount;
+  };
+
+  if (full()) {
+    Purge(now);
+    next_purge_time_ = now + kPurgeInterval;
+  }
+
+  while (record_count_ != 0 && full()) {
+    EvictOne();
+    ++eviction_count_;
+  }
+
+  ++record_count_;
+  byte_count_ += entry.size_;
+  DnsName name = entry.resource_->name_;
+  entries_by_name_[name].push_back(std::move(entry));
+  ++change_count_;
+}
+
+void MdnsCache::EvictOne() {
+  FTL_DCHECK(record_count_ != 0);
+
+  auto evict_iter = entries_by_name_.end();
+  size_t evict_index = 0;
+  for (auto iter = entries_by_name_.begin(); iter != entries_by_name_.end();
+       ++iter) {
+    for (size_t i = 0; i < iter->second.size(); ++i) {
+      if (evict_iter == entries_by_name_.end() ||
+          iter->second[i].expiration_time_ <
+              evict_iter->second[evict_index].expiration_time_) {
+        evict_iter = iter;
+        evict_index = i;
+      }
+    }
+  }
+
+  FTL_DCHECK(evict_iter != entries_by_name_.end());
+  std::vector<Entry>& entries = evict_iter->second;
+  --record_count_;
+  byte_count_ -= entries[evict_index].size_;
+  entries.erase(entries.begin() + evict_index);
+  ++change_count_;
+
+  if (entries.empty()) {
+    entries_by_name_.erase(evict_iter);
+  }
+}
+
+void MdnsCache::Purge(ftl::TimePoint now) {
+  for (auto iter = entries_by_name_.begin(); iter != entries_by_name_.end();) {
+    std::vector<Entry>& entries = iter->second;
+    for (auto entry_iter = entries.begin(); entry_iter != entries.end();) {
+      if (entry_iter->TimeToLive(now) == 0) {
+        --record_count_;
+        byte_count_ -= entry_iter->size_;
+        entry_iter = entries.erase(entry_iter);
+        ++change_count_;
+      } else {
+        ++entry_iter;
+      }
+    }
+
+    if (entries.empty()) {
+      iter = entries_by_name_.erase(iter);
+    } else {
+      ++iter;
+    }
+  }
+}
+
+MdnsCache::Entry::Entry(const DnsResource& resource, ftl::TimePoint now)
+    : resource_(std::make_shared<DnsResource>(resource)),
+      receive_time_(now),
+      size_(ResourceSize(resource)) {
+  if (resource_->time_to_live_ > kMaxTimeToLive) {
+    resource_->time_to_live_ = kMaxTimeToLive;
+  }
+
+  expiration_time_ =
+      now + ftl::TimeDelta::FromSeconds(resource_->time_to_live_);
+}
+
+uint32_t MdnsCache::Entry::TimeToLive(ftl::TimePoint now) const {
+  if (now >= expiration_time_) {
+    return 0;
+  }
+
+  return static_cast<uint32_t>((expiration_time_ - now).ToSeconds());
+}
+
+std::shared_ptr<DnsResource> MdnsCache::Entry::Copy(ftl::TimePoint now) const {
+  std::shared_ptr<DnsResource> copy = std::make_shared<DnsResource>(*resource_);
+  copy->time_to_live_ = TimeToLive(now);
+  return copy;
+}
+
+}  // namespace mdns
+}  // namespace netconnector
@@ -0,0 +1,137 @@
+// Copyright 2017 The Fuchsia Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#pragma once
+
+#include <memory>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include "apps/netconnector/src/mdns/dns_message.h"
+#include "lib/ftl/macros.h"
+#include "lib/ftl/time/time_point.h"
+
+namespace netconnector {
+namespace mdns {
+
+// Caches resource records received from the network, keyed by name. Records
+// are dropped when their TTLs expire. Any host on the link can fill the
+// cache, so TTLs are capped, and when the cache is full, the records closest
+// to expiring are evicted to make room.
+class MdnsCache {
+ public:
+  MdnsCache();
+
+  ~MdnsCache();
+
+  // Records flushed by a cache flush record expire after this period, unless
+  // they're received again in the meantime.
+  static const ftl::TimeDelta kCacheFlushGracePeriod;
+
+  // Adds |resource| to the cache or refreshes the matching record. A TTL of
+  // zero removes the matching record. If |resource| has the cache flush bit
+  // set, records with the same name, type and class that were received more
+  // than a second ago are set to expire in a second (RFC 6762 section 10.2).
+  // If |flushed| isn't null, copies of those records are added to it with
+  // their TTLs set to zero.
+  void Add(const DnsResource& resource,
+           ftl::TimePoint now,
+           std::vector<std::shared_ptr<DnsResource>>* flushed = nullptr);
+
+  // Determines whether the cache holds an unexpired record matching
+  // |resource|.
+  bool Contains(const DnsResource& resource, ftl::TimePoint now) const;
+
+  // Removes the records with the specified name and type.
+  void Remove(const DnsName& name, DnsType type);
+
+  // Adds copies of the unexpired records named |name| to |resources|. The
+  // TTLs of the copies are set to the time remaining.
+  void Get(const DnsName& name,
+           ftl::TimePoint now,
+           std::vector<std::shared_ptr<DnsResource>>* resources);
+
+  // Adds copies of the records answering |question| that have more than half
+  // their TTLs remaining to |known_answers| (RFC 6762 section 7.1). The TTLs
+  // of the copies are set to the time remaining.
+  void GetKnownAnswers(
+      const DnsQuestion& question,
+      ftl::TimePoint now,
+      std::vector<std::shared_ptr<DnsResource>>* known_answers);
+
+  // Writes the unexpired records to the file at |path|, along with the
+  // current wall-clock time so their expiration times survive a restart.
+  // Returns false if the file couldn't be written.
+  bool Save(const std::string& path, ftl::TimePoint now);
+
+  // Adds the records from a file written by |Save|, less those that have
+  // expired since. TTLs are capped at |max_time_to_live| so records that
+  // aren't confirmed from the network drop out soon. Returns false if the
+  // file couldn't be read or parsed.
+  bool Load(const std::string& path,
+            ftl::TimePoint now,
+            uint32_t max_time_to_live);
+
+  // Returns a count that changes whenever records are added or removed.
+  uint64_t change_count() const { return change_count_; }
+
+  // Returns the number of records in the cache, including expired records
+  // that haven't been purged yet.
+  size_t record_count() const { return record_count_; }
+
+  // Returns the approximate number of bytes the records take up.
+  size_t byte_count() const { return byte_count_; }
+
+  // Returns the number of records evicted to make room for others.
+  uint64_t eviction_count() const { return eviction_count_; }
+
+ private:
+  static const ftl::TimeDelta kPurgeInterval;
+
+  struct Entry {
+    // The TTL of |resource| is capped at |kMaxTimeToLive|.
+    Entry(const DnsResource& resource, ftl::TimePoint now);
+
+    // Returns the number of whole seconds remaining before expiration.
+    uint32_t TimeToLive(ftl::TimePoint now) const;
+
+    // Returns a copy of the resource with its TTL set to the time remaining.
+    std::shared_ptr<DnsResource> Copy(ftl::TimePoint now) const;
+
+    // The resource as received. This is a pointer, because |DnsResource|
+    // can't be assigned across types.
+    std::shared_ptr<DnsResource> resource_;
+    ftl::TimePoint expiration_time_;
+    ftl::TimePoint receive_time_;
+    // Approximately how many bytes the entry takes up.
+    size_t size_;
+  };
+
+  // Returns approximately how many bytes a copy of |resource| takes up.
+  static size_t ResourceSize(const DnsResource& resource);
+
+  // Adds |entry|, which must not match a record in the cache, evicting
+  // records if the cache is full.
+  void Insert(Entry entry, ftl::TimePoint now);
+
+  // Removes the record closest to expiring. The cache must not be empty.
+  void EvictOne();
+
+  // Removes expired records.
+  void Purge(ftl::TimePoint now);
+
+  std::unordered_map<DnsName, std::vector<Entry>, DnsName::Hash>
+      entries_by_name_;
+  ftl::TimePoint next_purge_time_;
+  uint64_t change_count_ = 0;
+  size_t record_count_ = 0;
+  size_t byte_count_ = 0;
+  uint64_t eviction_count_ = 0;
+
+  FTL_DISALLOW_COPY_AND_ASSIGN(MdnsCache);
+};
+
+}  // namespace mdns
+}  // namespace netconnector
@@ -4,6 +4,9 @@
 
 #include "apps/netconnector/src/mdns/mdns_fidl_util.h"
 
+#include <sstream>
+
+#include "apps/netconnector/src/mdns/dns_formatting.h"
 #include "lib/ftl/logging.h"
 
 namespace netconnector {
@@ -47,6 +50,7 @@ bool MdnsFidlUtil::UpdateServiceInstance(
   if (v4_address.is_valid()) {
     if (!service_instance->v4_address) {
       service_instance->v4_address = CreateNetAddressIPv4(v4_address);
+      changed = true;
     } else if (UpdateNetAddressIPv4(service_instance->v4_address, v4_address)) {
       changed = true;
     }
@@ -58,6 +62,7 @@ bool MdnsFidlUtil::UpdateServiceInstance(
   if (v6_address.is_valid()) {
     if (!service_instance->v6_address) {
       service_instance->v6_address = CreateNetAddressIPv6(v6_address);
+      changed = true;
     } else if (UpdateNetAddressIPv6(service_instance->v6_address, v6_address)) {
       changed = true;
     }
@@ -203,5 +208,64 @@ bool MdnsFidlUtil::UpdateNetAddressIPv6(
   return changed;
 }
 
+// static
+MdnsServiceStatsPtr MdnsFidlUtil::CreateServiceStats(const MdnsStats& stats) {
+  MdnsServiceStatsPtr result = MdnsServiceStats::New();
+
+  result->interfaces = fidl::Array<MdnsServiceInterfaceStatsPtr>::New(0);
+  for (const MdnsStats::Interface& interface : stats.interfaces_) {
+    MdnsServiceInterfaceStatsPtr interface_stats =
+        MdnsServiceInterfaceStats::New();
+    interface_stats->name = interface.name_;
+    interface_stats->address = interface.address_.ToString();
+    interface_stats->packets_sent = interface.stats_.packets_sent_;
+    interface_stats->bytes_sent = interface.stats_.bytes_sent_;
+    interface_stats->packets_received = interface.stats_.packets_received_;
+    interface_stats->bytes_received = interface.stats_.bytes_received_;
+    interface_stats->parse_failures = interface.stats_.parse_failures_;
+    result->interfaces.push_back(std::move(interface_stats));
+  }
+
+  result->types = fidl::Array<MdnsServiceTypeStatsPtr>::New(0);
+  for (auto& pair : stats.types_) {
+    std::ostringstream type_name;
+    type_name << pair.first;
+
+    MdnsServiceTypeStatsPtr type_stats = MdnsServiceTypeStats::New();
+    type_stats->type = type_name.str();
+    type_stats->questions_sent = pair.second.questions_sent_;
+    type_stats->questions_received = pair.second.questions_received_;
+    type_stats->records_sent = pair.second.records_sent_;
+    type_stats->records_received = pair.second.records_received_;
+    result->types.push_back(std::move(type_stats));
+  }
+
+  result->suppressed_questions = stats.suppressed_questions_;
+  result->suppressed_records = stats.suppressed_records_;
+  result->coalesced_questions = stats.coalesced_questions_;
+  result->rate_limited_records = stats.rate_limited_records_;
+  result->cache_records = stats.cache_records_;
+  result->cache_bytes = stats.cache_bytes_;
+  result->cache_evictions = stats.cache_evictions_;
+  result->question_queue_size = stats.question_queue_size_;
+  result->resource_queue_size = stats.resource_queue_size_;
+  result->wake_queue_size = stats.wake_queue_size_;
+
+  result->agents = fidl::Array<MdnsServiceAgentStatsPtr>::New(0);
+  for (const MdnsAgentStats& agent : stats.agents_) {
+    MdnsServiceAgentStatsPtr agent_stats = MdnsServiceAgentStats::New();
+    agent_stats->name = agent.name_;
+    agent_stats->resources_received = agent.resources_received_;
+    agent_stats->receive_resource_us =
+        agent.receive_resource_time_.ToMicroseconds();
+    agent_stats->end_of_message_count = agent.end_of_message_count_;
+    agent_stats->end_of_message_us =
+        agent.end_of_message_time_.ToMicroseconds();
+    result->agents.push_back(std::move(agent_stats));
+  }
+
+  return result;
+}
+
 }  // namespace mdns
 }  // namespace netconnector
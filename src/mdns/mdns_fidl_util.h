@@ -5,6 +5,7 @@
 #pragma once
 
 #include "apps/netconnector/services/mdns.fidl.h"
+#include "apps/netconnector/src/mdns/mdns_stats.h"
 #include "apps/netconnector/src/socket_address.h"
 
 namespace netconnector {
@@ -47,6 +48,8 @@ class MdnsFidlUtil {
   static bool UpdateNetAddressIPv6(
       const network::NetAddressIPv6Ptr& net_address,
       const SocketAddress& socket_address);
+
+  static MdnsServiceStatsPtr CreateServiceStats(const MdnsStats& stats);
 };
 
 }  // namespace mdns
@@ -6,9 +6,15 @@
 
 #include <arpa/inet.h>
 #include <errno.h>
+#include <net/if.h>
+#include <netinet/in.h>
 #include <sys/epoll.h>
+#include <sys/ioctl.h>
 #include <sys/socket.h>
 
+#include <algorithm>
+#include <cstring>
+
 #include "apps/netconnector/src/mdns/dns_formatting.h"
 #include "apps/netconnector/src/mdns/dns_reading.h"
 #include "apps/netconnector/src/mdns/dns_writing.h"
@@ -18,9 +24,96 @@
 #include "lib/ftl/files/unique_fd.h"
 #include "lib/ftl/logging.h"
 #include "lib/mtl/tasks/message_loop.h"
+#include "lib/mtl/threading/create_thread.h"
 
 namespace netconnector {
 namespace mdns {
+namespace {
+
+// Writes records to a packet until the packet is full, noting where the
+// interface's address records land.
+class PacketFiller {
+ public:
+  PacketFiller(PacketWriter* writer,
+               size_t max_size,
+               const DnsResource* address_resource,
+               const DnsResource* alternate_address_resource,
+               MdnsInterfaceTransceiver::OutboundPacket* packet)
+      : writer_(writer),
+        max_size_(max_size),
+        records_start_(writer->position()),
+        address_resource_(address_resource),
+        alternate_address_resource_(alternate_address_resource),
+        packet_(packet) {}
+
+  // Writes |records| starting at |*index|, advancing |*index| and |*count|
+  // for each record that fits. Returns true if all the records were written,
+  // false if the packet is full. A record is always written to a packet that
+  // has no records yet, even if it doesn't fit, so every call on a new packet
+  // makes progress.
+  template <typename Pointer>
+  bool Fill(const std::vector<Pointer>& records,
+            size_t* index,
+            uint16_t* count) {
+    for (; *index < records.size(); ++*index) {
+      size_t record_start = writer_->position();
+      *writer_ << *records[*index];
+
+      if (writer_->position() > max_size_ && record_start != records_start_) {
+        // Compression bookmarks created while writing this record are now
+        // stale, but nothing more is written to this packet.
+        writer_->SetPosition(record_start);
+        return false;
+      }
+
+      NoteRecord(*records[*index]);
+      ++*count;
+    }
+
+    return true;
+  }
+
+ private:
+  void NoteRecord(const DnsQuestion& question) {}
+
+  // Address records end with the address, so the address starts its length
+  // back from the end of the record.
+  void NoteRecord(const DnsResource& resource) {
+    if (&resource == address_resource_) {
+      packet_->address_positions_.push_back(
+          writer_->position() - AddressByteCount(resource));
+    } else if (&resource == alternate_address_resource_) {
+      packet_->alternate_address_positions_.push_back(
+          writer_->position() - AddressByteCount(resource));
+    }
+  }
+
+  static size_t AddressByteCount(const DnsResource& resource) {
+    return resource.type_ == DnsType::kA
+               ? resource.a_.address_.address_.byte_count()
+               : resource.aaaa_.address_.address_.byte_count();
+  }
+
+  PacketWriter* writer_;
+  size_t max_size_;
+  size_t records_start_;
+  const DnsResource* address_resource_;
+  const DnsResource* alternate_address_resource_;
+  MdnsInterfaceTransceiver::OutboundPacket* packet_;
+};
+
+// Copies the bytes of |address| into |packet| at each of |positions|.
+void PatchAddress(const IpAddress& address,
+                  const std::vector<size_t>& positions,
+                  MdnsInterfaceTransceiver::OutboundPacket* packet) {
+  for (size_t position : positions) {
+    FTL_DCHECK(position + address.byte_count() <= packet->size_);
+    std::memcpy(packet->data_.data() + position, address.as_bytes(),
+                address.byte_count());
+  }
+}
+
+}  // namespace
 
 // static
 std::unique_ptr<MdnsInterfaceTransceiver> MdnsInterfaceTransceiver::Create(
@@ -41,12 +134,28 @@ MdnsInterfaceTransceiver::MdnsInterfaceTransceiver(
     const netc_if_info_t& if_info,
     uint32_t index)
     : address_((struct sockaddr*)&if_info.addr),
+      netmask_(if_info.netmask.ss_family == if_info.addr.ss_family
+                   ? IpAddress((struct sockaddr*)&if_info.netmask)
+                   : IpAddress()),
       index_(index),
       name_(if_info.name),
-      inbound_buffer_(kMaxPacketSize),
-      outbound_buffer_(kMaxPacketSize) {}
+      inbound_buffer_(kMaxMdnsPacketSize),
+      task_runner_(mtl::MessageLoop::GetCurrent()->task_runner()) {}
 
-MdnsInterfaceTransceiver::~MdnsInterfaceTransceiver() {}
+MdnsInterfaceTransceiver::~MdnsInterfaceTransceiver() {
+  FTL_DCHECK(!receive_thread_.joinable())
+      << "Transceiver destroyed without calling Stop.";
+}
+
+MdnsInterfaceStats MdnsInterfaceTransceiver::stats() const {
+  MdnsInterfaceStats stats;
+  stats.packets_sent_ = packets_sent_;
+  stats.bytes_sent_ = bytes_sent_;
+  stats.packets_received_ = packets_received_.load(std::memory_order_relaxed);
+  stats.bytes_received_ = bytes_received_.load(std::memory_order_relaxed);
+  stats.parse_failures_ = parse_failures_.load(std::memory_order_relaxed);
+  return stats;
+}
 
 void MdnsInterfaceTransceiver::Start(const std::string& host_full_name,
                                      const InboundMessageCallback& callback) {
@@ -57,6 +166,7 @@ void MdnsInterfaceTransceiver::Start(const std::string& host_full_name,
                 << address_;
 
   address_resource_ = MakeAddressResource(host_full_name, address_);
+  UpdateAddressNSecResource();
 
   socket_fd_ = ftl::UniqueFD(socket(address_.family(), SOCK_DGRAM, 0));
 
@@ -65,6 +175,8 @@ void MdnsInterfaceTransceiver::Start(const std::string& host_full_name,
     return;
   }
 
+  UpdateMtu();
+
   // Set socket options and bind.
   if (SetOptionSharePort() != 0 || SetOptionJoinMulticastGroup() != 0 ||
       SetOptionOutboundInterface() != 0 || SetOptionUnicastTtl() != 0 ||
@@ -76,50 +188,204 @@ void MdnsInterfaceTransceiver::Start(const std::string& host_full_name,
 
   inbound_message_callback_ = callback;
 
-  WaitForInbound();
+  if (!receive_thread_enabled_) {
+    WaitForInbound();
+    return;
+  }
+
+  inbound_queue_ = std::make_shared<InboundQueue>();
+  inbound_queue_->callback_ = callback;
+  inbound_queue_->index_ = index_;
+
+  receive_thread_ =
+      mtl::CreateThread(&receive_task_runner_, "mdns receive " + name_);
+  receive_task_runner_->PostTask([this]() { WaitForInbound(); });
 }
 
 void MdnsInterfaceTransceiver::SetAlternateAddress(
     const std::string& host_full_name,
     const IpAddress& alternate_address) {
-  FTL_DCHECK(!alternate_address_resource_);
   FTL_DCHECK(alternate_address.family() != address_.family());
 
+  if (alternate_address_resource_ && alternate_address_ == alternate_address) {
+    return;
+  }
+
+  alternate_address_ = alternate_address;
   alternate_address_resource_ =
       MakeAddressResource(host_full_name, alternate_address);
+  UpdateAddressNSecResource();
+}
+
+void MdnsInterfaceTransceiver::ClearAlternateAddress() {
+  alternate_address_ = IpAddress();
+  alternate_address_resource_.reset();
+  UpdateAddressNSecResource();
 }
 
 void MdnsInterfaceTransceiver::Stop() {
   FTL_DCHECK(socket_fd_.is_valid()) << "BeginStop called when stopped.";
-  fd_waiter_.Cancel();
+
+  if (receive_thread_.joinable()) {
+    // The waiter belongs to the receive thread, so it's cancelled there.
+    receive_task_runner_->PostTask([this]() {
+      fd_waiter_.Cancel();
+      mtl::MessageLoop::GetCurrent()->QuitNow();
+    });
+
+    receive_thread_.join();
+    receive_task_runner_ = nullptr;
+    inbound_queue_->stopped_ = true;
+    inbound_queue_.reset();
+  } else {
+    fd_waiter_.Cancel();
+  }
+
   socket_fd_.reset();
 }
 
-void MdnsInterfaceTransceiver::SendMessage(DnsMessage* message,
+void MdnsInterfaceTransceiver::SendMessage(const DnsMessage& message,
                                            const SocketAddress& address) {
-  FTL_DCHECK(message);
+  WriteMessage(message, &outbound_packets_);
+  SendPackets(&outbound_packets_, address);
+}
+
+void MdnsInterfaceTransceiver::WriteMessage(
+    const DnsMessage& message,
+    std::vector<OutboundPacket>* packets) {
+  FTL_DCHECK(packets);
+
+  // The same message may be sent on several interfaces, so this interface's
+  // addresses go into views of the sections rather than the message.
+  bool addresses = ResolveRecords(message.answers_, &answer_records_);
+  addresses =
+      ResolveRecords(message.authorities_, &authority_records_) || addresses;
+  addresses =
+      ResolveRecords(message.additionals_, &additional_records_) || addresses;
+  if (addresses) {
+    additional_records_.push_back(address_nsec_resource_.get());
+  }
+
+  size_t max_size = max_payload_size();
+  size_t packet_count = 0;
+  size_t question_index = 0;
+  size_t answer_index = 0;
+  size_t authority_index = 0;
+  size_t additional_index = 0;
+  bool complete = false;
+
+  // Records that don't fit in one packet spill into additional packets, each
+  // with its own header. Questions come first, so continuation packets are
+  // mostly known answers or additional records.
+  while (!complete) {
+    if (packet_count == packets->size()) {
+      packets->emplace_back();
+      packets->back().data_.resize(mtu_);
+    }
+
+    OutboundPacket& packet = (*packets)[packet_count++];
+    packet.address_positions_.clear();
+    packet.alternate_address_positions_.clear();
+
+    DnsHeader header = message.header_;
+    header.question_count_ = 0;
+    header.answer_count_ = 0;
+    header.authority_count_ = 0;
+    header.additional_count_ = 0;
+
+    PacketWriter writer(std::move(packet.data_));
+    writer << header;
+
+    PacketFiller filler(&writer, max_size, address_resource_.get(),
+                        alternate_address_resource_.get(), &packet);
+    complete = filler.Fill(message.questions_, &question_index,
+                           &header.question_count_) &&
+               filler.Fill(answer_records_, &answer_index,
+                           &header.answer_count_) &&
+               filler.Fill(authority_records_, &authority_index,
+                           &header.authority_count_) &&
+               filler.Fill(additional_records_, &additional_index,
+                           &header.additional_count_);
+
+    // RFC 6762 section 7.2: a query whose known answers don't fit in one
+    // packet has the TC bit set on all but the last of its packets, so
+    // responders wait for the rest of the known answers before responding.
+    header.SetTruncated(!complete && !header.response() &&
+                        !answer_records_.empty());
+
+    packet.size_ = writer.position();
+    writer.SetPosition(0);
+    writer << header;
+    packet.data_ = writer.GetPacket();
+
+    if (packet.size_ > max_size) {
+      FTL_LOG(WARNING) << "Writing oversized mDNS packet of " << packet.size_
+                       << " bytes on interface " << name_;
+    }
+  }
+
+  // Keep the buffers of unused packets for later messages, but make sure
+  // they aren't sent.
+  for (size_t i = packet_count; i < packets->size(); ++i) {
+    (*packets)[i].size_ = 0;
+  }
+}
+
+bool MdnsInterfaceTransceiver::CanSendPacketsFrom(
+    const MdnsInterfaceTransceiver& other) const {
+  return address_.family() == other.address_.family() &&
+         mtu_ == other.mtu_ &&
+         !alternate_address_resource_ == !other.alternate_address_resource_;
+}
+
+void MdnsInterfaceTransceiver::SendPackets(
+    std::vector<OutboundPacket>* packets,
+    const SocketAddress& address) {
+  FTL_DCHECK(packets);
   FTL_DCHECK(address.is_valid());
   FTL_DCHECK(address.family() == address_.family() ||
              address == MdnsAddresses::kV4Multicast);
 
-  FixUpAddresses(&message->answers_);
-  FixUpAddresses(&message->authorities_);
-  FixUpAddresses(&message->additionals_);
-  message->UpdateCounts();
+  for (OutboundPacket& packet : *packets) {
+    if (packet.size_ == 0) {
+      break;
+    }
+
+    PatchAddress(address_, packet.address_positions_, &packet);
+    if (alternate_address_resource_) {
+      PatchAddress(alternate_address_, packet.alternate_address_positions_,
+                   &packet);
+    }
+
+    ssize_t result = SendTo(packet.data_.data(), packet.size_, address);
 
-  PacketWriter writer(std::move(outbound_buffer_));
-  writer << *message;
-  size_t packet_size = writer.position();
-  outbound_buffer_ = writer.GetPacket();
+    if (result < 0) {
+      FTL_LOG(ERROR) << "Failed to sendto, errno " << errno;
+      return;
+    }
 
-  ssize_t result = SendTo(outbound_buffer_.data(), packet_size, address);
+    ++packets_sent_;
+    bytes_sent_ += packet.size_;
 
-  if (result < 0) {
-    FTL_LOG(ERROR) << "Failed to sendto, errno " << errno;
-    return;
+    if (capture_ && capture_->enabled()) {
+      // V6 interfaces send to |kV6Multicast| in place of |kV4Multicast|.
+      capture_->Record(
+          index_, SocketAddress(address_, MdnsAddresses::kV4Bind.port()),
+          address.family() == address_.family() ? address
+                                                : MdnsAddresses::kV6Multicast,
+          packet.data_.data(), packet.size_);
+    }
   }
 }
 
+size_t MdnsInterfaceTransceiver::max_payload_size() const {
+  if (address_.is_v4()) {
+    return mtu_ - kV4HeaderSize - kUdpHeaderSize;
+  }
+
+  return mtu_ - kV6HeaderSize - kUdpHeaderSize;
+}
+
 int MdnsInterfaceTransceiver::SetOptionSharePort() {
   int param = 1;
   int result = setsockopt(socket_fd_.get(), SOL_SOCKET, SO_REUSEADDR, &param,
@@ -132,6 +398,29 @@ int MdnsInterfaceTransceiver::SetOptionSharePort() {
   return result;
 }
 
+void MdnsInterfaceTransceiver::UpdateMtu() {
+  struct ifreq request;
+  memset(&request, 0, sizeof(request));
+  strncpy(request.ifr_name, name_.c_str(), sizeof(request.ifr_name) - 1);
+
+  if (ioctl(socket_fd_.get(), SIOCGIFMTU, &request) < 0) {
+    // Not all network stacks support this, so it's not an error.
+    mtu_ = kDefaultMtu;
+    return;
+  }
+
+  // Links with smaller MTUs keep getting 1500-byte packets, which they
+  // fragment, as before. Jumbo MTUs are clamped to the mDNS limit.
+  mtu_ = std::min(
+      std::max(static_cast<size_t>(request.ifr_mtu), kDefaultMtu),
+      kMaxMdnsPacketSize);
+
+  if (mtu_ != kDefaultMtu) {
+    FTL_LOG(INFO) << "Using " << mtu_ << "-byte mDNS packets on interface "
+                  << name_;
+  }
+}
+
 void MdnsInterfaceTransceiver::WaitForInbound() {
   fd_waiter_.Wait([this](mx_status_t status,
                          uint32_t events) { InboundReady(status, events); },
@@ -140,37 +429,150 @@ void MdnsInterfaceTransceiver::WaitForInbound() {
 
 void MdnsInterfaceTransceiver::InboundReady(mx_status_t status,
                                             uint32_t events) {
-  sockaddr_storage source_address_storage;
-  socklen_t source_address_length =
-      address_.is_v4() ? sizeof(sockaddr_in) : sizeof(sockaddr_in6);
-  ssize_t result = recvfrom(
-      socket_fd_.get(), inbound_buffer_.data(), inbound_buffer_.size(),
-      0, reinterpret_cast<sockaddr*>(&source_address_storage),
-      &source_address_length);
-  if (result < 0) {
-    FTL_LOG(ERROR) << "Failed to recvfrom, errno " << errno;
-    WaitForInbound();
-    return;
+  // Datagrams tend to arrive in bursts, so this drains what's waiting rather
+  // than waiting again after each one. Each datagram is parsed before the
+  // next is received, so one buffer serves the whole batch.
+  for (size_t i = 0; i < kMaxInboundBatchSize; ++i) {
+    sockaddr_storage source_address_storage;
+    iovec iov = {inbound_buffer_.data(), inbound_buffer_.size()};
+    // Room for the TTL or hop limit and then some.
+    alignas(cmsghdr) uint8_t control[2 * CMSG_SPACE(sizeof(int))];
+    msghdr header = {};
+    header.msg_name = &source_address_storage;
+    header.msg_namelen =
+        address_.is_v4() ? sizeof(sockaddr_in) : sizeof(sockaddr_in6);
+    header.msg_iov = &iov;
+    header.msg_iovlen = 1;
+    header.msg_control = control;
+    header.msg_controllen = sizeof(control);
+    ssize_t result = recvmsg(socket_fd_.get(), &header, MSG_DONTWAIT);
+    if (result < 0) {
+      if (errno != EAGAIN && errno != EWOULDBLOCK) {
+        FTL_LOG(ERROR) << "Failed to recvmsg, errno " << errno;
+      }
+
+      break;
+    }
+
+    int hop_limit = -1;
+    for (cmsghdr* cmsg = CMSG_FIRSTHDR(&header); cmsg != nullptr;
+         cmsg = CMSG_NXTHDR(&header, cmsg)) {
+      if ((cmsg->cmsg_level == IPPROTO_IP && cmsg->cmsg_type == IP_TTL) ||
+          (cmsg->cmsg_level == IPPROTO_IPV6 &&
+           cmsg->cmsg_type == IPV6_HOPLIMIT)) {
+        std::memcpy(&hop_limit, CMSG_DATA(cmsg), sizeof(hop_limit));
+      }
+    }
+
+    SocketAddress source_address(source_address_storage);
+
+    packets_received_.fetch_add(1, std::memory_order_relaxed);
+    bytes_received_.fetch_add(result, std::memory_order_relaxed);
+
+    if (capture_ && capture_->enabled()) {
+      capture_->Record(index_, source_address,
+                       address_.is_v4() ? MdnsAddresses::kV4Multicast
+                                        : MdnsAddresses::kV6Multicast,
+                       inbound_buffer_.data(), result);
+    }
+
+    // The reader parses straight out of |inbound_buffer_|.
+    PacketReader reader(inbound_buffer_.data(), static_cast<size_t>(result));
+    std::unique_ptr<DnsMessage> message = std::make_unique<DnsMessage>();
+    reader >> *message.get();
+
+    if (reader.complete()) {
+      inbound_messages_.push_back(
+          {std::move(message), source_address,
+           IsOnLink(source_address.address(), hop_limit)});
+    } else {
+      parse_failures_.fetch_add(1, std::memory_order_relaxed);
+      inbound_buffer_.resize(result);
+      FTL_LOG(ERROR) << "Couldn't parse message from " << source_address
+                     << ", " << result << " bytes: " << inbound_buffer_;
+      inbound_buffer_.resize(kMaxMdnsPacketSize);
+    }
+  }
+
+  if (!inbound_messages_.empty()) {
+    DeliverInboundMessages();
+  }
+
+  WaitForInbound();
+}
+
+bool MdnsInterfaceTransceiver::IsOnLink(const IpAddress& source_address,
+                                        int hop_limit) const {
+  if (hop_limit != -1 && hop_limit != kTimeToLive_) {
+    return false;
+  }
+
+  if (source_address.family() != address_.family()) {
+    return false;
   }
 
-  SocketAddress source_address(source_address_storage);
+  if (source_address.is_v6() &&
+      IN6_IS_ADDR_LINKLOCAL(&source_address.as_in6_addr())) {
+    return true;
+  }
 
-  PacketReader reader(inbound_buffer_);
-  reader.SetBytesRemaining(static_cast<size_t>(result));
-  std::unique_ptr<DnsMessage> message = std::make_unique<DnsMessage>();
-  reader >> *message.get();
+  if (!netmask_) {
+    return false;
+  }
 
-  if (reader.complete()) {
+  for (size_t i = 0; i < address_.byte_count(); ++i) {
+    if ((source_address.as_bytes()[i] ^ address_.as_bytes()[i]) &
+        netmask_.as_bytes()[i]) {
+      return false;
+    }
+  }
+
+  return true;
+}
+
+void MdnsInterfaceTransceiver::DeliverInboundMessages() {
+  if (!inbound_queue_) {
     FTL_DCHECK(inbound_message_callback_);
-    inbound_message_callback_(std::move(message), source_address, index_);
-  } else {
-    inbound_buffer_.resize(result);
-    FTL_LOG(ERROR) << "Couldn't parse message from " << source_address << ", "
-                   << result << " bytes: " << inbound_buffer_;
-    inbound_buffer_.resize(kMaxPacketSize);
+    inbound_message_callback_(&inbound_messages_, index_);
+    inbound_messages_.clear();
+    return;
   }
 
-  WaitForInbound();
+  for (InboundMessage& message : inbound_messages_) {
+    inbound_queue_->messages_.Push(std::move(message));
+  }
+
+  inbound_messages_.clear();
+
+  // Messages pushed before the drain task runs are delivered with the same
+  // batch, so we only post when a drain isn't already pending.
+  if (!inbound_queue_->drain_pending_.exchange(true,
+                                               std::memory_order_acq_rel)) {
+    task_runner_->PostTask(
+        [queue = inbound_queue_]() { DrainInboundQueue(queue); });
+  }
+}
+
+// static
+void MdnsInterfaceTransceiver::DrainInboundQueue(
+    const std::shared_ptr<InboundQueue>& queue) {
+  // Clear the pending flag before popping, so messages pushed from here on
+  // schedule another drain.
+  queue->drain_pending_.exchange(false, std::memory_order_acq_rel);
+
+  InboundMessage message;
+  while (queue->messages_.Pop(&message)) {
+    if (!queue->stopped_) {
+      queue->batch_.push_back(std::move(message));
+    }
+  }
+
+  if (queue->batch_.empty()) {
+    return;
+  }
+
+  queue->callback_(&queue->batch_, queue->index_);
+  queue->batch_.clear();
 }
 
 std::shared_ptr<DnsResource> MdnsInterfaceTransceiver::MakeAddressResource(
@@ -189,37 +591,46 @@ std::shared_ptr<DnsResource> MdnsInterfaceTransceiver::MakeAddressResource(
   return resource;
 }
 
-void MdnsInterfaceTransceiver::FixUpAddresses(
-    std::vector<std::shared_ptr<DnsResource>>* resources) {
-  for (auto iter = resources->begin(); iter != resources->end(); ++iter) {
-    if ((*iter)->type_ == DnsType::kA || (*iter)->type_ == DnsType::kAaaa) {
-      **iter = *address_resource_;
-
-      auto next_iter = iter;
-      ++next_iter;
-
-      bool next_is_address = next_iter != resources->end() &&
-                             ((*next_iter)->type_ == DnsType::kA ||
-                              (*next_iter)->type_ == DnsType::kAaaa);
-
-      if (alternate_address_resource_) {
-        if (next_is_address) {
-          // There's already a second address record. Copy the alternate address
-          // record over it.
-          **next_iter = *alternate_address_resource_;
-        } else {
-          // There's no second address record. Insert the alternate address
-          // record after the first one.
-          resources->insert(next_iter, alternate_address_resource_);
-        }
-      } else if (next_is_address) {
-        // We don't need this second address record.
-        resources->erase(next_iter);
-      }
+void MdnsInterfaceTransceiver::UpdateAddressNSecResource() {
+  if (!address_resource_) {
+    return;
+  }
 
-      break;
+  address_nsec_resource_ =
+      std::make_shared<DnsResource>(address_resource_->name_, DnsType::kNSec);
+  address_nsec_resource_->time_to_live_ = DnsResource::kShortTimeToLive;
+  address_nsec_resource_->nsec_.next_domain_ = address_resource_->name_;
+  address_nsec_resource_->nsec_.AddType(address_resource_->type_);
+  if (alternate_address_resource_) {
+    address_nsec_resource_->nsec_.AddType(alternate_address_resource_->type_);
+  }
+}
+
+bool MdnsInterfaceTransceiver::ResolveRecords(
+    const std::vector<std::shared_ptr<DnsResource>>& resources,
+    std::vector<const DnsResource*>* records) const {
+  FTL_DCHECK(records);
+
+  records->clear();
+  bool found = false;
+
+  for (const std::shared_ptr<DnsResource>& resource : resources) {
+    // The placeholder is an A record with no address. Other address records,
+    // such as known answers from the cache, are left alone.
+    if (resource->type_ != DnsType::kA || resource->a_.address_.address_) {
+      records->push_back(resource.get());
+      continue;
     }
+
+    records->push_back(address_resource_.get());
+    if (alternate_address_resource_) {
+      records->push_back(alternate_address_resource_.get());
+    }
+
+    found = true;
   }
+
+  return found;
 }
 
 }  // namespace mdns
@@ -4,15 +4,21 @@
 
 #pragma once
 
+#include <atomic>
 #include <memory>
+#include <thread>
 #include <vector>
 
 #include "apps/netconnector/src/ip_address.h"
 #include "apps/netconnector/src/mdns/dns_message.h"
+#include "apps/netconnector/src/mdns/mdns_stats.h"
+#include "apps/netconnector/src/mdns/packet_capture.h"
 #include "apps/netconnector/src/socket_address.h"
+#include "apps/netconnector/src/spsc_queue.h"
 #include "apps/netstack/apps/include/netconfig.h"
 #include "lib/ftl/files/unique_fd.h"
 #include "lib/ftl/macros.h"
+#include "lib/ftl/tasks/task_runner.h"
 #include "lib/mtl/tasks/fd_waiter.h"
 
 namespace netconnector {
@@ -23,10 +29,30 @@ namespace mdns {
 // |MdnsInterfaceTransceiverV4| and |MdnsInterfaceTransceiverV6|.
 class MdnsInterfaceTransceiver {
  public:
-  // Callback to deliver inbound messages with source address and interface
-  // index.
-  using InboundMessageCallback = std::function<
-      void(std::unique_ptr<DnsMessage>, const SocketAddress&, uint32_t)>;
+  // An inbound message and the address it came from.
+  struct InboundMessage {
+    std::unique_ptr<DnsMessage> message_;
+    SocketAddress source_address_;
+    // Whether the message is known to have come from the link it arrived on
+    // (RFC 6762 section 11). Only on-link queriers get unicast replies.
+    bool on_link_ = false;
+  };
+
+  // Callback to deliver a batch of inbound messages, in the order they were
+  // received, with the interface index. The callee may consume the messages.
+  using InboundMessageCallback =
+      std::function<void(std::vector<InboundMessage>*, uint32_t)>;
+
+  // A serialized packet, with the positions of the address records' data
+  // noted so other interfaces can patch in their own addresses.
+  struct OutboundPacket {
+    std::vector<uint8_t> data_;
+    size_t size_ = 0;
+    // Positions of the data of the interface's address records and of its
+    // alternate address records.
+    std::vector<size_t> address_positions_;
+    std::vector<size_t> alternate_address_positions_;
+  };
 
   // Creates the variant of |MdnsInterfaceTransceiver| appropriate for the
   // address family specified in |if_info|. |index| is the index of the
@@ -41,10 +67,25 @@ class MdnsInterfaceTransceiver {
 
   const IpAddress& address() const { return address_; }
 
-  // Sets an alternate address for the interface.
+  MdnsInterfaceStats stats() const;
+
+  // Sets an alternate address for the interface, replacing any previous
+  // alternate address.
   void SetAlternateAddress(const std::string& host_full_name,
                            const IpAddress& alternate_address);
 
+  // Removes the alternate address, if there is one.
+  void ClearAlternateAddress();
+
+  // Sets the capture to which sent and received datagrams are recorded.
+  void SetCapture(PacketCapture* capture) { capture_ = capture; }
+
+  // Has the transceiver receive and parse datagrams on a thread of its own,
+  // so a busy interface doesn't hold up the others. Parsed messages are
+  // still delivered on the thread that calls |Start|. Must be called before
+  // |Start|.
+  void EnableReceiveThread() { receive_thread_enabled_ = true; }
+
   // Starts the interface transceiver.
   void Start(const std::string& host_full_name,
              const InboundMessageCallback& callback);
@@ -54,14 +95,35 @@ class MdnsInterfaceTransceiver {
 
   // Sends a messaage to the specified address. A V6 interface will send to
   // |MdnsAddresses::kV6Multicast| if |dest_address| is
-  // |MdnsAddresses::kV4Multicast|. This method expects there to be at most two
-  // address records per record vector and, if there are two, that they are
-  // adjacent. The same constraints will apply when this method returns.
-  void SendMessage(DnsMessage* message, const SocketAddress& address);
+  // |MdnsAddresses::kV4Multicast|. The address placeholder, if the message
+  // has one, is replaced with this interface's address records.
+  void SendMessage(const DnsMessage& message, const SocketAddress& address);
+
+  // Serializes |message| into |packets| as |SendMessage| would. Messages too
+  // large for one packet are split across several. Buffers already in
+  // |packets| are reused.
+  void WriteMessage(const DnsMessage& message,
+                    std::vector<OutboundPacket>* packets);
+
+  // Determines whether packets written by |other| can be sent by this
+  // interface after its addresses are patched in. This is true when the
+  // interfaces have the same family and MTU and both or neither have
+  // alternate addresses.
+  bool CanSendPacketsFrom(const MdnsInterfaceTransceiver& other) const;
+
+  // Patches this interface's addresses into |packets| and sends them to the
+  // specified address. |packets| must have been written by this interface or
+  // by one that |CanSendPacketsFrom| accepts.
+  void SendPackets(std::vector<OutboundPacket>* packets,
+                   const SocketAddress& address);
 
  protected:
   static constexpr int kTimeToLive_ = 255;
-  static constexpr size_t kMaxPacketSize = 1500;
+  // The MTU assumed for interfaces whose MTU can't be determined.
+  static constexpr size_t kDefaultMtu = 1500;
+  // The largest mDNS packet, including IP and UDP headers (RFC 6762 section
+  // 17). Larger MTUs are clamped to this.
+  static constexpr size_t kMaxMdnsPacketSize = 9000;
 
   MdnsInterfaceTransceiver(const netc_if_info_t& if_info, uint32_t index);
 
@@ -80,32 +142,110 @@ class MdnsInterfaceTransceiver {
                      const SocketAddress& address) = 0;
 
  private:
+  static constexpr size_t kUdpHeaderSize = 8;
+  static constexpr size_t kV4HeaderSize = 20;
+  static constexpr size_t kV6HeaderSize = 40;
+  // The most datagrams received per readiness notification.
+  static constexpr size_t kMaxInboundBatchSize = 16;
+
+  // Messages parsed on the receive thread, waiting to be delivered. Drain
+  // tasks hold a reference, because they may run after the transceiver is
+  // gone.
+  struct InboundQueue {
+    SpscQueue<InboundMessage> messages_;
+    // Set when a drain task has been posted and hasn't started draining.
+    std::atomic<bool> drain_pending_{false};
+    InboundMessageCallback callback_;
+    uint32_t index_;
+    // Set when the transceiver stops, so undelivered messages are dropped.
+    // Accessed on the delivering thread only.
+    bool stopped_ = false;
+    // Reused for each batch. Accessed on the delivering thread only.
+    std::vector<InboundMessage> batch_;
+  };
+
+  // Delivers the messages in |queue|. Runs on the thread that called
+  // |Start|.
+  static void DrainInboundQueue(const std::shared_ptr<InboundQueue>& queue);
+
   int SetOptionSharePort();
 
+  // Sets |mtu_| from the interface's MTU, if it can be determined.
+  void UpdateMtu();
+
+  // Returns the largest DNS message that fits in an unfragmented packet.
+  size_t max_payload_size() const;
+
   void WaitForInbound();
 
+  // Receives the datagrams that are waiting, up to |kMaxInboundBatchSize|,
+  // and delivers the messages parsed from them as one batch. Runs on the
+  // receive thread, if there is one.
   void InboundReady(mx_status_t status, uint32_t events);
 
+  // Determines whether a datagram from |source_address| that arrived with
+  // the specified hop limit came from this interface's link. The source must
+  // be link-local or in the interface's subnet, and the hop limit, if the
+  // stack reported it (|hop_limit| is -1 if not), must be 255.
+  bool IsOnLink(const IpAddress& source_address, int hop_limit) const;
+
+  // Delivers |inbound_messages_|, directly or via |inbound_queue_|.
+  void DeliverInboundMessages();
+
   std::shared_ptr<DnsResource> MakeAddressResource(
       const std::string& host_full_name,
       const IpAddress& address);
 
-  // Fixes up the address records in the vector. This method expects there to
-  // be at most two address records in the vector and, if there are two, that
-  // they are adjacent. The same constraints will apply when this method
-  // returns.
-  void FixUpAddresses(std::vector<std::shared_ptr<DnsResource>>* resources);
+  // Creates |address_nsec_resource_| for the address records this interface
+  // has, if it has been started.
+  void UpdateAddressNSecResource();
+
+  // Fills |records| with the records in |resources|, with this interface's
+  // address records in place of the address placeholder. Returns true if the
+  // placeholder was found. |records| doesn't hold references, so the same
+  // message can be written for each interface without copying it.
+  bool ResolveRecords(
+      const std::vector<std::shared_ptr<DnsResource>>& resources,
+      std::vector<const DnsResource*>* records) const;
 
   IpAddress address_;
+  // Invalid if the interface's netmask isn't known.
+  IpAddress netmask_;
   uint32_t index_;
   std::string name_;
+  // The size of the largest packet sent on this interface, including IP and
+  // UDP headers.
+  size_t mtu_ = kDefaultMtu;
   ftl::UniqueFD socket_fd_;
+  // Used on the receive thread, if there is one.
   mtl::FDWaiter fd_waiter_;
   std::vector<uint8_t> inbound_buffer_;
-  std::vector<uint8_t> outbound_buffer_;
+  std::vector<InboundMessage> inbound_messages_;
+  bool receive_thread_enabled_ = false;
+  ftl::RefPtr<ftl::TaskRunner> task_runner_;
+  ftl::RefPtr<ftl::TaskRunner> receive_task_runner_;
+  std::thread receive_thread_;
+  std::shared_ptr<InboundQueue> inbound_queue_;
+  std::vector<OutboundPacket> outbound_packets_;
+  // The sections of the message being written, kept to reuse their storage.
+  std::vector<const DnsResource*> answer_records_;
+  std::vector<const DnsResource*> authority_records_;
+  std::vector<const DnsResource*> additional_records_;
   InboundMessageCallback inbound_message_callback_;
   std::shared_ptr<DnsResource> address_resource_;
+  IpAddress alternate_address_;
   std::shared_ptr<DnsResource> alternate_address_resource_;
+  // Asserts that the host name has no records but the address records above
+  // (RFC 6762 section 6.1). Sent along with them.
+  std::shared_ptr<DnsResource> address_nsec_resource_;
+  // Receive-side counters are updated on the receive thread, if there is
+  // one, and read on the main thread.
+  uint64_t packets_sent_ = 0;
+  uint64_t bytes_sent_ = 0;
+  std::atomic<uint64_t> packets_received_{0};
+  std::atomic<uint64_t> bytes_received_{0};
+  std::atomic<uint64_t> parse_failures_{0};
+  PacketCapture* capture_ = nullptr;
 
   FTL_DISALLOW_COPY_AND_ASSIGN(MdnsInterfaceTransceiver);
 };
@@ -71,7 +71,16 @@ int MdnsInterfaceTransceiverV4::SetOptionMulticastTtl() {
 }
 
 int MdnsInterfaceTransceiverV4::SetOptionFamilySpecific() {
-  // Nothing to do.
+  // Receive the TTL of inbound datagrams, so queriers can be checked for
+  // being on-link. Without it, only their addresses are checked.
+  int param = 1;
+  int result = setsockopt(socket_fd().get(), IPPROTO_IP, IP_RECVTTL, &param,
+                          sizeof(param));
+  if (result < 0) {
+    FTL_LOG(WARNING) << "Failed to set socket option IP_RECVTTL, errno "
+                     << errno;
+  }
+
   return 0;
 }
 
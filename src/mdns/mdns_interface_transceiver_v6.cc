@@ -83,6 +83,15 @@ int MdnsInterfaceTransceiverV6::SetOptionFamilySpecific() {
     return result;
   }
 
+  // Receive the hop limit of inbound datagrams, so queriers can be checked
+  // for being on-link. Without it, only their addresses are checked.
+  param = 1;
+  if (setsockopt(socket_fd().get(), IPPROTO_IPV6, IPV6_RECVHOPLIMIT, &param,
+                 sizeof(param)) < 0) {
+    FTL_LOG(WARNING) << "Failed to set socket option IPV6_RECVHOPLIMIT, errno "
+                     << errno;
+  }
+
   // Receive V6 packets only.
   param = 1;
   result = setsockopt(socket_fd().get(), IPPROTO_IPV6, IPV6_V6ONLY, &param,
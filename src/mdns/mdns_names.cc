@@ -46,6 +46,15 @@ std::string MdnsNames::LocalServiceFullName(const std::string& service_name) {
   return Concatenate({service_name, kLocalDomainName});
 }
 
+// static
+std::string MdnsNames::LocalSubtypeFullName(const std::string& subtype,
+                                            const std::string& service_name) {
+  FTL_DCHECK(IsValidSubtypeName(subtype));
+  FTL_DCHECK(IsValidServiceName(service_name));
+
+  return Concatenate({subtype, "._sub.", service_name, kLocalDomainName});
+}
+
 // static
 std::string MdnsNames::LocalInstanceFullName(const std::string& instance_name,
                                              const std::string& service_name) {
@@ -106,5 +115,13 @@ bool MdnsNames::IsValidServiceName(const std::string& service_name) {
                               kUdpSuffix.size(), kUdpSuffix) == 0;
 }
 
+// static
+bool MdnsNames::IsValidSubtypeName(const std::string& subtype) {
+  static constexpr size_t kMaxLabelSize = 63;
+
+  return !subtype.empty() && subtype.size() <= kMaxLabelSize &&
+         subtype.find('.') == std::string::npos;
+}
+
 }  // namespace mdns
 }  // namespace netconnector
@@ -23,6 +23,13 @@ struct MdnsNames {
   // must end in ".".
   static std::string LocalServiceFullName(const std::string& service_name);
 
+  // Constructs a local service subtype name from a subtype and a simple
+  // service name. For example, produces "_bar._sub._foo._tcp.local." from
+  // "_bar" and "_foo._tcp." (RFC 6763 section 7.1). The simple service name
+  // must end in ".".
+  static std::string LocalSubtypeFullName(const std::string& subtype,
+                                          const std::string& service_name);
+
   // Constructs a local service instance name from a simple instance name and
   // a simple service name. For example, produces "myfoo._foo._tcp.local." from
   // "myfoo" and "_foo._tcp.local.". The simple instance name must not end in a
@@ -39,6 +46,10 @@ struct MdnsNames {
 
   // Determines if |service\ is a valid simple service name.
   static bool IsValidServiceName(const std::string& service_name);
+
+  // Determines if |subtype| is a valid service subtype, that is, a single
+  // label.
+  static bool IsValidSubtypeName(const std::string& subtype);
 };
 
 }  // namespace mdns
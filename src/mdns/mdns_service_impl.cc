@@ -4,39 +4,74 @@
 
 #include "apps/netconnector/src/mdns/mdns_service_impl.h"
 
+#include <unordered_set>
+
 #include "apps/netconnector/src/mdns/mdns_fidl_util.h"
 #include "apps/netconnector/src/mdns/mdns_names.h"
 #include "lib/ftl/logging.h"
+#include "lib/mtl/tasks/message_loop.h"
+#include "lib/mtl/threading/create_thread.h"
 
 namespace netconnector {
 namespace mdns {
 
-MdnsServiceImpl::MdnsServiceImpl() {}
+MdnsServiceImpl::MdnsServiceImpl()
+    : task_runner_(mtl::MessageLoop::GetCurrent()->task_runner()) {
+  mdns_thread_ = mtl::CreateThread(&mdns_task_runner_, "mdns");
+  FTL_DCHECK(mdns_task_runner_);
 
-MdnsServiceImpl::~MdnsServiceImpl() {}
+  // |Mdns| and its transceivers take the task runner of the thread on which
+  // they're created, so |Mdns| is created on the mDNS thread.
+  mdns_task_runner_->PostTask([this]() { mdns_ = std::make_unique<Mdns>(); });
+}
+
+MdnsServiceImpl::~MdnsServiceImpl() {
+  // Commands posted earlier run before this task. Stopping sends goodbyes
+  // for the published instances.
+  mdns_task_runner_->PostTask([this]() {
+    mdns_->Stop();
+    mdns_.reset();
+    mtl::MessageLoop::GetCurrent()->QuitNow();
+  });
+
+  mdns_thread_.join();
+}
 
 void MdnsServiceImpl::AddBinding(fidl::InterfaceRequest<MdnsService> request) {
   bindings_.AddBinding(this, std::move(request));
 }
 
-bool MdnsServiceImpl::Start(const std::string& host_name) {
-  return mdns_.Start(host_name);
+void MdnsServiceImpl::SetCacheFile(const std::string& path) {
+  mdns_task_runner_->PostTask([this, path]() { mdns_->SetCacheFile(path); });
+}
+
+void MdnsServiceImpl::SetAggregationWindow(ftl::TimeDelta min,
+                                           ftl::TimeDelta max) {
+  mdns_task_runner_->PostTask(
+      [this, min, max]() { mdns_->SetAggregationWindow(min, max); });
+}
+
+void MdnsServiceImpl::EnableReceiveThreads() {
+  mdns_task_runner_->PostTask([this]() { mdns_->EnableReceiveThreads(); });
+}
+
+void MdnsServiceImpl::Start(const std::string& host_name,
+                            const StartCallback& callback) {
+  FTL_DCHECK(callback);
+  mdns_task_runner_->PostTask([this, host_name, callback]() {
+    bool started = mdns_->Start(host_name);
+    task_runner_->PostTask([callback, started]() { callback(started); });
+  });
 }
 
 void MdnsServiceImpl::SubscribeToService(
     const std::string& service_name,
+    ftl::TimeDelta coalescing_interval,
     const Mdns::ServiceInstanceCallback& callback) {
-  auto iter = subscriptions_by_service_name_.find(service_name);
-
-  if (iter == subscriptions_by_service_name_.end()) {
-    auto pair = subscriptions_by_service_name_.emplace(
-        service_name,
-        std::make_unique<MdnsServiceSubscriptionImpl>(this, service_name));
-    FTL_DCHECK(pair.second);
-    iter = pair.first;
-  }
-
-  iter->second->SetCallback(callback);
+  MdnsServiceSubscriptionImpl* subscription =
+      GetSubscription(service_name, ServiceFilter());
+  subscription->SetCoalescingInterval(coalescing_interval);
+  subscription->SetCallback(callback);
 }
 
 void MdnsServiceImpl::PublishServiceInstance(
@@ -44,21 +79,32 @@ void MdnsServiceImpl::PublishServiceInstance(
     const std::string& instance_name,
     IpPort port,
     const std::vector<std::string>& text) {
-  mdns_.PublishServiceInstance(service_name, instance_name, port, text);
+  mdns_task_runner_->PostTask([this, service_name, instance_name, port,
+                               text]() {
+    mdns_->PublishServiceInstance(service_name, instance_name, port, text);
+  });
 }
 
 void MdnsServiceImpl::ResolveHostName(const fidl::String& host_name,
                                       uint32_t timeout_ms,
                                       const ResolveHostNameCallback& callback) {
-  mdns_.ResolveHostName(
-      host_name,
-      ftl::TimePoint::Now() + ftl::TimeDelta::FromMilliseconds(timeout_ms),
-      [this, callback](const std::string& host_name,
-                       const IpAddress& v4_address,
-                       const IpAddress& v6_address) {
-        callback(MdnsFidlUtil::CreateNetAddressIPv4(v4_address),
-                 MdnsFidlUtil::CreateNetAddressIPv6(v6_address));
-      });
+  ftl::TimePoint timeout =
+      ftl::TimePoint::Now() + ftl::TimeDelta::FromMilliseconds(timeout_ms);
+
+  mdns_task_runner_->PostTask([
+    this, host_name = host_name.get(), timeout, callback
+  ]() {
+    mdns_->ResolveHostName(
+        host_name, timeout,
+        [this, callback](const std::string& host_name,
+                         const IpAddress& v4_address,
+                         const IpAddress& v6_address) {
+          task_runner_->PostTask([callback, v4_address, v6_address]() {
+            callback(MdnsFidlUtil::CreateNetAddressIPv4(v4_address),
+                     MdnsFidlUtil::CreateNetAddressIPv6(v6_address));
+          });
+        });
+  });
 }
 
 void MdnsServiceImpl::SubscribeToService(
@@ -72,17 +118,43 @@ void MdnsServiceImpl::SubscribeToService(
     return;
   }
 
-  auto iter = subscriptions_by_service_name_.find(service_name);
+  GetSubscription(service_name, ServiceFilter())
+      ->AddBinding(std::move(subscription_request));
+}
 
-  if (iter == subscriptions_by_service_name_.end()) {
-    auto pair = subscriptions_by_service_name_.emplace(
-        service_name,
-        std::make_unique<MdnsServiceSubscriptionImpl>(this, service_name));
-    FTL_DCHECK(pair.second);
-    iter = pair.first;
+void MdnsServiceImpl::SubscribeToFilteredService(
+    const fidl::String& service_name,
+    MdnsServiceFilterPtr filter,
+    fidl::InterfaceRequest<MdnsServiceSubscription> subscription_request) {
+  if (!MdnsNames::IsValidServiceName(service_name)) {
+    FTL_LOG(ERROR) << "Client supplied invalid service name " << service_name
+                   << " in call to SubscribeToFilteredService, resetting "
+                      "subscription request.";
+    subscription_request = nullptr;
+    return;
   }
 
-  iter->second->AddBinding(std::move(subscription_request));
+  ServiceFilter service_filter;
+  if (filter) {
+    if (!filter->subtype.is_null()) {
+      service_filter.subtype_ = filter->subtype;
+    }
+
+    service_filter.text_ = filter->text.To<std::vector<std::string>>();
+  }
+
+  if (!service_filter.subtype_.empty() &&
+      !MdnsNames::IsValidSubtypeName(service_filter.subtype_)) {
+    FTL_LOG(ERROR) << "Client supplied invalid subtype "
+                   << service_filter.subtype_
+                   << " in call to SubscribeToFilteredService, resetting "
+                      "subscription request.";
+    subscription_request = nullptr;
+    return;
+  }
+
+  GetSubscription(service_name, service_filter)
+      ->AddBinding(std::move(subscription_request));
 }
 
 void MdnsServiceImpl::PublishServiceInstance(const fidl::String& service_name,
@@ -95,9 +167,9 @@ void MdnsServiceImpl::PublishServiceInstance(const fidl::String& service_name,
     return;
   }
 
-  mdns_.PublishServiceInstance(service_name, instance_name,
-                               IpPort::From_uint16_t(port),
-                               text.To<std::vector<std::string>>());
+  PublishServiceInstance(service_name, instance_name,
+                         IpPort::From_uint16_t(port),
+                         text.To<std::vector<std::string>>());
 }
 
 void MdnsServiceImpl::UnpublishServiceInstance(
@@ -109,21 +181,147 @@ void MdnsServiceImpl::UnpublishServiceInstance(
     return;
   }
 
-  mdns_.UnpublishServiceInstance(service_name, instance_name);
+  mdns_task_runner_->PostTask([
+    this, service_name = service_name.get(),
+    instance_name = instance_name.get()
+  ]() { mdns_->UnpublishServiceInstance(service_name, instance_name); });
+}
+
+void MdnsServiceImpl::PublishServiceInstances(
+    fidl::Array<MdnsServicePublicationPtr> publications) {
+  std::vector<Mdns::ServiceInstance> instances;
+  if (!ConvertPublications(publications, "PublishServiceInstances",
+                           &instances)) {
+    return;
+  }
+
+  mdns_task_runner_->PostTask(
+      [this, instances]() { mdns_->PublishServiceInstances(instances); });
+}
+
+void MdnsServiceImpl::UnpublishServiceInstances(
+    fidl::Array<MdnsServicePublicationPtr> publications) {
+  std::vector<Mdns::ServiceInstance> instances;
+  if (!ConvertPublications(publications, "UnpublishServiceInstances",
+                           &instances)) {
+    return;
+  }
+
+  mdns_task_runner_->PostTask(
+      [this, instances]() { mdns_->UnpublishServiceInstances(instances); });
 }
 
 void MdnsServiceImpl::SetVerbose(bool value) {
-  mdns_.SetVerbose(value);
+  mdns_task_runner_->PostTask([this, value]() { mdns_->SetVerbose(value); });
+}
+
+void MdnsServiceImpl::GetStats(const GetStatsCallback& callback) {
+  mdns_task_runner_->PostTask([this, callback]() {
+    MdnsStats stats;
+    mdns_->GetStats(&stats);
+    task_runner_->PostTask([callback, stats]() {
+      callback(MdnsFidlUtil::CreateServiceStats(stats));
+    });
+  });
+}
+
+void MdnsServiceImpl::SetCaptureSize(uint32_t max_packets) {
+  mdns_task_runner_->PostTask(
+      [this, max_packets]() { mdns_->SetCaptureCapacity(max_packets); });
+}
+
+void MdnsServiceImpl::WriteCapture(const fidl::String& path,
+                                   const WriteCaptureCallback& callback) {
+  mdns_task_runner_->PostTask([ this, path = path.get(), callback ]() {
+    bool written = mdns_->WriteCapture(path);
+    task_runner_->PostTask([callback, written]() { callback(written); });
+  });
+}
+
+// static
+bool MdnsServiceImpl::ConvertPublications(
+    const fidl::Array<MdnsServicePublicationPtr>& publications,
+    const char* method,
+    std::vector<Mdns::ServiceInstance>* instances) {
+  FTL_DCHECK(instances);
+
+  instances->reserve(publications.size());
+
+  for (const MdnsServicePublicationPtr& publication : publications) {
+    if (!publication ||
+        !MdnsNames::IsValidServiceName(publication->service_name)) {
+      FTL_LOG(ERROR) << "Client supplied invalid service name in call to "
+                     << method << ", ignoring.";
+      return false;
+    }
+
+    instances->push_back(
+        {publication->service_name, publication->instance_name,
+         IpPort::From_uint16_t(publication->port),
+         publication->text.To<std::vector<std::string>>()});
+  }
+
+  return true;
+}
+
+MdnsServiceImpl::MdnsServiceSubscriptionImpl* MdnsServiceImpl::GetSubscription(
+    const std::string& service_name,
+    const ServiceFilter& filter) {
+  std::string key = service_name + filter.ToString();
+  auto iter = subscriptions_by_key_.find(key);
+
+  if (iter == subscriptions_by_key_.end()) {
+    auto pair = subscriptions_by_key_.emplace(
+        key, std::make_unique<MdnsServiceSubscriptionImpl>(
+                 this, key, service_name, filter));
+    FTL_DCHECK(pair.second);
+    iter = pair.first;
+  }
+
+  return iter->second.get();
+}
+
+void MdnsServiceImpl::PostSubscribe(const std::string& key,
+                                    const std::string& service_name,
+                                    const ServiceFilter& filter) {
+  mdns_task_runner_->PostTask([this, key, service_name, filter]() {
+    mdns_->SubscribeToService(
+        service_name, filter,
+        [this, key](const std::string& service, const std::string& instance,
+                    const SocketAddress& v4_address,
+                    const SocketAddress& v6_address,
+                    const std::vector<std::string>& text) {
+          task_runner_->PostTask(
+              [this, key, instance, v4_address, v6_address, text]() {
+                // The subscription may have gone away since the update was
+                // posted.
+                auto iter = subscriptions_by_key_.find(key);
+                if (iter != subscriptions_by_key_.end()) {
+                  iter->second->ReceiveInstanceChange(instance, v4_address,
+                                                      v6_address, text);
+                }
+              });
+        });
+  });
+}
+
+void MdnsServiceImpl::PostUnsubscribe(const std::string& service_name,
+                                      const ServiceFilter& filter) {
+  mdns_task_runner_->PostTask([this, service_name, filter]() {
+    mdns_->UnsubscribeToService(service_name, filter);
+  });
 }
 
 MdnsServiceImpl::MdnsServiceSubscriptionImpl::MdnsServiceSubscriptionImpl(
     MdnsServiceImpl* owner,
-    const std::string& service_name)
-    : owner_(owner) {
-  bindings_.set_on_empty_set_handler([this, service_name]() {
+    const std::string& key,
+    const std::string& service_name,
+    const ServiceFilter& filter)
+    : owner_(owner), key_(key), service_name_(service_name) {
+  bindings_.set_on_empty_set_handler([this, key, service_name, filter]() {
     if (!callback_) {
-      owner_->mdns_.UnsubscribeToService(service_name);
-      owner_->subscriptions_by_service_name_.erase(service_name);
+      owner_->PostUnsubscribe(service_name, filter);
+      owner_->subscriptions_by_key_.erase(key);
     }
   });
 
@@ -139,36 +337,7 @@ MdnsServiceImpl::MdnsServiceSubscriptionImpl::MdnsServiceSubscriptionImpl(
         callback(version, std::move(instances));
       });
 
-  owner->mdns_.SubscribeToService(
-      service_name,
-      [this](const std::string& service, const std::string& instance,
-             const SocketAddress& v4_address, const SocketAddress& v6_address,
-             const std::vector<std::string>& text) {
-        if (callback_) {
-          callback_(service, instance, v4_address, v6_address, text);
-        }
-
-        bool changed = false;
-
-        if (v4_address.is_valid() || v6_address.is_valid()) {
-          auto iter = instances_by_name_.find(instance);
-          if (iter == instances_by_name_.end()) {
-            instances_by_name_.emplace(
-                instance, MdnsFidlUtil::CreateServiceInstance(
-                              service, instance, v4_address, v6_address, text));
-            changed = true;
-          } else {
-            changed = MdnsFidlUtil::UpdateServiceInstance(
-                iter->second, v4_address, v6_address, text);
-          }
-        } else {
-          changed = instances_by_name_.erase(instance) != 0;
-        }
-
-        if (changed) {
-          instances_publisher_.SendUpdates();
-        }
-      });
+  owner->PostSubscribe(key, service_name, filter);
 }
 
 MdnsServiceImpl::MdnsServiceSubscriptionImpl::~MdnsServiceSubscriptionImpl() {}
@@ -178,11 +347,154 @@ void MdnsServiceImpl::MdnsServiceSubscriptionImpl::AddBinding(
   bindings_.AddBinding(this, std::move(subscription_request));
 }
 
+void MdnsServiceImpl::MdnsServiceSubscriptionImpl::ReceiveInstanceChange(
+    const std::string& instance_name,
+    const SocketAddress& v4_address,
+    const SocketAddress& v6_address,
+    const std::vector<std::string>& text) {
+  if (coalescing_interval_ <= ftl::TimeDelta()) {
+    ApplyInstanceChange(instance_name, v4_address, v6_address, text);
+    return;
+  }
+
+  if (pending_changes_.empty()) {
+    // The subscription may be gone by the time the task runs, so it's looked
+    // up by key.
+    owner_->task_runner_->PostDelayedTask(
+        [owner = owner_, key = key_]() {
+          auto iter = owner->subscriptions_by_key_.find(key);
+          if (iter != owner->subscriptions_by_key_.end()) {
+            iter->second->ApplyPendingChanges();
+          }
+        },
+        coalescing_interval_);
+  }
+
+  // Each change carries the whole state of the instance, so the latest one
+  // is all that's needed.
+  pending_changes_[instance_name] = {v4_address, v6_address, text};
+}
+
+void MdnsServiceImpl::MdnsServiceSubscriptionImpl::ApplyPendingChanges() {
+  std::unordered_map<std::string, PendingChange> changes;
+  changes.swap(pending_changes_);
+
+  for (auto& pair : changes) {
+    ApplyInstanceChange(pair.first, pair.second.v4_address_,
+                        pair.second.v6_address_, pair.second.text_);
+  }
+}
+
+void MdnsServiceImpl::MdnsServiceSubscriptionImpl::ApplyInstanceChange(
+    const std::string& instance_name,
+    const SocketAddress& v4_address,
+    const SocketAddress& v6_address,
+    const std::vector<std::string>& text) {
+  bool changed = false;
+
+  if (v4_address.is_valid() || v6_address.is_valid()) {
+    auto iter = instances_by_name_.find(instance_name);
+    if (iter == instances_by_name_.end()) {
+      instances_by_name_.emplace(
+          instance_name,
+          MdnsFidlUtil::CreateServiceInstance(service_name_, instance_name,
+                                              v4_address, v6_address, text));
+      changed = true;
+    } else {
+      changed = MdnsFidlUtil::UpdateServiceInstance(iter->second, v4_address,
+                                                    v6_address, text);
+    }
+  } else {
+    changed = instances_by_name_.erase(instance_name) != 0;
+  }
+
+  if (!changed) {
+    return;
+  }
+
+  if (callback_) {
+    callback_(service_name_, instance_name, v4_address, v6_address, text);
+  }
+
+  instances_publisher_.SendUpdates();
+  NoteChange(instance_name);
+}
+
 void MdnsServiceImpl::MdnsServiceSubscriptionImpl::GetInstances(
     uint64_t version_last_seen,
     const GetInstancesCallback& callback) {
   instances_publisher_.Get(version_last_seen, callback);
 }
 
+void MdnsServiceImpl::MdnsServiceSubscriptionImpl::GetInstanceChanges(
+    uint64_t version_last_seen,
+    const GetInstanceChangesCallback& callback) {
+  if (version_last_seen == version_) {
+    pending_change_callbacks_.push_back(callback);
+    return;
+  }
+
+  SendChanges(version_last_seen, callback);
+}
+
+void MdnsServiceImpl::MdnsServiceSubscriptionImpl::NoteChange(
+    const std::string& instance_name) {
+  ++version_;
+  changes_.emplace_back(version_, instance_name);
+
+  if (changes_.size() > kMaxChangeCount) {
+    dropped_version_ = changes_.front().version_;
+    changes_.pop_front();
+  }
+
+  // Callbacks may call |GetInstanceChanges| again, so we work from a local
+  // copy.
+  std::vector<GetInstanceChangesCallback> callbacks;
+  callbacks.swap(pending_change_callbacks_);
+
+  for (auto& callback : callbacks) {
+    SendChanges(version_ - 1, callback);
+  }
+}
+
+void MdnsServiceImpl::MdnsServiceSubscriptionImpl::SendChanges(
+    uint64_t version_last_seen,
+    const GetInstanceChangesCallback& callback) {
+  fidl::Array<MdnsServiceInstancePtr> changed =
+      fidl::Array<MdnsServiceInstancePtr>::New(0);
+  fidl::Array<fidl::String> removed = fidl::Array<fidl::String>::New(0);
+
+  bool full = version_last_seen == kInitialInstances ||
+              version_last_seen < dropped_version_ ||
+              version_last_seen > version_;
+
+  if (full) {
+    for (auto& pair : instances_by_name_) {
+      changed.push_back(pair.second.Clone());
+    }
+  } else {
+    // An instance may have changed several times, but it's sent once, as it
+    // is now.
+    std::unordered_set<std::string> names_sent;
+
+    for (auto iter = changes_.rbegin();
+         iter != changes_.rend() && iter->version_ > version_last_seen;
+         ++iter) {
+      if (!names_sent.insert(iter->instance_name_).second) {
+        continue;
+      }
+
+      auto instance_iter = instances_by_name_.find(iter->instance_name_);
+      if (instance_iter != instances_by_name_.end()) {
+        changed.push_back(instance_iter->second.Clone());
+      } else {
+        removed.push_back(iter->instance_name_);
+      }
+    }
+  }
+
+  callback(version_, full, std::move(changed), std::move(removed));
+}
+
 }  // namespace mdns
 }  // namespace netconnector
@@ -4,30 +4,67 @@
 
 #pragma once
 
+#include <deque>
+#include <functional>
+#include <memory>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
 #include "apps/media/src/util/fidl_publisher.h"
 #include "apps/netconnector/services/mdns.fidl.h"
 #include "apps/netconnector/src/mdns/mdns.h"
 #include "lib/fidl/cpp/bindings/binding_set.h"
 #include "lib/ftl/macros.h"
+#include "lib/ftl/tasks/task_runner.h"
+#include "lib/ftl/time/time_delta.h"
 
 namespace netconnector {
 namespace mdns {
 
+// Implements |MdnsService| using an |Mdns| that runs on a thread of its own,
+// so mDNS traffic doesn't compete with the rest of the process for the
+// calling thread. |MdnsServiceImpl| must be used on the thread on which it was
+// constructed. Commands are posted to the mDNS thread in the order in which
+// they're issued, and results and instance updates are posted back, so all
+// callbacks are called on the constructing thread.
 class MdnsServiceImpl : public MdnsService {
  public:
+  using StartCallback = std::function<void(bool started)>;
+
   MdnsServiceImpl();
 
   ~MdnsServiceImpl() override;
 
   void AddBinding(fidl::InterfaceRequest<MdnsService> request);
 
-  bool Start(const std::string& host_name);
+  // Sets the file in which the mDNS cache is kept across restarts. Should be
+  // called before calling |Start|.
+  void SetCacheFile(const std::string& path);
+
+  // Sets the range of the mDNS aggregation window. See
+  // |Mdns::SetAggregationWindow|.
+  void SetAggregationWindow(ftl::TimeDelta min, ftl::TimeDelta max);
+
+  // Has each interface receive on a thread of its own. See
+  // |Mdns::EnableReceiveThreads|. Should be called before calling |Start|.
+  void EnableReceiveThreads();
 
-  // Registers interest in the specified service.
+  // Starts mDNS and calls |callback| to indicate whether it started.
+  void Start(const std::string& host_name, const StartCallback& callback);
+
+  // Registers interest in the specified service. If |coalescing_interval| is
+  // positive, changes to an instance arriving within the interval of the
+  // first one are merged and reported once, at the end of the interval.
+  // Instances added and removed within the interval aren't reported at all.
+  // The interval also applies to FIDL clients of the same subscription.
   void SubscribeToService(const std::string& service_name,
+                          ftl::TimeDelta coalescing_interval,
                           const Mdns::ServiceInstanceCallback& callback);
 
-  // Starts publishing the indicated service instance.
+  // Starts publishing the indicated service instance, or updates its port and
+  // text if it's already published.
   void PublishServiceInstance(const std::string& service_name,
                               const std::string& instance_name,
                               IpPort port,
@@ -42,6 +79,12 @@ class MdnsServiceImpl : public MdnsService {
                           fidl::InterfaceRequest<MdnsServiceSubscription>
                               subscription_request) override;
 
+  void SubscribeToFilteredService(
+      const fidl::String& service_name,
+      MdnsServiceFilterPtr filter,
+      fidl::InterfaceRequest<MdnsServiceSubscription> subscription_request)
+      override;
+
   void PublishServiceInstance(const fidl::String& service_name,
                               const fidl::String& instance_name,
                               uint16_t port,
@@ -50,13 +93,29 @@ class MdnsServiceImpl : public MdnsService {
   void UnpublishServiceInstance(const fidl::String& service_name,
                                 const fidl::String& instance_name) override;
 
+  void PublishServiceInstances(
+      fidl::Array<MdnsServicePublicationPtr> publications) override;
+
+  void UnpublishServiceInstances(
+      fidl::Array<MdnsServicePublicationPtr> publications) override;
+
   void SetVerbose(bool value) override;
 
+  void GetStats(const GetStatsCallback& callback) override;
+
+  void SetCaptureSize(uint32_t max_packets) override;
+
+  void WriteCapture(const fidl::String& path,
+                    const WriteCaptureCallback& callback) override;
+
  private:
   class MdnsServiceSubscriptionImpl : public MdnsServiceSubscription {
    public:
+    // |key| identifies the subscription in |subscriptions_by_key_|.
     MdnsServiceSubscriptionImpl(MdnsServiceImpl* owner,
-                                const std::string& service_name);
+                                const std::string& key,
+                                const std::string& service_name,
+                                const ServiceFilter& filter);
 
     ~MdnsServiceSubscriptionImpl() override;
 
@@ -69,24 +128,114 @@ class MdnsServiceImpl : public MdnsService {
       callback_ = callback;
     }
 
+    // Sets the interval over which instance changes are merged. The default,
+    // zero, reports changes as they arrive.
+    void SetCoalescingInterval(ftl::TimeDelta coalescing_interval) {
+      coalescing_interval_ = coalescing_interval;
+    }
+
+    // Handles an instance update posted from the mDNS thread.
+    void ReceiveInstanceChange(const std::string& instance_name,
+                               const SocketAddress& v4_address,
+                               const SocketAddress& v6_address,
+                               const std::vector<std::string>& text);
+
     // MdnsServiceSubscription implementation.
     void GetInstances(uint64_t version_last_seen,
                       const GetInstancesCallback& callback) override;
 
+    void GetInstanceChanges(
+        uint64_t version_last_seen,
+        const GetInstanceChangesCallback& callback) override;
+
    private:
+    // The number of changes kept for |GetInstanceChanges|. Callers further
+    // behind get all the instances.
+    static constexpr size_t kMaxChangeCount = 256;
+
+    // A change to an instance, which was added, changed or removed.
+    struct Change {
+      Change(uint64_t version, const std::string& instance_name)
+          : version_(version), instance_name_(instance_name) {}
+
+      uint64_t version_;
+      std::string instance_name_;
+    };
+
+    // The latest state of an instance whose changes are being coalesced.
+    struct PendingChange {
+      SocketAddress v4_address_;
+      SocketAddress v6_address_;
+      std::vector<std::string> text_;
+    };
+
+    // Applies an instance change, calling |callback_| and notifying FIDL
+    // clients if the instance actually changed.
+    void ApplyInstanceChange(const std::string& instance_name,
+                             const SocketAddress& v4_address,
+                             const SocketAddress& v6_address,
+                             const std::vector<std::string>& text);
+
+    // Applies the changes coalesced in |pending_changes_|.
+    void ApplyPendingChanges();
+
+    // Records a change to the named instance and sends it to the waiting
+    // |GetInstanceChanges| callers.
+    void NoteChange(const std::string& instance_name);
+
+    // Calls |callback| with the changes since |version_last_seen|.
+    void SendChanges(uint64_t version_last_seen,
+                     const GetInstanceChangesCallback& callback);
+
     MdnsServiceImpl* owner_;
+    std::string key_;
+    std::string service_name_;
     fidl::BindingSet<MdnsServiceSubscription> bindings_;
     Mdns::ServiceInstanceCallback callback_;
     media::FidlPublisher<GetInstancesCallback> instances_publisher_;
     std::unordered_map<std::string, MdnsServiceInstancePtr> instances_by_name_;
+    uint64_t version_ = kInitialInstances + 1;
+    // Changes through this version are no longer in |changes_|.
+    uint64_t dropped_version_ = kInitialInstances;
+    std::deque<Change> changes_;
+    std::vector<GetInstanceChangesCallback> pending_change_callbacks_;
+    ftl::TimeDelta coalescing_interval_;
+    std::unordered_map<std::string, PendingChange> pending_changes_;
 
     FTL_DISALLOW_COPY_AND_ASSIGN(MdnsServiceSubscriptionImpl);
   };
 
+  // Converts |publications| to |Mdns::ServiceInstance|s. Returns false if a
+  // service name is invalid, logging an error that names |method|.
+  static bool ConvertPublications(
+      const fidl::Array<MdnsServicePublicationPtr>& publications,
+      const char* method,
+      std::vector<Mdns::ServiceInstance>* instances);
+
+  // Returns the subscription to |service_name| with |filter|, creating it if
+  // there isn't one.
+  MdnsServiceSubscriptionImpl* GetSubscription(const std::string& service_name,
+                                               const ServiceFilter& filter);
+
+  // Subscribes to |service_name| with |filter| on the mDNS thread. Updates
+  // are posted back to the subscription for |key|, if it still exists.
+  void PostSubscribe(const std::string& key,
+                     const std::string& service_name,
+                     const ServiceFilter& filter);
+
+  // Ends the subscription to |service_name| with |filter| on the mDNS thread.
+  void PostUnsubscribe(const std::string& service_name,
+                       const ServiceFilter& filter);
+
+  ftl::RefPtr<ftl::TaskRunner> task_runner_;
+  ftl::RefPtr<ftl::TaskRunner> mdns_task_runner_;
+  std::thread mdns_thread_;
+  // Created, used and destroyed on the mDNS thread only.
+  std::unique_ptr<mdns::Mdns> mdns_;
   fidl::BindingSet<MdnsService> bindings_;
-  mdns::Mdns mdns_;
+  // Keyed by service name and |ServiceFilter::ToString|.
   std::unordered_map<std::string, std::unique_ptr<MdnsServiceSubscriptionImpl>>
-      subscriptions_by_service_name_;
+      subscriptions_by_key_;
 
   FTL_DISALLOW_COPY_AND_ASSIGN(MdnsServiceImpl);
 };
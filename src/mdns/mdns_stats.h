@@ -0,0 +1,86 @@
+// Copyright 2017 The Fuchsia Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#pragma once
+
+#include <stdint.h>
+
+#include <map>
+#include <string>
+#include <vector>
+
+#include "apps/netconnector/src/ip_address.h"
+#include "apps/netconnector/src/mdns/dns_message.h"
+#include "lib/ftl/time/time_delta.h"
+
+namespace netconnector {
+namespace mdns {
+
+// Traffic counters for one interface.
+struct MdnsInterfaceStats {
+  // Datagrams written to and read from the socket. Byte counts are DNS
+  // message bytes, excluding IP and UDP headers.
+  uint64_t packets_sent_ = 0;
+  uint64_t bytes_sent_ = 0;
+  uint64_t packets_received_ = 0;
+  uint64_t bytes_received_ = 0;
+  // Datagrams that couldn't be parsed as DNS messages.
+  uint64_t parse_failures_ = 0;
+};
+
+// Questions and resource records of one type that were sent and received.
+struct MdnsTypeStats {
+  uint64_t questions_sent_ = 0;
+  uint64_t questions_received_ = 0;
+  uint64_t records_sent_ = 0;
+  uint64_t records_received_ = 0;
+};
+
+// The cost of one agent's handling of inbound messages.
+struct MdnsAgentStats {
+  std::string name_;
+  // Resources presented to the agent and the time it spent on them.
+  uint64_t resources_received_ = 0;
+  ftl::TimeDelta receive_resource_time_;
+  // |EndOfMessage| calls and the time the agent spent in them.
+  uint64_t end_of_message_count_ = 0;
+  ftl::TimeDelta end_of_message_time_;
+};
+
+// Statistics for |Mdns| as a whole.
+struct MdnsStats {
+  struct Interface {
+    std::string name_;
+    IpAddress address_;
+    MdnsInterfaceStats stats_;
+  };
+
+  // The interfaces currently in use.
+  std::vector<Interface> interfaces_;
+  std::map<DnsType, MdnsTypeStats> types_;
+  // Queued questions and answers dropped because another host on the network
+  // sent the same (RFC 6762 sections 7.3 and 7.4).
+  uint64_t suppressed_questions_ = 0;
+  uint64_t suppressed_records_ = 0;
+  // Queued questions dropped because local agents queued the same question
+  // for the same message.
+  uint64_t coalesced_questions_ = 0;
+  // Queued records held back because they were multicast less than a second
+  // before (RFC 6762 section 6).
+  uint64_t rate_limited_records_ = 0;
+  // Records in the cache, the approximate bytes they take up and the number
+  // of records evicted because the cache was full.
+  size_t cache_records_ = 0;
+  size_t cache_bytes_ = 0;
+  uint64_t cache_evictions_ = 0;
+  // Current queue depths.
+  size_t question_queue_size_ = 0;
+  size_t resource_queue_size_ = 0;
+  size_t wake_queue_size_ = 0;
+  // The agents currently running.
+  std::vector<MdnsAgentStats> agents_;
+};
+
+}  // namespace mdns
+}  // namespace netconnector
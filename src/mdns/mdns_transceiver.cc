@@ -18,12 +18,12 @@ namespace netconnector {
 namespace mdns {
 
 // static
-const ftl::TimeDelta MdnsTransceiver::kMinAddressRecheckDelay =
-    ftl::TimeDelta::FromSeconds(1);
+const ftl::TimeDelta MdnsTransceiver::kPendingAddressPollInterval =
+    ftl::TimeDelta::FromMilliseconds(250);
 
 // static
-const ftl::TimeDelta MdnsTransceiver::kMaxAddressRecheckDelay =
-    ftl::TimeDelta::FromSeconds(5 * 60);
+const ftl::TimeDelta MdnsTransceiver::kInterfacePollInterval =
+    ftl::TimeDelta::FromSeconds(5);
 
 MdnsTransceiver::MdnsTransceiver()
     : task_runner_(mtl::MessageLoop::GetCurrent()->task_runner()) {}
@@ -43,13 +43,23 @@ bool MdnsTransceiver::Start(
 
   inbound_message_callback_ = inbound_message_callback;
   host_full_name_ = host_full_name;
+  started_ = true;
 
-  return FindNewInterfaces();
+  if (!UpdateInterfaces()) {
+    started_ = false;
+    return false;
+  }
+
+  return true;
 }
 
 void MdnsTransceiver::Stop() {
+  started_ = false;
+
   for (auto& interface : interfaces_) {
-    interface->Stop();
+    if (interface) {
+      interface->Stop();
+    }
   }
 }
 
@@ -78,18 +88,55 @@ void MdnsTransceiver::SendMessage(DnsMessage* message,
   FTL_DCHECK(message);
 
   if (dest_address == MdnsAddresses::kV4Multicast) {
-    for (auto& i : interfaces_) {
-      i->SendMessage(message, dest_address);
+    // The message is serialized once for each group of interfaces that can
+    // share packets, and each interface patches in its own addresses.
+    interfaces_sent_.assign(interfaces_.size(), false);
+
+    for (size_t i = 0; i < interfaces_.size(); ++i) {
+      if (!interfaces_[i] || interfaces_sent_[i]) {
+        continue;
+      }
+
+      interfaces_[i]->WriteMessage(*message, &outbound_packets_);
+
+      for (size_t j = i; j < interfaces_.size(); ++j) {
+        if (interfaces_[j] && !interfaces_sent_[j] &&
+            interfaces_[j]->CanSendPacketsFrom(*interfaces_[i])) {
+          interfaces_[j]->SendPackets(&outbound_packets_, dest_address);
+          interfaces_sent_[j] = true;
+        }
+      }
     }
 
     return;
   }
 
   FTL_DCHECK(interface_index < interfaces_.size());
-  interfaces_[interface_index]->SendMessage(message, dest_address);
+  if (!interfaces_[interface_index]) {
+    // The interface went away.
+    return;
+  }
+
+  interfaces_[interface_index]->SendMessage(*message, dest_address);
+}
+
+void MdnsTransceiver::GetInterfaceStats(
+    std::vector<MdnsStats::Interface>* stats) const {
+  FTL_DCHECK(stats);
+
+  for (auto& interface : interfaces_) {
+    if (interface) {
+      stats->push_back(
+          {interface->name(), interface->address(), interface->stats()});
+    }
+  }
 }
 
-bool MdnsTransceiver::FindNewInterfaces() {
+bool MdnsTransceiver::UpdateInterfaces() {
+  if (!started_) {
+    return true;
+  }
+
   ftl::UniqueFD socket_fd = ftl::UniqueFD(socket(AF_INET, SOCK_DGRAM, 0));
 
   if (!socket_fd.is_valid()) {
@@ -105,10 +152,23 @@ bool MdnsTransceiver::FindNewInterfaces() {
     return false;
   }
 
-  bool recheck_addresses = false;
+  bool address_pending = false;
+  bool interfaces_changed = false;
 
   if (get_if_info.n_info == 0) {
-    recheck_addresses = true;
+    address_pending = true;
+  }
+
+  // Stop the transceivers for interfaces that are gone, down or readdressed.
+  // Readdressed interfaces get new transceivers below.
+  for (auto& interface : interfaces_) {
+    if (interface && !InterfaceStillReported(*interface, get_if_info)) {
+      FTL_LOG(INFO) << "Stopping mDNS on interface " << interface->name()
+                    << ", address " << interface->address();
+      interface->Stop();
+      interface.reset();
+      interfaces_changed = true;
+    }
   }
 
   // Launch a transceiver for each new interface.
@@ -119,9 +179,6 @@ bool MdnsTransceiver::FindNewInterfaces() {
     // address, but we check anyway.
     if (if_info->addr.ss_family != AF_INET &&
         if_info->addr.ss_family != AF_INET6) {
-      FTL_LOG(ERROR) << "Not starting mDNS for interface " << if_info->name
-                     << ": unsupported address family "
-                     << if_info->addr.ss_family;
       continue;
     }
 
@@ -129,7 +186,7 @@ bool MdnsTransceiver::FindNewInterfaces() {
       IpAddress address((struct sockaddr*)&if_info->addr);
 
       if (!AddressIsSet(address)) {
-        recheck_addresses = true;
+        address_pending = true;
         continue;
       }
 
@@ -140,34 +197,35 @@ bool MdnsTransceiver::FindNewInterfaces() {
       std::unique_ptr<MdnsInterfaceTransceiver> interface =
           MdnsInterfaceTransceiver::Create(*if_info, interfaces_.size());
 
-      interface->Start(host_full_name_, inbound_message_callback_);
-
-      for (auto& i : interfaces_) {
-        if (i->name() == interface->name()) {
-          i->SetAlternateAddress(host_full_name_, interface->address());
-          interface->SetAlternateAddress(host_full_name_, i->address());
-        }
+      interface->SetCapture(&capture_);
+      if (receive_threads_enabled_) {
+        interface->EnableReceiveThread();
       }
 
+      interface->Start(host_full_name_, inbound_message_callback_);
+
       interfaces_.push_back(std::move(interface));
+      interfaces_changed = true;
     }
   }
 
-  if (recheck_addresses) {
-    task_runner_->PostDelayedTask([this]() { FindNewInterfaces(); },
-                                  address_recheck_delay_);
-
-    address_recheck_delay_ =
-        std::min(address_recheck_delay_ * kAddressRecheckDelayMultiplier,
-                 kMaxAddressRecheckDelay);
+  if (interfaces_changed) {
+    UpdateAlternateAddresses();
   }
 
+  // Netstack doesn't notify us of interface changes, so we poll. Interfaces
+  // waiting for addresses (e.g. via DHCP) are polled often, so we start
+  // responding as soon as an address arrives.
+  task_runner_->PostDelayedTask(
+      [this]() { UpdateInterfaces(); },
+      address_pending ? kPendingAddressPollInterval : kInterfacePollInterval);
+
   return true;
 }
 
 bool MdnsTransceiver::InterfaceAlreadyFound(const IpAddress& address) {
   for (auto& i : interfaces_) {
-    if (i->address() == address) {
+    if (i && i->address() == address) {
       return true;
     }
   }
@@ -175,6 +233,49 @@ bool MdnsTransceiver::InterfaceAlreadyFound(const IpAddress& address) {
   return false;
 }
 
+bool MdnsTransceiver::InterfaceStillReported(
+    const MdnsInterfaceTransceiver& interface,
+    const netc_get_if_info_t& get_if_info) {
+  for (uint32_t i = 0; i < get_if_info.n_info; ++i) {
+    netc_if_info_t if_info = get_if_info.info[i];
+
+    if (interface.name().compare(if_info.name) != 0 ||
+        interface.address().family() != if_info.addr.ss_family ||
+        !InterfaceEnabled(&if_info)) {
+      continue;
+    }
+
+    if (IpAddress((struct sockaddr*)&if_info.addr) == interface.address()) {
+      return true;
+    }
+  }
+
+  return false;
+}
+
+void MdnsTransceiver::UpdateAlternateAddresses() {
+  for (auto& interface : interfaces_) {
+    if (!interface) {
+      continue;
+    }
+
+    const MdnsInterfaceTransceiver* alternate = nullptr;
+    for (auto& other : interfaces_) {
+      if (other && other->name() == interface->name() &&
+          other->address().family() != interface->address().family()) {
+        alternate = other.get();
+        break;
+      }
+    }
+
+    if (alternate) {
+      interface->SetAlternateAddress(host_full_name_, alternate->address());
+    } else {
+      interface->ClearAlternateAddress();
+    }
+  }
+}
+
 bool MdnsTransceiver::AddressIsSet(const IpAddress& address) {
   size_t word_count = address.word_count();
   const uint16_t* words = address.as_words();
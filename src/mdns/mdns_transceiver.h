@@ -10,6 +10,7 @@
 #include <netinet/in.h>
 
 #include "apps/netconnector/src/mdns/mdns_interface_transceiver.h"
+#include "apps/netconnector/src/mdns/packet_capture.h"
 #include "lib/ftl/macros.h"
 #include "lib/ftl/tasks/task_runner.h"
 #include "lib/ftl/time/time_delta.h"
@@ -20,8 +21,9 @@ namespace mdns {
 // Sends and receives mDNS messages on any number of interfaces.
 class MdnsTransceiver {
  public:
-  using InboundMessageCallback = std::function<
-      void(std::unique_ptr<DnsMessage>, const SocketAddress&, uint32_t)>;
+  using InboundMessage = MdnsInterfaceTransceiver::InboundMessage;
+  using InboundMessageCallback =
+      MdnsInterfaceTransceiver::InboundMessageCallback;
 
   MdnsTransceiver();
 
@@ -33,6 +35,11 @@ class MdnsTransceiver {
   // interfaces that have been enabled.
   void EnableInterface(const std::string& name, sa_family_t family);
 
+  // Has each interface transceiver receive on a thread of its own. See
+  // |MdnsInterfaceTransceiver::EnableReceiveThread|. Should be called before
+  // calling |Start|.
+  void EnableReceiveThreads() { receive_threads_enabled_ = true; }
+
   // Starts the transceiver. Returns true if successful.
   bool Start(const std::string& host_full_name,
              const InboundMessageCallback& inbound_message_callback);
@@ -42,15 +49,22 @@ class MdnsTransceiver {
 
   // Sends a messaage to the specified address on the specified interface. A
   // V6 interface will send to |MdnsAddresses::kV6Multicast| if |dest_address|
-  // is |MdnsAddresses::kV4Multicast|.
+  // is |MdnsAddresses::kV4Multicast|. Multicast messages are serialized once
+  // for all interfaces of the same shape.
   void SendMessage(DnsMessage* message,
                    const SocketAddress& dest_address,
                    uint32_t interface_index);
 
+  // Returns the capture of the datagrams sent and received on all
+  // interfaces.
+  PacketCapture& capture() { return capture_; }
+
+  // Adds the interfaces in use and their counters to |stats|.
+  void GetInterfaceStats(std::vector<MdnsStats::Interface>* stats) const;
+
  private:
-  static const ftl::TimeDelta kMinAddressRecheckDelay;
-  static const ftl::TimeDelta kMaxAddressRecheckDelay;
-  static constexpr int64_t kAddressRecheckDelayMultiplier = 2;
+  static const ftl::TimeDelta kPendingAddressPollInterval;
+  static const ftl::TimeDelta kInterfacePollInterval;
 
   struct InterfaceId {
     InterfaceId(const std::string& name, sa_family_t family)
@@ -63,15 +77,26 @@ class MdnsTransceiver {
   // Determines if the interface is enabled.
   bool InterfaceEnabled(netc_if_info_t* if_info);
 
-  // Creates a new |MdnsInterfaceTransciver| for each interface that's ready
-  // and doesn't already have one. Schedules another call to this method if
-  // unready interfaces were found.
-  bool FindNewInterfaces();
+  // Brings |interfaces_| in line with the interfaces netstack reports. A
+  // |MdnsInterfaceTransciver| is created for each interface that's ready and
+  // doesn't already have one, and transceivers are stopped for interfaces
+  // that are gone, down or have a different address. Schedules the next
+  // call to this method, sooner if unready interfaces were found.
+  bool UpdateInterfaces();
 
   // Determines if a |MdnsInterfaceTransciver| has already been created for the
   // specified address.
   bool InterfaceAlreadyFound(const IpAddress& address);
 
+  // Determines if |get_if_info| still reports |interface|'s interface as
+  // enabled and with the same address.
+  bool InterfaceStillReported(const MdnsInterfaceTransceiver& interface,
+                              const netc_get_if_info_t& get_if_info);
+
+  // Gives each interface transceiver the address of the transceiver of the
+  // other family on the same interface, if there is one.
+  void UpdateAlternateAddresses();
+
   // Determines if |address| has been set (e.g. via DHCP).
   bool AddressIsSet(const IpAddress& address);
 
@@ -79,8 +104,14 @@ class MdnsTransceiver {
   std::vector<InterfaceId> enabled_interfaces_;
   InboundMessageCallback inbound_message_callback_;
   std::string host_full_name_;
+  // Indexed by interface index. Entries for interfaces that have gone away
+  // are null, so the indices of the remaining interfaces don't change.
   std::vector<std::unique_ptr<MdnsInterfaceTransceiver>> interfaces_;
-  ftl::TimeDelta address_recheck_delay_ = kMinAddressRecheckDelay;
+  std::vector<MdnsInterfaceTransceiver::OutboundPacket> outbound_packets_;
+  std::vector<bool> interfaces_sent_;
+  PacketCapture capture_;
+  bool receive_threads_enabled_ = false;
+  bool started_ = false;
 
   FTL_DISALLOW_COPY_AND_ASSIGN(MdnsTransceiver);
 };
@@ -0,0 +1,439 @@
+// Copyright 2017 The Fuchsia Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#include "apps/netconnector/src/mdns/packet_capture.h"
+
+#include <arpa/inet.h>
+#include <sys/time.h>
+
+#include <algorithm>
+#include <cstring>
+
+#include "lib/ftl/files/file.h"
+#include "lib/ftl/logging.h"
+
+namespace netconnector {
+namespace mdns {
+namespace {
+
+// pcapng block types and constants (draft-tuexen-opsawg-pcapng).
+static constexpr uint32_t kSectionHeaderBlockType = 0x0a0d0d0a;
+static constexpr uint32_t kInterfaceDescriptionBlockType = 1;
+static constexpr uint32_t kEnhancedPacketBlockType = 6;
+static constexpr uint32_t kByteOrderMagic = 0x1a2b3c4d;
+static constexpr size_t kBlockOverhead = 12;
+
+// Link types.
+static constexpr uint16_t kLinkTypeEthernet = 1;
+static constexpr uint16_t kLinkTypeRaw = 101;
+
+static constexpr size_t kEthernetHeaderSize = 14;
+static constexpr uint16_t kEtherTypeV4 = 0x0800;
+static constexpr uint16_t kEtherTypeV6 = 0x86dd;
+static constexpr size_t kV4HeaderSize = 20;
+static constexpr size_t kV6HeaderSize = 40;
+static constexpr size_t kUdpHeaderSize = 8;
+static constexpr uint8_t kIpProtocolUdp = 17;
+static constexpr uint8_t kTimeToLive = 255;
+static constexpr uint16_t kMdnsPort = 5353;
+
+template <typename T>
+void Append(T value, std::string* out) {
+  out->append(reinterpret_cast<const char*>(&value), sizeof(value));
+}
+
+void AppendBigEndian16(uint16_t value, std::string* out) {
+  Append(htons(value), out);
+}
+
+void AppendBytes(const void* data, size_t size, std::string* out) {
+  out->append(reinterpret_cast<const char*>(data), size);
+}
+
+// Appends a block with the given type and body, which is padded to a 32-bit
+// boundary.
+void AppendBlock(uint32_t type, const std::string& body, std::string* out) {
+  size_t padding = (4 - body.size() % 4) % 4;
+  uint32_t total_length =
+      static_cast<uint32_t>(kBlockOverhead + body.size() + padding);
+
+  Append(type, out);
+  Append(total_length, out);
+  out->append(body);
+  out->append(padding, '\0');
+  Append(total_length, out);
+}
+
+// Adds |size| bytes at |data| to an internet checksum sum (RFC 1071).
+uint32_t AddToChecksum(const uint8_t* data, size_t size, uint32_t sum) {
+  for (size_t i = 0; i + 1 < size; i += 2) {
+    sum += (static_cast<uint32_t>(data[i]) << 8) | data[i + 1];
+  }
+
+  if (size % 2 != 0) {
+    sum += static_cast<uint32_t>(data[size - 1]) << 8;
+  }
+
+  return sum;
+}
+
+uint16_t FinishChecksum(uint32_t sum) {
+  while (sum >> 16) {
+    sum = (sum & 0xffff) + (sum >> 16);
+  }
+
+  return static_cast<uint16_t>(~sum);
+}
+
+// Appends |packet| as an IP datagram with a UDP header.
+void AppendDatagram(const PacketCapture::Packet& packet, std::string* out) {
+  const IpAddress source = packet.source_address_.address();
+  const IpAddress dest = packet.dest_address_.address();
+  uint16_t udp_length =
+      static_cast<uint16_t>(kUdpHeaderSize + packet.data_.size());
+
+  // The UDP checksum covers a pseudo-header, the UDP header and the payload.
+  uint32_t sum = 0;
+  sum = AddToChecksum(source.as_bytes(), source.byte_count(), sum);
+  sum = AddToChecksum(dest.as_bytes(), dest.byte_count(), sum);
+  sum += kIpProtocolUdp;
+  sum += udp_length;
+  sum += packet.source_address_.port().as_uint16_t();
+  sum += packet.dest_address_.port().as_uint16_t();
+  sum += udp_length;
+  sum = AddToChecksum(packet.data_.data(), packet.data_.size(), sum);
+  uint16_t udp_checksum = FinishChecksum(sum);
+  if (udp_checksum == 0) {
+    udp_checksum = 0xffff;
+  }
+
+  if (source.is_v4()) {
+    uint8_t header[kV4HeaderSize] = {0x45, 0};
+    uint16_t total_length =
+        htons(static_cast<uint16_t>(kV4HeaderSize + udp_length));
+    std::memcpy(header + 2, &total_length, sizeof(total_length));
+    header[8] = kTimeToLive;
+    header[9] = kIpProtocolUdp;
+    std::memcpy(header + 12, source.as_bytes(), source.byte_count());
+    std::memcpy(header + 16, dest.as_bytes(), dest.byte_count());
+    uint16_t checksum =
+        htons(FinishChecksum(AddToChecksum(header, kV4HeaderSize, 0)));
+    std::memcpy(header + 10, &checksum, sizeof(checksum));
+    AppendBytes(header, sizeof(header), out);
+  } else {
+    uint8_t header[kV6HeaderSize] = {0x60, 0};
+    uint16_t payload_length = htons(udp_length);
+    std::memcpy(header + 4, &payload_length, sizeof(payload_length));
+    header[6] = kIpProtocolUdp;
+    header[7] = kTimeToLive;
+    std::memcpy(header + 8, source.as_bytes(), source.byte_count());
+    std::memcpy(header + 24, dest.as_bytes(), dest.byte_count());
+    AppendBytes(header, sizeof(header), out);
+  }
+
+  AppendBigEndian16(packet.source_address_.port().as_uint16_t(), out);
+  AppendBigEndian16(packet.dest_address_.port().as_uint16_t(), out);
+  AppendBigEndian16(udp_length, out);
+  AppendBigEndian16(udp_checksum, out);
+  AppendBytes(packet.data_.data(), packet.data_.size(), out);
+}
+
+template <typename T>
+T Read(const uint8_t* data) {
+  T value;
+  std::memcpy(&value, data, sizeof(value));
+  return value;
+}
+
+uint16_t ReadBigEndian16(const uint8_t* data) {
+  return ntohs(Read<uint16_t>(data));
+}
+
+// Parses a captured frame of the given link type. Returns false if the frame
+// isn't a UDP datagram to or from the mDNS port.
+bool ParseFrame(uint16_t link_type,
+                const uint8_t* data,
+                size_t size,
+                PacketCapture::Packet* packet) {
+  if (link_type == kLinkTypeEthernet) {
+    if (size < kEthernetHeaderSize) {
+      return false;
+    }
+
+    uint16_t ether_type = ReadBigEndian16(data + 12);
+    if (ether_type != kEtherTypeV4 && ether_type != kEtherTypeV6) {
+      return false;
+    }
+
+    data += kEthernetHeaderSize;
+    size -= kEthernetHeaderSize;
+  } else if (link_type != kLinkTypeRaw) {
+    return false;
+  }
+
+  if (size == 0) {
+    return false;
+  }
+
+  IpAddress source;
+  IpAddress dest;
+  size_t header_size;
+
+  if ((data[0] >> 4) == 4) {
+    header_size = (data[0] & 0xf) * 4;
+    if (size < kV4HeaderSize || header_size < kV4HeaderSize ||
+        size < header_size || data[9] != kIpProtocolUdp) {
+      return false;
+    }
+
+    // Ethernet frames may be padded.
+    size = std::min(size, static_cast<size_t>(ReadBigEndian16(data + 2)));
+    source = IpAddress(Read<in_addr>(data + 12));
+    dest = IpAddress(Read<in_addr>(data + 16));
+  } else if ((data[0] >> 4) == 6) {
+    header_size = kV6HeaderSize;
+    if (size < kV6HeaderSize || data[6] != kIpProtocolUdp) {
+      return false;
+    }
+
+    size = std::min(size, kV6HeaderSize + ReadBigEndian16(data + 4));
+    source = IpAddress(Read<in6_addr>(data + 8));
+    dest = IpAddress(Read<in6_addr>(data + 24));
+  } else {
+    return false;
+  }
+
+  if (size < header_size + kUdpHeaderSize) {
+    return false;
+  }
+
+  data += header_size;
+  size -= header_size;
+
+  uint16_t source_port = ReadBigEndian16(data);
+  uint16_t dest_port = ReadBigEndian16(data + 2);
+  if (source_port != kMdnsPort && dest_port != kMdnsPort) {
+    return false;
+  }
+
+  size = std::min(size, static_cast<size_t>(ReadBigEndian16(data + 4)));
+  if (size < kUdpHeaderSize) {
+    return false;
+  }
+
+  packet->source_address_ =
+      SocketAddress(source, IpPort::From_uint16_t(source_port));
+  packet->dest_address_ = SocketAddress(dest, IpPort::From_uint16_t(dest_port));
+  packet->data_.assign(data + kUdpHeaderSize, data + size);
+  return true;
+}
+
+}  // namespace
+
+// static
+bool PacketCapture::ReadFile(const std::string& path,
+                             std::vector<Packet>* packets) {
+  FTL_DCHECK(packets);
+
+  std::string contents;
+  if (!files::ReadFileToString(path, &contents)) {
+    FTL_LOG(ERROR) << "Failed to read " << path;
+    return false;
+  }
+
+  const uint8_t* data = reinterpret_cast<const uint8_t*>(contents.data());
+  size_t size = contents.size();
+  std::vector<uint16_t> link_types;
+  bool have_first_timestamp = false;
+  uint64_t first_timestamp = 0;
+
+  for (size_t position = 0; position < size;) {
+    if (size - position < kBlockOverhead) {
+      FTL_LOG(ERROR) << path << " is truncated";
+      return false;
+    }
+
+    const uint8_t* block = data + position;
+    uint32_t type = Read<uint32_t>(block);
+    uint32_t length = Read<uint32_t>(block + 4);
+    if (length < kBlockOverhead || length % 4 != 0 ||
+        length > size - position) {
+      FTL_LOG(ERROR) << path << " has a bad block length at " << position;
+      return false;
+    }
+
+    switch (type) {
+      case kSectionHeaderBlockType:
+        if (length < 28 || Read<uint32_t>(block + 8) != kByteOrderMagic) {
+          FTL_LOG(ERROR) << path << " isn't a pcapng file in host byte order";
+          return false;
+        }
+
+        // Interface IDs are per section.
+        link_types.clear();
+        break;
+
+      case kInterfaceDescriptionBlockType:
+        if (length < 20) {
+          return false;
+        }
+
+        link_types.push_back(Read<uint16_t>(block + 8));
+        break;
+
+      case kEnhancedPacketBlockType: {
+        if (length < 32) {
+          return false;
+        }
+
+        uint32_t interface_id = Read<uint32_t>(block + 8);
+        uint32_t captured_length = Read<uint32_t>(block + 20);
+        if (interface_id >= link_types.size() ||
+            captured_length > length - 32) {
+          return false;
+        }
+
+        // Timestamps are assumed to be in microseconds, the default.
+        uint64_t timestamp =
+            (static_cast<uint64_t>(Read<uint32_t>(block + 12)) << 32) |
+            Read<uint32_t>(block + 16);
+        if (!have_first_timestamp) {
+          first_timestamp = timestamp;
+          have_first_timestamp = true;
+        }
+
+        Packet packet;
+        if (ParseFrame(link_types[interface_id], block + 28, captured_length,
+                       &packet)) {
+          packet.time_ =
+              ftl::TimePoint() +
+              ftl::TimeDelta::FromMicroseconds(timestamp - first_timestamp);
+          packet.interface_index_ = interface_id;
+          packets->push_back(std::move(packet));
+        }
+      } break;
+
+      default:
+        // Other blocks aren't needed.
+        break;
+    }
+
+    position += length;
+  }
+
+  return true;
+}
+
+PacketCapture::PacketCapture() {}
+
+PacketCapture::~PacketCapture() {}
+
+void PacketCapture::SetCapacity(size_t capacity) {
+  ftl::MutexLocker locker(&mutex_);
+  capacity_.store(capacity, std::memory_order_relaxed);
+  packets_.clear();
+  packets_.shrink_to_fit();
+  packets_.reserve(capacity);
+  next_ = 0;
+}
+
+void PacketCapture::Record(uint32_t interface_index,
+                           const SocketAddress& source_address,
+                           const SocketAddress& dest_address,
+                           const uint8_t* data,
+                           size_t size) {
+  if (!enabled()) {
+    return;
+  }
+
+  ftl::MutexLocker locker(&mutex_);
+
+  // The capacity may have changed since it was checked above.
+  size_t capacity = capacity_.load(std::memory_order_relaxed);
+  if (capacity == 0) {
+    return;
+  }
+
+  Packet* packet;
+  if (packets_.size() < capacity) {
+    packets_.emplace_back();
+    packet = &packets_.back();
+  } else {
+    packet = &packets_[next_];
+    next_ = (next_ + 1) % capacity;
+  }
+
+  packet->time_ = ftl::TimePoint::Now();
+  packet->interface_index_ = interface_index;
+  packet->source_address_ = source_address;
+  packet->dest_address_ = dest_address;
+  // |assign| reuses the buffer of the packet being replaced.
+  packet->data_.assign(data, data + size);
+}
+
+bool PacketCapture::WriteFile(const std::string& path) const {
+  // Recording waits while the capture is written, which is acceptable for a
+  // debugging aid.
+  ftl::MutexLocker locker(&mutex_);
+
+  std::string out;
+
+  // Section header block: byte-order magic, version 1.0 and unknown
+  // section length.
+  std::string body;
+  Append(kByteOrderMagic, &body);
+  Append(static_cast<uint16_t>(1), &body);
+  Append(static_cast<uint16_t>(0), &body);
+  Append(static_cast<int64_t>(-1), &body);
+  AppendBlock(kSectionHeaderBlockType, body, &out);
+
+  // One interface description block per interface index, so the index
+  // serves as the interface ID.
+  uint32_t max_interface_index = 0;
+  for (const Packet& packet : packets_) {
+    max_interface_index =
+        std::max(max_interface_index, packet.interface_index_);
+  }
+
+  for (uint32_t i = 0; i <= max_interface_index; ++i) {
+    body.clear();
+    Append(kLinkTypeRaw, &body);
+    Append(static_cast<uint16_t>(0), &body);
+    Append(static_cast<uint32_t>(0), &body);
+    AppendBlock(kInterfaceDescriptionBlockType, body, &out);
+  }
+
+  // Packet times are converted from the monotonic clock to wall-clock
+  // microseconds.
+  timeval wall_now;
+  gettimeofday(&wall_now, nullptr);
+  int64_t wall_now_us =
+      static_cast<int64_t>(wall_now.tv_sec) * 1000000 + wall_now.tv_usec;
+  ftl::TimePoint now = ftl::TimePoint::Now();
+
+  std::string datagram;
+  for (size_t i = 0; i < packets_.size(); ++i) {
+    const Packet& packet = packets_[(next_ + i) % packets_.size()];
+
+    uint64_t timestamp = static_cast<uint64_t>(
+        wall_now_us - (now - packet.time_).ToMicroseconds());
+
+    datagram.clear();
+    AppendDatagram(packet, &datagram);
+
+    body.clear();
+    Append(packet.interface_index_, &body);
+    Append(static_cast<uint32_t>(timestamp >> 32), &body);
+    Append(static_cast<uint32_t>(timestamp), &body);
+    Append(static_cast<uint32_t>(datagram.size()), &body);
+    Append(static_cast<uint32_t>(datagram.size()), &body);
+    body.append(datagram);
+    AppendBlock(kEnhancedPacketBlockType, body, &out);
+  }
+
+  return files::WriteFile(path, out.data(), out.size());
+}
+
+}  // namespace mdns
+}  // namespace netconnector
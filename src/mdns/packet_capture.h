@@ -0,0 +1,86 @@
+// Copyright 2017 The Fuchsia Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <atomic>
+#include <string>
+#include <vector>
+
+#include "apps/netconnector/src/socket_address.h"
+#include "lib/ftl/macros.h"
+#include "lib/ftl/synchronization/mutex.h"
+#include "lib/ftl/synchronization/thread_annotations.h"
+#include "lib/ftl/time/time_point.h"
+
+namespace netconnector {
+namespace mdns {
+
+// Keeps the most recent mDNS datagrams sent and received in a ring, so they
+// can be written to a capture file on demand. Datagrams are copied as they
+// are, with no formatting, so capturing is cheap enough to leave on. Once
+// the ring is full, its buffers are reused.
+//
+// Capture files are pcapng files with one raw-IP interface per interface
+// index. IP and UDP headers are synthesized from the datagrams' addresses.
+// The destination of inbound datagrams isn't known, so it's recorded as the
+// mDNS multicast address of the family.
+//
+// Datagrams may be recorded on any thread, so interfaces with receive threads
+// can share one capture.
+class PacketCapture {
+ public:
+  struct Packet {
+    ftl::TimePoint time_;
+    uint32_t interface_index_ = 0;
+    SocketAddress source_address_;
+    SocketAddress dest_address_;
+    std::vector<uint8_t> data_;
+  };
+
+  // Reads the UDP datagrams sent to or from the mDNS port from the pcapng file
+  // at |path|, appending them to |packets| in file order. Files with raw-IP
+  // and Ethernet interfaces are supported. Times are relative to the first
+  // packet in the file. Returns false if the file can't be read or parsed.
+  static bool ReadFile(const std::string& path, std::vector<Packet>* packets);
+
+  PacketCapture();
+
+  ~PacketCapture();
+
+  // Determines whether datagrams are being captured.
+  bool enabled() const {
+    return capacity_.load(std::memory_order_relaxed) != 0;
+  }
+
+  // Sets the number of datagrams the ring holds. Zero, the default, turns
+  // capture off. Datagrams already captured are discarded.
+  void SetCapacity(size_t capacity);
+
+  // Records a datagram, replacing the oldest one if the ring is full.
+  void Record(uint32_t interface_index,
+              const SocketAddress& source_address,
+              const SocketAddress& dest_address,
+              const uint8_t* data,
+              size_t size);
+
+  // Writes the captured datagrams to the file at |path|, oldest first.
+  // Returns false if the file couldn't be written.
+  bool WriteFile(const std::string& path) const;
+
+ private:
+  std::atomic<size_t> capacity_{0};
+  mutable ftl::Mutex mutex_;
+  std::vector<Packet> packets_ FTL_GUARDED_BY(mutex_);
+  // The position in |packets_| of the oldest packet, once the ring is full.
+  size_t next_ FTL_GUARDED_BY(mutex_) = 0;
+
+  FTL_DISALLOW_COPY_AND_ASSIGN(PacketCapture);
+};
+
+}  // namespace mdns
+}  // namespace netconnector
@@ -11,8 +11,13 @@
 namespace netconnector {
 namespace mdns {
 
-PacketReader::PacketReader(std::vector<uint8_t> packet)
-    : packet_(std::move(packet)), packet_size_(packet_.size()) {}
+PacketReader::PacketReader(const uint8_t* data, size_t size)
+    : data_(data), buffer_size_(size), packet_size_(size) {
+  FTL_DCHECK(data_ != nullptr || size == 0);
+}
+
+PacketReader::PacketReader(const std::vector<uint8_t>& packet)
+    : PacketReader(packet.data(), packet.size()) {}
 
 PacketReader::~PacketReader() {}
 
@@ -37,7 +42,7 @@ const uint8_t* PacketReader::Bytes(size_t count) {
     return nullptr;
   }
 
-  const uint8_t* result = packet_.data() + bytes_consumed_;
+  const uint8_t* result = data_ + bytes_consumed_;
   bytes_consumed_ += count;
   return result;
 }
@@ -53,7 +58,7 @@ bool PacketReader::SetBytesConsumed(size_t bytes_consumed) {
 }
 
 bool PacketReader::SetBytesRemaining(size_t bytes_remaining) {
-  if (bytes_remaining + bytes_consumed_ > packet_.size()) {
+  if (bytes_remaining + bytes_consumed_ > buffer_size_) {
     healthy_ = false;
     return false;
   }
@@ -62,6 +67,32 @@ bool PacketReader::SetBytesRemaining(size_t bytes_remaining) {
   return healthy_;
 }
 
+size_t PacketReader::AddNameChars(const char* chars, size_t size) {
+  FTL_DCHECK(chars != nullptr || size == 0);
+  size_t position = name_chars_.size();
+  name_chars_.insert(name_chars_.end(), chars, chars + size);
+  return position;
+}
+
+void PacketReader::AddNameSuffix(size_t offset, size_t position, size_t size) {
+  FTL_DCHECK(position + size <= name_chars_.size());
+  name_suffixes_.push_back({offset, position, size});
+}
+
+const char* PacketReader::FindNameSuffix(size_t offset, size_t* size) const {
+  FTL_DCHECK(size != nullptr);
+
+  // Packets have few enough names that a linear search is fine.
+  for (const NameSuffix& suffix : name_suffixes_) {
+    if (suffix.offset_ == offset) {
+      *size = suffix.size_;
+      return name_chars_.data() + suffix.position_;
+    }
+  }
+
+  return nullptr;
+}
+
 PacketReader& PacketReader::operator>>(bool& value) {
   GetBytes(sizeof(value), &value);
   return *this;
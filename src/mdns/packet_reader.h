@@ -4,16 +4,24 @@
 
 #pragma once
 
+#include <stddef.h>
+#include <stdint.h>
+
 #include <vector>
 
 namespace netconnector {
 namespace mdns {
 
-// Reads values from a binary packet buffer.
+// Reads values from a binary packet buffer. The reader doesn't own the buffer,
+// which must outlive the reader and must not be modified while the reader is
+// in use.
 class PacketReader {
  public:
-  // Constructs a packet reader.
-  PacketReader(std::vector<uint8_t> packet);
+  // Constructs a packet reader for the |size| bytes at |data|.
+  PacketReader(const uint8_t* data, size_t size);
+
+  // Constructs a packet reader for the contents of |packet|.
+  explicit PacketReader(const std::vector<uint8_t>& packet);
 
   ~PacketReader();
 
@@ -55,6 +63,20 @@ class PacketReader {
   // returns false thereafter. Returns  the resulting value of |healthy()|.
   bool SetBytesRemaining(size_t bytes_remaining);
 
+  // Stores a copy of the |size| characters at |chars|, a decoded DNS name,
+  // for use with |AddNameSuffix|. Returns the position of the copy.
+  size_t AddNameChars(const char* chars, size_t size);
+
+  // Notes that the DNS name starting at |offset| in the packet decodes to the
+  // |size| characters at |position| in the characters stored by
+  // |AddNameChars|, so compression pointers to |offset| needn't be followed
+  // again.
+  void AddNameSuffix(size_t offset, size_t position, size_t size);
+
+  // Returns the characters noted by |AddNameSuffix| for |offset|, setting
+  // |*size| to their number, or nullptr if there are none.
+  const char* FindNameSuffix(size_t offset, size_t* size) const;
+
   PacketReader& operator>>(bool& value);
   PacketReader& operator>>(uint8_t& value);
   PacketReader& operator>>(uint16_t& value);
@@ -67,9 +89,22 @@ class PacketReader {
 
  private:
   bool healthy_ = true;
-  std::vector<uint8_t> packet_;
+  const uint8_t* data_;
+  // The size of the buffer at |data_|.
+  size_t buffer_size_;
+  // The size of the packet, which may be reduced by |SetBytesRemaining|.
   size_t packet_size_;
   size_t bytes_consumed_ = 0;
+
+  struct NameSuffix {
+    size_t offset_;
+    // Position and size of the characters in |name_chars_|.
+    size_t position_;
+    size_t size_;
+  };
+
+  std::vector<NameSuffix> name_suffixes_;
+  std::vector<char> name_chars_;
 };
 
 }  // namespace mdns
@@ -6,6 +6,9 @@
 
 #include <endian.h>
 
+#include <algorithm>
+#include <cstring>
+
 #include "lib/ftl/logging.h"
 
 namespace netconnector {
@@ -19,15 +22,15 @@ PacketWriter::PacketWriter(std::vector<uint8_t> packet)
 PacketWriter::~PacketWriter() {}
 
 std::vector<uint8_t> PacketWriter::GetResizedPacket() {
-  position_ = 0;
-  positions_by_label_.clear();
   packet_.resize(position_);
+  position_ = 0;
+  ClearLabels();
   return std::move(packet_);
 }
 
 std::vector<uint8_t> PacketWriter::GetPacket() {
   position_ = 0;
-  positions_by_label_.clear();
+  ClearLabels();
   return std::move(packet_);
 }
 
@@ -39,7 +42,8 @@ void PacketWriter::PutBytes(size_t count, const void* source) {
   FTL_DCHECK(source != nullptr);
 
   if (packet_.size() < position_ + count) {
-    packet_.resize(position_ + count);
+    // Grow geometrically, so the vector isn't resized on every write.
+    packet_.resize(std::max(position_ + count, packet_.size() * 2));
   }
 
   std::memcpy(packet_.data() + position_, source, count);
@@ -47,17 +51,86 @@ void PacketWriter::PutBytes(size_t count, const void* source) {
   position_ += count;
 }
 
-void PacketWriter::CreateBookmark(const std::string& label) {
-  positions_by_label_.emplace(label, position_);
+size_t PacketWriter::FindLabel(const char* label,
+                               size_t size,
+                               size_t parent_position) const {
+  FTL_DCHECK(label != nullptr || size == 0);
+
+  uint32_t hash = HashLabel(label, size, parent_position);
+
+  size_t i = hash & (kLabelTableSize - 1);
+  while (labels_[i].position_ != 0) {
+    const LabelEntry& entry = labels_[i];
+    if (entry.hash_ == hash && entry.parent_position_ == parent_position &&
+        entry.position_ + 1 + size <= position_ &&
+        packet_[entry.position_] == size &&
+        std::memcmp(packet_.data() + entry.position_ + 1, label, size) == 0) {
+      return entry.position_;
+    }
+
+    i = (i + 1) & (kLabelTableSize - 1);
+  }
+
+  return npos;
+}
+
+void PacketWriter::AddLabel(const char* label,
+                            size_t size,
+                            size_t parent_position,
+                            size_t position) {
+  FTL_DCHECK(position != 0);
+
+  if (position > kMaxLabelPosition || label_count_ == kMaxLabelCount) {
+    return;
+  }
+
+  uint32_t hash = HashLabel(label, size, parent_position);
+
+  size_t i = hash & (kLabelTableSize - 1);
+  while (labels_[i].position_ != 0) {
+    i = (i + 1) & (kLabelTableSize - 1);
+  }
+
+  labels_[i].hash_ = hash;
+  labels_[i].parent_position_ = static_cast<uint16_t>(parent_position);
+  labels_[i].position_ = static_cast<uint16_t>(position);
+  ++label_count_;
 }
 
-size_t PacketWriter::GetBookmarkPosition(const std::string& label) const {
-  auto iter = positions_by_label_.find(label);
-  if (iter == positions_by_label_.end()) {
-    return npos;
+// static
+uint32_t PacketWriter::HashLabel(const char* label,
+                                 size_t size,
+                                 size_t parent_position) {
+  // Labels are verified against the packet contents when they're found, so
+  // the hash only needs the first and last eight bytes of the label.
+  static constexpr uint64_t kMultiplier = 0x9e3779b97f4a7c15ull;
+
+  uint64_t hash = (parent_position << 8 | size) * kMultiplier;
+
+  if (size >= sizeof(uint64_t)) {
+    uint64_t first;
+    uint64_t last;
+    std::memcpy(&first, label, sizeof(first));
+    std::memcpy(&last, label + size - sizeof(last), sizeof(last));
+    hash = (hash ^ first) * kMultiplier;
+    hash = (hash ^ last) * kMultiplier;
+  } else {
+    uint64_t chunk = 0;
+    for (size_t i = 0; i < size; ++i) {
+      chunk |= static_cast<uint64_t>(static_cast<uint8_t>(label[i])) << (i * 8);
+    }
+
+    hash = (hash ^ chunk) * kMultiplier;
   }
 
-  return iter->second;
+  return static_cast<uint32_t>(hash >> 32);
+}
+
+void PacketWriter::ClearLabels() {
+  if (label_count_ != 0) {
+    std::fill(labels_, labels_ + kLabelTableSize, LabelEntry());
+    label_count_ = 0;
+  }
 }
 
 PacketWriter& PacketWriter::operator<<(bool value) {
@@ -4,9 +4,9 @@
 
 #pragma once
 
+#include <stdint.h>
+
 #include <limits>
-#include <string>
-#include <unordered_map>
 #include <vector>
 
 namespace netconnector {
@@ -21,7 +21,7 @@ class PacketWriter {
   static std::vector<uint8_t> Write(const T& t) {
     PacketWriter writer;
     writer << t;
-    return writer.GetPacket();
+    return writer.GetResizedPacket();
   }
 
   // Creates a packet writer with an empty packet vector.
@@ -62,12 +62,21 @@ class PacketWriter {
   // Puts |count| bytes from |source| into the packet.
   void PutBytes(size_t count, const void* source);
 
-  // Creates a bookmark for the current position.
-  void CreateBookmark(const std::string& label);
-
-  // Gets the position for a bookmark (established by calling |CreateBookmark|).
-  // Returns |npos| if the bookmark isn't found.
-  size_t GetBookmarkPosition(const std::string& label) const;
+  // Finds a name suffix already written to the packet, for name compression.
+  // |label| is the first label of the suffix, and |parent_position| is the
+  // position of the rest of the suffix, or zero if |label| is the last label
+  // of the name. Returns |npos| if the suffix isn't found.
+  size_t FindLabel(const char* label,
+                   size_t size,
+                   size_t parent_position) const;
+
+  // Records that a label was written at |position|, so that later names can
+  // refer to it. |parent_position| is as for |FindLabel|. Labels are dropped
+  // if the position is too large to refer to or the table is full.
+  void AddLabel(const char* label,
+                size_t size,
+                size_t parent_position,
+                size_t position);
 
   PacketWriter& operator<<(bool value);
   PacketWriter& operator<<(uint8_t value);
@@ -81,9 +90,35 @@ class PacketWriter {
   PacketWriter& operator<<(const std::vector<uint8_t>& value);
 
  private:
+  // Size of the label table. Must be a power of two.
+  static constexpr size_t kLabelTableSize = 256;
+
+  // Max number of labels in the table, which keeps probe sequences short.
+  static constexpr size_t kMaxLabelCount = kLabelTableSize * 3 / 4;
+
+  // Max position a name compression pointer can refer to.
+  static constexpr size_t kMaxLabelPosition = 0x3fff;
+
+  // A label written to the packet. The label itself isn't stored, because
+  // it can be compared with the packet contents at |position_|. A
+  // |position_| of zero indicates an unused entry, because a label can't be
+  // written at the start of the packet.
+  struct LabelEntry {
+    uint32_t hash_ = 0;
+    uint16_t parent_position_ = 0;
+    uint16_t position_ = 0;
+  };
+
+  static uint32_t HashLabel(const char* label,
+                            size_t size,
+                            size_t parent_position);
+
+  void ClearLabels();
+
   std::vector<uint8_t> packet_;
   size_t position_ = 0;
-  std::unordered_map<std::string, size_t> positions_by_label_;
+  LabelEntry labels_[kLabelTableSize];
+  size_t label_count_ = 0;
 };
 
 }  // namespace mdns
@@ -4,6 +4,8 @@
 
 #include "apps/netconnector/src/mdns/resource_renewer.h"
 
+#include <random>
+
 #include "lib/ftl/logging.h"
 #include "lib/ftl/time/time_point.h"
 
@@ -13,7 +15,15 @@ namespace mdns {
 // static
 const std::string ResourceRenewer::kName = "##resource renewer##";
 
-ResourceRenewer::ResourceRenewer(MdnsAgent::Host* host) : host_(host) {}
+// static
+const ftl::TimeDelta ResourceRenewer::kQueryCoalescingWindow =
+    ftl::TimeDelta::FromSeconds(1);
+
+ResourceRenewer::ResourceRenewer(MdnsAgent::Host* host) : host_(host) {
+  std::random_device random_device;
+  jitter_salt_ = (static_cast<uint64_t>(random_device()) << 32) ^
+                 static_cast<uint64_t>(random_device());
+}
 
 ResourceRenewer::~ResourceRenewer() {
   FTL_DCHECK(entries_.size() == schedule_.size());
@@ -25,12 +35,13 @@ ResourceRenewer::~ResourceRenewer() {
 void ResourceRenewer::Renew(const DnsResource& resource) {
   FTL_DCHECK(resource.time_to_live_ != 0);
 
-  Entry key(resource.name_.dotted_string_, resource.type_);
+  Entry key(resource.name_, resource.type_);
   auto iter = entries_.find(&key);
 
   if (iter == entries_.end()) {
-    Entry* entry = new Entry(resource.name_.dotted_string_, resource.type_);
-    entry->SetFirstQuery(resource.time_to_live_);
+    Entry* entry = new Entry(resource.name_, resource.type_);
+    entry->SetFirstQuery(resource.time_to_live_,
+                         JitterPerThousand(resource.name_));
 
     Schedule(entry);
 
@@ -40,7 +51,8 @@ void ResourceRenewer::Renew(const DnsResource& resource) {
 
     entries_.insert(std::move(entry));
   } else {
-    (*iter)->SetFirstQuery(resource.time_to_live_);
+    (*iter)->SetFirstQuery(resource.time_to_live_,
+                           JitterPerThousand(resource.name_));
     (*iter)->delete_ = false;
   }
 }
@@ -50,7 +62,17 @@ void ResourceRenewer::Start() {}
 void ResourceRenewer::Wake() {
   ftl::TimePoint now = ftl::TimePoint::Now();
 
-  while (!schedule_.empty() && schedule_.top()->schedule_time_ <= now) {
+  // Queries that are nearly due are sent now, so they go out in the same
+  // message. Expirations wait until they're due.
+  ftl::TimePoint query_horizon = now + kQueryCoalescingWindow;
+  std::vector<Entry*> early_expirations;
+  // Entries queried in this wake are rescheduled after the loop, so a short
+  // query interval can't put them back within the horizon to be queried
+  // again now.
+  std::vector<Entry*> requeried;
+
+  while (!schedule_.empty() &&
+         schedule_.top()->schedule_time_ <= query_horizon) {
     Entry* entry = const_cast<Entry*>(schedule_.top());
     schedule_.pop();
 
@@ -60,6 +82,8 @@ void ResourceRenewer::Wake() {
     } else if (entry->schedule_time_ != entry->time_) {
       // Postponed entry.
       Schedule(entry);
+    } else if (entry->queries_remaining_ == 0 && entry->time_ > now) {
+      early_expirations.push_back(entry);
     } else if (entry->queries_remaining_ == 0) {
       // TTL expired.
       std::shared_ptr<DnsResource> resource =
@@ -68,15 +92,27 @@ void ResourceRenewer::Wake() {
       entries_.erase(entry);
       host_->SendResource(resource, MdnsResourceSection::kExpired, now);
       delete entry;
+    } else if (!host_->HasInterest(entry->name_)) {
+      // Nobody wants this resource anymore.
+      entries_.erase(entry);
+      delete entry;
     } else {
       // Need to query.
       host_->SendQuestion(
           std::make_shared<DnsQuestion>(entry->name_, entry->type_), now);
       entry->SetNextQueryOrExpiration();
-      Schedule(entry);
+      requeried.push_back(entry);
     }
   }
 
+  for (Entry* entry : early_expirations) {
+    schedule_.push(entry);
+  }
+
+  for (Entry* entry : requeried) {
+    Schedule(entry);
+  }
+
   if (!schedule_.empty()) {
     host_->WakeAt(shared_from_this(), schedule_.top()->schedule_time_);
   }
@@ -88,11 +124,33 @@ void ResourceRenewer::ReceiveResource(const DnsResource& resource,
                                       MdnsResourceSection section) {
   FTL_DCHECK(section != MdnsResourceSection::kExpired);
 
-  Entry key(resource.name_.dotted_string_, resource.type_);
+  Entry key(resource.name_, resource.type_);
   auto iter = entries_.find(&key);
   if (iter != entries_.end()) {
     (*iter)->delete_ = true;
   }
+
+  if (resource.type_ != DnsType::kNSec || resource.time_to_live_ == 0) {
+    return;
+  }
+
+  // Records of the types an NSEC record doesn't list no longer exist, so
+  // they expire now rather than after a round of futile queries.
+  std::vector<std::shared_ptr<DnsResource>> expirations;
+  for (Entry* entry : entries_) {
+    if (!entry->delete_ && entry->name_ == resource.name_ &&
+        !resource.nsec_.HasType(entry->type_)) {
+      entry->delete_ = true;
+      expirations.push_back(
+          std::make_shared<DnsResource>(entry->name_, entry->type_));
+      expirations.back()->time_to_live_ = 0;
+    }
+  }
+
+  for (auto& expiration : expirations) {
+    host_->SendResource(expiration, MdnsResourceSection::kExpired,
+                        ftl::TimePoint::Now());
+  }
 }
 
 void ResourceRenewer::EndOfMessage() {}
@@ -107,18 +165,34 @@ void ResourceRenewer::Schedule(Entry* entry) {
   schedule_.push(entry);
 }
 
-void ResourceRenewer::Entry::SetFirstQuery(uint32_t time_to_live) {
-  time_ = ftl::TimePoint::Now() + ftl::TimeDelta::FromMilliseconds(
-                                      time_to_live * kFirstQueryPerThousand);
-  interval_ = ftl::TimeDelta::FromMilliseconds(time_to_live *
-                                               kQueryIntervalPerThousand);
+uint32_t ResourceRenewer::JitterPerThousand(const DnsName& name) const {
+  uint64_t hash = (DnsName::Hash{}(name) ^ jitter_salt_) * 0x9e3779b97f4a7c15;
+  return static_cast<uint32_t>((hash >> 32) %
+                               (Entry::kMaxJitterPerThousand + 1));
+}
+
+void ResourceRenewer::Entry::SetFirstQuery(uint32_t time_to_live,
+                                           uint32_t jitter_per_thousand) {
+  ftl::TimePoint now = ftl::TimePoint::Now();
+  time_ = now + ftl::TimeDelta::FromMilliseconds(
+                    time_to_live * int64_t(kFirstQueryPerThousand +
+                                           jitter_per_thousand));
+  interval_ = ftl::TimeDelta::FromMilliseconds(
+      time_to_live * int64_t(kQueryIntervalPerThousand));
+  expiration_time_ = now + ftl::TimeDelta::FromSeconds(time_to_live);
   queries_remaining_ = kQueriesToAttempt;
 }
 
 void ResourceRenewer::Entry::SetNextQueryOrExpiration() {
   FTL_DCHECK(queries_remaining_ != 0);
-  time_ = time_ + interval_;
   --queries_remaining_;
+
+  // The jitter delays the queries but not the expiration.
+  if (queries_remaining_ == 0) {
+    time_ = expiration_time_;
+  } else {
+    time_ = time_ + interval_;
+  }
 }
 
 }  // namespace mdns
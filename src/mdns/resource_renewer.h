@@ -22,20 +22,24 @@ namespace mdns {
 // |Renew| method.
 //
 // |ResourceRenewer| queries for a resource at 80%, 85%, 90% and 95% of the
-// resource's TTL. If a resource is renewed, the renewer forgets about the
+// resource's TTL, plus up to 2% to keep devices from renewing in lockstep
+// (RFC 6762 section 5.2). The extra is the same for resources with the same
+// name, so their queries tend to go out together, and queries that are due
+// within a second of each other are sent in the same message. If a resource
+// is renewed, the renewer forgets about the
 // resource until asked again to renew it. If a resource's TTL expires,
 // |ResourceRenewer| sends a resource record to all the agents with
 // a TTL of zero, signalling that the resource should be deleted and forgets
 // about the resource. If a resource is explicitly deleted (a resource
 // record arrives with TTL 0), |ResourceRenewer| will not attempt to renew the
-// resource.
+// resource. If an NSEC record says a resource's type doesn't exist for its
+// name, the resource expires right away.
 //
-// Agents that need a resource record renewed call |Renew| on the host, which
-// then calls |Renew| on the |ResourceRenewer|. Agents must continue to renew
-// incoming resources as long as they want renewals to occur. When an agent
-// loses interest in a record, it should imply stop renewing the incoming
-// resource records. This approach will cause some unneeded renewals, but avoids
-// difficult cleanup issues associated with a persistent renewal scheme.
+// |Mdns| calls |Renew| for each incoming resource record with a name that
+// some agent is interested in. When it's time to query for a resource and no
+// agent is interested in its name anymore, |ResourceRenewer| forgets about the
+// resource. This avoids difficult cleanup issues associated with a persistent
+// renewal scheme.
 class ResourceRenewer : public MdnsAgent,
                         public std::enable_shared_from_this<ResourceRenewer> {
  public:
@@ -62,6 +66,8 @@ class ResourceRenewer : public MdnsAgent,
   void Quit() override;
 
  private:
+  static const ftl::TimeDelta kQueryCoalescingWindow;
+
   // All Entry objects are represented in both |entries_| and |schedule_|. We're
   // using raw pointers, so the destructor must delete all Entry objects
   // explicitly.
@@ -70,14 +76,16 @@ class ResourceRenewer : public MdnsAgent,
     static constexpr uint32_t kFirstQueryPerThousand = 800;
     static constexpr uint32_t kQueryIntervalPerThousand = 50;
     static constexpr uint32_t kQueriesToAttempt = 4;
+    static constexpr uint32_t kMaxJitterPerThousand = 20;
 
-    Entry(const std::string& name, DnsType type) : name_(name), type_(type) {}
+    Entry(const DnsName& name, DnsType type) : name_(name), type_(type) {}
 
-    std::string name_;
+    DnsName name_;
     DnsType type_;
 
     ftl::TimePoint time_;
     ftl::TimeDelta interval_;
+    ftl::TimePoint expiration_time_;
     uint32_t queries_remaining_;
 
     // Time value used for |schedule|. In some cases, we want to postpone a
@@ -89,9 +97,11 @@ class ResourceRenewer : public MdnsAgent,
 
     bool delete_ = false;
 
-    // Sets |time_|, |interval_| and |queries_remaining_| to their initial
-    // values to initiate the eventual renewal of the resource.
-    void SetFirstQuery(uint32_t time_to_live);
+    // Sets |time_|, |interval_|, |expiration_time_| and |queries_remaining_|
+    // to their initial values to initiate the eventual renewal of the
+    // resource. The queries are delayed by |jitter_per_thousand| thousandths
+    // of the TTL.
+    void SetFirstQuery(uint32_t time_to_live, uint32_t jitter_per_thousand);
 
     // Updates |time_| and |queries_remaining_| for the purposes of scheduling
     // the next query or expiration.
@@ -101,8 +111,7 @@ class ResourceRenewer : public MdnsAgent,
   struct Hash {
     size_t operator()(const Entry* m) {
       FTL_DCHECK(m != nullptr);
-      return std::hash<std::string>{}(m->name_) ^
-             std::hash<DnsType>{}(m->type_);
+      return DnsName::Hash{}(m->name_) ^ std::hash<DnsType>{}(m->type_);
     }
   };
 
@@ -124,7 +133,13 @@ class ResourceRenewer : public MdnsAgent,
 
   void Schedule(Entry* entry);
 
+  // Returns the renewal delay for resources named |name|, in thousandths of
+  // the TTL.
+  uint32_t JitterPerThousand(const DnsName& name) const;
+
   MdnsAgent::Host* host_;
+  // Makes the jitter differ from device to device.
+  uint64_t jitter_salt_;
   std::unordered_set<Entry*, Hash, Equals> entries_;
   std::priority_queue<Entry*, std::vector<Entry*>, LaterScheduleTime> schedule_;
 };
@@ -0,0 +1,99 @@
+// Copyright 2017 The Fuchsia Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#include "apps/netconnector/src/mdns/service_filter.h"
+
+#include <ctype.h>
+
+#include <algorithm>
+
+namespace netconnector {
+namespace mdns {
+namespace {
+
+// Returns the length of the key in a TXT string of the form "key" or
+// "key=value".
+size_t KeySize(const std::string& entry) {
+  size_t equals = entry.find('=');
+  return equals == std::string::npos ? entry.size() : equals;
+}
+
+bool KeysMatch(const std::string& a,
+               size_t a_size,
+               const std::string& b,
+               size_t b_size) {
+  if (a_size != b_size) {
+    return false;
+  }
+
+  for (size_t i = 0; i < a_size; ++i) {
+    if (tolower(static_cast<unsigned char>(a[i])) !=
+        tolower(static_cast<unsigned char>(b[i]))) {
+      return false;
+    }
+  }
+
+  return true;
+}
+
+// Determines whether the instance text entry |entry| satisfies |required|.
+bool EntryMatches(const std::string& required, const std::string& entry) {
+  size_t required_key_size = KeySize(required);
+  size_t entry_key_size = KeySize(entry);
+
+  if (!KeysMatch(required, required_key_size, entry, entry_key_size)) {
+    return false;
+  }
+
+  if (required_key_size == required.size()) {
+    // Just the key is required.
+    return true;
+  }
+
+  return required.compare(required_key_size, std::string::npos, entry,
+                          entry_key_size, std::string::npos) == 0;
+}
+
+}  // namespace
+
+bool ServiceFilter::MatchesText(const std::vector<std::string>& text) const {
+  for (const std::string& required : text_) {
+    if (std::none_of(text.begin(), text.end(),
+                     [&required](const std::string& entry) {
+                       return EntryMatches(required, entry);
+                     })) {
+      return false;
+    }
+  }
+
+  return true;
+}
+
+std::string ServiceFilter::ToString() const {
+  if (empty()) {
+    return std::string();
+  }
+
+  std::string result = " [";
+  if (!subtype_.empty()) {
+    result += "subtype " + subtype_;
+  }
+
+  // Entries are sorted so the order in which they were given doesn't matter.
+  std::vector<std::string> text = text_;
+  std::sort(text.begin(), text.end());
+
+  for (const std::string& entry : text) {
+    if (result.size() > 2) {
+      result += ", ";
+    }
+
+    result += "text " + entry;
+  }
+
+  return result + "]";
+}
+
+}  // namespace mdns
+}  // namespace netconnector
@@ -0,0 +1,38 @@
+// Copyright 2017 The Fuchsia Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#pragma once
+
+#include <string>
+#include <vector>
+
+namespace netconnector {
+namespace mdns {
+
+// Narrows a service subscription to the instances of interest. The default
+// filter passes every instance.
+struct ServiceFilter {
+  // Determines whether the filter passes every instance.
+  bool empty() const { return subtype_.empty() && text_.empty(); }
+
+  // Determines whether an instance with the specified text passes |text_|.
+  // Keys are compared without regard to case (RFC 6763 section 6.4).
+  bool MatchesText(const std::vector<std::string>& text) const;
+
+  // Returns a string that's the same for equivalent filters and empty for
+  // the default filter, used to tell subscriptions apart.
+  std::string ToString() const;
+
+  // A DNS-SD subtype such as "_printer" (RFC 6763 section 7.1). If not
+  // empty, only instances registered under the subtype are reported. The
+  // subtype is part of the query, so other instances aren't sent to us.
+  std::string subtype_;
+
+  // Entries the text of an instance must include. An entry "key" requires
+  // the key, with or without a value, and "key=value" requires that value.
+  std::vector<std::string> text_;
+};
+
+}  // namespace mdns
+}  // namespace netconnector
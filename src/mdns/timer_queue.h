@@ -0,0 +1,225 @@
+// Copyright 2017 The Fuchsia Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#pragma once
+
+#include <stdint.h>
+
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+#include "lib/ftl/logging.h"
+#include "lib/ftl/macros.h"
+#include "lib/ftl/time/time_point.h"
+
+namespace netconnector {
+namespace mdns {
+
+// A queue of values ordered by time. Values scheduled for the same time come
+// out in the order they were scheduled. The queue is a binary heap with an
+// index from id to heap position, so scheduled values can be cancelled or
+// rescheduled in O(log n) rather than lingering until they come due.
+template <typename T>
+class TimerQueue {
+ public:
+  using Id = uint64_t;
+
+  static constexpr Id kInvalidId = 0;
+
+  TimerQueue() {}
+
+  ~TimerQueue() {}
+
+  bool empty() const { return heap_.empty(); }
+
+  size_t size() const { return heap_.size(); }
+
+  // Returns the time of the earliest value. Must not be called when the queue
+  // is empty.
+  ftl::TimePoint top_time() const {
+    FTL_DCHECK(!empty());
+    return heap_.front().time_;
+  }
+
+  // Returns the earliest value. Must not be called when the queue is empty.
+  const T& top() const {
+    FTL_DCHECK(!empty());
+    return heap_.front().value_;
+  }
+
+  // Returns the time for which |id| is scheduled. |id| must be in the queue.
+  ftl::TimePoint time(Id id) const {
+    auto iter = positions_by_id_.find(id);
+    FTL_DCHECK(iter != positions_by_id_.end());
+    return heap_[iter->second].time_;
+  }
+
+  // Adds a value to the queue and returns its id.
+  Id Schedule(ftl::TimePoint time, T value) {
+    Id id = next_id_++;
+    heap_.emplace_back(time, next_sequence_++, id, std::move(value));
+    positions_by_id_[id] = heap_.size() - 1;
+    SiftUp(heap_.size() - 1);
+    return id;
+  }
+
+  // Changes the time of a scheduled value. Returns false if |id| isn't in the
+  // queue.
+  bool Reschedule(Id id, ftl::TimePoint time) {
+    auto iter = positions_by_id_.find(id);
+    if (iter == positions_by_id_.end()) {
+      return false;
+    }
+
+    size_t position = iter->second;
+    heap_[position].time_ = time;
+    heap_[position].sequence_ = next_sequence_++;
+    SiftDown(SiftUp(position));
+    return true;
+  }
+
+  // Removes a scheduled value. Returns false if |id| isn't in the queue.
+  bool Cancel(Id id) {
+    auto iter = positions_by_id_.find(id);
+    if (iter == positions_by_id_.end()) {
+      return false;
+    }
+
+    size_t position = iter->second;
+    positions_by_id_.erase(iter);
+    RemoveAt(position);
+    return true;
+  }
+
+  // Removes the earliest value and returns it. Must not be called when the
+  // queue is empty.
+  T Pop() {
+    FTL_DCHECK(!empty());
+    T value = std::move(heap_.front().value_);
+    positions_by_id_.erase(heap_.front().id_);
+    RemoveAt(0);
+    return value;
+  }
+
+  // Removes the values for which |predicate| returns true. |predicate| is
+  // called with the time and value of each entry. This is O(n).
+  template <typename Predicate>
+  void RemoveIf(Predicate predicate) {
+    size_t kept = 0;
+    for (size_t i = 0; i < heap_.size(); ++i) {
+      if (predicate(heap_[i].time_, const_cast<const T&>(heap_[i].value_))) {
+        positions_by_id_.erase(heap_[i].id_);
+      } else {
+        if (kept != i) {
+          heap_[kept] = std::move(heap_[i]);
+        }
+
+        ++kept;
+      }
+    }
+
+    if (kept == heap_.size()) {
+      return;
+    }
+
+    heap_.erase(heap_.begin() + kept, heap_.end());
+
+    for (size_t i = heap_.size() / 2; i-- > 0;) {
+      SiftDown(i);
+    }
+
+    for (size_t i = 0; i < heap_.size(); ++i) {
+      positions_by_id_[heap_[i].id_] = i;
+    }
+  }
+
+ private:
+  struct Node {
+    Node(ftl::TimePoint time, uint64_t sequence, Id id, T value)
+        : time_(time), sequence_(sequence), id_(id), value_(std::move(value)) {}
+
+    bool Before(const Node& other) const {
+      return time_ < other.time_ ||
+             (time_ == other.time_ && sequence_ < other.sequence_);
+    }
+
+    ftl::TimePoint time_;
+    uint64_t sequence_;
+    Id id_;
+    T value_;
+  };
+
+  // Removes the node at |position|, whose id has already been removed from
+  // |positions_by_id_|.
+  void RemoveAt(size_t position) {
+    size_t last = heap_.size() - 1;
+    if (position != last) {
+      heap_[position] = std::move(heap_[last]);
+      positions_by_id_[heap_[position].id_] = position;
+    }
+
+    heap_.pop_back();
+
+    if (position < heap_.size()) {
+      SiftDown(SiftUp(position));
+    }
+  }
+
+  // Moves the node at |position| toward the root as needed and returns its
+  // new position.
+  size_t SiftUp(size_t position) {
+    while (position != 0) {
+      size_t parent = (position - 1) / 2;
+      if (!heap_[position].Before(heap_[parent])) {
+        break;
+      }
+
+      Swap(position, parent);
+      position = parent;
+    }
+
+    return position;
+  }
+
+  // Moves the node at |position| toward the leaves as needed.
+  void SiftDown(size_t position) {
+    while (true) {
+      size_t first = position;
+      size_t left = position * 2 + 1;
+      size_t right = left + 1;
+
+      if (left < heap_.size() && heap_[left].Before(heap_[first])) {
+        first = left;
+      }
+
+      if (right < heap_.size() && heap_[right].Before(heap_[first])) {
+        first = right;
+      }
+
+      if (first == position) {
+        return;
+      }
+
+      Swap(position, first);
+      position = first;
+    }
+  }
+
+  void Swap(size_t a, size_t b) {
+    std::swap(heap_[a], heap_[b]);
+    positions_by_id_[heap_[a].id_] = a;
+    positions_by_id_[heap_[b].id_] = b;
+  }
+
+  std::vector<Node> heap_;
+  std::unordered_map<Id, size_t> positions_by_id_;
+  Id next_id_ = kInvalidId + 1;
+  uint64_t next_sequence_ = 0;
+
+  FTL_DISALLOW_COPY_AND_ASSIGN(TimerQueue);
+};
+
+}  // namespace mdns
+}  // namespace netconnector
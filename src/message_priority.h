@@ -0,0 +1,20 @@
+// Copyright 2017 The Fuchsia Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#pragma once
+
+#include <stdint.h>
+
+namespace netconnector {
+
+// Priority class for the packets of a logical channel. Packets of high
+// priority channels are written to the socket ahead of those of normal
+// priority channels, except that normal priority channels get a turn
+// periodically so they aren't starved.
+enum class MessagePriority : uint8_t {
+  kNormal,
+  kHigh,
+};
+
+}  // namespace netconnector
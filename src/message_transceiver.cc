@@ -5,56 +5,317 @@
 #include "apps/netconnector/src/message_transceiver.h"
 
 #include <errno.h>
+#include <fcntl.h>
 #include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/epoll.h>
 #include <sys/socket.h>
 #include <sys/types.h>
+#include <sys/uio.h>
+#include <unistd.h>
 
+#include <algorithm>
+#include <random>
+
+#include "apps/netconnector/lib/buffer_pool.h"
+#include "apps/netconnector/lib/vmo_message.h"
+#include "apps/netconnector/src/loop_monitor.h"
+#include "apps/netconnector/src/socket_reactor.h"
+#include "lib/ftl/functional/make_copyable.h"
 #include "lib/ftl/logging.h"
+#include "lib/ftl/synchronization/waitable_event.h"
 #include "lib/mtl/tasks/message_loop.h"
-#include "lib/mtl/threading/create_thread.h"
 
 namespace netconnector {
 
-MessageTransciever::MessageTransciever(ftl::UniqueFD socket_fd)
+// static
+const ftl::TimeDelta MessageTransciever::kConnectionAttemptDelay =
+    ftl::TimeDelta::FromMilliseconds(250);
+
+MessageTransciever::MessageTransciever(ftl::UniqueFD socket_fd,
+                                       bool direct_delivery)
+    : MessageTransciever(std::move(socket_fd),
+                         ftl::UniqueFD(),
+                         SocketAddress(),
+                         false,
+                         ftl::TimeDelta::Zero(),
+                         direct_delivery) {}
+
+MessageTransciever::MessageTransciever(ftl::UniqueFD socket_fd,
+                                       ftl::TimeDelta connect_timeout,
+                                       bool direct_delivery)
+    : MessageTransciever(std::move(socket_fd),
+                         ftl::UniqueFD(),
+                         SocketAddress(),
+                         true,
+                         connect_timeout,
+                         direct_delivery) {}
+
+MessageTransciever::MessageTransciever(ftl::UniqueFD socket_fd,
+                                       ftl::UniqueFD alternate_socket_fd,
+                                       const SocketAddress& alternate_address,
+                                       ftl::TimeDelta connect_timeout,
+                                       bool direct_delivery)
+    : MessageTransciever(std::move(socket_fd),
+                         std::move(alternate_socket_fd),
+                         alternate_address,
+                         true,
+                         connect_timeout,
+                         direct_delivery) {}
+
+MessageTransciever::MessageTransciever(ftl::UniqueFD socket_fd,
+                                       ftl::UniqueFD alternate_socket_fd,
+                                       const SocketAddress& alternate_address,
+                                       bool connecting,
+                                       ftl::TimeDelta connect_timeout,
+                                       bool direct_delivery)
     : socket_fd_(std::move(socket_fd)),
+      direct_delivery_(direct_delivery),
+      tracing_(LatencyTracer::Get()->enabled()),
       task_runner_(mtl::MessageLoop::GetCurrent()->task_runner()),
-      receive_buffer_(kRecvBufferSize) {
+      creation_time_(ftl::TimePoint::Now()),
+      resumption_enabled_(false),
+      initiate_session_(false),
+      connecting_(connecting),
+      alternate_socket_fd_(std::move(alternate_socket_fd)),
+      alternate_address_(alternate_address),
+      receive_buffer_(kMinRecvBufferSize),
+      send_queue_drain_pending_(false),
+      max_send_batch_bytes_(kDefaultMaxSendBatchBytes),
+      max_send_batch_packets_(kDefaultMaxSendBatchPackets),
+      bytes_sent_(0),
+      bytes_received_(0),
+      messages_received_(0),
+      send_stalls_(0),
+      messages_expired_(0),
+      heartbeat_rtt_ns_(0) {
   FTL_DCHECK(socket_fd_.is_valid());
   FTL_DCHECK(task_runner_);
 
-  message_relay_.SetMessageReceivedCallback([this](
-      std::vector<uint8_t> message) { SendMessage(std::move(message)); });
+  int flags = fcntl(socket_fd_.get(), F_GETFL, 0);
+  if (flags < 0 ||
+      fcntl(socket_fd_.get(), F_SETFL, flags | O_NONBLOCK) < 0) {
+    FTL_LOG(ERROR) << "Failed to make socket non-blocking, errno " << errno;
+  }
+
+  if (alternate_socket_fd_.is_valid()) {
+    FTL_DCHECK(connecting_);
+    FTL_DCHECK(alternate_address_.is_valid());
+    flags = fcntl(alternate_socket_fd_.get(), F_GETFL, 0);
+    if (flags < 0 ||
+        fcntl(alternate_socket_fd_.get(), F_SETFL, flags | O_NONBLOCK) < 0) {
+      FTL_LOG(ERROR) << "Failed to make alternate socket non-blocking, errno "
+                     << errno;
+      alternate_socket_fd_.reset();
+    }
+  }
+
+  io_self_ = std::make_shared<MessageTransciever*>(this);
+  main_self_ = std::make_shared<MessageTransciever*>(this);
+  main_weak_self_ = main_self_;
+  io_task_runner_ = SocketReactor::Get()->AssignThread();
 
-  message_relay_.SetChannelClosedCallback([this]() { CloseConnection(); });
+  if (direct_delivery_) {
+    // Messages for the primary channel may arrive before the channel is
+    // supplied, so the direct channel is created up front to queue them.
+    io_task_runner_->PostTask(
+        [this]() { GetDirectChannel(kPrimaryChannelId); });
+  }
 
-  receive_thread_ = std::thread([this]() { ReceiveWorker(); });
-  send_thread_ = mtl::CreateThread(&send_task_runner_);
+  if (connecting_) {
+    io_task_runner_->PostTask(
+        [this, connect_timeout]() { WaitForConnected(connect_timeout); });
+  } else {
+    io_task_runner_->PostTask([this]() { WaitForReadable(); });
+  }
 
   SendVersionPacket();
 }
 
 MessageTransciever::~MessageTransciever() {
-  send_task_runner_->PostTask(
-      []() { mtl::MessageLoop::GetCurrent()->QuitNow(); });
+  // Tasks the I/O thread posted to the main thread that haven't run yet find
+  // this reset and do nothing.
+  main_self_.reset();
+
+  // Cancel the waits on the I/O thread and wait until that's done. Tasks
+  // referencing this transceiver that were posted to the I/O thread earlier
+  // run before this one.
+  ftl::AutoResetWaitableEvent cancelled;
+  io_task_runner_->PostTask([this, &cancelled]() {
+    read_waiter_.Cancel();
+    write_waiter_.Cancel();
+    alternate_waiter_.Cancel();
+    direct_channels_.clear();
+    io_self_.reset();
+    cancelled.Signal();
+  });
+  cancelled.Wait();
+}
+
+void MessageTransciever::PostToMain(ftl::Closure task) {
+  std::weak_ptr<MessageTransciever*> weak_self = main_weak_self_;
+  task_runner_->PostTask(
+      ftl::MakeCopyable([ weak_self, task = std::move(task) ]() mutable {
+        if (!weak_self.expired()) {
+          task();
+        }
+      }));
+}
+
+TransceiverStats MessageTransciever::GetStats() const {
+  TransceiverStats stats;
+  stats.lifetime_ = ftl::TimePoint::Now() - creation_time_;
+  stats.bytes_sent_ = bytes_sent_.load(std::memory_order_relaxed);
+  stats.bytes_received_ = bytes_received_.load(std::memory_order_relaxed);
+  stats.messages_sent_ = messages_sent_;
+  stats.messages_received_ =
+      messages_received_.load(std::memory_order_relaxed);
+  stats.messages_expired_ = messages_expired_.load(std::memory_order_relaxed) +
+                            released_relay_messages_expired_;
+  stats.send_stalls_ = send_stalls_.load(std::memory_order_relaxed);
+  stats.receive_pauses_ = receive_pauses_;
+  stats.channel_count_ = channels_.size();
+  stats.heartbeat_rtt_ = ftl::TimeDelta::FromNanoseconds(
+      heartbeat_rtt_ns_.load(std::memory_order_relaxed));
+
+  for (auto& pair : channels_) {
+    stats.send_queue_bytes_ += pair.second.send_queue_bytes_;
+    if (pair.second.relay_) {
+      stats.receive_queue_bytes_ += pair.second.relay_->write_queue_bytes();
+      stats.messages_expired_ += pair.second.relay_->messages_expired();
+    }
+  }
+
+  return stats;
+}
+
+size_t MessageTransciever::LogicalChannelCount(
+    const std::string& service_name) const {
+  size_t count = 0;
+  for (auto& pair : channels_) {
+    if (pair.first == kPrimaryChannelId) {
+      continue;
+    }
+
+    auto iter = channel_service_names_.find(pair.first);
+    if (iter != channel_service_names_.end() && iter->second == service_name) {
+      ++count;
+    }
+  }
 
-  if (receive_thread_.joinable()) {
-    receive_thread_.join();
+  return count;
+}
+
+void MessageTransciever::Heartbeat(uint32_t max_missed) {
+  FTL_DCHECK(max_missed != 0);
+
+  if (connection_closed_ || suspended_ ||
+      negotiated_version_ < kHeartbeatVersion) {
+    return;
   }
 
-  if (send_thread_.joinable()) {
-    send_thread_.join();
+  // Any traffic from the remote party shows it's alive, not just pongs. While
+  // receipt is paused, we can't tell, so misses aren't counted. Receipt may
+  // be paused by a full relay write queue or, with direct delivery, by a
+  // full channel on the I/O thread.
+  uint64_t bytes_received = bytes_received_.load(std::memory_order_relaxed);
+  if (bytes_received != heartbeat_bytes_received_ ||
+      full_write_queue_count_ != 0 ||
+      receive_pause_count_.load(std::memory_order_relaxed) != 0) {
+    heartbeats_missed_ = 0;
+  } else if (ping_sent_ && ++heartbeats_missed_ >= max_missed) {
+    FTL_LOG(WARNING) << "Remote party hasn't responded to "
+                     << heartbeats_missed_ << " heartbeats, abandoning socket";
+    heartbeats_missed_ = 0;
+    ping_sent_ = false;
+    // The connection is suspended rather than closed if it has a session.
+    io_task_runner_->PostTask([this]() { OnSocketFailed(); });
+    return;
+  }
+
+  heartbeat_bytes_received_ = bytes_received;
+
+  std::vector<uint8_t> payload;
+  AppendUint64(ftl::TimePoint::Now().ToEpochDelta().ToNanoseconds(), &payload);
+  EnqueuePacket(PacketType::kPing, kPrimaryChannelId, std::move(payload));
+  ping_sent_ = true;
+}
+
+ftl::UniqueFD MessageTransciever::DetachSocket() {
+  ftl::UniqueFD socket_fd;
+  ftl::AutoResetWaitableEvent detached;
+  io_task_runner_->PostTask([this, &socket_fd, &detached]() {
+    // If our version packet hasn't been written, the remote party would
+    // receive part of it on the resumed connection.
+    if (socket_fd_.is_valid() && send_packets_.empty()) {
+      socket_fd.reset(dup(socket_fd_.get()));
+    }
+
+    CloseSocket();
+    detached.Signal();
+  });
+  detached.Wait();
+
+  connection_closed_ = true;
+  return socket_fd;
+}
+
+void MessageTransciever::ResumeConnected(ftl::UniqueFD socket_fd,
+                                         uint64_t received_count) {
+  FTL_DCHECK(socket_fd.is_valid());
+
+  if (connection_closed_) {
+    return;
   }
+
+  io_task_runner_->PostTask(ftl::MakeCopyable([
+    this, socket_fd = std::move(socket_fd), received_count,
+    profile = transport_profile_
+  ]() mutable {
+    // The remote party has given up on the old socket, even if we haven't.
+    if (socket_fd_.is_valid() && !SuspendSocket()) {
+      CloseSocket();
+      return;
+    }
+
+    if (!socket_suspended_) {
+      // The connection has closed.
+      return;
+    }
+
+    socket_fd_ = std::move(socket_fd);
+    socket_suspended_ = false;
+    ResetReceiveState();
+    SetSocketOptions(socket_fd_.get(), profile);
+
+    if (!Replay(received_count)) {
+      CloseSocket();
+      return;
+    }
+
+    // The resume packet goes ahead of the replayed packets.
+    std::vector<uint8_t> payload;
+    AppendUint64(session_id_, &payload);
+    AppendUint64(received_sequence_, &payload);
+    acknowledged_sequence_ = received_sequence_;
+
+    WaitForReadable();
+    PushControlPacket(
+        OutboundPacket(PacketType::kResume, kPrimaryChannelId, payload));
+    PostToMain([this]() { OnSocketResumed(); });
+  }));
 }
 
 void MessageTransciever::SetChannel(mx::channel channel) {
   FTL_DCHECK(channel);
 
-  if (!socket_fd_.is_valid()) {
+  if (connection_closed_) {
     return;
   }
 
-  if (version_ != kNullVersion) {
-    message_relay_.SetChannel(std::move(channel));
+  if (negotiated_version_ != kNullVersion) {
+    AttachRelay(kPrimaryChannelId, std::move(channel));
   } else {
     // Version exchange hasn't occurred yet. Postpone setting the channel on the
     // relay until it does, because we don't want messages sent over the network
@@ -63,265 +324,2119 @@ void MessageTransciever::SetChannel(mx::channel channel) {
   }
 }
 
+void MessageTransciever::SetChannelEarly(mx::channel channel) {
+  FTL_DCHECK(channel);
+
+  if (connection_closed_) {
+    return;
+  }
+
+  AttachRelay(kPrimaryChannelId, std::move(channel));
+}
+
+void MessageTransciever::SetChannel(uint16_t channel_id, mx::channel channel) {
+  FTL_DCHECK(channel);
+  FTL_DCHECK(channel_id != kPrimaryChannelId);
+  FTL_DCHECK(is_multiplexed());
+
+  if (connection_closed_) {
+    return;
+  }
+
+  AttachRelay(channel_id, std::move(channel));
+}
+
+void MessageTransciever::OpenChannel(const std::string& service_name,
+                                     mx::channel channel) {
+  FTL_DCHECK(!service_name.empty());
+  FTL_DCHECK(channel);
+  FTL_DCHECK(is_multiplexed());
+
+  if (connection_closed_) {
+    FTL_LOG(WARNING) << "OpenChannel called with closed connection";
+    return;
+  }
+
+  uint16_t channel_id = AllocateChannelId();
+  SetChannelServiceName(channel_id, service_name);
+  EnqueuePacket(PacketType::kOpenChannel, channel_id,
+                std::vector<uint8_t>(service_name.begin(), service_name.end()));
+  AttachRelay(channel_id, std::move(channel));
+}
+
+void MessageTransciever::SendSharedMessage(const std::string& service_name,
+                                           SharedMessage message,
+                                           const DeliveryCallback& callback) {
+  FTL_DCHECK(!service_name.empty());
+  FTL_DCHECK(message && !message->empty());
+  FTL_DCHECK(message->size() <= kMaxPayloadSize);
+  FTL_DCHECK(callback);
+  FTL_DCHECK(is_multiplexed());
+
+  if (connection_closed_) {
+    callback(false);
+    return;
+  }
+
+  // No relay is attached to the channel. Anything the remote party sends on
+  // it is discarded.
+  uint16_t channel_id = AllocateChannelId();
+  SetChannelServiceName(channel_id, service_name);
+  delivery_callbacks_[channel_id] = callback;
+
+  EnqueuePacket(PacketType::kOpenChannel, channel_id,
+                std::vector<uint8_t>(service_name.begin(), service_name.end()));
+
+  OutboundPacket packet(PacketType::kMessage, channel_id, std::move(message));
+  packet.priority_ = ChannelPriority(channel_id);
+  ++messages_sent_;
+  send_queue_.Push(std::move(packet));
+
+  EnqueuePacket(PacketType::kCloseChannel, channel_id, std::vector<uint8_t>());
+  channel_service_names_.erase(channel_id);
+  channel_priorities_.erase(channel_id);
+
+  if (direct_delivery_) {
+    // The drain that picks up the open channel packet, creating a direct
+    // channel for it, runs before this task.
+    io_task_runner_->PostTask(
+        [this, channel_id]() { ReleaseDirectChannel(channel_id); });
+  }
+}
+
 void MessageTransciever::SendServiceName(const std::string& service_name) {
-  if (!socket_fd_.is_valid()) {
+  // |socket_fd_| belongs to the I/O thread. While the connection is
+  // suspended, packets are queued and sent once the session resumes.
+  if (connection_closed_) {
     FTL_LOG(WARNING) << "SendServiceName called with closed connection";
     return;
   }
 
-  send_task_runner_->PostTask([ this, service_name = service_name ]() {
-    SendPacket(PacketType::kServiceName, service_name.data(),
-               service_name.size());
-  });
+  SetChannelServiceName(kPrimaryChannelId, service_name);
+  EnqueuePacket(PacketType::kServiceName, kPrimaryChannelId,
+                std::vector<uint8_t>(service_name.begin(), service_name.end()));
 }
 
 void MessageTransciever::SendMessage(std::vector<uint8_t> message) {
-  if (!socket_fd_.is_valid()) {
+  // Messages sent while suspended are queued for replay, as above.
+  if (connection_closed_) {
     FTL_LOG(WARNING) << "SendMessage called with closed connection";
     return;
   }
 
-  send_task_runner_->PostTask([ this, m = std::move(message) ]() {
-    SendPacket(PacketType::kMessage, m.data(), m.size());
-  });
+  SendChannelMessage(kPrimaryChannelId, std::move(message));
+}
+
+void MessageTransciever::SetSendBatchLimits(size_t max_bytes,
+                                            size_t max_packets) {
+  if (max_bytes != 0) {
+    max_send_batch_bytes_ = max_bytes;
+  }
+
+  if (max_packets != 0) {
+    max_send_batch_packets_ =
+        max_packets < kMaxSendBatchPackets ? max_packets : kMaxSendBatchPackets;
+  }
 }
 
 void MessageTransciever::CloseConnection() {
-  if (socket_fd_.is_valid()) {
-    socket_fd_.reset();
-    task_runner_->PostTask([this]() {
-      channel_.reset();
-      message_relay_.CloseChannel();
-      OnConnectionClosed();
-    });
+  if (io_task_runner_->RunsTasksOnCurrentThread()) {
+    CloseSocket();
+  } else {
+    connection_closed_ = true;
+    io_task_runner_->PostTask([this]() { CloseSocket(); });
+  }
+}
+
+void MessageTransciever::EnableResumption(bool initiate) {
+  initiate_session_ = initiate;
+  resumption_enabled_ = true;
+}
+
+void MessageTransciever::SetDeviceTokenBucket(
+    std::shared_ptr<TokenBucket> token_bucket) {
+  io_task_runner_->PostTask([this, token_bucket]() {
+    device_token_bucket_ = token_bucket;
+  });
+}
+
+void MessageTransciever::ResumeConnecting(ftl::UniqueFD socket_fd,
+                                          ftl::TimeDelta connect_timeout) {
+  FTL_DCHECK(socket_fd.is_valid());
+
+  if (connection_closed_) {
+    return;
   }
+
+  io_task_runner_->PostTask(ftl::MakeCopyable([
+    this, socket_fd = std::move(socket_fd), connect_timeout,
+    profile = transport_profile_
+  ]() mutable {
+    if (!socket_suspended_) {
+      // The connection has closed.
+      return;
+    }
+
+    socket_fd_ = std::move(socket_fd);
+    socket_suspended_ = false;
+    resume_handshake_ = true;
+    connecting_ = true;
+    ResetReceiveState();
+    SetSocketOptions(socket_fd_.get(), profile);
+    WaitForConnected(connect_timeout);
+  }));
 }
 
 void MessageTransciever::OnMessageReceived(std::vector<uint8_t> message) {
-  message_relay_.SendMessage(std::move(message));
+  OnChannelMessageReceived(kPrimaryChannelId, std::move(message));
 }
 
 void MessageTransciever::OnConnectionClosed() {}
 
-void MessageTransciever::SendVersionPacket() {
-  send_task_runner_->PostTask([this]() {
-    uint32_t version = htonl(kVersion);
-    SendPacket(PacketType::kVersion, &version, sizeof(version));
-  });
+void MessageTransciever::OnIdle() {
+  CloseConnection();
 }
 
-void MessageTransciever::SendPacket(PacketType type,
-                                    const void* payload,
-                                    size_t payload_size) {
-  FTL_DCHECK(payload_size == 0 || payload != nullptr);
+void MessageTransciever::OnConnectionSuspended() {
+  CloseConnection();
+}
 
-  PacketHeader packet_header;
+void MessageTransciever::OnResumeRequested(uint64_t session_id,
+                                           uint64_t received_count) {
+  CloseConnection();
+}
 
-  packet_header.sentinel_ = kSentinel;
-  packet_header.type_ = type;
-  packet_header.channel_ = 0;
-  packet_header.payload_size_ = htonl(payload_size);
+Watermarks MessageTransciever::GetWatermarks(const std::string& service_name) {
+  return Watermarks();
+}
 
-  int result = send(socket_fd_.get(), &packet_header, sizeof(packet_header), 0);
-  if (result == -1) {
-    FTL_LOG(ERROR) << "Failed to send, errno " << errno;
-    CloseConnection();
-    return;
+size_t MessageTransciever::GetVmoThreshold(const std::string& service_name) {
+  return 0;
+}
+
+ftl::TimeDelta MessageTransciever::GetMessageLifetime(
+    const std::string& service_name) {
+  return ftl::TimeDelta::Zero();
+}
+
+std::shared_ptr<TokenBucket> MessageTransciever::GetTokenBucket(
+    const std::string& service_name) {
+  return nullptr;
+}
+
+TransportProfile MessageTransciever::GetTransportProfile(
+    const std::string& service_name) {
+  return TransportProfile::Default();
+}
+
+MessagePriority MessageTransciever::GetPriority(
+    const std::string& service_name) {
+  return MessagePriority::kNormal;
+}
+
+void MessageTransciever::OnRoundTripMeasured(ftl::TimeDelta rtt) {}
+
+void MessageTransciever::OnThroughputMeasured(uint64_t bytes,
+                                              ftl::TimeDelta duration) {}
+
+// static
+bool MessageTransciever::IsSequenced(PacketType type) {
+  return type != PacketType::kVersion && type != PacketType::kPing &&
+         type != PacketType::kPong && type != PacketType::kSession &&
+         type != PacketType::kAcknowledge && type != PacketType::kResume;
+}
+
+// static
+void MessageTransciever::AppendUint64(uint64_t value,
+                                      std::vector<uint8_t>* payload) {
+  FTL_DCHECK(payload != nullptr);
+  for (int shift = 56; shift >= 0; shift -= 8) {
+    payload->push_back(static_cast<uint8_t>(value >> shift));
   }
+}
 
-  FTL_DCHECK(result == static_cast<int>(sizeof(packet_header)));
+void MessageTransciever::SendVersionPacket() {
+  uint32_t version = htonl(kVersion);
+  const uint8_t* bytes = reinterpret_cast<const uint8_t*>(&version);
+  EnqueuePacket(PacketType::kVersion, kPrimaryChannelId,
+                std::vector<uint8_t>(bytes, bytes + sizeof(version)));
+}
 
-  if (payload_size == 0) {
-    return;
+void MessageTransciever::EnqueuePacket(PacketType type,
+                                       uint16_t channel_id,
+                                       std::vector<uint8_t> payload) {
+  OutboundPacket packet(type, channel_id, std::move(payload));
+  packet.priority_ = ChannelPriority(channel_id);
+  if (type == PacketType::kMessage) {
+    if (tracing_) {
+      packet.enqueue_time_ = ftl::TimePoint::Now();
+    }
+
+    packet.deadline_ = MessageDeadline(channel_id);
   }
 
-  result = send(socket_fd_.get(), payload, payload_size, 0);
-  if (result == -1) {
-    FTL_LOG(ERROR) << "Failed to send, errno " << errno;
-    CloseConnection();
-    return;
+  send_queue_.Push(std::move(packet));
+  ScheduleDrain();
+}
+
+void MessageTransciever::EnqueueMessagePackets(
+    uint16_t channel_id,
+    std::vector<std::vector<uint8_t>> messages) {
+  ftl::TimePoint enqueue_time =
+      tracing_ ? ftl::TimePoint::Now() : ftl::TimePoint();
+  MessagePriority priority = ChannelPriority(channel_id);
+  ftl::TimePoint deadline = MessageDeadline(channel_id);
+  for (std::vector<uint8_t>& message : messages) {
+    OutboundPacket packet(PacketType::kMessage, channel_id,
+                          std::move(message));
+    packet.priority_ = priority;
+    packet.enqueue_time_ = enqueue_time;
+    packet.deadline_ = deadline;
+    send_queue_.Push(std::move(packet));
   }
 
-  FTL_DCHECK(result == static_cast<int>(payload_size));
+  ScheduleDrain();
 }
 
-void MessageTransciever::ReceiveWorker() {
-  while (true) {
-    int result = recv(socket_fd_.get(), receive_buffer_.data(),
-                      receive_buffer_.size(), 0);
-    if (result == -1) {
-      // If we got EIO and socket_fd_ isn't valid, recv failed because the
-      // socket was closed locally.
-      if (errno != EIO || socket_fd_.is_valid()) {
-        FTL_LOG(ERROR) << "Failed to receive, errno " << errno;
-      }
+void MessageTransciever::ScheduleDrain() {
+  // Packets pushed before the drain task runs are picked up by the same
+  // drain, so we only post when a drain isn't already pending. The exchanges
+  // here and in DrainSendQueue order the pushes with the drain, so a packet
+  // is never left in the queue without a drain to pick it up.
+  if (!send_queue_drain_pending_.exchange(true, std::memory_order_acq_rel)) {
+    io_task_runner_->PostTask([this]() { DrainSendQueue(); });
+  }
+}
 
-      CloseConnection();
-      break;
-    }
+void MessageTransciever::AttachRelay(uint16_t channel_id, mx::channel channel) {
+  FTL_DCHECK(channel);
 
-    if (result == 0) {
-      // The remote party closed the connection.
+  Channel& logical_channel = channels_[channel_id];
+  if (logical_channel.relay_) {
+    FTL_LOG(ERROR) << "Channel id " << channel_id << " already in use";
+    CloseConnection();
+    return;
+  }
+
+  logical_channel.watermarks_ =
+      GetWatermarks(channel_service_names_[channel_id]);
+  size_t vmo_threshold = GetVmoThreshold(channel_service_names_[channel_id]);
+  logical_channel.message_lifetime_ =
+      GetMessageLifetime(channel_service_names_[channel_id]);
+
+  std::shared_ptr<TokenBucket> token_bucket =
+      GetTokenBucket(channel_service_names_[channel_id]);
+  if (token_bucket) {
+    logical_channel.rate_limited_ = true;
+    io_task_runner_->PostTask([this, channel_id, token_bucket]() {
+      channel_token_buckets_[channel_id] = token_bucket;
+    });
+  }
+  ApplyTransportProfile(
+      GetTransportProfile(channel_service_names_[channel_id]));
+
+  if (direct_delivery_) {
+    // The I/O thread writes received messages to its own handle for the
+    // channel, and the relay only reads.
+    mx::channel direct_channel;
+    mx_status_t status =
+        channel.duplicate(MX_RIGHT_SAME_RIGHTS, &direct_channel);
+    if (status != NO_ERROR) {
+      FTL_LOG(ERROR) << "Failed to duplicate channel, status " << status;
+      channels_.erase(channel_id);
       CloseConnection();
-      break;
+      return;
     }
 
-    ParseReceivedBytes(result);
+    io_task_runner_->PostTask(ftl::MakeCopyable([
+      this, channel_id, watermarks = logical_channel.watermarks_,
+      vmo_threshold, message_lifetime = logical_channel.message_lifetime_,
+      direct_channel = std::move(direct_channel)
+    ]() mutable {
+      InstallDirectChannel(channel_id, std::move(direct_channel), watermarks,
+                           vmo_threshold, message_lifetime);
+    }));
   }
+  logical_channel.relay_.reset(new MessageRelay());
+  MessageRelay* relay = logical_channel.relay_.get();
+
+  relay->SetMessagesReceivedCallback(
+      [this, channel_id](std::vector<std::vector<uint8_t>> messages) {
+        LoopMonitor::ScopedTask task(LoopMonitor::Category::kRelayRead);
+        SendChannelMessages(channel_id, std::move(messages));
+      });
+
+  relay->SetChannelClosedCallback(
+      [this, channel_id]() { OnRelayClosed(channel_id); });
+
+  relay->SetWriteQueueFullCallback([this, channel_id](bool full) {
+    OnRelayWriteQueueFull(channel_id, full);
+  });
+
+  relay->SetWriteQueueWatermarks(logical_channel.watermarks_.high_,
+                                 logical_channel.watermarks_.low_);
+  relay->SetVmoThreshold(vmo_threshold);
+  // Larger messages couldn't be fragmented, so they close the channel they
+  // came from rather than tripping up the connection.
+  relay->SetMaxVmoMessageSize(kMaxMessageSize);
+  relay->SetMessageLifetime(logical_channel.message_lifetime_);
+
+  relay->SetChannel(std::move(channel));
 }
 
-// Determines whether the indicated field in the packet header has been
-// received.
-#define PacketHeaderFieldReceived(field)                        \
-  (receive_packet_offset_ >=                                    \
-   (reinterpret_cast<uint8_t*>(&receive_packet_header_.field) - \
-    reinterpret_cast<uint8_t*>(&receive_packet_header_)) +      \
-       sizeof(receive_packet_header_.field))
+void MessageTransciever::ApplyTransportProfile(
+    const TransportProfile& profile) {
+  TransportProfile merged = transport_profile_;
+  merged.Merge(profile);
+  if (merged == transport_profile_) {
+    return;
+  }
+
+  transport_profile_ = merged;
+  io_task_runner_->PostTask([this, merged]() { SetSocketOptions(merged); });
+}
 
-void MessageTransciever::ParseReceivedBytes(size_t byte_count) {
-  uint8_t* bytes = receive_buffer_.data();
+void MessageTransciever::SetSocketOptions(const TransportProfile& profile) {
+  if (!socket_fd_.is_valid()) {
+    return;
+  }
 
-  while (byte_count != 0) {
-    if (receive_packet_offset_ < sizeof(receive_packet_header_)) {
-      bool header_complete =
-          CopyReceivedBytes(&bytes, &byte_count,
-                            reinterpret_cast<uint8_t*>(&receive_packet_header_),
-                            sizeof(receive_packet_header_), 0);
-
-      if (PacketHeaderFieldReceived(sentinel_) &&
-          receive_packet_header_.sentinel_ != kSentinel) {
-        FTL_LOG(ERROR) << "Received bad packet sentinel "
-                       << receive_packet_header_.sentinel_;
-        CloseConnection();
-        return;
-      }
+  SetSocketOptions(socket_fd_.get(), profile);
 
-      if (PacketHeaderFieldReceived(type_) &&
-          receive_packet_header_.type_ > PacketType::kMax) {
-        FTL_LOG(ERROR) << "Received bad packet type "
-                       << static_cast<uint8_t>(receive_packet_header_.type_);
-        CloseConnection();
-        return;
-      }
+  // The alternate socket may yet replace |socket_fd_|.
+  if (alternate_socket_fd_.is_valid()) {
+    SetSocketOptions(alternate_socket_fd_.get(), profile);
+  }
+}
 
-      // If we ever use channel_, we'll need to make sure we fix its byte
-      // order exactly once. For now, 0 is 0 regardless of byte order.
-      if (PacketHeaderFieldReceived(channel_) &&
-          receive_packet_header_.channel_ != 0) {
-        FTL_LOG(ERROR) << "Received bad channel id "
-                       << receive_packet_header_.channel_;
-        CloseConnection();
-        return;
-      }
+// static
+void MessageTransciever::SetSocketOptions(int fd,
+                                          const TransportProfile& profile) {
+  // Failures here are logged but otherwise ignored, because the connection
+  // still works with the system defaults.
+  int value = profile.no_delay_ ? 1 : 0;
+  if (setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &value, sizeof(value)) < 0) {
+    FTL_LOG(WARNING) << "Failed to set TCP_NODELAY, errno " << errno;
+  }
 
-      if (header_complete) {
-        receive_packet_header_.payload_size_ =
-            ntohl(receive_packet_header_.payload_size_);
-        if (receive_packet_header_.payload_size_ > kMaxPayloadSize) {
-          FTL_LOG(ERROR) << "Received bad payload size "
-                         << receive_packet_header_.payload_size_;
-          CloseConnection();
-          return;
-        }
+  value = profile.keep_alive_ ? 1 : 0;
+  if (setsockopt(fd, SOL_SOCKET, SO_KEEPALIVE, &value, sizeof(value)) < 0) {
+    FTL_LOG(WARNING) << "Failed to set SO_KEEPALIVE, errno " << errno;
+  }
 
-        receive_packet_payload_.resize(receive_packet_header_.payload_size_);
-      }
+  if (profile.send_buffer_size_ != 0) {
+    value = static_cast<int>(profile.send_buffer_size_);
+    if (setsockopt(fd, SOL_SOCKET, SO_SNDBUF, &value, sizeof(value)) < 0) {
+      FTL_LOG(WARNING) << "Failed to set SO_SNDBUF, errno " << errno;
     }
+  }
 
-    if (CopyReceivedBytes(&bytes, &byte_count, receive_packet_payload_.data(),
-                          receive_packet_payload_.size(),
-                          sizeof(PacketHeader))) {
-      // Packet complete.
-      receive_packet_offset_ = 0;
-      OnReceivedPacketComplete();
+  if (profile.receive_buffer_size_ != 0) {
+    value = static_cast<int>(profile.receive_buffer_size_);
+    if (setsockopt(fd, SOL_SOCKET, SO_RCVBUF, &value, sizeof(value)) < 0) {
+      FTL_LOG(WARNING) << "Failed to set SO_RCVBUF, errno " << errno;
     }
   }
 }
 
-bool MessageTransciever::CopyReceivedBytes(uint8_t** bytes,
-                                           size_t* byte_count,
-                                           uint8_t* dest,
-                                           size_t dest_size,
-                                           size_t dest_packet_offset) {
-  FTL_DCHECK(bytes != nullptr);
-  FTL_DCHECK(*bytes != nullptr);
-  FTL_DCHECK(byte_count != nullptr);
-  FTL_DCHECK(dest != nullptr);
-  FTL_DCHECK(dest_size != 0);
-  FTL_DCHECK(dest_packet_offset <= receive_packet_offset_);
-  FTL_DCHECK(receive_packet_offset_ < dest_packet_offset + dest_size);
+void MessageTransciever::SendChannelMessage(uint16_t channel_id,
+                                            std::vector<uint8_t> message) {
+  FTL_DCHECK(message.size() <= kMaxMessageSize);
+  ++messages_sent_;
+  AddChannelSendQueueBytes(channel_id, message.size());
+  EnqueuePacket(PacketType::kMessage, channel_id, std::move(message));
+}
 
-  size_t dest_offset = receive_packet_offset_ - dest_packet_offset;
-  size_t bytes_to_copy = std::min(*byte_count, dest_size - dest_offset);
+void MessageTransciever::SendChannelMessages(
+    uint16_t channel_id,
+    std::vector<std::vector<uint8_t>> messages) {
+  size_t byte_count = 0;
+  for (const std::vector<uint8_t>& message : messages) {
+    FTL_DCHECK(message.size() <= kMaxMessageSize);
+    byte_count += message.size();
+  }
 
-  if (bytes_to_copy != 0) {
-    std::memcpy(dest + dest_offset, *bytes, bytes_to_copy);
+  messages_sent_ += messages.size();
+  AddChannelSendQueueBytes(channel_id, byte_count);
+  EnqueueMessagePackets(channel_id, std::move(messages));
+}
 
-    *byte_count -= bytes_to_copy;
-    *bytes += bytes_to_copy;
-    dest_offset += bytes_to_copy;
-    receive_packet_offset_ += bytes_to_copy;
+void MessageTransciever::AddChannelSendQueueBytes(uint16_t channel_id,
+                                                  size_t byte_count) {
+  auto iter = channels_.find(channel_id);
+  if (iter == channels_.end()) {
+    return;
   }
 
-  return dest_offset == dest_size;
+  Channel& logical_channel = iter->second;
+  logical_channel.send_queue_bytes_ += byte_count;
+
+  // Stop reading from the channel until the socket catches up.
+  if (!logical_channel.reading_paused_ &&
+      logical_channel.send_queue_bytes_ >= logical_channel.watermarks_.high_) {
+    logical_channel.reading_paused_ = true;
+    logical_channel.relay_->PauseReading();
+  }
 }
 
-void MessageTransciever::OnReceivedPacketComplete() {
-  switch (receive_packet_header_.type_) {
-    case PacketType::kVersion:
-      if (version_ != kNullVersion) {
-        FTL_LOG(ERROR) << "Version packet received out of order";
-        CloseConnection();
-        return;
-      }
+void MessageTransciever::OnMessagesSent(
+    const std::vector<std::pair<uint16_t, size_t>>& sent,
+    const std::vector<SendTrace>& traces) {
+  for (const SendTrace& trace : traces) {
+    auto iter = channel_service_names_.find(trace.channel_id_);
+    if (iter == channel_service_names_.end()) {
+      continue;
+    }
 
-      if (receive_packet_header_.payload_size_ != sizeof(uint32_t)) {
-        FTL_LOG(ERROR) << "Version packet has bad payload size "
-                       << receive_packet_header_.payload_size_;
-        CloseConnection();
-        return;
-      }
+    LatencyTracer* tracer = LatencyTracer::Get();
+    tracer->Record(iter->second, LatencyTracer::Stage::kSendQueue,
+                   trace.drain_time_ - trace.enqueue_time_);
+    tracer->Record(iter->second, LatencyTracer::Stage::kSendWrite,
+                   trace.write_time_ - trace.drain_time_);
+  }
 
-      version_ = ParsePayloadUint32();
+  for (auto& pair : sent) {
+    auto iter = channels_.find(pair.first);
+    if (iter == channels_.end()) {
+      // The channel may be one on which a shared message was sent.
+      CompleteDelivery(pair.first, true);
+      continue;
+    }
 
-      if (version_ < kMinSupportedVersion) {
-        FTL_LOG(ERROR) << "Unsupported version " << version_;
-        CloseConnection();
-        return;
-      }
+    Channel& logical_channel = iter->second;
+    FTL_DCHECK(logical_channel.send_queue_bytes_ >= pair.second);
+    logical_channel.send_queue_bytes_ -= pair.second;
 
-      task_runner_->PostTask([ this, version = version_ ]() {
-        OnVersionReceived(version);
-        if (socket_fd_.is_valid() && channel_) {
-          // We've postponed setting the channel on the relay until now, because
-          // we don't want messages sent over the network until the version of
-          // the remote party is known.
-          message_relay_.SetChannel(std::move(channel_));
-        }
-      });
+    if (logical_channel.reading_paused_ &&
+        logical_channel.send_queue_bytes_ <= logical_channel.watermarks_.low_) {
+      logical_channel.reading_paused_ = false;
+      logical_channel.relay_->ResumeReading();
+    }
+  }
+}
 
-      if (version_ > kVersion) {
-        version_ = kVersion;
-      }
-      break;
+void MessageTransciever::RecordReceiveTrace(uint16_t channel_id,
+                                            const ReceiveTrace& trace,
+                                            ftl::TimePoint handle_time) {
+  auto iter = channel_service_names_.find(channel_id);
+  if (iter == channel_service_names_.end()) {
+    return;
+  }
 
-    case PacketType::kServiceName:
-      if (version_ == kNullVersion) {
-        FTL_LOG(ERROR) << "Service name packet received when version "
-                          "packet was expected";
-        CloseConnection();
-        return;
-      }
+  LatencyTracer* tracer = LatencyTracer::Get();
+  tracer->Record(iter->second, LatencyTracer::Stage::kReceiveAssembly,
+                 trace.complete_time_ - trace.start_time_);
+  tracer->Record(iter->second, LatencyTracer::Stage::kReceiveQueue,
+                 handle_time - trace.complete_time_);
+  tracer->Record(iter->second, LatencyTracer::Stage::kReceiveWrite,
+                 ftl::TimePoint::Now() - handle_time);
+}
 
+void MessageTransciever::OnRelayWriteQueueFull(uint16_t channel_id,
+                                               bool full) {
+  auto iter = channels_.find(channel_id);
+  if (iter == channels_.end() || iter->second.write_queue_full_ == full) {
+    return;
+  }
+
+  iter->second.write_queue_full_ = full;
+  UpdateFullWriteQueueCount(full);
+}
+
+void MessageTransciever::UpdateFullWriteQueueCount(bool increment) {
+  // Stop receiving from the socket while any channel is backed up. Because
+  // the socket is shared, this affects every channel on the connection.
+  if (increment) {
+    if (full_write_queue_count_++ == 0) {
+      ++receive_pauses_;
+      io_task_runner_->PostTask([this]() { PauseReceiving(); });
+    }
+  } else {
+    FTL_DCHECK(full_write_queue_count_ != 0);
+    if (--full_write_queue_count_ == 0) {
+      io_task_runner_->PostTask([this]() { ResumeReceiving(); });
+    }
+  }
+}
+
+void MessageTransciever::OnRelayClosed(uint16_t channel_id) {
+  if (!ReleaseRelay(channel_id)) {
+    // The relay was closed because the remote party closed the channel or
+    // because the connection closed.
+    return;
+  }
+
+  if (negotiated_version_ == kNullVersion) {
+    // Only the primary channel can be open before the version exchange
+    // completes, and how we report its closure depends on the version.
+    FTL_DCHECK(channel_id == kPrimaryChannelId);
+    primary_channel_closed_early_ = true;
+    return;
+  }
+
+  ReportChannelClosed(channel_id);
+}
+
+void MessageTransciever::ReportChannelClosed(uint16_t channel_id) {
+  FTL_DCHECK(negotiated_version_ != kNullVersion);
+
+  if (!is_multiplexed()) {
+    CloseConnection();
+    return;
+  }
+
+  EnqueuePacket(PacketType::kCloseChannel, channel_id, std::vector<uint8_t>());
+  channel_priorities_.erase(channel_id);
+
+  if (channels_.empty()) {
+    OnIdle();
+  }
+}
+
+void MessageTransciever::OnRemoteChannelClosed(uint16_t channel_id) {
+  auto iter = channels_.find(channel_id);
+  if (iter == channels_.end()) {
+    // We closed the channel locally, and the remote party closed it before
+    // getting our close channel packet.
+    return;
+  }
+
+  MessageRelay* relay = iter->second.relay_.get();
+  ReleaseRelay(channel_id);
+  channel_priorities_.erase(channel_id);
+  relay->CloseChannel();
+
+  if (channels_.empty()) {
+    OnIdle();
+  }
+}
+
+void MessageTransciever::OnChannelMessageReceived(
+    uint16_t channel_id,
+    std::vector<uint8_t> message) {
+  auto iter = channels_.find(channel_id);
+  if (iter != channels_.end()) {
+    iter->second.relay_->SendMessage(std::move(message));
+  }
+}
+
+bool MessageTransciever::ReleaseRelay(uint16_t channel_id) {
+  channel_service_names_.erase(channel_id);
+
+  auto iter = channels_.find(channel_id);
+  if (iter == channels_.end()) {
+    return false;
+  }
+
+  if (direct_delivery_) {
+    io_task_runner_->PostTask(
+        [this, channel_id]() { ReleaseDirectChannel(channel_id); });
+  }
+
+  if (iter->second.write_queue_full_) {
+    UpdateFullWriteQueueCount(false);
+  }
+
+  released_relay_messages_expired_ += iter->second.relay_->messages_expired();
+
+  if (iter->second.rate_limited_) {
+    io_task_runner_->PostTask(
+        [this, channel_id]() { channel_token_buckets_.erase(channel_id); });
+  }
+
+  // The relay may be on the call stack, so we delete it later.
+  task_runner_->PostTask(ftl::MakeCopyable(
+      [relay = std::move(iter->second.relay_)]() mutable { relay.reset(); }));
+  channels_.erase(iter);
+  return true;
+}
+
+uint16_t MessageTransciever::AllocateChannelId() {
+  // Channel ids are allocated sequentially, skipping any that are still in
+  // use after wrapping around.
+  while (next_channel_id_ == kPrimaryChannelId ||
+         channels_.find(next_channel_id_) != channels_.end() ||
+         delivery_callbacks_.find(next_channel_id_) !=
+             delivery_callbacks_.end()) {
+    ++next_channel_id_;
+  }
+
+  return next_channel_id_++;
+}
+
+void MessageTransciever::CompleteDelivery(uint16_t channel_id,
+                                          bool delivered) {
+  auto iter = delivery_callbacks_.find(channel_id);
+  if (iter == delivery_callbacks_.end()) {
+    return;
+  }
+
+  DeliveryCallback callback = std::move(iter->second);
+  delivery_callbacks_.erase(iter);
+  callback(delivered);
+}
+
+void MessageTransciever::SetChannelServiceName(
+    uint16_t channel_id,
+    const std::string& service_name) {
+  channel_service_names_[channel_id] = service_name;
+  channel_priorities_[channel_id] = GetPriority(service_name);
+}
+
+MessagePriority MessageTransciever::ChannelPriority(
+    uint16_t channel_id) const {
+  auto iter = channel_priorities_.find(channel_id);
+  return iter == channel_priorities_.end() ? MessagePriority::kNormal
+                                           : iter->second;
+}
+
+ftl::TimePoint MessageTransciever::MessageDeadline(uint16_t channel_id) const {
+  auto iter = channels_.find(channel_id);
+  if (iter == channels_.end() ||
+      iter->second.message_lifetime_ == ftl::TimeDelta::Zero()) {
+    return ftl::TimePoint();
+  }
+
+  return ftl::TimePoint::Now() + iter->second.message_lifetime_;
+}
+
+void MessageTransciever::DrainSendQueue() {
+  // Clear the pending flag before popping, so packets pushed from here on
+  // schedule another drain.
+  send_queue_drain_pending_.exchange(false, std::memory_order_acq_rel);
+
+  ftl::TimePoint drain_time =
+      tracing_ ? ftl::TimePoint::Now() : ftl::TimePoint();
+
+  OutboundPacket packet;
+  while (send_queue_.Pop(&packet)) {
+    packet.drain_time_ = drain_time;
+
+    if (!socket_fd_.is_valid() && !socket_suspended_) {
+      // Discard the packet.
+      continue;
+    }
+
+    uint16_t channel_id = packet.channel_id();
+
+    if (direct_delivery_ && packet.header_.type_ == PacketType::kOpenChannel) {
+      // Responses on the new channel may arrive before the main thread
+      // supplies the channel.
+      GetDirectChannel(channel_id);
+    }
+
+    SendLane& lane = packet.priority_ == MessagePriority::kHigh
+                         ? high_priority_lane_
+                         : normal_priority_lane_;
+
+    auto iter = send_streams_.find(channel_id);
+    if (packet.header_.type_ == PacketType::kVersion ||
+        packet.header_.type_ == PacketType::kPing) {
+      // These apply to the connection, so they don't wait for other packets.
+      PushSendPacket(std::move(packet));
+    } else if (iter != send_streams_.end()) {
+      // A large message is being sent on this channel, so this packet has to
+      // wait for it.
+      iter->second.packets_.push_back(std::move(packet));
+    } else if (NeedsSendStream(packet)) {
+      send_streams_[channel_id].packets_.push_back(std::move(packet));
+      lane.stream_order_.push_back(channel_id);
+    } else {
+      lane.packets_.push_back(std::move(packet));
+    }
+  }
+
+  // If we're waiting for the socket to become writable or connected, the
+  // write happens when it does.
+  if (!write_waiting_ && !connecting_) {
+    WriteSendPackets();
+  }
+}
+
+bool MessageTransciever::NeedsSendStream(const OutboundPacket& packet) {
+  if (packet.header_.type_ != PacketType::kMessage ||
+      packet.payload_.size() <= kMaxFragmentSize) {
+    return false;
+  }
+
+  // If we don't know the remote party's version yet, a message that fits in
+  // a single packet is sent without fragmentation, so it works with any
+  // version. Larger messages wait for the version.
+  return version_ >= kFragmentationVersion ||
+         packet.payload_.size() > kMaxPayloadSize;
+}
+
+void MessageTransciever::FillSendPackets(size_t byte_count) {
+  while (send_packets_bytes_ < byte_count) {
+    SendLane* lane = SelectSendLane();
+    if (lane == nullptr) {
+      return;
+    }
+
+    size_t bytes_before = send_packets_bytes_;
+    TakeFromSendLane(lane);
+    if (!socket_fd_.is_valid() && !socket_suspended_) {
+      // The socket was closed.
+      return;
+    }
+
+    if (lane == &high_priority_lane_) {
+      high_priority_run_ += send_packets_bytes_ - bytes_before;
+    }
+  }
+}
+
+bool MessageTransciever::IsSendLaneReady(const SendLane& lane) const {
+  // Streams for messages that are too large for a single packet can't make
+  // progress until we know whether the remote party supports fragmentation.
+  return !lane.packets_.empty() ||
+         (version_ != kNullVersion && !lane.stream_order_.empty());
+}
+
+MessageTransciever::SendLane* MessageTransciever::SelectSendLane() {
+  bool high_ready = IsSendLaneReady(high_priority_lane_);
+  bool normal_ready = IsSendLaneReady(normal_priority_lane_);
+
+  if (high_ready &&
+      (!normal_ready || high_priority_run_ < kHighPriorityQuantum)) {
+    if (!normal_ready) {
+      // The quantum only accrues while the normal priority lane is waiting.
+      high_priority_run_ = 0;
+    }
+
+    return &high_priority_lane_;
+  }
+
+  high_priority_run_ = 0;
+  return normal_ready ? &normal_priority_lane_ : nullptr;
+}
+
+void MessageTransciever::TakeFromSendLane(SendLane* lane) {
+  FTL_DCHECK(lane != nullptr);
+
+  if (!lane->packets_.empty()) {
+    if (!DiscardIfExpired(&lane->packets_.front()) &&
+        !ThrottlePacket(&lane->packets_.front())) {
+      PushSendPacket(std::move(lane->packets_.front()));
+    }
+
+    lane->packets_.pop_front();
+    return;
+  }
+
+  FTL_DCHECK(!lane->stream_order_.empty());
+  uint16_t channel_id = lane->stream_order_.front();
+  lane->stream_order_.pop_front();
+
+  auto iter = send_streams_.find(channel_id);
+  FTL_DCHECK(iter != send_streams_.end());
+  SendStream& stream = iter->second;
+  FTL_DCHECK(!stream.packets_.empty());
+  OutboundPacket& packet = stream.packets_.front();
+  FTL_DCHECK(NeedsSendStream(packet));
+
+  if (stream.offset_ == 0 && DiscardIfExpired(&packet)) {
+    // No fragments have been sent, so the whole message can be dropped.
+    stream.packets_.pop_front();
+  } else {
+    if (ThrottleStream(channel_id, lane)) {
+      // The stream rejoins the lane when the channel has tokens.
+      return;
+    }
+
+    if (version_ < kFragmentationVersion) {
+      FTL_LOG(ERROR) << "Message of " << packet.payload_.size()
+                     << " bytes is too large for remote party version "
+                     << version_;
+      CloseSocket();
+      return;
+    }
+
+    std::vector<uint8_t>& message = packet.payload_;
+    size_t fragment_size = message.size() - stream.offset_;
+    if (fragment_size > kMaxFragmentSize) {
+      fragment_size = kMaxFragmentSize;
+    }
+
+    // The first fragment is prefixed with the size of the whole message.
+    size_t prefix_size = stream.offset_ == 0 ? sizeof(uint32_t) : 0;
+    std::vector<uint8_t> payload =
+        BufferPool::Get()->Allocate(prefix_size + fragment_size);
+    if (prefix_size != 0) {
+      uint32_t message_size = htonl(message.size());
+      std::memcpy(payload.data(), &message_size, sizeof(message_size));
+    }
+
+    std::memcpy(payload.data() + prefix_size, message.data() + stream.offset_,
+                fragment_size);
+
+    OutboundPacket fragment(PacketType::kMessageFragment, channel_id,
+                            std::move(payload));
+    fragment.message_bytes_ = fragment_size;
+    if (stream.offset_ + fragment_size == message.size()) {
+      // The message is sent when its last fragment is.
+      fragment.enqueue_time_ = packet.enqueue_time_;
+      fragment.drain_time_ = packet.drain_time_;
+    }
+
+    ChargeTokenBuckets(channel_id, fragment.size(), ftl::TimePoint::Now());
+    PushSendPacket(std::move(fragment));
+
+    stream.offset_ += fragment_size;
+    if (stream.offset_ == message.size()) {
+      BufferPool::Get()->Recycle(std::move(message));
+      stream.packets_.pop_front();
+      stream.offset_ = 0;
+    }
+  }
+
+  if (stream.offset_ == 0) {
+    // Packets held back behind the message can go now, up to the next
+    // large message.
+    while (!stream.packets_.empty() &&
+           !NeedsSendStream(stream.packets_.front())) {
+      if (!DiscardIfExpired(&stream.packets_.front()) &&
+          !ThrottlePacket(&stream.packets_.front())) {
+        PushSendPacket(std::move(stream.packets_.front()));
+      }
+
+      stream.packets_.pop_front();
+    }
+  }
+
+  if (stream.packets_.empty()) {
+    send_streams_.erase(iter);
+  } else {
+    lane->stream_order_.push_back(channel_id);
+  }
+}
+
+bool MessageTransciever::DiscardIfExpired(OutboundPacket* packet) {
+  FTL_DCHECK(packet != nullptr);
+
+  if (packet->deadline_ == ftl::TimePoint() ||
+      packet->deadline_ > ftl::TimePoint::Now()) {
+    return false;
+  }
+
+  FTL_DCHECK(packet->header_.type_ == PacketType::kMessage);
+  uint16_t channel_id = packet->channel_id();
+  if (!expired_.empty() && expired_.back().first == channel_id) {
+    expired_.back().second += packet->message_bytes_;
+  } else {
+    expired_.emplace_back(channel_id, packet->message_bytes_);
+  }
+
+  messages_expired_.fetch_add(1, std::memory_order_relaxed);
+  BufferPool::Get()->Recycle(std::move(packet->payload_));
+  return true;
+}
+
+bool MessageTransciever::ThrottlePacket(OutboundPacket* packet) {
+  FTL_DCHECK(packet != nullptr);
+
+  uint16_t channel_id = packet->channel_id();
+  auto iter = throttled_channels_.find(channel_id);
+  if (iter != throttled_channels_.end()) {
+    // Packets of any type wait behind the channel's throttled messages, so
+    // the channel's packets stay in order.
+    iter->second.packets_.push_back(std::move(*packet));
+    return true;
+  }
+
+  if ((!device_token_bucket_ && channel_token_buckets_.empty()) ||
+      (packet->header_.type_ != PacketType::kMessage &&
+       packet->header_.type_ != PacketType::kMessageFragment)) {
+    return false;
+  }
+
+  ftl::TimePoint now = ftl::TimePoint::Now();
+  ftl::TimeDelta delay = ThrottleDelay(channel_id, now);
+  if (delay > ftl::TimeDelta::Zero()) {
+    throttled_channels_[channel_id].packets_.push_back(std::move(*packet));
+    ScheduleThrottleWake(delay);
+    return true;
+  }
+
+  ChargeTokenBuckets(channel_id, packet->size(), now);
+  return false;
+}
+
+bool MessageTransciever::ThrottleStream(uint16_t channel_id, SendLane* lane) {
+  FTL_DCHECK(lane != nullptr);
+
+  auto iter = throttled_channels_.find(channel_id);
+  if (iter == throttled_channels_.end()) {
+    if (!device_token_bucket_ && channel_token_buckets_.empty()) {
+      return false;
+    }
+
+    ftl::TimeDelta delay = ThrottleDelay(channel_id, ftl::TimePoint::Now());
+    if (delay == ftl::TimeDelta::Zero()) {
+      return false;
+    }
+
+    iter = throttled_channels_.emplace(channel_id, ThrottledChannel()).first;
+    ScheduleThrottleWake(delay);
+  }
+
+  iter->second.stream_lane_ = lane;
+  return true;
+}
+
+ftl::TimeDelta MessageTransciever::ThrottleDelay(uint16_t channel_id,
+                                                 ftl::TimePoint now) {
+  ftl::TimeDelta delay = ftl::TimeDelta::Zero();
+
+  auto iter = channel_token_buckets_.find(channel_id);
+  if (iter != channel_token_buckets_.end()) {
+    delay = iter->second->Delay(now);
+  }
+
+  if (device_token_bucket_) {
+    delay = std::max(delay, device_token_bucket_->Delay(now));
+  }
+
+  return delay;
+}
+
+void MessageTransciever::ChargeTokenBuckets(uint16_t channel_id,
+                                            size_t bytes,
+                                            ftl::TimePoint now) {
+  auto iter = channel_token_buckets_.find(channel_id);
+  if (iter != channel_token_buckets_.end()) {
+    iter->second->Spend(bytes, now);
+  }
+
+  if (device_token_bucket_) {
+    device_token_bucket_->Spend(bytes, now);
+  }
+}
+
+void MessageTransciever::ScheduleThrottleWake(ftl::TimeDelta delay) {
+  ftl::TimePoint wake_time = ftl::TimePoint::Now() + delay;
+  if (throttle_wake_time_ != ftl::TimePoint() &&
+      throttle_wake_time_ <= wake_time) {
+    return;
+  }
+
+  // A wake superseded by an earlier one finds |throttle_wake_time_| changed
+  // and does nothing.
+  throttle_wake_time_ = wake_time;
+  std::weak_ptr<MessageTransciever*> weak_self = io_self_;
+  io_task_runner_->PostDelayedTask(
+      [weak_self, wake_time]() {
+        std::shared_ptr<MessageTransciever*> self = weak_self.lock();
+        if (self && (*self)->throttle_wake_time_ == wake_time) {
+          (*self)->throttle_wake_time_ = ftl::TimePoint();
+          (*self)->ReleaseThrottledPackets();
+        }
+      },
+      delay);
+}
+
+void MessageTransciever::ReleaseThrottledPackets() {
+  if (!socket_fd_.is_valid() && !socket_suspended_) {
+    return;
+  }
+
+  ftl::TimePoint now = ftl::TimePoint::Now();
+  ftl::TimeDelta next_delay = ftl::TimeDelta::Max();
+
+  for (auto iter = throttled_channels_.begin();
+       iter != throttled_channels_.end();) {
+    uint16_t channel_id = iter->first;
+    ThrottledChannel& throttled_channel = iter->second;
+
+    ftl::TimeDelta delay = ftl::TimeDelta::Zero();
+    while (!throttled_channel.packets_.empty()) {
+      OutboundPacket& packet = throttled_channel.packets_.front();
+      if (!DiscardIfExpired(&packet)) {
+        if (packet.header_.type_ == PacketType::kMessage) {
+          delay = ThrottleDelay(channel_id, now);
+          if (delay > ftl::TimeDelta::Zero()) {
+            break;
+          }
+
+          ChargeTokenBuckets(channel_id, packet.size(), now);
+        }
+
+        PushSendPacket(std::move(packet));
+      }
+
+      throttled_channel.packets_.pop_front();
+    }
+
+    if (throttled_channel.packets_.empty()) {
+      if (throttled_channel.stream_lane_ != nullptr) {
+        throttled_channel.stream_lane_->stream_order_.push_back(channel_id);
+      }
+
+      iter = throttled_channels_.erase(iter);
+    } else {
+      next_delay = std::min(next_delay, delay);
+      ++iter;
+    }
+  }
+
+  if (!throttled_channels_.empty()) {
+    ScheduleThrottleWake(next_delay);
+  }
+
+  if (!write_waiting_ && !connecting_) {
+    WriteSendPackets();
+  }
+}
+
+void MessageTransciever::PushSendPacket(OutboundPacket packet) {
+  packet.sequenced_ = sending_sequenced_ && IsSequenced(packet.header_.type_);
+
+  // Numbered packets aren't compressed, because the compression history is
+  // lost if the session is resumed.
+  if (version_ >= kCompressionVersion && !compression_failed_ &&
+      !sending_sequenced_ && !packet.shared_payload_ &&
+      (packet.header_.type_ == PacketType::kMessage ||
+       packet.header_.type_ == PacketType::kMessageFragment) &&
+      packet.payload_.size() >= kMinCompressedPayloadSize) {
+    CompressPacket(&packet);
+  }
+
+  send_packets_bytes_ += packet.size();
+  send_packets_.push_back(std::move(packet));
+}
+
+void MessageTransciever::CompressPacket(OutboundPacket* packet) {
+  FTL_DCHECK(packet != nullptr);
+
+  std::vector<uint8_t> compressed;
+  if (!compressor_.Compress(packet->payload_.data(), packet->payload_.size(),
+                            &compressed)) {
+    // The remote party only decompresses flagged payloads, so we can carry
+    // on without compression.
+    compression_failed_ = true;
+    BufferPool::Get()->Recycle(std::move(compressed));
+    return;
+  }
+
+  BufferPool::Get()->Recycle(std::move(packet->payload_));
+  packet->payload_ = std::move(compressed);
+  packet->header_.type_ = static_cast<PacketType>(
+      static_cast<uint8_t>(packet->header_.type_) | kCompressedFlag);
+  packet->header_.payload_size_ = htonl(packet->payload_.size());
+}
+
+void MessageTransciever::WriteSendPackets() {
+  if (resume_handshake_) {
+    // Nothing more is sent until the remote party responds to the resume
+    // packet.
+    return;
+  }
+
+  size_t max_bytes = max_send_batch_bytes_;
+  size_t max_packets = max_send_batch_packets_;
+
+  std::vector<struct iovec> iov;
+  iov.reserve(max_packets * 2);
+
+  // Message bytes written per channel, reported to the main thread so it can
+  // relieve backpressure on the channels.
+  std::vector<std::pair<uint16_t, size_t>> sent;
+
+  while (true) {
+    FillSendPackets(max_bytes);
+    if (!socket_fd_.is_valid() || send_packets_.empty()) {
+      break;
+    }
+
+    size_t batch_bytes = 0;
+    size_t packet_count = 0;
+    size_t packet_offset = send_offset_;
+    iov.clear();
+
+    // A batch always contains at least one packet, even if that packet alone
+    // exceeds |max_bytes|.
+    for (OutboundPacket& packet : send_packets_) {
+      size_t remaining = packet.size() - packet_offset;
+      if (packet_count == max_packets ||
+          (packet_count != 0 && batch_bytes + remaining > max_bytes)) {
+        break;
+      }
+
+      if (packet_offset < sizeof(PacketHeader)) {
+        iov.push_back(
+            {reinterpret_cast<uint8_t*>(&packet.header_) + packet_offset,
+             sizeof(PacketHeader) - packet_offset});
+        packet_offset = sizeof(PacketHeader);
+      }
+
+      size_t payload_offset = packet_offset - sizeof(PacketHeader);
+      const std::vector<uint8_t>& payload = packet.payload();
+      if (payload_offset < payload.size()) {
+        iov.push_back({const_cast<uint8_t*>(payload.data()) + payload_offset,
+                       payload.size() - payload_offset});
+      }
+
+      batch_bytes += remaining;
+      packet_offset = 0;
+      ++packet_count;
+    }
+
+    ssize_t result = writev(socket_fd_.get(), iov.data(), iov.size());
+    if (result == -1) {
+      if (errno == EINTR) {
+        continue;
+      }
+
+      // EINPROGRESS means a deferred connect sent its SYN without data, and
+      // the socket becomes writable when the handshake completes.
+      if (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINPROGRESS) {
+        send_stalls_.fetch_add(1, std::memory_order_relaxed);
+        if (send_backlog_start_time_ == ftl::TimePoint()) {
+          send_backlog_start_time_ = ftl::TimePoint::Now();
+          send_backlog_bytes_ = 0;
+        }
+
+        ReportMessagesSent(std::move(sent));
+        write_waiting_ = true;
+        write_waiter_.Wait(
+            [this](mx_status_t status, uint32_t events) {
+              write_waiting_ = false;
+              WriteSendPackets();
+            },
+            socket_fd_.get(), EPOLLOUT);
+        return;
+      }
+
+      FTL_LOG(ERROR) << "Failed to send, errno " << errno;
+      OnSocketFailed();
+      return;
+    }
+
+    bytes_sent_.fetch_add(result, std::memory_order_relaxed);
+    send_backlog_bytes_ += static_cast<uint64_t>(result);
+    ftl::TimePoint write_time =
+        tracing_ ? ftl::TimePoint::Now() : ftl::TimePoint();
+
+    // Discard whatever was written. The write may have stopped partway
+    // through a packet, in which case we remember how far we got.
+    send_offset_ += static_cast<size_t>(result);
+    while (!send_packets_.empty() &&
+           send_offset_ >= send_packets_.front().size()) {
+      OutboundPacket& packet = send_packets_.front();
+      if (packet.message_bytes_ != 0) {
+        uint16_t channel_id = packet.channel_id();
+        if (!sent.empty() && sent.back().first == channel_id) {
+          sent.back().second += packet.message_bytes_;
+        } else {
+          sent.emplace_back(channel_id, packet.message_bytes_);
+        }
+      }
+
+      if (packet.enqueue_time_ != ftl::TimePoint()) {
+        send_traces_.push_back({packet.channel_id(), packet.enqueue_time_,
+                                packet.drain_time_, write_time});
+      }
+
+      send_offset_ -= packet.size();
+      send_packets_bytes_ -= packet.size();
+      if (packet.sequenced_ && session_id_ != 0) {
+        RetainForReplay(std::move(packet));
+      } else {
+        BufferPool::Get()->Recycle(std::move(packet.payload_));
+      }
+
+      send_packets_.pop_front();
+    }
+  }
+
+  ReportMessagesSent(std::move(sent));
+  ReportSendBacklogCleared();
+}
+
+void MessageTransciever::ReportMessagesSent(
+    std::vector<std::pair<uint16_t, size_t>> sent) {
+  // Expired messages relieve backpressure just as sent ones do.
+  sent.insert(sent.end(), expired_.begin(), expired_.end());
+  expired_.clear();
+
+  if (sent.empty() && send_traces_.empty()) {
+    return;
+  }
+
+  std::vector<SendTrace> traces;
+  traces.swap(send_traces_);
+  PostToMain(ftl::MakeCopyable([
+    this, sent = std::move(sent), traces = std::move(traces)
+  ]() { OnMessagesSent(sent, traces); }));
+}
+
+void MessageTransciever::ReportSendBacklogCleared() {
+  if (send_backlog_start_time_ == ftl::TimePoint()) {
+    return;
+  }
+
+  ftl::TimeDelta duration = ftl::TimePoint::Now() - send_backlog_start_time_;
+  uint64_t bytes = send_backlog_bytes_;
+  send_backlog_start_time_ = ftl::TimePoint();
+  send_backlog_bytes_ = 0;
+
+  if (bytes >= kMinThroughputSampleBytes && socket_fd_.is_valid()) {
+    PostToMain([this, bytes, duration]() {
+      OnThroughputMeasured(bytes, duration);
+    });
+  }
+}
+
+void MessageTransciever::WaitForConnected(ftl::TimeDelta timeout) {
+  if (!socket_fd_.is_valid()) {
+    return;
+  }
+
+  connect_deadline_ = ftl::TimePoint::Now() + timeout;
+
+  // With an alternate address, the first connect gets a head start rather
+  // than the whole timeout.
+  if (alternate_socket_fd_.is_valid() && kConnectionAttemptDelay < timeout) {
+    timeout = kConnectionAttemptDelay;
+  }
+
+  // A non-blocking connect completes when the socket becomes writable.
+  write_waiter_.Wait(
+      [this](mx_status_t status, uint32_t events) { OnConnected(status); },
+      socket_fd_.get(), EPOLLOUT, timeout.ToNanoseconds());
+}
+
+void MessageTransciever::OnConnected(mx_status_t status) {
+  ftl::TimePoint now = ftl::TimePoint::Now();
+
+  if (status == ERR_TIMED_OUT && alternate_socket_fd_.is_valid() &&
+      !alternate_connect_started_ && now < connect_deadline_) {
+    // The head start is over. Race the alternate connect against this one.
+    StartAlternateConnect();
+    write_waiter_.Wait(
+        [this](mx_status_t status, uint32_t events) { OnConnected(status); },
+        socket_fd_.get(), EPOLLOUT,
+        (connect_deadline_ - now).ToNanoseconds());
+    return;
+  }
+
+  if (status == ERR_TIMED_OUT) {
+    FTL_LOG(WARNING) << "Connect timed out";
+    OnSocketFailed();
+    return;
+  }
+
+  if (!ConnectSucceeded(status, socket_fd_.get())) {
+    if (!alternate_socket_fd_.is_valid()) {
+      OnSocketFailed();
+      return;
+    }
+
+    // Carry on with the alternate connect, starting it if need be.
+    first_connect_failed_ = true;
+    if (!alternate_connect_started_) {
+      StartAlternateConnect();
+      if (!alternate_socket_fd_.is_valid()) {
+        CloseSocket();
+      }
+    }
+
+    return;
+  }
+
+  OnConnectComplete();
+}
+
+void MessageTransciever::StartAlternateConnect() {
+  FTL_DCHECK(alternate_socket_fd_.is_valid());
+  FTL_DCHECK(!alternate_connect_started_);
+
+  alternate_connect_started_ = true;
+
+  if (connect(alternate_socket_fd_.get(), alternate_address_.as_sockaddr(),
+              alternate_address_.socklen()) < 0 &&
+      errno != EINPROGRESS) {
+    FTL_LOG(WARNING) << "Failed to connect to alternate address "
+                     << alternate_address_ << ", errno " << errno;
+    alternate_socket_fd_.reset();
+    return;
+  }
+
+  ftl::TimePoint now = ftl::TimePoint::Now();
+  ftl::TimeDelta timeout = connect_deadline_ > now ? connect_deadline_ - now
+                                                   : ftl::TimeDelta::Zero();
+  alternate_waiter_.Wait(
+      [this](mx_status_t status, uint32_t events) {
+        OnAlternateConnected(status);
+      },
+      alternate_socket_fd_.get(), EPOLLOUT, timeout.ToNanoseconds());
+}
+
+void MessageTransciever::OnAlternateConnected(mx_status_t status) {
+  if (status == ERR_TIMED_OUT ||
+      !ConnectSucceeded(status, alternate_socket_fd_.get())) {
+    alternate_socket_fd_.reset();
+
+    // If the first connect has already failed, nothing else will close the
+    // connection.
+    if (first_connect_failed_) {
+      CloseSocket();
+    }
+
+    return;
+  }
+
+  // The alternate connect won. Abandon the first one.
+  FTL_VLOG(1) << "Connected to alternate address " << alternate_address_;
+  write_waiter_.Cancel();
+  socket_fd_.reset(alternate_socket_fd_.release());
+  OnConnectComplete();
+}
+
+void MessageTransciever::OnConnectComplete() {
+  if (alternate_socket_fd_.is_valid()) {
+    // The first connect won.
+    alternate_waiter_.Cancel();
+    alternate_socket_fd_.reset();
+  }
+
+  connecting_ = false;
+
+  if (ConnectDeferred(socket_fd_.get())) {
+    WatchDeferredConnect();
+  }
+
+  if (resume_handshake_) {
+    if (!WriteResumePacket()) {
+      OnSocketFailed();
+      return;
+    }
+
+    WaitForReadable();
+    return;
+  }
+
+  connect_complete_time_ = ftl::TimePoint::Now();
+  WaitForReadable();
+  WriteSendPackets();
+}
+
+// static
+bool MessageTransciever::ConnectSucceeded(mx_status_t status, int fd) {
+  int error = 0;
+  socklen_t error_size = sizeof(error);
+  if (status != NO_ERROR ||
+      getsockopt(fd, SOL_SOCKET, SO_ERROR, &error, &error_size) < 0 ||
+      error != 0) {
+    FTL_LOG(WARNING) << "Failed to connect, status " << status << ", errno "
+                     << (error != 0 ? error : errno);
+    return false;
+  }
+
+  return true;
+}
+
+// static
+bool MessageTransciever::ConnectDeferred(int fd) {
+#ifdef TCP_FASTOPEN_CONNECT
+  struct tcp_info info;
+  socklen_t info_size = sizeof(info);
+  return getsockopt(fd, IPPROTO_TCP, TCP_INFO, &info, &info_size) == 0 &&
+         info.tcpi_state == TCP_SYN_SENT;
+#else
+  return false;
+#endif
+}
+
+void MessageTransciever::WatchDeferredConnect() {
+  ftl::TimePoint now = ftl::TimePoint::Now();
+  ftl::TimeDelta timeout = connect_deadline_ > now ? connect_deadline_ - now
+                                                   : ftl::TimeDelta::Zero();
+
+  // A watch superseded by a reconnect finds |deferred_connect_deadline_|
+  // changed and does nothing.
+  ftl::TimePoint deadline = connect_deadline_;
+  deferred_connect_deadline_ = deadline;
+  uint64_t bytes_received = bytes_received_.load(std::memory_order_relaxed);
+  std::weak_ptr<MessageTransciever*> weak_self = io_self_;
+  io_task_runner_->PostDelayedTask(
+      [weak_self, deadline, bytes_received]() {
+        std::shared_ptr<MessageTransciever*> self = weak_self.lock();
+        if (!self || (*self)->deferred_connect_deadline_ != deadline) {
+          return;
+        }
+
+        (*self)->deferred_connect_deadline_ = ftl::TimePoint();
+        if ((*self)->bytes_received_.load(std::memory_order_relaxed) ==
+            bytes_received) {
+          FTL_LOG(WARNING) << "Connect timed out";
+          (*self)->OnSocketFailed();
+        }
+      },
+      timeout);
+}
+
+void MessageTransciever::WaitForReadable() {
+  if (!socket_fd_.is_valid() || receive_pause_count_ != 0) {
+    return;
+  }
+
+  read_waiting_ = true;
+  read_waiter_.Wait(
+      [this](mx_status_t status, uint32_t events) {
+        read_waiting_ = false;
+        OnReadable(status, events);
+      },
+      socket_fd_.get(), EPOLLIN);
+}
+
+void MessageTransciever::PauseReceiving() {
+  if (receive_pause_count_++ == 0 && read_waiting_) {
+    read_waiter_.Cancel();
+    read_waiting_ = false;
+  }
+}
+
+void MessageTransciever::ResumeReceiving() {
+  FTL_DCHECK(receive_pause_count_ != 0);
+
+  // If we're still connecting, OnConnected starts the wait.
+  if (--receive_pause_count_ == 0 && !read_waiting_ && !connecting_) {
+    WaitForReadable();
+  }
+}
+
+MessageTransciever::DirectChannel* MessageTransciever::GetDirectChannel(
+    uint16_t channel_id) {
+  std::unique_ptr<DirectChannel>& direct_channel =
+      direct_channels_[channel_id];
+  if (!direct_channel) {
+    direct_channel.reset(new DirectChannel());
+  }
+
+  return direct_channel.get();
+}
+
+void MessageTransciever::InstallDirectChannel(uint16_t channel_id,
+                                              mx::channel channel,
+                                              const Watermarks& watermarks,
+                                              size_t vmo_threshold,
+                                              ftl::TimeDelta message_lifetime) {
+  if (!socket_fd_.is_valid()) {
+    return;
+  }
+
+  DirectChannel* direct_channel = GetDirectChannel(channel_id);
+  FTL_DCHECK(!direct_channel->channel_);
+  direct_channel->channel_ = std::move(channel);
+  direct_channel->watermarks_ = watermarks;
+  direct_channel->vmo_threshold_ = vmo_threshold;
+  direct_channel->message_lifetime_ = message_lifetime;
+  WriteDirectMessages(channel_id);
+}
+
+void MessageTransciever::ReleaseDirectChannel(uint16_t channel_id) {
+  auto iter = direct_channels_.find(channel_id);
+  if (iter == direct_channels_.end()) {
+    return;
+  }
+
+  if (iter->second->messages_.empty() || !iter->second->channel_) {
+    EraseDirectChannel(channel_id);
+  } else {
+    // Let the queued messages drain first.
+    iter->second->released_ = true;
+  }
+}
+
+void MessageTransciever::DeliverMessageDirect(uint16_t channel_id,
+                                              std::vector<uint8_t> message) {
+  auto iter = direct_channels_.find(channel_id);
+  if (iter == direct_channels_.end() || iter->second->failed_) {
+    // The channel isn't open. The main thread would discard this message,
+    // too.
+    BufferPool::Get()->Recycle(std::move(message));
+    return;
+  }
+
+  DirectChannel* direct_channel = iter->second.get();
+  direct_channel->message_bytes_ += message.size();
+  direct_channel->messages_.push_back(std::move(message));
+  // Messages received before the channel is installed don't expire, because
+  // the lifetime isn't known yet.
+  direct_channel->deadlines_.push_back(
+      direct_channel->message_lifetime_ == ftl::TimeDelta::Zero()
+          ? ftl::TimePoint()
+          : ftl::TimePoint::Now() + direct_channel->message_lifetime_);
+
+  if (!direct_channel->full_ &&
+      direct_channel->message_bytes_ >= direct_channel->watermarks_.high_) {
+    direct_channel->full_ = true;
+    PauseReceiving();
+  }
+
+  if (direct_channel->channel_ && !direct_channel->write_wait_.is_waiting()) {
+    WriteDirectMessages(channel_id);
+  }
+}
+
+void MessageTransciever::WriteDirectMessages(uint16_t channel_id) {
+  auto iter = direct_channels_.find(channel_id);
+  if (iter == direct_channels_.end()) {
+    return;
+  }
+
+  DirectChannel* direct_channel = iter->second.get();
+  FTL_DCHECK(direct_channel->channel_);
+
+  // The clock is read at most once per pass.
+  ftl::TimePoint now;
+
+  while (!direct_channel->messages_.empty()) {
+    std::vector<uint8_t>& message = direct_channel->messages_.front();
+    ftl::TimePoint deadline = direct_channel->deadlines_.front();
+    if (deadline != ftl::TimePoint() && now == ftl::TimePoint()) {
+      now = ftl::TimePoint::Now();
+    }
+
+    mx_status_t status;
+    if (deadline != ftl::TimePoint() && deadline <= now) {
+      // Expired. It may have been copied into a VMO for an earlier attempt.
+      direct_channel->vmo_to_write_.reset();
+      messages_expired_.fetch_add(1, std::memory_order_relaxed);
+      status = NO_ERROR;
+    } else if (direct_channel->vmo_threshold_ != 0 &&
+               message.size() >= direct_channel->vmo_threshold_) {
+      status = direct_channel->vmo_to_write_
+                   ? NO_ERROR
+                   : CopyMessageToVmo(message, &direct_channel->vmo_to_write_);
+      if (status == NO_ERROR) {
+        status = WriteVmoMessage(direct_channel->channel_, message.size(),
+                                 &direct_channel->vmo_to_write_);
+      }
+    } else {
+      status = direct_channel->channel_.write(0, message.data(),
+                                              message.size(), nullptr, 0);
+    }
+
+    if (status == ERR_SHOULD_WAIT) {
+      direct_channel->write_wait_.Start(
+          direct_channel->channel_.get(),
+          MX_CHANNEL_WRITABLE | MX_CHANNEL_PEER_CLOSED, MX_TIME_INFINITE,
+          [this, channel_id]() { WriteDirectMessages(channel_id); });
+      return;
+    }
+
+    if (status != NO_ERROR) {
+      // The relay will notice that the channel has closed and tell the main
+      // thread.
+      if (status != ERR_PEER_CLOSED) {
+        FTL_LOG(ERROR) << "mx::channel::write failed, status " << status;
+      }
+
+      direct_channel->failed_ = true;
+      direct_channel->messages_.clear();
+      direct_channel->deadlines_.clear();
+      direct_channel->vmo_to_write_.reset();
+      direct_channel->message_bytes_ = 0;
+    } else {
+      direct_channel->message_bytes_ -= message.size();
+      BufferPool::Get()->Recycle(std::move(message));
+      direct_channel->messages_.pop_front();
+      direct_channel->deadlines_.pop_front();
+    }
+
+    if (direct_channel->full_ &&
+        direct_channel->message_bytes_ <= direct_channel->watermarks_.low_) {
+      direct_channel->full_ = false;
+      ResumeReceiving();
+    }
+  }
+
+  if (direct_channel->released_) {
+    // We may be in a callback from |write_wait_|, so we delete the channel
+    // later.
+    io_task_runner_->PostTask([this, channel_id]() {
+      auto iter = direct_channels_.find(channel_id);
+      if (iter != direct_channels_.end() && iter->second->released_) {
+        EraseDirectChannel(channel_id);
+      }
+    });
+  }
+}
+
+void MessageTransciever::EraseDirectChannel(uint16_t channel_id) {
+  auto iter = direct_channels_.find(channel_id);
+  FTL_DCHECK(iter != direct_channels_.end());
+
+  if (iter->second->full_) {
+    ResumeReceiving();
+  }
+
+  direct_channels_.erase(iter);
+}
+
+void MessageTransciever::OnReadable(mx_status_t status, uint32_t events) {
+  for (size_t i = 0; i < kMaxReadsPerWait; ++i) {
+    ssize_t result = Receive();
+    if (result == -1) {
+      if (errno == EINTR) {
+        continue;
+      }
+
+      if (errno == EAGAIN || errno == EWOULDBLOCK) {
+        break;
+      }
+
+      FTL_LOG(ERROR) << "Failed to receive, errno " << errno;
+      OnSocketFailed();
+      return;
+    }
+
+    if (result == 0) {
+      // The remote party closed the connection.
+      CloseSocket();
+      return;
+    }
+
+    bytes_received_.fetch_add(result, std::memory_order_relaxed);
+
+    if (!socket_fd_.is_valid()) {
+      // The received bytes were bad, and the connection was closed.
+      return;
+    }
+
+    if (receive_pause_count_ != 0) {
+      // A received packet paused receipt.
+      break;
+    }
+  }
+
+  AdaptReceiveBufferSize();
+  WaitForReadable();
+}
+
+ssize_t MessageTransciever::Receive() {
+  if (receive_packet_offset_ >= sizeof(PacketHeader)) {
+    // We're partway through a payload. If the rest of it won't fit in the
+    // receive buffer, receive it in place to avoid copying it.
+    size_t payload_offset = receive_payload_base_ + receive_packet_offset_ -
+                            sizeof(PacketHeader);
+    size_t payload_remaining = receive_packet_payload_.size() - payload_offset;
+    if (payload_remaining > receive_buffer_.size()) {
+      uint8_t* dest = receive_packet_payload_.data() + payload_offset;
+      ssize_t result = recv(socket_fd_.get(), dest, payload_remaining, 0);
+      if (result > 0) {
+        if (tracing_) {
+          receive_time_ = ftl::TimePoint::Now();
+        }
+
+        receive_packet_offset_ += result;
+        if (static_cast<size_t>(result) == payload_remaining) {
+          // Packet complete.
+          receive_packet_offset_ = 0;
+          OnReceivedPacketComplete();
+        }
+      }
+
+      return result;
+    }
+  }
+
+  ssize_t result = recv(socket_fd_.get(), receive_buffer_.data(),
+                        receive_buffer_.size(), 0);
+  if (result > 0) {
+    if (tracing_) {
+      receive_time_ = ftl::TimePoint::Now();
+    }
+
+    ParseReceivedBytes(result);
+  }
+
+  return result;
+}
+
+void MessageTransciever::AdaptReceiveBufferSize() {
+  size_t target_size = kMinRecvBufferSize;
+  while (target_size < average_packet_size_ * kRecvBufferPacketCount &&
+         target_size < kMaxRecvBufferSize) {
+    target_size *= 2;
+  }
+
+  // We shrink the buffer only when it's much too big to avoid resizing back
+  // and forth.
+  if (target_size > receive_buffer_.size() ||
+      target_size * 4 <= receive_buffer_.size()) {
+    std::vector<uint8_t>(target_size).swap(receive_buffer_);
+  }
+}
+
+void MessageTransciever::CloseSocket() {
+  if (!socket_fd_.is_valid() && !socket_suspended_) {
+    return;
+  }
+
+  socket_suspended_ = false;
+  resume_handshake_ = false;
+  for (OutboundPacket& packet : replay_packets_) {
+    BufferPool::Get()->Recycle(std::move(packet.payload_));
+  }
+
+  replay_packets_.clear();
+  replay_bytes_ = 0;
+
+  read_waiter_.Cancel();
+  write_waiter_.Cancel();
+  alternate_waiter_.Cancel();
+  write_waiting_ = false;
+  socket_fd_.reset();
+  alternate_socket_fd_.reset();
+  send_packets_.clear();
+  send_packets_bytes_ = 0;
+  send_offset_ = 0;
+  send_streams_.clear();
+  throttled_channels_.clear();
+  high_priority_lane_ = SendLane();
+  normal_priority_lane_ = SendLane();
+  high_priority_run_ = 0;
+  reassemblies_.clear();
+  reassembly_bytes_ = 0;
+  direct_channels_.clear();
+
+  PostToMain([this]() { OnSocketClosed(); });
+}
+
+void MessageTransciever::OnSocketClosed() {
+  connection_closed_ = true;
+  channel_.reset();
+
+  // Releasing the relays before closing them means OnRelayClosed won't try
+  // to send close channel packets. Released relays aren't deleted until later.
+  std::vector<MessageRelay*> relays;
+  while (!channels_.empty()) {
+    relays.push_back(channels_.begin()->second.relay_.get());
+    ReleaseRelay(channels_.begin()->first);
+  }
+
+  for (MessageRelay* relay : relays) {
+    relay->CloseChannel();
+  }
+
+  while (!delivery_callbacks_.empty()) {
+    CompleteDelivery(delivery_callbacks_.begin()->first, false);
+  }
+
+  OnConnectionClosed();
+}
+
+void MessageTransciever::ParseReceivedBytes(size_t byte_count) {
+  uint8_t* bytes = receive_buffer_.data();
+
+  while (byte_count != 0) {
+    if (tracing_ && receive_packet_offset_ == 0) {
+      receive_packet_start_time_ = receive_time_;
+    }
+
+    if (receive_packet_offset_ == 0 && byte_count >= sizeof(PacketHeader)) {
+      // The whole header is in the buffer, so we decode it in one go.
+      std::memcpy(&receive_packet_header_, bytes, sizeof(PacketHeader));
+      bytes += sizeof(PacketHeader);
+      byte_count -= sizeof(PacketHeader);
+      receive_packet_offset_ = sizeof(PacketHeader);
+
+      if (!OnReceivedHeaderComplete()) {
+        CloseConnection();
+        return;
+      }
+    } else if (receive_packet_offset_ < sizeof(PacketHeader)) {
+      // The header straddles receive buffers.
+      if (!CopyReceivedBytes(
+              &bytes, &byte_count,
+              reinterpret_cast<uint8_t*>(&receive_packet_header_),
+              sizeof(receive_packet_header_), 0)) {
+        FTL_DCHECK(byte_count == 0);
+        return;
+      }
+
+      if (!OnReceivedHeaderComplete()) {
+        CloseConnection();
+        return;
+      }
+    }
+
+    if (receive_packet_header_.payload_size_ == 0 ||
+        CopyReceivedBytes(
+            &bytes, &byte_count,
+            receive_packet_payload_.data() + receive_payload_base_,
+            receive_packet_header_.payload_size_, sizeof(PacketHeader))) {
+      // Packet complete.
+      receive_packet_offset_ = 0;
+      OnReceivedPacketComplete();
+
+      if (!socket_fd_.is_valid()) {
+        // The packet was bad, and the connection was closed.
+        return;
+      }
+    }
+  }
+}
+
+bool MessageTransciever::OnReceivedHeaderComplete() {
+  if (receive_packet_header_.sentinel_ != kSentinel) {
+    FTL_LOG(ERROR) << "Received bad packet sentinel "
+                   << receive_packet_header_.sentinel_;
+    return false;
+  }
+
+  uint8_t type = static_cast<uint8_t>(receive_packet_header_.type_);
+  receive_compressed_ = (type & kCompressedFlag) != 0;
+  receive_packet_header_.type_ =
+      static_cast<PacketType>(type & ~kCompressedFlag);
+
+  if (receive_packet_header_.type_ > PacketType::kMax) {
+    FTL_LOG(ERROR) << "Received bad packet type "
+                   << static_cast<uint8_t>(receive_packet_header_.type_);
+    return false;
+  }
+
+  receive_packet_header_.channel_ = ntohs(receive_packet_header_.channel_);
+  receive_packet_header_.payload_size_ =
+      ntohl(receive_packet_header_.payload_size_);
+
+  // Channels other than the primary channel aren't allowed until we know the
+  // remote party supports them.
+  if (version_ < kMultiplexingVersion &&
+      receive_packet_header_.channel_ != kPrimaryChannelId) {
+    FTL_LOG(ERROR) << "Received bad channel id "
+                   << receive_packet_header_.channel_;
+    return false;
+  }
+
+  if (receive_packet_header_.payload_size_ > kMaxPayloadSize) {
+    FTL_LOG(ERROR) << "Received bad payload size "
+                   << receive_packet_header_.payload_size_;
+    return false;
+  }
+
+  if (receive_compressed_ &&
+      (version_ < kCompressionVersion ||
+       (receive_packet_header_.type_ != PacketType::kMessage &&
+        receive_packet_header_.type_ != PacketType::kMessageFragment) ||
+       receive_packet_header_.payload_size_ == 0)) {
+    FTL_LOG(ERROR) << "Received bad compressed packet";
+    return false;
+  }
+
+  return PrepareReceivePayload();
+}
+
+bool MessageTransciever::CopyReceivedBytes(uint8_t** bytes,
+                                           size_t* byte_count,
+                                           uint8_t* dest,
+                                           size_t dest_size,
+                                           size_t dest_packet_offset) {
+  FTL_DCHECK(bytes != nullptr);
+  FTL_DCHECK(*bytes != nullptr);
+  FTL_DCHECK(byte_count != nullptr);
+  FTL_DCHECK(dest != nullptr);
+  FTL_DCHECK(dest_size != 0);
+  FTL_DCHECK(dest_packet_offset <= receive_packet_offset_);
+  FTL_DCHECK(receive_packet_offset_ < dest_packet_offset + dest_size);
+
+  size_t dest_offset = receive_packet_offset_ - dest_packet_offset;
+  size_t bytes_to_copy = std::min(*byte_count, dest_size - dest_offset);
+
+  if (bytes_to_copy != 0) {
+    std::memcpy(dest + dest_offset, *bytes, bytes_to_copy);
+
+    *byte_count -= bytes_to_copy;
+    *bytes += bytes_to_copy;
+    dest_offset += bytes_to_copy;
+    receive_packet_offset_ += bytes_to_copy;
+  }
+
+  return dest_offset == dest_size;
+}
+
+bool MessageTransciever::PrepareReceivePayload() {
+  receive_payload_base_ = 0;
+
+  if (receive_packet_header_.type_ == PacketType::kMessageFragment) {
+    auto iter = reassemblies_.find(receive_packet_header_.channel_);
+    if (iter != reassemblies_.end() && !receive_compressed_) {
+      // Receive the fragment directly into the message being reassembled.
+      Reassembly& reassembly = iter->second;
       if (receive_packet_header_.payload_size_ == 0 ||
-          receive_packet_header_.payload_size_ > kMaxServiceNameLength) {
-        FTL_LOG(ERROR) << "Service name packet has bad payload size "
+          receive_packet_header_.payload_size_ >
+              reassembly.size_ - reassembly.message_.size()) {
+        FTL_LOG(ERROR) << "Fragment packet has bad payload size "
+                       << receive_packet_header_.payload_size_;
+        return false;
+      }
+
+      receive_payload_base_ = reassembly.message_.size();
+      BufferPool::Get()->Recycle(std::move(receive_packet_payload_));
+      receive_packet_payload_ = std::move(reassembly.message_);
+      receive_packet_payload_.resize(receive_payload_base_ +
+                                     receive_packet_header_.payload_size_);
+      return true;
+    }
+  } else if (reassemblies_.find(receive_packet_header_.channel_) !=
+                 reassemblies_.end() &&
+             receive_packet_header_.type_ != PacketType::kCloseChannel &&
+             receive_packet_header_.type_ != PacketType::kPing &&
+             receive_packet_header_.type_ != PacketType::kPong &&
+             receive_packet_header_.type_ != PacketType::kAcknowledge) {
+    FTL_LOG(ERROR) << "Packet received on channel "
+                   << receive_packet_header_.channel_
+                   << " while a fragmented message was incomplete";
+    return false;
+  }
+
+  // If the previous payload was handed off, replace it from the pool.
+  if (receive_packet_payload_.capacity() <
+      receive_packet_header_.payload_size_) {
+    BufferPool::Get()->Recycle(std::move(receive_packet_payload_));
+    receive_packet_payload_ =
+        BufferPool::Get()->Allocate(receive_packet_header_.payload_size_);
+  } else {
+    receive_packet_payload_.resize(receive_packet_header_.payload_size_);
+  }
+
+  return true;
+}
+
+void MessageTransciever::OnReceivedPacketComplete() {
+  uint16_t channel_id = receive_packet_header_.channel_;
+
+  if (receive_compressed_ && !DecompressReceivedPayload()) {
+    CloseConnection();
+    return;
+  }
+
+  average_packet_size_ =
+      (average_packet_size_ * 7 + sizeof(PacketHeader) +
+       receive_packet_header_.payload_size_) /
+      8;
+
+  if (resume_handshake_ &&
+      receive_packet_header_.type_ != PacketType::kVersion &&
+      receive_packet_header_.type_ != PacketType::kResume) {
+    FTL_LOG(ERROR) << "Packet received when resume packet was expected";
+    CloseConnection();
+    return;
+  }
+
+  bool acknowledge_due = false;
+  if (receiving_sequenced_ && IsSequenced(receive_packet_header_.type_)) {
+    ++received_sequence_;
+    acknowledge_due =
+        received_sequence_ - acknowledged_sequence_ >= kAcknowledgeInterval;
+  }
+
+  switch (receive_packet_header_.type_) {
+    case PacketType::kVersion:
+      if (resume_handshake_) {
+        // The remote party's new connection sent this before it knew we were
+        // resuming.
+        break;
+      }
+
+      if (version_ != kNullVersion) {
+        FTL_LOG(ERROR) << "Version packet received out of order";
+        CloseConnection();
+        return;
+      }
+
+      if (receive_packet_header_.payload_size_ != sizeof(uint32_t)) {
+        FTL_LOG(ERROR) << "Version packet has bad payload size "
                        << receive_packet_header_.payload_size_;
         CloseConnection();
         return;
       }
 
-      task_runner_->PostTask([ this, service_name = ParsePayloadString() ]() {
+      version_ = ParsePayloadUint32();
+
+      if (version_ < kMinSupportedVersion) {
+        FTL_LOG(ERROR) << "Unsupported version " << version_;
+        CloseConnection();
+        return;
+      }
+
+      {
+        uint32_t remote_version = version_;
+
+        if (version_ > kVersion) {
+          version_ = kVersion;
+        }
+
+        if (resumption_enabled_ && initiate_session_ &&
+            version_ >= kResumptionVersion) {
+          StartSession();
+        }
+
+        // Large messages waiting for the version can be sent now.
+        if (!send_streams_.empty() && !write_waiting_ && !connecting_) {
+          WriteSendPackets();
+        }
+
+        // For the connecting party, the version arrives about one round trip
+        // after the connect completes, because the remote party sends its
+        // version as soon as it accepts.
+        ftl::TimeDelta handshake_rtt;
+        if (connect_complete_time_ != ftl::TimePoint()) {
+          handshake_rtt = ftl::TimePoint::Now() - connect_complete_time_;
+          connect_complete_time_ = ftl::TimePoint();
+        }
+
+        PostToMain([
+          this, remote_version, negotiated_version = version_, handshake_rtt
+        ]() {
+          LoopMonitor::ScopedTask task(LoopMonitor::Category::kHandshake);
+          negotiated_version_ = negotiated_version;
+          if (handshake_rtt > ftl::TimeDelta::Zero()) {
+            OnRoundTripMeasured(handshake_rtt);
+          }
+
+          OnVersionReceived(remote_version);
+          if (!connection_closed_ && channel_) {
+            // We've postponed setting the channel on the relay until now,
+            // because we don't want messages sent over the network until
+            // the version of the remote party is known.
+            AttachRelay(kPrimaryChannelId, std::move(channel_));
+          }
+
+          if (!connection_closed_ && primary_channel_closed_early_) {
+            primary_channel_closed_early_ = false;
+            ReportChannelClosed(kPrimaryChannelId);
+          }
+        });
+      }
+      break;
+
+    case PacketType::kServiceName:
+      if (version_ == kNullVersion) {
+        FTL_LOG(ERROR) << "Service name packet received when version "
+                          "packet was expected";
+        CloseConnection();
+        return;
+      }
+
+      if (channel_id != kPrimaryChannelId) {
+        FTL_LOG(ERROR) << "Service name packet received on channel "
+                       << channel_id;
+        CloseConnection();
+        return;
+      }
+
+      if (!ValidatePayloadServiceName("Service name")) {
+        CloseConnection();
+        return;
+      }
+
+      PostToMain([ this, service_name = ParsePayloadString() ]() {
+        LoopMonitor::ScopedTask task(LoopMonitor::Category::kHandshake);
+        SetChannelServiceName(kPrimaryChannelId, service_name);
         OnServiceNameReceived(service_name);
       });
       break;
@@ -334,15 +2449,292 @@ void MessageTransciever::OnReceivedPacketComplete() {
         return;
       }
 
-      task_runner_->PostTask([
-        this, payload = std::move(receive_packet_payload_)
-      ]() mutable { OnMessageReceived(std::move(payload)); });
+      DeliverMessage(channel_id, std::move(receive_packet_payload_));
+      break;
+
+    case PacketType::kMessageFragment:
+      if (version_ < kFragmentationVersion) {
+        FTL_LOG(ERROR) << "Fragment packet received on connection that "
+                          "doesn't support fragmentation";
+        CloseConnection();
+        return;
+      }
+
+      OnFragmentReceived();
+      break;
+
+    case PacketType::kOpenChannel:
+      if (version_ < kMultiplexingVersion) {
+        FTL_LOG(ERROR) << "Open channel packet received on connection that "
+                          "doesn't support multiplexing";
+        CloseConnection();
+        return;
+      }
+
+      if (channel_id == kPrimaryChannelId) {
+        FTL_LOG(ERROR) << "Open channel packet received for primary channel";
+        CloseConnection();
+        return;
+      }
+
+      if (!ValidatePayloadServiceName("Open channel")) {
+        CloseConnection();
+        return;
+      }
+
+      if (direct_delivery_) {
+        // Messages on the new channel may arrive before the main thread
+        // supplies the channel.
+        GetDirectChannel(channel_id);
+      }
+
+      PostToMain([
+        this, channel_id, service_name = ParsePayloadString()
+      ]() {
+        LoopMonitor::ScopedTask task(LoopMonitor::Category::kHandshake);
+        SetChannelServiceName(channel_id, service_name);
+        OnChannelRequested(channel_id, service_name);
+      });
+      break;
+
+    case PacketType::kCloseChannel:
+      if (version_ < kMultiplexingVersion) {
+        FTL_LOG(ERROR) << "Close channel packet received on connection that "
+                          "doesn't support multiplexing";
+        CloseConnection();
+        return;
+      }
+
+      if (receive_packet_header_.payload_size_ != 0) {
+        FTL_LOG(ERROR) << "Close channel packet has bad payload size "
+                       << receive_packet_header_.payload_size_;
+        CloseConnection();
+        return;
+      }
+
+      // The sender can't close a channel while sending a fragmented message
+      // on it, so there's nothing to reassemble.
+      if (reassemblies_.erase(channel_id) != 0) {
+        FTL_LOG(ERROR) << "Close channel packet received while a fragmented "
+                          "message was incomplete";
+        CloseConnection();
+        return;
+      }
+
+      PostToMain([this, channel_id]() { OnRemoteChannelClosed(channel_id); });
+      break;
+
+    case PacketType::kPing:
+      if (!ValidateConnectionPacket("Ping", kHeartbeatVersion,
+                                    sizeof(uint64_t))) {
+        CloseConnection();
+        return;
+      }
+
+      OnPingReceived();
+      break;
+
+    case PacketType::kPong:
+      if (!ValidateConnectionPacket("Pong", kHeartbeatVersion,
+                                    sizeof(uint64_t))) {
+        CloseConnection();
+        return;
+      }
+
+      OnPongReceived();
+      break;
+
+    case PacketType::kSession:
+      if (!ValidateConnectionPacket("Session", kResumptionVersion,
+                                    sizeof(uint64_t)) ||
+          !OnSessionReceived()) {
+        CloseConnection();
+        return;
+      }
+      break;
+
+    case PacketType::kAcknowledge:
+      if (!ValidateConnectionPacket("Acknowledge", kResumptionVersion,
+                                    sizeof(uint64_t)) ||
+          !OnAcknowledgeReceived()) {
+        CloseConnection();
+        return;
+      }
+      break;
+
+    case PacketType::kResume:
+      // A resume packet may be the first packet on a connection, so there's
+      // no version to check.
+      if (!ValidateConnectionPacket("Resume", kNullVersion,
+                                    2 * sizeof(uint64_t)) ||
+          !OnResumeReceived()) {
+        CloseConnection();
+        return;
+      }
       break;
 
     default:
       FTL_CHECK(false);  // ParseReceivedBytes shouldn't have let this through.
       break;
   }
+
+  if (acknowledge_due && socket_fd_.is_valid()) {
+    SendAcknowledge();
+  }
+}
+
+bool MessageTransciever::DecompressReceivedPayload() {
+  std::vector<uint8_t> payload;
+  if (!decompressor_.Decompress(receive_packet_payload_.data(),
+                                receive_packet_payload_.size(),
+                                kMaxPayloadSize, &payload)) {
+    BufferPool::Get()->Recycle(std::move(payload));
+    return false;
+  }
+
+  BufferPool::Get()->Recycle(std::move(receive_packet_payload_));
+
+  if (receive_packet_header_.type_ == PacketType::kMessageFragment) {
+    auto iter = reassemblies_.find(receive_packet_header_.channel_);
+    if (iter != reassemblies_.end()) {
+      Reassembly& reassembly = iter->second;
+      if (payload.empty() ||
+          payload.size() > reassembly.size_ - reassembly.message_.size()) {
+        FTL_LOG(ERROR) << "Fragment packet has bad decompressed size "
+                       << payload.size();
+        BufferPool::Get()->Recycle(std::move(payload));
+        return false;
+      }
+
+      receive_payload_base_ = reassembly.message_.size();
+      reassembly.message_.insert(reassembly.message_.end(), payload.begin(),
+                                 payload.end());
+      BufferPool::Get()->Recycle(std::move(payload));
+      receive_packet_payload_ = std::move(reassembly.message_);
+      return true;
+    }
+  }
+
+  receive_packet_payload_ = std::move(payload);
+  return true;
+}
+
+void MessageTransciever::OnFragmentReceived() {
+  uint16_t channel_id = receive_packet_header_.channel_;
+
+  if (receive_payload_base_ == 0) {
+    // This is the first fragment of a message. It starts with the size of the
+    // whole message.
+    uint32_t net_byte_order_size;
+    if (receive_packet_payload_.size() <= sizeof(net_byte_order_size)) {
+      FTL_LOG(ERROR) << "Fragment packet has bad payload size "
+                     << receive_packet_payload_.size();
+      CloseConnection();
+      return;
+    }
+
+    std::memcpy(&net_byte_order_size, receive_packet_payload_.data(),
+                sizeof(net_byte_order_size));
+    size_t message_size = ntohl(net_byte_order_size);
+    size_t fragment_size =
+        receive_packet_payload_.size() - sizeof(net_byte_order_size);
+
+    if (message_size <= fragment_size || message_size > kMaxMessageSize) {
+      FTL_LOG(ERROR) << "Fragment packet has bad message size "
+                     << message_size;
+      CloseConnection();
+      return;
+    }
+
+    if (reassembly_bytes_ + message_size > kMaxReassemblyBytes) {
+      FTL_LOG(ERROR) << "Fragmented messages being reassembled exceed "
+                     << kMaxReassemblyBytes << " bytes";
+      CloseConnection();
+      return;
+    }
+
+    // The message grows as its fragments arrive, so a peer that announces a
+    // large message and sends little of it doesn't get a large buffer.
+    reassembly_bytes_ += message_size;
+    Reassembly& reassembly = reassemblies_[channel_id];
+    reassembly.size_ = message_size;
+    reassembly.start_time_ = receive_packet_start_time_;
+    reassembly.message_.assign(
+        receive_packet_payload_.begin() + sizeof(net_byte_order_size),
+        receive_packet_payload_.end());
+    return;
+  }
+
+  // The fragment was received in place.
+  receive_payload_base_ = 0;
+  auto iter = reassemblies_.find(channel_id);
+  FTL_DCHECK(iter != reassemblies_.end());
+
+  if (receive_packet_payload_.size() == iter->second.size_) {
+    receive_packet_start_time_ = iter->second.start_time_;
+    reassembly_bytes_ -= iter->second.size_;
+    reassemblies_.erase(iter);
+    DeliverMessage(channel_id, std::move(receive_packet_payload_));
+  } else {
+    iter->second.message_ = std::move(receive_packet_payload_);
+  }
+}
+
+void MessageTransciever::DeliverMessage(uint16_t channel_id,
+                                        std::vector<uint8_t> message) {
+  messages_received_.fetch_add(1, std::memory_order_relaxed);
+
+  if (direct_delivery_) {
+    DeliverMessageDirect(channel_id, std::move(message));
+    return;
+  }
+
+  ReceiveTrace trace;
+  if (tracing_) {
+    trace.start_time_ = receive_packet_start_time_;
+    trace.complete_time_ = ftl::TimePoint::Now();
+  }
+
+  PostToMain([ this, channel_id, trace,
+               message = std::move(message) ]() mutable {
+    LoopMonitor::ScopedTask task(LoopMonitor::Category::kRelayWrite);
+    ftl::TimePoint handle_time =
+        tracing_ ? ftl::TimePoint::Now() : ftl::TimePoint();
+
+    if (channel_id == kPrimaryChannelId) {
+      OnMessageReceived(std::move(message));
+    } else {
+      OnChannelMessageReceived(channel_id, std::move(message));
+    }
+
+    if (tracing_) {
+      RecordReceiveTrace(channel_id, trace, handle_time);
+    }
+  });
+}
+
+MessageTransciever::OutboundPacket::OutboundPacket(
+    PacketType type,
+    uint16_t channel_id,
+    std::vector<uint8_t> payload)
+    : payload_(std::move(payload)),
+      message_bytes_(type == PacketType::kMessage ? payload_.size() : 0) {
+  header_.sentinel_ = kSentinel;
+  header_.type_ = type;
+  header_.channel_ = htons(channel_id);
+  header_.payload_size_ = htonl(payload_.size());
+}
+
+MessageTransciever::OutboundPacket::OutboundPacket(PacketType type,
+                                                   uint16_t channel_id,
+                                                   SharedMessage payload)
+    : shared_payload_(std::move(payload)),
+      message_bytes_(type == PacketType::kMessage ? shared_payload_->size()
+                                                  : 0) {
+  header_.sentinel_ = kSentinel;
+  header_.type_ = type;
+  header_.channel_ = htons(channel_id);
+  header_.payload_size_ = htonl(shared_payload_->size());
 }
 
 uint32_t MessageTransciever::ParsePayloadUint32() {
@@ -353,9 +2745,399 @@ uint32_t MessageTransciever::ParsePayloadUint32() {
   return ntohl(net_byte_order_result);
 }
 
+uint64_t MessageTransciever::ParsePayloadUint64(size_t offset) {
+  FTL_DCHECK(receive_packet_payload_.size() >= offset + sizeof(uint64_t));
+  uint64_t result = 0;
+  for (size_t i = 0; i < sizeof(uint64_t); ++i) {
+    result = (result << 8) | receive_packet_payload_[offset + i];
+  }
+
+  return result;
+}
+
 std::string MessageTransciever::ParsePayloadString() {
   return std::string(reinterpret_cast<char*>(receive_packet_payload_.data()),
                      receive_packet_payload_.size());
 }
 
+bool MessageTransciever::ValidatePayloadServiceName(const char* packet_name) {
+  if (receive_packet_header_.payload_size_ == 0 ||
+      receive_packet_header_.payload_size_ > kMaxServiceNameLength) {
+    FTL_LOG(ERROR) << packet_name << " packet has bad payload size "
+                   << receive_packet_header_.payload_size_;
+    return false;
+  }
+
+  return true;
+}
+
+bool MessageTransciever::ValidateConnectionPacket(const char* packet_name,
+                                                  uint32_t min_version,
+                                                  size_t payload_size) {
+  if (version_ < min_version) {
+    FTL_LOG(ERROR) << packet_name
+                   << " packet received on connection with version "
+                   << version_;
+    return false;
+  }
+
+  if (receive_packet_header_.channel_ != kPrimaryChannelId) {
+    FTL_LOG(ERROR) << packet_name << " packet received on channel "
+                   << receive_packet_header_.channel_;
+    return false;
+  }
+
+  if (receive_packet_header_.payload_size_ != payload_size) {
+    FTL_LOG(ERROR) << packet_name << " packet has bad payload size "
+                   << receive_packet_header_.payload_size_;
+    return false;
+  }
+
+  return true;
+}
+
+void MessageTransciever::OnPingReceived() {
+  // The pong is an opportunity to acknowledge numbered packets.
+  SendAcknowledge();
+
+  std::vector<uint8_t> payload(receive_packet_payload_.begin(),
+                               receive_packet_payload_.end());
+  PushControlPacket(
+      OutboundPacket(PacketType::kPong, kPrimaryChannelId, std::move(payload)));
+}
+
+void MessageTransciever::OnPongReceived() {
+  ftl::TimeDelta rtt = ftl::TimePoint::Now().ToEpochDelta() -
+                       ftl::TimeDelta::FromNanoseconds(
+                           static_cast<int64_t>(ParsePayloadUint64(0)));
+  if (rtt < ftl::TimeDelta::Zero()) {
+    // The pong doesn't answer one of our pings.
+    return;
+  }
+
+  heartbeat_rtt_ns_.store(rtt.ToNanoseconds(), std::memory_order_relaxed);
+  PostToMain([this, rtt]() { OnRoundTripMeasured(rtt); });
+}
+
+void MessageTransciever::PushControlPacket(OutboundPacket packet) {
+  // Control packets go ahead of everything but a packet that's partially
+  // written, so queued bulk data doesn't delay them.
+  auto position = send_packets_.begin();
+  if (send_offset_ != 0) {
+    ++position;
+  }
+
+  send_packets_bytes_ += packet.size();
+  send_packets_.insert(position, std::move(packet));
+
+  if (socket_fd_.is_valid() && !write_waiting_ && !connecting_) {
+    WriteSendPackets();
+  }
+}
+
+void MessageTransciever::StartSession() {
+  FTL_DCHECK(session_id_ == 0);
+
+  std::random_device random_device;
+  while (session_id_ == 0) {
+    session_id_ = (static_cast<uint64_t>(random_device()) << 32) ^
+                  static_cast<uint64_t>(random_device());
+  }
+
+  // Packets queued from here on are numbered.
+  std::vector<uint8_t> payload;
+  AppendUint64(session_id_, &payload);
+  PushSendPacket(
+      OutboundPacket(PacketType::kSession, kPrimaryChannelId, payload));
+  sending_sequenced_ = true;
+
+  if (!write_waiting_ && !connecting_) {
+    WriteSendPackets();
+  }
+}
+
+void MessageTransciever::SendAcknowledge() {
+  if (!receiving_sequenced_ || received_sequence_ == acknowledged_sequence_) {
+    return;
+  }
+
+  acknowledged_sequence_ = received_sequence_;
+
+  std::vector<uint8_t> payload;
+  AppendUint64(received_sequence_, &payload);
+  PushControlPacket(
+      OutboundPacket(PacketType::kAcknowledge, kPrimaryChannelId, payload));
+}
+
+bool MessageTransciever::OnSessionReceived() {
+  uint64_t session_id = ParsePayloadUint64(0);
+
+  if (initiate_session_) {
+    if (session_id_ == 0 || receiving_sequenced_ ||
+        (session_id != 0 && session_id != session_id_)) {
+      FTL_LOG(ERROR) << "Unexpected session packet received";
+      return false;
+    }
+
+    if (session_id == 0) {
+      // The remote party declined the session.
+      session_id_ = 0;
+      sending_sequenced_ = false;
+      for (OutboundPacket& packet : replay_packets_) {
+        BufferPool::Get()->Recycle(std::move(packet.payload_));
+      }
+
+      replay_packets_.clear();
+      replay_bytes_ = 0;
+      return true;
+    }
+  } else {
+    if (session_id == 0 || session_id_ != 0) {
+      FTL_LOG(ERROR) << "Unexpected session packet received";
+      return false;
+    }
+
+    std::vector<uint8_t> payload;
+    if (!resumption_enabled_) {
+      AppendUint64(0, &payload);
+      PushSendPacket(
+          OutboundPacket(PacketType::kSession, kPrimaryChannelId, payload));
+      if (!write_waiting_ && !connecting_) {
+        WriteSendPackets();
+      }
+
+      return true;
+    }
+
+    // Packets queued from here on are numbered.
+    session_id_ = session_id;
+    AppendUint64(session_id, &payload);
+    PushSendPacket(
+        OutboundPacket(PacketType::kSession, kPrimaryChannelId, payload));
+    sending_sequenced_ = true;
+
+    if (!write_waiting_ && !connecting_) {
+      WriteSendPackets();
+    }
+  }
+
+  // Packets received from here on are numbered.
+  receiving_sequenced_ = true;
+  PostToMain([this, session_id]() { established_session_id_ = session_id; });
+  return true;
+}
+
+bool MessageTransciever::OnAcknowledgeReceived() {
+  uint64_t received_count = ParsePayloadUint64(0);
+
+  if (!sending_sequenced_ || received_count > sent_sequence_) {
+    FTL_LOG(ERROR) << "Unexpected acknowledge packet received";
+    return false;
+  }
+
+  while (replay_base_ < received_count) {
+    FTL_DCHECK(!replay_packets_.empty());
+    replay_bytes_ -= replay_packets_.front().size();
+    BufferPool::Get()->Recycle(std::move(replay_packets_.front().payload_));
+    replay_packets_.pop_front();
+    ++replay_base_;
+  }
+
+  return true;
+}
+
+bool MessageTransciever::OnResumeReceived() {
+  uint64_t session_id = ParsePayloadUint64(0);
+  uint64_t received_count = ParsePayloadUint64(sizeof(uint64_t));
+
+  if (resume_handshake_) {
+    if (session_id != session_id_) {
+      FTL_LOG(ERROR) << "Resume packet received for a different session";
+      return false;
+    }
+
+    resume_handshake_ = false;
+    if (!Replay(received_count)) {
+      return false;
+    }
+
+    PostToMain([this]() { OnSocketResumed(); });
+    WriteSendPackets();
+    return true;
+  }
+
+  if (version_ != kNullVersion || initiate_session_ || !resumption_enabled_) {
+    FTL_LOG(ERROR) << "Unexpected resume packet received";
+    return false;
+  }
+
+  // Nothing more should arrive until the socket is handed off, but we stop
+  // receiving to be sure.
+  PauseReceiving();
+  PostToMain([this, session_id, received_count]() {
+    OnResumeRequested(session_id, received_count);
+  });
+  return true;
+}
+
+void MessageTransciever::RetainForReplay(OutboundPacket packet) {
+  ++sent_sequence_;
+
+  // The packet's message bytes and timestamps have been reported already.
+  packet.message_bytes_ = 0;
+  packet.enqueue_time_ = ftl::TimePoint();
+
+  replay_bytes_ += packet.size();
+  replay_packets_.push_back(std::move(packet));
+
+  while (replay_bytes_ > kMaxReplayBytes) {
+    replay_bytes_ -= replay_packets_.front().size();
+    BufferPool::Get()->Recycle(std::move(replay_packets_.front().payload_));
+    replay_packets_.pop_front();
+    ++replay_base_;
+  }
+}
+
+bool MessageTransciever::Replay(uint64_t received_count) {
+  FTL_DCHECK(send_offset_ == 0);
+
+  if (received_count < replay_base_ || received_count > sent_sequence_) {
+    FTL_LOG(WARNING) << "Can't resume session, remote party has received "
+                     << received_count << " packets, and we have packets "
+                     << replay_base_ << " through " << sent_sequence_;
+    return false;
+  }
+
+  while (replay_base_ < received_count) {
+    replay_bytes_ -= replay_packets_.front().size();
+    BufferPool::Get()->Recycle(std::move(replay_packets_.front().payload_));
+    replay_packets_.pop_front();
+    ++replay_base_;
+  }
+
+  // The packets are numbered again as they're written.
+  sent_sequence_ = replay_base_;
+  while (!replay_packets_.empty()) {
+    OutboundPacket& packet = replay_packets_.back();
+    send_packets_bytes_ += packet.size();
+    send_packets_.push_front(std::move(packet));
+    replay_packets_.pop_back();
+  }
+
+  replay_bytes_ = 0;
+  return true;
+}
+
+bool MessageTransciever::WriteResumePacket() {
+  std::vector<uint8_t> payload;
+  AppendUint64(session_id_, &payload);
+  AppendUint64(received_sequence_, &payload);
+  acknowledged_sequence_ = received_sequence_;
+  OutboundPacket packet(PacketType::kResume, kPrimaryChannelId, payload);
+
+  // The socket has only just connected, so it has room for the whole packet.
+  struct iovec iov[] = {{&packet.header_, sizeof(PacketHeader)},
+                        {packet.payload_.data(), packet.payload_.size()}};
+  ssize_t result = writev(socket_fd_.get(), iov, 2);
+  if (result != static_cast<ssize_t>(packet.size())) {
+    FTL_LOG(WARNING) << "Failed to send resume packet, errno " << errno;
+    return false;
+  }
+
+  bytes_sent_.fetch_add(result, std::memory_order_relaxed);
+  return true;
+}
+
+void MessageTransciever::OnSocketFailed() {
+  if (!socket_fd_.is_valid()) {
+    return;
+  }
+
+  if (session_id_ == 0 || !receiving_sequenced_ || !SuspendSocket()) {
+    CloseSocket();
+  }
+}
+
+bool MessageTransciever::SuspendSocket() {
+  FTL_DCHECK(socket_fd_.is_valid());
+
+  // Unnumbered data wouldn't be replayed.
+  for (const OutboundPacket& packet : send_packets_) {
+    if (!packet.sequenced_ && IsSequenced(packet.header_.type_)) {
+      return false;
+    }
+  }
+
+  FTL_VLOG(1) << "Suspending session " << session_id_;
+
+  read_waiter_.Cancel();
+  write_waiter_.Cancel();
+  alternate_waiter_.Cancel();
+  read_waiting_ = false;
+  write_waiting_ = false;
+  connecting_ = false;
+  resume_handshake_ = false;
+  send_backlog_start_time_ = ftl::TimePoint();
+  socket_fd_.reset();
+  alternate_socket_fd_.reset();
+
+  // Control packets are specific to the socket, and numbered packets that
+  // were partially written are sent again from the start.
+  std::deque<OutboundPacket> packets;
+  packets.swap(send_packets_);
+  send_packets_bytes_ = 0;
+  send_offset_ = 0;
+  for (OutboundPacket& packet : packets) {
+    if (packet.sequenced_) {
+      send_packets_bytes_ += packet.size();
+      send_packets_.push_back(std::move(packet));
+    } else {
+      BufferPool::Get()->Recycle(std::move(packet.payload_));
+    }
+  }
+
+  socket_suspended_ = true;
+  PostToMain([this]() { OnSocketSuspended(); });
+  return true;
+}
+
+void MessageTransciever::ResetReceiveState() {
+  if (receive_packet_offset_ >= sizeof(PacketHeader) &&
+      receive_packet_header_.type_ == PacketType::kMessageFragment &&
+      !receive_compressed_) {
+    auto iter = reassemblies_.find(receive_packet_header_.channel_);
+    if (iter != reassemblies_.end() && iter->second.message_.empty()) {
+      // The fragment was being received into the message being reassembled.
+      // Put the message back without the partial fragment.
+      receive_packet_payload_.resize(receive_payload_base_);
+      iter->second.message_ = std::move(receive_packet_payload_);
+    }
+  }
+
+  receive_packet_offset_ = 0;
+  receive_payload_base_ = 0;
+  receive_compressed_ = false;
+}
+
+void MessageTransciever::OnSocketSuspended() {
+  if (connection_closed_) {
+    return;
+  }
+
+  if (!suspended_) {
+    suspended_ = true;
+    suspend_time_ = ftl::TimePoint::Now();
+  }
+
+  ++suspension_count_;
+  OnConnectionSuspended();
+}
+
+void MessageTransciever::OnSocketResumed() {
+  suspended_ = false;
+  heartbeat_bytes_received_ = bytes_received_.load(std::memory_order_relaxed);
+  heartbeats_missed_ = 0;
+  ping_sent_ = false;
+}
+
 }  // namespace netconnector
@@ -4,17 +4,38 @@
 
 #pragma once
 
-#include <queue>
-#include <thread>
+#include <atomic>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <string>
+#include <unordered_map>
+#include <utility>
 #include <vector>
 
+#include <arpa/inet.h>
+#include <sys/uio.h>
+
 #include <mx/channel.h>
+#include <mx/vmo.h>
 
+#include "apps/netconnector/lib/async_wait.h"
 #include "apps/netconnector/lib/message_relay.h"
+#include "apps/netconnector/src/latency_tracer.h"
+#include "apps/netconnector/src/message_priority.h"
+#include "apps/netconnector/src/socket_address.h"
+#include "apps/netconnector/src/spsc_queue.h"
+#include "apps/netconnector/src/stream_compression.h"
+#include "apps/netconnector/src/token_bucket.h"
+#include "apps/netconnector/src/transceiver_stats.h"
+#include "apps/netconnector/src/transport_profile.h"
+#include "apps/netconnector/src/watermarks.h"
 #include "lib/ftl/files/unique_fd.h"
-#include "lib/ftl/synchronization/mutex.h"
-#include "lib/ftl/synchronization/thread_annotations.h"
+#include "lib/ftl/functional/closure.h"
 #include "lib/ftl/tasks/task_runner.h"
+#include "lib/ftl/time/time_delta.h"
+#include "lib/ftl/time/time_point.h"
+#include "lib/mtl/tasks/fd_waiter.h"
 
 namespace netconnector {
 
@@ -24,18 +45,30 @@ All packets conform to the following format:
 
     sentinel     (1 byte, 0xcc)
     type         (1 byte)
-    channel      (2 bytes, 0x0000)
+    channel      (2 bytes)
     payload size (4 bytes)
     payload      (<payload size> bytes)
 
-The sentinel is just a sanity check, and the channel isn't used (always zeros).
-All integers are in big-endian order.
+The sentinel is just a sanity check. The channel identifies the logical
+channel to which the packet applies and must be zero prior to version 2. All
+integers are in big-endian order.
 
 Here are the types:
 
     version        (0x00) indicates the version of the sender
     service name   (0x01) indicates the name of the desired service
     message        (0x02) contains a message
+    open channel   (0x03) opens a logical channel (version 2)
+    close channel  (0x04) closes a logical channel (version 2)
+    fragment       (0x05) contains part of a large message (version 3)
+    ping           (0x06) requests a pong packet (version 5)
+    pong           (0x07) responds to a ping packet (version 5)
+    session        (0x08) proposes or accepts a resumable session (version 6)
+    acknowledge    (0x09) acknowledges received packets (version 6)
+    resume         (0x0a) resumes a session on a new connection (version 6)
+
+Starting with version 4, the high bit of the type (0x80) may be set on message
+and fragment packets to indicate that the payload is compressed.
 
 A version packet has a 4-byte payload specifying the version of the sender.
 Version packets are sent by both sides upon connection establishment. The format
@@ -44,11 +77,86 @@ version numbers. If either party isn't backward-compatible to that version, it
 must close the connection.
 
 A service name packet's payload consists of a string identifying the desired
-service. The requestor sends a service name packet after the version packets
-are exchanged. If the remote party doesn't recognize the service name,
-it must close the connection.
+service. The requestor sends a service name packet immediately after its
+version packet, without waiting for the remote party's version packet. If the
+remote party doesn't recognize the service name, it must close the connection.
+The service name packet always applies to channel zero, the primary channel.
+
+Until the requestor has received the remote party's version packet, it may
+only send packets in the version 1 format: the service name packet and message
+packets on the primary channel. This allows application data to flow without
+waiting a round trip for the version exchange. The remote party validates this
+traffic against the version established by the requestor's version packet.
+
+A message packet contains a message intended for the requestor/service on the
+indicated channel.
+
+Starting with version 2, a connection can carry any number of logical
+channels. The requestor opens a channel by sending an open channel packet with
+an unused non-zero channel id. The payload of the open channel packet is the
+name of the desired service, as with the service name packet. Either party
+may close a channel, including the primary channel, by sending a close
+channel packet with an empty payload. When the last open channel on a
+connection is closed, the requestor may keep the connection open to carry
+channels opened later, so the remote party must not close the connection on
+that account. In version 1, closing the primary channel closes the
+connection.
+
+Starting with version 3, a large message may be sent as a sequence of
+fragment packets on its channel rather than as a single message packet. The
+payload of the first fragment packet of a message starts with the 4-byte size
+of the whole message, followed by the first part of the message. The payloads
+of subsequent fragment packets contain the rest of the message, in order. The
+message is complete when the indicated number of bytes has been received.
+The whole message must be larger than the message part carried by the first
+fragment packet. Until the message is complete, no other packets may be sent
+on that channel, but packets for other channels may be interleaved with the
+fragment packets. This allows messages larger than the maximum payload size
+and keeps large messages from delaying small messages on other channels.
 
-A message packet contains a message intended for the requestor/service.
+Starting with version 4, the payloads of message and fragment packets may be
+compressed. Compressed payloads on a connection form a single raw deflate
+stream (RFC 1951) in each direction, flushed at the end of each payload with
+a sync flush, so every compressed payload can be decompressed on arrival
+using the history of the payloads before it. A compressed payload must
+decompress to a valid payload for the packet type. Compression is at the
+sender's discretion, so small or incompressible payloads may be sent as is.
+
+Starting with version 5, either party may send a ping packet to check that the
+connection is alive. The payload of a ping packet is 8 bytes chosen by the
+sender, typically a timestamp. The receiving party must respond promptly with
+a pong packet carrying the same payload. Ping and pong packets use channel
+zero but apply to the connection as a whole, so they may be interleaved with
+the fragment packets of a message on the primary channel.
+
+Starting with version 6, a connection may be resumed on a new connection if
+it fails. After the version exchange, the requestor may propose a session by
+sending a session packet whose payload is an 8-byte non-zero session id. The
+remote party accepts by sending a session packet with the same id or declines
+by sending one with an id of zero. Once a party has sent a session packet
+with a non-zero id, it numbers the packets it sends after that, starting at
+zero, and keeps the packets it has sent until they're acknowledged. The
+requestor stops numbering packets if its proposal is declined. Version, ping,
+pong, session, acknowledge and resume packets aren't numbered, and numbered
+packets aren't compressed. A party acknowledges the numbered packets it has
+received by sending an acknowledge packet whose 8-byte payload is the number
+of numbered packets received so far. Acknowledge packets may be sent at any
+time, like ping packets.
+
+If the connection fails, the requestor may open a new connection and send a
+resume packet instead of a version packet. The payload of a resume packet is
+the 8-byte session id followed by the 8-byte number of numbered packets the
+sender has received. Having sent the resume packet, the requestor sends
+nothing more until it receives a resume packet in response. The remote party
+responds with a resume packet carrying the same id and the number of numbered
+packets it has received, followed by the numbered packets it sent that the
+requestor hasn't received. The requestor then sends the numbered packets that
+the remote party hasn't received, and the connection carries on as before.
+The new connection has no version exchange of its own, although the remote
+party's version packet may precede its resume packet and is ignored. If the
+remote party doesn't recognize the session or no longer has packets that the
+requestor hasn't received, it closes the new connection, and the requestor
+must consider the session closed.
 
 If either party receives a malformed packet, it must close the connection.
 
@@ -59,45 +167,272 @@ If either party receives a malformed packet, it must close the connection.
 //
 // MessageTransciever is not thread-safe. All methods calls must be serialized.
 // All overridables will be called on the same thread on which the transceiver
-// was constructed.
+// was constructed. Socket I/O is done on a thread shared with other
+// transceivers (see SocketReactor), and the socket is non-blocking.
 class MessageTransciever {
  public:
+  // A message sent on several connections, which share it rather than each
+  // having a copy.
+  using SharedMessage = std::shared_ptr<const std::vector<uint8_t>>;
+
+  // Called when a message sent with SendSharedMessage has been written to the
+  // socket, with true, or when the connection closes before it's written,
+  // with false.
+  using DeliveryCallback = std::function<void(bool)>;
+
+  // Returns the size of the largest message that can be sent with
+  // SendSharedMessage.
+  static size_t max_shared_message_size() { return kMaxPayloadSize; }
+
   virtual ~MessageTransciever();
 
+  // Returns statistics for the connection.
+  TransceiverStats GetStats() const;
+
+  // Returns the number of channels open on the connection, including the
+  // primary channel. Must be called on the main thread.
+  size_t channel_count() const { return channels_.size(); }
+
+  // Returns the number of logical channels to |service_name| that are open
+  // on the connection, not counting the primary channel.
+  size_t LogicalChannelCount(const std::string& service_name) const;
+
+  // Checks that the remote party is still responsive and sends it a ping.
+  // Intended to be called periodically. If nothing has been received from the
+  // remote party over |max_missed| consecutive calls, the connection is
+  // closed. Does nothing if the remote party doesn't support heartbeats.
+  void Heartbeat(uint32_t max_missed);
+
+  // Returns the id of the connection's session, which is zero if there's no
+  // session.
+  uint64_t session_id() const { return established_session_id_; }
+
+  // Indicates whether the connection's socket has failed and the session
+  // hasn't been resumed.
+  bool is_suspended() const { return suspended_; }
+
+  // Returns the number of times the connection has been suspended.
+  uint64_t suspension_count() const { return suspension_count_; }
+
+  // Returns when the connection was suspended, if it's suspended.
+  ftl::TimePoint suspend_time() const { return suspend_time_; }
+
+  // Closes the connection, handing its socket to the caller. This is used
+  // on a connection on which the remote party has requested resumption (see
+  // OnResumeRequested). Returns an invalid descriptor if the socket can't be
+  // handed off.
+  ftl::UniqueFD DetachSocket();
+
+  // Resumes a session on |socket_fd|, which was taken with DetachSocket from
+  // the connection on which the remote party requested resumption.
+  // |received_count| is from the request. If the connection isn't suspended,
+  // its socket is abandoned first. If the session can't be resumed, the
+  // connection is closed.
+  void ResumeConnected(ftl::UniqueFD socket_fd, uint64_t received_count);
+
  protected:
-  MessageTransciever(ftl::UniqueFD socket_fd);
+  // Constructs a transceiver for a connected socket. If |direct_delivery| is
+  // true, messages received from the socket are written to their channels
+  // directly by the I/O thread rather than being forwarded via the main
+  // thread. In that case, OnMessageReceived isn't called.
+  MessageTransciever(ftl::UniqueFD socket_fd, bool direct_delivery);
+
+  // Constructs a transceiver for a socket on which a non-blocking connect is
+  // in progress. Nothing is sent or received until the connect completes.
+  // Packets sent in the meantime are queued. If the connect fails or doesn't
+  // complete within |connect_timeout|, the connection is closed.
+  MessageTransciever(ftl::UniqueFD socket_fd,
+                     ftl::TimeDelta connect_timeout,
+                     bool direct_delivery);
+
+  // Constructs a transceiver as above that races the connect in progress on
+  // |socket_fd| against a connect to |alternate_address| on
+  // |alternate_socket_fd| (RFC 8305). The alternate connect is started if the
+  // first hasn't completed after a short delay or fails. Whichever connect
+  // completes first is used, and the other socket is closed. If
+  // |alternate_socket_fd| is invalid, this is the same as the above.
+  MessageTransciever(ftl::UniqueFD socket_fd,
+                     ftl::UniqueFD alternate_socket_fd,
+                     const SocketAddress& alternate_address,
+                     ftl::TimeDelta connect_timeout,
+                     bool direct_delivery);
 
-  // Sets the channel that the transceiver should use to forward messages.
+  // Sets the channel that the transceiver should use to forward messages on
+  // the primary channel. Messages aren't forwarded until the version exchange
+  // completes.
   void SetChannel(mx::channel channel);
 
+  // Sets the channel that the transceiver should use to forward messages on
+  // the primary channel, forwarding messages immediately rather than waiting
+  // for the version exchange. This is safe, because messages on the primary
+  // channel have the same format in all versions.
+  void SetChannelEarly(mx::channel channel);
+
+  // Sets the channel that the transceiver should use to forward messages on
+  // the logical channel identified by |channel_id|. This is used to accept
+  // a channel requested by the remote party (see OnChannelRequested).
+  void SetChannel(uint16_t channel_id, mx::channel channel);
+
+  // Opens a logical channel to |service_name| on the remote party, forwarding
+  // messages for the new channel to and from |channel|. May only be called if
+  // |is_multiplexed()| is true.
+  void OpenChannel(const std::string& service_name, mx::channel channel);
+
+  // Opens a logical channel to |service_name| on the remote party, sends
+  // |message| on it and closes it. |message| isn't copied, and it's sent as a
+  // single packet, never as fragments. It must not be empty or larger than
+  // |max_shared_message_size()|. May only be called if |is_multiplexed()| is
+  // true.
+  void SendSharedMessage(const std::string& service_name,
+                         SharedMessage message,
+                         const DeliveryCallback& callback);
+
   // Sends a service name.
   void SendServiceName(const std::string& service_name);
 
-  // Sends a message.
+  // Sends a message on the primary channel.
   void SendMessage(std::vector<uint8_t> message);
 
+  // Sets limits on the number of bytes and packets the I/O thread will
+  // coalesce into a single write. Queued packets beyond these limits are sent
+  // in subsequent writes. A limit of zero leaves the default in place, which
+  // is |kDefaultMaxSendBatchBytes| or |kDefaultMaxSendBatchPackets|.
+  void SetSendBatchLimits(size_t max_bytes, size_t max_packets);
+
   // Closes the connection.
   void CloseConnection();
 
+  // Enables session resumption (see the protocol description above). If
+  // |initiate| is true, a session is proposed once the version exchange shows
+  // that the remote party supports resumption. Otherwise, sessions proposed
+  // by the remote party are accepted. When the socket of a connection with a
+  // session fails, OnConnectionSuspended is called rather than
+  // OnConnectionClosed, and the channels remain open.
+  void EnableResumption(bool initiate);
+
+  // Limits the bandwidth of the connection as a whole with |token_bucket|, in
+  // addition to the limits on its channels' services. Messages on all
+  // channels are metered, but other packets aren't.
+  void SetDeviceTokenBucket(std::shared_ptr<TokenBucket> token_bucket);
+
+  // Resumes a suspended session on |socket_fd|, on which a non-blocking
+  // connect is in progress. Used by the party that proposed the session. If
+  // the connect or the resume exchange fails, OnConnectionSuspended is called
+  // again, unless the remote party refuses to resume, in which case the
+  // connection is closed.
+  void ResumeConnecting(ftl::UniqueFD socket_fd,
+                        ftl::TimeDelta connect_timeout);
+
   // Called when a version is received.
   virtual void OnVersionReceived(uint32_t version) = 0;
 
   // Called when a service name is received.
   virtual void OnServiceNameReceived(const std::string& service_name) = 0;
 
-  // Called when a message is received. The default implementation puts the
-  // message on the channel supplied by SetChannel.
+  // Called when the remote party opens a logical channel. The implementation
+  // should accept the channel by calling |SetChannel(channel_id, channel)|.
+  virtual void OnChannelRequested(uint16_t channel_id,
+                                  const std::string& service_name) = 0;
+
+  // Called when a message is received on the primary channel. The default
+  // implementation puts the message on the channel supplied by SetChannel.
+  // Not called if direct delivery is enabled.
   virtual void OnMessageReceived(std::vector<uint8_t> message);
 
   // Called when the connection closes. The default implementation does nothing.
   virtual void OnConnectionClosed();
 
+  // Called when the last open channel on a multiplexed connection closes. The
+  // default implementation closes the connection.
+  virtual void OnIdle();
+
+  // Called when the socket of a connection with a session fails. Queued
+  // packets are kept until the session is resumed. The default
+  // implementation closes the connection.
+  virtual void OnConnectionSuspended();
+
+  // Called when the remote party asks to resume the session identified by
+  // |session_id| on this new connection. |received_count| is the number of
+  // numbered packets the remote party has received. The implementation should
+  // hand the socket to the transceiver with the session (see DetachSocket and
+  // ResumeConnected) or close the connection. The default implementation
+  // closes the connection.
+  virtual void OnResumeRequested(uint64_t session_id,
+                                 uint64_t received_count);
+
+  // Returns the flow control watermarks for a channel connected to the
+  // service named |service_name|. Messages from the channel are queued for
+  // the socket until the high watermark is reached, at which point reading
+  // from the channel pauses until the queue drains to the low watermark. The
+  // same watermarks bound the messages queued for the channel, and the
+  // socket isn't read while any channel's queue is full. The default
+  // implementation returns default watermarks.
+  virtual Watermarks GetWatermarks(const std::string& service_name);
+
+  // Returns the socket options for a connection carrying the service named
+  // |service_name|. When a connection carries several services, the profiles
+  // are merged (see TransportProfile::Merge). The default implementation
+  // returns the default profile.
+  virtual TransportProfile GetTransportProfile(const std::string& service_name);
+
+  // Returns the size at and above which messages on a channel connected to
+  // the service named |service_name| are moved between the channel and the
+  // transceiver in VMOs, or zero if VMO messages aren't used for the service
+  // (see vmo_message.h). The default implementation returns zero.
+  virtual size_t GetVmoThreshold(const std::string& service_name);
+
+  // Returns how long a message on a channel connected to the service named
+  // |service_name| may wait to be sent, in either direction. Messages that
+  // are still waiting when the lifetime is up are discarded unsent, unless
+  // sending has already started. Zero means messages never expire. The
+  // default implementation returns zero.
+  virtual ftl::TimeDelta GetMessageLifetime(const std::string& service_name);
+
+  // Returns the token bucket that limits the bandwidth of channels connected
+  // to the service named |service_name|, or null if their bandwidth isn't
+  // limited. The default implementation returns null.
+  virtual std::shared_ptr<TokenBucket> GetTokenBucket(
+      const std::string& service_name);
+
+  // Returns the priority class for a channel connected to the service named
+  // |service_name|. Packets on high priority channels are written ahead of
+  // those on normal priority channels. The default implementation returns
+  // |MessagePriority::kNormal|.
+  virtual MessagePriority GetPriority(const std::string& service_name);
+
+  // Called when a round trip time to the remote party has been measured,
+  // either from the version exchange of a connection this party initiated or
+  // from a heartbeat. The default implementation does nothing.
+  virtual void OnRoundTripMeasured(ftl::TimeDelta rtt);
+
+  // Called when |bytes| have been written to the socket over |duration| while
+  // the socket was backed up, which indicates the throughput of the path to
+  // the remote party. The default implementation does nothing.
+  virtual void OnThroughputMeasured(uint64_t bytes, ftl::TimeDelta duration);
+
+  // Indicates whether the connection can carry more than one logical channel.
+  // Always false prior to the call to OnVersionReceived.
+  bool is_multiplexed() const {
+    return negotiated_version_ >= kMultiplexingVersion;
+  }
+
+  // Indicates whether the connection has been closed or is closing.
+  bool is_closed() const { return connection_closed_; }
+
  private:
   enum class PacketType : uint8_t {
     kVersion = 0,
     kServiceName = 1,
     kMessage = 2,
-    kMax = 2
+    kOpenChannel = 3,
+    kCloseChannel = 4,
+    kMessageFragment = 5,
+    kPing = 6,
+    kPong = 7,
+    kSession = 8,
+    kAcknowledge = 9,
+    kResume = 10,
+    kMax = 10
   };
 
   struct __attribute__((packed)) PacketHeader {
@@ -107,30 +442,528 @@ class MessageTransciever {
     uint32_t payload_size_;
   };
 
-  static const size_t kRecvBufferSize = 2048;
+  // The receive buffer is sized to hold |kRecvBufferPacketCount| packets of
+  // the average size observed, within these bounds. Payloads that don't fit
+  // in the receive buffer are received directly into the payload vector.
+  static const size_t kMinRecvBufferSize = 2048;
+  static const size_t kMaxRecvBufferSize = 16384;
+  static const size_t kRecvBufferPacketCount = 4;
   static const uint8_t kSentinel = 0xcc;
+  // Set in the type of a packet whose payload is compressed.
+  static const uint8_t kCompressedFlag = 0x80;
+  // Message payloads smaller than this aren't worth compressing.
+  static const size_t kMinCompressedPayloadSize = 256;
   // TODO(dalesat): Make this larger when mx::channel messages can be larger.
   static const uint32_t kMaxPayloadSize = 65536;
-  static const uint32_t kVersion = 1;
+  // The maximum size of a message sent as fragments.
+  static const size_t kMaxMessageSize = 16 * 1024 * 1024;
+  // The most bytes of fragmented messages, by their announced sizes, that may
+  // be in reassembly at once on a connection.
+  static const size_t kMaxReassemblyBytes = 2 * kMaxMessageSize;
+  // Messages larger than this are sent as fragments of at most this size, if
+  // the remote party supports fragmentation.
+  static const size_t kMaxFragmentSize = 16384;
+  static const uint32_t kVersion = 6;
   static const uint32_t kNullVersion = 0;
   static const uint32_t kMinSupportedVersion = 1;
+  // The first version that supports logical channels.
+  static const uint32_t kMultiplexingVersion = 2;
+  // The first version that supports fragmented messages.
+  static const uint32_t kFragmentationVersion = 3;
+  // The first version that supports compressed payloads.
+  static const uint32_t kCompressionVersion = 4;
+  // The first version that supports ping and pong packets.
+  static const uint32_t kHeartbeatVersion = 5;
+  // The first version that supports resumable sessions.
+  static const uint32_t kResumptionVersion = 6;
+  // Numbered packets are acknowledged after this many are received and when
+  // a ping is received.
+  static const uint64_t kAcknowledgeInterval = 32;
+  // The most bytes of sent packets kept for a session until they're
+  // acknowledged. If more are unacknowledged, the oldest are discarded, and
+  // the session may not be resumable.
+  static const size_t kMaxReplayBytes = 1024 * 1024;
+  static const uint16_t kPrimaryChannelId = 0;
   static const size_t kMaxServiceNameLength = 1024;
+  static const size_t kDefaultMaxSendBatchBytes = 256 * 1024;
+  static const size_t kDefaultMaxSendBatchPackets = 64;
+  // Writes use two iovecs per packet, and the maximum must stay well within
+  // IOV_MAX.
+  static const size_t kMaxSendBatchPackets = 256;
+  // When both priority classes have packets waiting, the normal priority
+  // class gets a turn, writing one packet or fragment, after this many bytes
+  // of high priority packets.
+  static const size_t kHighPriorityQuantum = 64 * 1024;
+  // Limits the number of reads done in response to a single readiness
+  // notification so one busy connection can't starve the others sharing the
+  // I/O thread.
+  static const size_t kMaxReadsPerWait = 16;
+  // How long a connect has to complete before a connect to the alternate
+  // address is started (RFC 8305 section 5).
+  static const ftl::TimeDelta kConnectionAttemptDelay;
+  // Periods in which the socket is backed up are reported as throughput
+  // samples if at least this many bytes are written in them. Shorter
+  // periods say more about the socket buffer than about the path.
+  static const uint64_t kMinThroughputSampleBytes = 256 * 1024;
+
+  // State for a logical channel. Accessed on the main thread only.
+  struct Channel {
+    std::unique_ptr<MessageRelay> relay_;
+    Watermarks watermarks_;
+    // Bytes of messages from the relay not yet written to the socket.
+    size_t send_queue_bytes_ = 0;
+    // How long messages from the relay may wait to be sent, or zero.
+    ftl::TimeDelta message_lifetime_;
+    // Whether the I/O thread has a token bucket for the channel.
+    bool rate_limited_ = false;
+    bool reading_paused_ = false;
+    bool write_queue_full_ = false;
+  };
+
+  // A packet waiting to be sent.
+  struct OutboundPacket {
+    OutboundPacket() : message_bytes_(0) {}
+
+    OutboundPacket(PacketType type,
+                   uint16_t channel_id,
+                   std::vector<uint8_t> payload);
+
+    OutboundPacket(PacketType type, uint16_t channel_id, SharedMessage payload);
+
+    // Returns the payload, which is |shared_payload_| if that's set.
+    const std::vector<uint8_t>& payload() const {
+      return shared_payload_ ? *shared_payload_ : payload_;
+    }
+
+    // Returns the total size of the packet in bytes.
+    size_t size() const { return sizeof(header_) + payload().size(); }
+
+    // Returns the id of the channel to which the packet applies.
+    uint16_t channel_id() const { return ntohs(header_.channel_); }
+
+    PacketHeader header_;
+    std::vector<uint8_t> payload_;
+    // Set instead of |payload_| for a shared message. Shared payloads aren't
+    // compressed or fragmented.
+    SharedMessage shared_payload_;
+    // The number of bytes of message content in the packet.
+    size_t message_bytes_;
+    // Indicates whether the packet is numbered for the session.
+    bool sequenced_ = false;
+    // The priority of the packet's channel, set when the packet is queued.
+    MessagePriority priority_ = MessagePriority::kNormal;
+    // When the message was queued on the main thread and picked up by the
+    // I/O thread. Set only when tracing. For a fragmented message, only the
+    // last fragment carries these.
+    ftl::TimePoint enqueue_time_;
+    ftl::TimePoint drain_time_;
+    // When the message expires, or ftl::TimePoint() if it doesn't. Set only
+    // for message packets.
+    ftl::TimePoint deadline_;
+  };
+
+  // Timestamps for a message that has been written to the socket.
+  struct SendTrace {
+    uint16_t channel_id_;
+    ftl::TimePoint enqueue_time_;
+    ftl::TimePoint drain_time_;
+    ftl::TimePoint write_time_;
+  };
+
+  // Timestamps for a message that has been received from the socket.
+  struct ReceiveTrace {
+    ftl::TimePoint start_time_;
+    ftl::TimePoint complete_time_;
+  };
+
+  // Packets for a channel on which a large message is being sent as
+  // fragments. Accessed on the I/O thread only.
+  struct SendStream {
+    // The first packet is the message being fragmented. The others are
+    // packets for the same channel held back until the message is sent.
+    std::deque<OutboundPacket> packets_;
+    // The number of bytes of the first packet's payload already fragmented.
+    size_t offset_ = 0;
+  };
+
+  // Packets of one priority class waiting to be moved to |send_packets_|.
+  // All the packets for a channel are in the same lane, so they're written in
+  // the order they were queued. Accessed on the I/O thread only.
+  struct SendLane {
+    // Packets that are sent whole, in the order they were queued.
+    std::deque<OutboundPacket> packets_;
+    // The channels in |send_streams_| in this lane, in the order in which
+    // they're serviced.
+    std::deque<uint16_t> stream_order_;
+  };
+
+  // Packets for a channel that are waiting for tokens. Once a channel is
+  // throttled, all its packets wait here in order until it has tokens
+  // again. Accessed on the I/O thread only.
+  struct ThrottledChannel {
+    std::deque<OutboundPacket> packets_;
+    // The lane of the channel's send stream, if the stream is waiting too.
+    // The stream is returned to the lane when |packets_| has been sent.
+    SendLane* stream_lane_ = nullptr;
+  };
+
+  // A channel to which the I/O thread writes received messages directly.
+  // Messages are queued until the main thread supplies the channel and while
+  // the channel is full. Accessed on the I/O thread only.
+  struct DirectChannel {
+    mx::channel channel_;
+    Watermarks watermarks_;
+    size_t vmo_threshold_ = 0;
+    ftl::TimeDelta message_lifetime_;
+    // The VMO holding the message at the front of |messages_|, if it couldn't
+    // be written yet.
+    mx::vmo vmo_to_write_;
+    std::deque<std::vector<uint8_t>> messages_;
+    // When each message in |messages_| expires, or ftl::TimePoint() if it
+    // doesn't.
+    std::deque<ftl::TimePoint> deadlines_;
+    size_t message_bytes_ = 0;
+    bool full_ = false;
+    // Set when the main thread releases the channel. The channel is deleted
+    // when its queued messages have been written.
+    bool released_ = false;
+    // Set when a write fails. Subsequent messages are discarded.
+    bool failed_ = false;
+    AsyncWait write_wait_;
+  };
+
+  // A fragmented message being received. Accessed on the I/O thread only.
+  struct Reassembly {
+    std::vector<uint8_t> message_;
+    size_t size_;
+    // When the first fragment started arriving. Set only when tracing.
+    ftl::TimePoint start_time_;
+  };
+
+  MessageTransciever(ftl::UniqueFD socket_fd,
+                     ftl::UniqueFD alternate_socket_fd,
+                     const SocketAddress& alternate_address,
+                     bool connecting,
+                     ftl::TimeDelta connect_timeout,
+                     bool direct_delivery);
+
+  // Determines whether packets of type |type| are numbered in a session.
+  static bool IsSequenced(PacketType type);
+
+  // Appends |value| to |payload| in big-endian order.
+  static void AppendUint64(uint64_t value, std::vector<uint8_t>* payload);
 
   // Sends a version packet.
   void SendVersionPacket();
 
-  // Sends a packet. Must be called in the send thread.
-  void SendPacket(PacketType type, const void* payload, size_t payload_size);
+  // Adds a packet to the send queue, scheduling a drain of the queue on the
+  // I/O thread if one isn't already scheduled.
+  void EnqueuePacket(PacketType type,
+                     uint16_t channel_id,
+                     std::vector<uint8_t> payload);
+
+  // Adds message packets for a logical channel to the send queue, scheduling
+  // a single drain for all of them.
+  void EnqueueMessagePackets(uint16_t channel_id,
+                             std::vector<std::vector<uint8_t>> messages);
+
+  // Schedules a drain of the send queue if one isn't already scheduled.
+  void ScheduleDrain();
+
+  // Creates a relay for the indicated logical channel.
+  void AttachRelay(uint16_t channel_id, mx::channel channel);
+
+  // Merges |profile| into |transport_profile_|, updating the socket options
+  // if that changes anything.
+  void ApplyTransportProfile(const TransportProfile& profile);
+
+  // Sets the socket options specified by |profile|. Must be called on the I/O
+  // thread.
+  void SetSocketOptions(const TransportProfile& profile);
+
+  // Sets the options in |profile| on |fd|.
+  static void SetSocketOptions(int fd, const TransportProfile& profile);
+
+  // Sends a message on a logical channel, pausing reads from the channel's
+  // relay if too many of its messages are waiting to be written.
+  void SendChannelMessage(uint16_t channel_id, std::vector<uint8_t> message);
+
+  // Sends a batch of messages read from a channel's relay.
+  void SendChannelMessages(uint16_t channel_id,
+                           std::vector<std::vector<uint8_t>> messages);
+
+  // Charges |byte_count| bytes against a channel's send queue, pausing reads
+  // from the channel's relay if the high watermark is reached.
+  void AddChannelSendQueueBytes(uint16_t channel_id, size_t byte_count);
+
+  // Called on the main thread when messages have been written to the socket.
+  // |sent| gives the number of message bytes written for each channel.
+  // |traces| has timestamps for the messages if tracing is enabled.
+  void OnMessagesSent(const std::vector<std::pair<uint16_t, size_t>>& sent,
+                      const std::vector<SendTrace>& traces);
+
+  // Records the latencies for a received message that the main thread
+  // started handling at |handle_time|.
+  void RecordReceiveTrace(uint16_t channel_id,
+                          const ReceiveTrace& trace,
+                          ftl::TimePoint handle_time);
 
-  // Worker for the receive thread.
-  void ReceiveWorker();
+  // Called when a relay's write queue crosses a watermark.
+  void OnRelayWriteQueueFull(uint16_t channel_id, bool full);
 
-  // Parses |byte_count| received bytes from |receive_buffer_|.
+  // Adjusts |full_write_queue_count_|, pausing or resuming receipt from the
+  // socket as it leaves or reaches zero.
+  void UpdateFullWriteQueueCount(bool increment);
+
+  // Called when the local end of a logical channel closes.
+  void OnRelayClosed(uint16_t channel_id);
+
+  // Tells the remote party that a channel has closed, closing the connection
+  // if the connection isn't multiplexed or no channels remain open. Must not
+  // be called before the version exchange completes.
+  void ReportChannelClosed(uint16_t channel_id);
+
+  // Called when the remote party closes a logical channel.
+  void OnRemoteChannelClosed(uint16_t channel_id);
+
+  // Called when a message arrives for a logical channel other than the
+  // primary channel.
+  void OnChannelMessageReceived(uint16_t channel_id,
+                                std::vector<uint8_t> message);
+
+  // Removes the relay for a logical channel from |channels_|, deferring its
+  // destruction so it's safe to call from the relay's callbacks. Returns
+  // false if there's no such relay.
+  bool ReleaseRelay(uint16_t channel_id);
+
+  // Allocates an unused logical channel id.
+  uint16_t AllocateChannelId();
+
+  // Calls and removes the delivery callback for the shared message sent on
+  // |channel_id|, if there is one.
+  void CompleteDelivery(uint16_t channel_id, bool delivered);
+
+  // Records the name of the service connected to a channel, along with the
+  // priority of the channel's packets.
+  void SetChannelServiceName(uint16_t channel_id,
+                             const std::string& service_name);
+
+  // Returns the priority of the packets for a channel.
+  MessagePriority ChannelPriority(uint16_t channel_id) const;
+
+  // Returns when a message queued now on a channel expires, or
+  // ftl::TimePoint() if messages on the channel don't expire.
+  ftl::TimePoint MessageDeadline(uint16_t channel_id) const;
+
+  // Moves the packets in the send queue to the send lanes and writes as many
+  // as the socket will accept. Must be called on the I/O thread.
+  void DrainSendQueue();
+
+  // Determines whether |packet| must be sent using a send stream.
+  bool NeedsSendStream(const OutboundPacket& packet);
+
+  // Moves packets from the send lanes to |send_packets_| until
+  // |send_packets_| holds at least |byte_count| bytes or the lanes are
+  // exhausted (see SelectSendLane). Must be called on the I/O thread.
+  void FillSendPackets(size_t byte_count);
+
+  // Determines whether |lane| has a packet or fragment that can be sent.
+  bool IsSendLaneReady(const SendLane& lane) const;
+
+  // Returns the lane from which the next packet or fragment should be taken,
+  // or nullptr if no lane is ready. The high priority lane is preferred
+  // unless it has had |kHighPriorityQuantum| bytes since the normal priority
+  // lane last had a turn.
+  SendLane* SelectSendLane();
+
+  // Moves a packet from |lane| to |send_packets_|. Whole packets are taken
+  // first. Otherwise, a fragment or packet is taken from each of the lane's
+  // send streams in turn.
+  void TakeFromSendLane(SendLane* lane);
+
+  // Discards |packet| if it's a message whose deadline has passed, reporting
+  // its bytes as sent so the channel's backpressure is relieved. Returns true
+  // if the packet was discarded. Must be called on the I/O thread.
+  bool DiscardIfExpired(OutboundPacket* packet);
+
+  // Moves |packet| to |throttled_channels_| if its channel is throttled or
+  // it's a message that must wait for tokens, charging the token buckets
+  // otherwise. Returns true if the packet was moved. Must be called on the
+  // I/O thread.
+  bool ThrottlePacket(OutboundPacket* packet);
+
+  // Determines whether the send stream for |channel_id| in |lane| must wait
+  // for tokens and, if so, takes it out of the lane until it needn't. Must
+  // be called on the I/O thread.
+  bool ThrottleStream(uint16_t channel_id, SendLane* lane);
+
+  // Returns how long a message on |channel_id| must wait for tokens. Must be
+  // called on the I/O thread.
+  ftl::TimeDelta ThrottleDelay(uint16_t channel_id, ftl::TimePoint now);
+
+  // Spends tokens for |bytes| sent on |channel_id|. Must be called on the I/O
+  // thread.
+  void ChargeTokenBuckets(uint16_t channel_id,
+                          size_t bytes,
+                          ftl::TimePoint now);
+
+  // Arranges for ReleaseThrottledPackets to be called after |delay|, unless
+  // it's already due to be called sooner. Must be called on the I/O thread.
+  void ScheduleThrottleWake(ftl::TimeDelta delay);
+
+  // Sends the throttled packets for which there are now tokens and returns
+  // unthrottled send streams to their lanes. Must be called on the I/O
+  // thread.
+  void ReleaseThrottledPackets();
+
+  // Adds a packet to |send_packets_|, compressing its payload if that's
+  // worthwhile. Packets must be added in the order in which they're written
+  // to the socket, because compressed payloads share a stream.
+  void PushSendPacket(OutboundPacket packet);
+
+  // Replaces the payload of |packet| with its compressed equivalent.
+  void CompressPacket(OutboundPacket* packet);
+
+  // Writes packets from |send_packets_| until it's empty or the socket would
+  // block, coalescing them into as few writes as the send batch limits allow.
+  // If the socket would block, waits for it to become writable. Must be called
+  // on the I/O thread.
+  void WriteSendPackets();
+
+  // Posts a call to OnMessagesSent to the main thread if |sent| or
+  // |send_traces_| isn't empty. Must be called on the I/O thread.
+  void ReportMessagesSent(std::vector<std::pair<uint16_t, size_t>> sent);
+
+  // Ends the current send backlog period, if there is one, posting a call to
+  // OnThroughputMeasured to the main thread if enough was written during it.
+  // Must be called on the I/O thread when all packets have been written.
+  void ReportSendBacklogCleared();
+
+  // Posts |task| to the main thread. The task is dropped if the transceiver
+  // is destroyed before it runs. Used for all tasks the I/O thread posts
+  // there, because pooled agents may be destroyed with such tasks queued.
+  void PostToMain(ftl::Closure task);
+
+  // Waits for a connect in progress to complete. Must be called on the I/O
+  // thread.
+  void WaitForConnected(ftl::TimeDelta timeout);
+
+  // Called on the I/O thread when a connect in progress completes or times
+  // out.
+  void OnConnected(mx_status_t status);
+
+  // Starts the connect to |alternate_address_|. Must be called on the I/O
+  // thread.
+  void StartAlternateConnect();
+
+  // Called on the I/O thread when the connect to |alternate_address_|
+  // completes or times out.
+  void OnAlternateConnected(mx_status_t status);
+
+  // Called on the I/O thread when the connect on |socket_fd_| has completed
+  // successfully.
+  void OnConnectComplete();
+
+  // Determines whether a connect that completed with |status| succeeded on
+  // |fd|, logging the failure if not.
+  static bool ConnectSucceeded(mx_status_t status, int fd);
+
+  // Determines whether TCP fast open deferred the connect on |fd| until the
+  // first write, in which case the socket is writable before the handshake.
+  static bool ConnectDeferred(int fd);
+
+  // Fails the socket if nothing has been received on it by
+  // |connect_deadline_|, so the connect timeout still applies to a deferred
+  // connect. Must be called on the I/O thread.
+  void WatchDeferredConnect();
+
+  // Starts waiting for the socket to become readable. Must be called on the
+  // I/O thread.
+  void WaitForReadable();
+
+  // Stops receiving from the socket until ResumeReceiving is called. Calls
+  // nest, so receiving resumes when each call has been matched by a call to
+  // ResumeReceiving. Must be called on the I/O thread.
+  void PauseReceiving();
+
+  // Resumes receiving from the socket after a call to PauseReceiving. Must be
+  // called on the I/O thread.
+  void ResumeReceiving();
+
+  // Returns the direct channel for |channel_id|, creating it if it doesn't
+  // exist. Must be called on the I/O thread.
+  DirectChannel* GetDirectChannel(uint16_t channel_id);
+
+  // Supplies the channel to which messages for |channel_id| are written
+  // directly. Must be called on the I/O thread.
+  void InstallDirectChannel(uint16_t channel_id,
+                            mx::channel channel,
+                            const Watermarks& watermarks,
+                            size_t vmo_threshold,
+                            ftl::TimeDelta message_lifetime);
+
+  // Indicates that the main thread has released the relay for |channel_id|.
+  // Must be called on the I/O thread.
+  void ReleaseDirectChannel(uint16_t channel_id);
+
+  // Writes a received message directly to its channel, queuing it if the
+  // channel isn't available. Must be called on the I/O thread.
+  void DeliverMessageDirect(uint16_t channel_id, std::vector<uint8_t> message);
+
+  // Writes queued messages to a direct channel until the queue is empty or
+  // the channel is full. Must be called on the I/O thread.
+  void WriteDirectMessages(uint16_t channel_id);
+
+  // Deletes a direct channel. Must be called on the I/O thread.
+  void EraseDirectChannel(uint16_t channel_id);
+
+  // Called on the I/O thread when the socket becomes readable.
+  void OnReadable(mx_status_t status, uint32_t events);
+
+  // Receives once from the socket, either into |receive_buffer_| or, if the
+  // rest of the current payload won't fit there, directly into
+  // |receive_packet_payload_|. Returns the result from recv.
+  ssize_t Receive();
+
+  // Resizes |receive_buffer_| based on |average_packet_size_|.
+  void AdaptReceiveBufferSize();
+
+  // Closes the socket and notifies the owner on the main thread. Must be
+  // called on the I/O thread.
+  void CloseSocket();
+
+  // Closes all the relays and calls OnConnectionClosed.
+  void OnSocketClosed();
+
+  // Parses |byte_count| received bytes from |receive_buffer_|. Headers that
+  // are entirely in the buffer are decoded directly. Headers that straddle
+  // buffers are accumulated incrementally.
   void ParseReceivedBytes(size_t byte_count);
 
+  // Validates and converts the header of the current packet and prepares to
+  // receive its payload. Returns false if the header is invalid.
+  bool OnReceivedHeaderComplete();
+
   // Called when a complete packet has been received.
   void OnReceivedPacketComplete();
 
+  // Prepares |receive_packet_payload_| for the payload of the packet whose
+  // header has just been received. Returns false if the packet is invalid.
+  bool PrepareReceivePayload();
+
+  // Replaces |receive_packet_payload_| with its decompressed equivalent. If
+  // the packet is a fragment of a message being reassembled, the fragment is
+  // appended to the message, and the message becomes the payload, as if the
+  // fragment had been received in place. Returns false if the payload is
+  // invalid.
+  bool DecompressReceivedPayload();
+
+  // Called when a complete fragment packet has been received.
+  void OnFragmentReceived();
+
+  // Delivers a complete message to the main thread.
+  void DeliverMessage(uint16_t channel_id, std::vector<uint8_t> message);
+
   // Copies received bytes.
   // |*bytes| points to the received bytes and is increased to reflect the
   //     number of bytes actually copied.
@@ -153,24 +986,253 @@ class MessageTransciever {
   // Parses a uint32 out of receive_buffer_.
   uint32_t ParsePayloadUint32();
 
+  // Parses a big-endian uint64 at |offset| in |receive_packet_payload_|.
+  uint64_t ParsePayloadUint64(size_t offset);
+
   // Parses string out of receive_buffer_.
   std::string ParsePayloadString();
 
+  // Determines whether |receive_packet_payload_| contains a valid service
+  // name, logging an error if not.
+  bool ValidatePayloadServiceName(const char* packet_name);
+
+  // Determines whether the current packet is a valid packet that applies to
+  // the connection as a whole, logging an error if not. Such packets are on
+  // the primary channel and have fixed-size payloads.
+  bool ValidateConnectionPacket(const char* packet_name,
+                                uint32_t min_version,
+                                size_t payload_size);
+
+  // Called on the I/O thread when a ping packet is received. Sends a pong
+  // ahead of any packets that haven't been written yet.
+  void OnPingReceived();
+
+  // Called on the I/O thread when a pong packet is received.
+  void OnPongReceived();
+
+  // Adds an unnumbered packet to |send_packets_| ahead of everything but a
+  // packet that's partially written, and writes it if possible. Must be
+  // called on the I/O thread.
+  void PushControlPacket(OutboundPacket packet);
+
+  // Proposes a session. Must be called on the I/O thread.
+  void StartSession();
+
+  // Sends an acknowledge packet if any numbered packets haven't been
+  // acknowledged. Must be called on the I/O thread.
+  void SendAcknowledge();
+
+  // Called on the I/O thread when a session, acknowledge or resume packet
+  // is received. Returns false if the packet is invalid.
+  bool OnSessionReceived();
+  bool OnAcknowledgeReceived();
+  bool OnResumeReceived();
+
+  // Called on the I/O thread when a numbered packet has been written. Keeps
+  // the packet until it's acknowledged.
+  void RetainForReplay(OutboundPacket packet);
+
+  // Requeues the kept packets that the remote party hasn't received, given
+  // that it has received |received_count| numbered packets. Returns false if
+  // some of those packets have been discarded. Must be called on the I/O
+  // thread.
+  bool Replay(uint64_t received_count);
+
+  // Writes a resume packet to the newly connected socket. Returns false if
+  // the write fails. Must be called on the I/O thread.
+  bool WriteResumePacket();
+
+  // Called on the I/O thread when the socket fails. Suspends the session if
+  // there is one and it can be resumed, and closes the connection otherwise.
+  void OnSocketFailed();
+
+  // Abandons the socket, keeping the session's state for resumption. Returns
+  // false if some sent data would be lost, in which case nothing is changed.
+  // Must be called on the I/O thread.
+  bool SuspendSocket();
+
+  // Resets the state of the packet being received, for resumption on a new
+  // socket. Must be called on the I/O thread.
+  void ResetReceiveState();
+
+  // Called on the main thread when the socket has been suspended or the
+  // session resumed.
+  void OnSocketSuspended();
+  void OnSocketResumed();
+
   ftl::UniqueFD socket_fd_;
+  const bool direct_delivery_;
+  // Indicates whether message latencies are recorded with the LatencyTracer.
+  // Received messages are only traced when they're forwarded via the main
+  // thread, not when they're delivered directly.
+  const bool tracing_;
   ftl::RefPtr<ftl::TaskRunner> task_runner_;
   mx::channel channel_;
-  MessageRelay message_relay_;
+  std::unordered_map<uint16_t, Channel> channels_;
+  std::unordered_map<uint16_t, std::string> channel_service_names_;
+  std::unordered_map<uint16_t, MessagePriority> channel_priorities_;
+  // Callbacks for shared messages that haven't been written yet, by the ids
+  // of the channels they were sent on.
+  std::unordered_map<uint16_t, DeliveryCallback> delivery_callbacks_;
+  TransportProfile transport_profile_;
+  size_t full_write_queue_count_ = 0;
+  const ftl::TimePoint creation_time_;
+  uint64_t messages_sent_ = 0;
+  uint64_t receive_pauses_ = 0;
+  // Messages that expired in the write queues of relays since released.
+  uint64_t released_relay_messages_expired_ = 0;
+  uint16_t next_channel_id_ = 1;
+  uint32_t negotiated_version_ = kNullVersion;
+  bool connection_closed_ = false;
+  bool primary_channel_closed_early_ = false;
+  // |bytes_received_| as of the last call to Heartbeat, and the number of
+  // calls since then in which nothing was received.
+  uint64_t heartbeat_bytes_received_ = 0;
+  uint32_t heartbeats_missed_ = 0;
+  bool ping_sent_ = false;
+  uint64_t established_session_id_ = 0;
+  bool suspended_ = false;
+  uint64_t suspension_count_ = 0;
+  ftl::TimePoint suspend_time_;
 
+  // Accessed on the I/O thread only.
   uint32_t version_ = kNullVersion;
 
-  std::thread receive_thread_;
+  // Session state. |resumption_enabled_| and |initiate_session_| are set on
+  // the main thread. The rest is accessed on the I/O thread only.
+  std::atomic<bool> resumption_enabled_;
+  std::atomic<bool> initiate_session_;
+  uint64_t session_id_ = 0;
+  // Set once this party has sent a session packet with a non-zero id and,
+  // respectively, once the remote party has.
+  bool sending_sequenced_ = false;
+  bool receiving_sequenced_ = false;
+  // Set while the socket is gone and the session may yet be resumed.
+  bool socket_suspended_ = false;
+  // Set while waiting for the remote party's resume packet.
+  bool resume_handshake_ = false;
+  // Numbered packets written to the socket, received from it, and
+  // acknowledged to the remote party.
+  uint64_t sent_sequence_ = 0;
+  uint64_t received_sequence_ = 0;
+  uint64_t acknowledged_sequence_ = 0;
+  // Written numbered packets that haven't been acknowledged. The first is
+  // number |replay_base_|.
+  std::deque<OutboundPacket> replay_packets_;
+  size_t replay_bytes_ = 0;
+  uint64_t replay_base_ = 0;
+
+  ftl::RefPtr<ftl::TaskRunner> io_task_runner_;
+  mtl::FDWaiter read_waiter_;
+  mtl::FDWaiter write_waiter_;
+  bool write_waiting_ = false;
+  bool read_waiting_ = false;
+  // Changed on the I/O thread only. Also read by |Heartbeat|, which must not
+  // count misses while receipt is paused.
+  std::atomic<size_t> receive_pause_count_{0};
+  bool connecting_;
+  // The socket and address for the alternate connect, if there is one. The
+  // socket is invalid if there's no alternate connect or it's been abandoned.
+  // Accessed on the I/O thread only, after construction.
+  ftl::UniqueFD alternate_socket_fd_;
+  SocketAddress alternate_address_;
+  mtl::FDWaiter alternate_waiter_;
+  bool alternate_connect_started_ = false;
+  bool first_connect_failed_ = false;
+  ftl::TimePoint connect_deadline_;
+  // |connect_deadline_| while WatchDeferredConnect is waiting on it.
+  ftl::TimePoint deferred_connect_deadline_;
+  // When the connect completed, until the version is received.
+  ftl::TimePoint connect_complete_time_;
+  // When the socket last backed up with packets waiting, and the bytes
+  // written since. Reset when the packets have all been written.
+  ftl::TimePoint send_backlog_start_time_;
+  uint64_t send_backlog_bytes_ = 0;
+
   std::vector<uint8_t> receive_buffer_;
+  // When the last receive happened and when the current packet started
+  // arriving. Set only when tracing.
+  ftl::TimePoint receive_time_;
+  ftl::TimePoint receive_packet_start_time_;
+  size_t average_packet_size_ = 0;
   size_t receive_packet_offset_ = 0;
   PacketHeader receive_packet_header_;
   std::vector<uint8_t> receive_packet_payload_;
+  // Where the current packet's payload starts in |receive_packet_payload_|.
+  // This is non-zero when a fragment is received directly into the message
+  // being reassembled.
+  size_t receive_payload_base_ = 0;
+  // Indicates whether the current packet's payload is compressed.
+  bool receive_compressed_ = false;
+  StreamDecompressor decompressor_;
+  std::unordered_map<uint16_t, Reassembly> reassemblies_;
+  // The sum of the sizes of the messages in |reassemblies_|.
+  size_t reassembly_bytes_ = 0;
+  std::unordered_map<uint16_t, std::unique_ptr<DirectChannel>>
+      direct_channels_;
+
+  // Packets waiting for the socket to accept them, in the order they're
+  // written. |send_offset_| is the number of bytes of the first packet already
+  // written.
+  std::deque<OutboundPacket> send_packets_;
+  size_t send_packets_bytes_ = 0;
+  size_t send_offset_ = 0;
+
+  // Send streams by channel id.
+  std::unordered_map<uint16_t, SendStream> send_streams_;
+
+  // Packets waiting for |send_packets_| by priority. |high_priority_run_| is
+  // the number of bytes taken from the high priority lane since the normal
+  // priority lane last had a turn.
+  SendLane high_priority_lane_;
+  SendLane normal_priority_lane_;
+  size_t high_priority_run_ = 0;
+
+  // Timestamps for messages written since the last call to
+  // ReportMessagesSent. Used only when tracing.
+  std::vector<SendTrace> send_traces_;
+
+  // Message bytes per channel discarded because they expired since the last
+  // call to ReportMessagesSent.
+  std::vector<std::pair<uint16_t, size_t>> expired_;
+
+  // Token buckets by channel id and for the connection, and the channels
+  // waiting for tokens. |throttle_wake_time_| is when ReleaseThrottledPackets
+  // is next due to be called, or ftl::TimePoint() if it isn't.
+  std::unordered_map<uint16_t, std::shared_ptr<TokenBucket>>
+      channel_token_buckets_;
+  std::shared_ptr<TokenBucket> device_token_bucket_;
+  std::unordered_map<uint16_t, ThrottledChannel> throttled_channels_;
+  ftl::TimePoint throttle_wake_time_;
+  // Referenced weakly by delayed tasks on the I/O thread, which do nothing
+  // once the destructor has reset it there.
+  std::shared_ptr<MessageTransciever*> io_self_;
+  // Referenced weakly by tasks posted to the main thread, which do nothing
+  // once the destructor has reset it. The I/O thread copies
+  // |main_weak_self_|, which never changes after construction.
+  std::shared_ptr<MessageTransciever*> main_self_;
+  std::weak_ptr<MessageTransciever*> main_weak_self_;
+
+  StreamCompressor compressor_;
+  bool compression_failed_ = false;
+
+  // Packets are sent from the main thread to the I/O thread using
+  // |send_queue_|. A drain task is posted to the I/O thread only when
+  // |send_queue_drain_pending_| indicates one isn't already pending.
+  SpscQueue<OutboundPacket> send_queue_;
+  std::atomic<bool> send_queue_drain_pending_;
+  std::atomic<size_t> max_send_batch_bytes_;
+  std::atomic<size_t> max_send_batch_packets_;
 
-  std::thread send_thread_;
-  ftl::RefPtr<ftl::TaskRunner> send_task_runner_;
+  // Statistics maintained on the I/O thread and read on the main thread.
+  std::atomic<uint64_t> bytes_sent_;
+  std::atomic<uint64_t> bytes_received_;
+  std::atomic<uint64_t> messages_received_;
+  std::atomic<uint64_t> send_stalls_;
+  // Messages discarded by the I/O thread because they expired.
+  std::atomic<uint64_t> messages_expired_;
+  // The round trip time of the most recent ping in nanoseconds.
+  std::atomic<int64_t> heartbeat_rtt_ns_;
 
   FTL_DISALLOW_COPY_AND_ASSIGN(MessageTransciever);
 };
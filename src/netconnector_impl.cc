@@ -4,22 +4,213 @@
 
 #include "apps/netconnector/src/netconnector_impl.h"
 
+#include <algorithm>
 #include <iostream>
+#include <map>
+#include <tuple>
 
 #include "apps/netconnector/src/device_service_provider.h"
 #include "apps/netconnector/src/host_name.h"
+#include "apps/netconnector/src/latency_tracer.h"
+#include "apps/netconnector/src/loop_monitor.h"
 #include "apps/netconnector/src/mdns/mdns_names.h"
 #include "apps/netconnector/src/netconnector_params.h"
+#include "lib/ftl/files/directory.h"
 #include "lib/ftl/functional/make_copyable.h"
 #include "lib/ftl/logging.h"
+#include "lib/ftl/strings/string_number_conversions.h"
 #include "lib/mtl/tasks/message_loop.h"
 
 namespace netconnector {
+namespace {
+
+ConnectionStatsPtr ToFidl(const TransceiverStats& stats,
+                          const SocketAddress& address,
+                          bool requestor) {
+  ConnectionStatsPtr result = ConnectionStats::New();
+  result->remote_address = address.is_valid() ? address.ToString() : "";
+  result->requestor = requestor;
+  result->lifetime_ms = stats.lifetime_.ToMilliseconds();
+  result->bytes_sent = stats.bytes_sent_;
+  result->bytes_received = stats.bytes_received_;
+  result->messages_sent = stats.messages_sent_;
+  result->messages_received = stats.messages_received_;
+  result->messages_expired = stats.messages_expired_;
+  result->send_stalls = stats.send_stalls_;
+  result->receive_pauses = stats.receive_pauses_;
+  result->send_queue_bytes = stats.send_queue_bytes_;
+  result->receive_queue_bytes = stats.receive_queue_bytes_;
+  result->channel_count = stats.channel_count_;
+  result->heartbeat_rtt_us = stats.heartbeat_rtt_.ToMicroseconds();
+  return result;
+}
+
+BandwidthStatsPtr ToFidl(const std::string& name,
+                         bool device,
+                         const TokenBucket::State& state) {
+  BandwidthStatsPtr result = BandwidthStats::New();
+  result->name = name;
+  result->device = device;
+  result->rate = state.limit_.rate_;
+  result->burst = state.limit_.burst_;
+  result->tokens = state.tokens_;
+  result->bytes = state.bytes_;
+  result->delays = state.delays_;
+  return result;
+}
+
+DeviceInfoPtr ToFidl(const std::string& device_name,
+                     const DeviceDirectory::Device& device) {
+  DeviceInfoPtr result = DeviceInfo::New();
+  result->device_name = device_name;
+  if (device.addresses_.v4_.is_valid()) {
+    result->v4_address = device.addresses_.v4_.ToString();
+  }
+  if (device.addresses_.v6_.is_valid()) {
+    result->v6_address = device.addresses_.v6_.ToString();
+  }
+  result->services = fidl::Array<fidl::String>::From(device.services_);
+  result->load = device.load_;
+  return result;
+}
+
+void PrintConnectionStats(const ConnectionStats& stats) {
+  std::cout << "    sent " << stats.bytes_sent << " bytes, "
+            << stats.messages_sent << " messages, " << stats.send_stalls
+            << " stalls" << std::endl;
+  std::cout << "    received " << stats.bytes_received << " bytes, "
+            << stats.messages_received << " messages, "
+            << stats.receive_pauses << " pauses" << std::endl;
+  std::cout << "    queued " << stats.send_queue_bytes << " bytes to send, "
+            << stats.receive_queue_bytes << " bytes to deliver, "
+            << stats.channel_count << " channels" << std::endl;
+  if (stats.messages_expired != 0) {
+    std::cout << "    expired " << stats.messages_expired << " messages"
+              << std::endl;
+  }
+}
+
+void PrintStats(const NetConnectorStats& stats) {
+  std::cout << "up " << stats.uptime_ms << " ms, "
+            << stats.connections.size() << " connections open, "
+            << stats.connections_closed << " closed" << std::endl;
+  std::cout << "refused " << stats.connections_refused_limit
+            << " connections over the limit, "
+            << stats.connections_refused_peer_limit << " over the per-peer "
+            << "limit, " << stats.connections_refused_service_limit
+            << " over service limits" << std::endl;
+  std::cout << "totals:" << std::endl;
+  PrintConnectionStats(*stats.totals);
+
+  for (auto& connection : stats.connections) {
+    std::cout << (connection->requestor ? "to " : "from ")
+              << connection->remote_address << ", open "
+              << connection->lifetime_ms << " ms";
+    if (connection->heartbeat_rtt_us != 0) {
+      std::cout << ", round trip " << connection->heartbeat_rtt_us << " us";
+    }
+
+    std::cout << ":" << std::endl;
+    PrintConnectionStats(*connection);
+  }
+
+  for (auto& bandwidth : stats.bandwidth) {
+    std::cout << (bandwidth->device ? "device " : "service ")
+              << bandwidth->name << " limited to " << bandwidth->rate
+              << " bytes/s, burst " << bandwidth->burst << " bytes: "
+              << bandwidth->tokens << " tokens, sent " << bandwidth->bytes
+              << " bytes, " << bandwidth->delays << " delays" << std::endl;
+  }
+
+  for (auto& latency : stats.latencies) {
+    std::cout << latency->service_name << " " << latency->stage << ": "
+              << latency->count << " messages, p50 " << latency->p50_us
+              << " us, p90 " << latency->p90_us << " us, p99 "
+              << latency->p99_us << " us, max " << latency->max_us << " us"
+              << std::endl;
+  }
+
+  for (auto& loop : stats.loop) {
+    std::cout << "main loop " << loop->name << ": " << loop->count
+              << " samples, total " << loop->total_us << " us, p50 "
+              << loop->p50_us << " us, p90 " << loop->p90_us << " us, p99 "
+              << loop->p99_us << " us, max " << loop->max_us << " us"
+              << std::endl;
+  }
+}
+
+void PrintMdnsStats(const MdnsServiceStats& stats) {
+  for (auto& interface : stats.interfaces) {
+    std::cout << "interface " << interface->name << " " << interface->address
+              << ":" << std::endl;
+    std::cout << "    sent " << interface->packets_sent << " packets, "
+              << interface->bytes_sent << " bytes" << std::endl;
+    std::cout << "    received " << interface->packets_received
+              << " packets, " << interface->bytes_received << " bytes, "
+              << interface->parse_failures << " unparseable" << std::endl;
+  }
+
+  for (auto& type : stats.types) {
+    std::cout << type->type << ": questions sent " << type->questions_sent
+              << ", received " << type->questions_received
+              << "; records sent " << type->records_sent << ", received "
+              << type->records_received << std::endl;
+  }
+
+  std::cout << "suppressed " << stats.suppressed_questions << " questions, "
+            << stats.suppressed_records << " records; coalesced "
+            << stats.coalesced_questions << " questions; rate-limited "
+            << stats.rate_limited_records << " records" << std::endl;
+  std::cout << "queued " << stats.question_queue_size << " questions, "
+            << stats.resource_queue_size << " records, "
+            << stats.wake_queue_size << " wakeups" << std::endl;
+  std::cout << "cached " << stats.cache_records << " records, "
+            << stats.cache_bytes << " bytes; evicted "
+            << stats.cache_evictions << " records" << std::endl;
+
+  for (auto& agent : stats.agents) {
+    std::cout << agent->name << ": " << agent->resources_received
+              << " records in " << agent->receive_resource_us << " us, "
+              << agent->end_of_message_count << " message ends in "
+              << agent->end_of_message_us << " us" << std::endl;
+  }
+}
+
+}  // namespace
 
 // static
 const IpPort NetConnectorImpl::kPort = IpPort::From_uint16_t(7777);
 // static
 const std::string NetConnectorImpl::kFuchsiaServiceName = "_fuchsia._tcp.";
+// Leads the text of devices that list their responding services there. The
+// other entries are service names, as keys without values (RFC 6763 section
+// 6.4).
+// static
+const std::string NetConnectorImpl::kServicesTextVersion = "txtvers=1";
+// Also in the text of those devices, followed by the number of connections
+// the device is serving.
+// static
+const std::string NetConnectorImpl::kLoadTextKey = "load=";
+// static
+const ftl::TimeDelta NetConnectorImpl::kLoadUpdateDelay =
+    ftl::TimeDelta::FromSeconds(5);
+// static
+const ftl::TimeDelta NetConnectorImpl::kDeviceFailurePenaltyInterval =
+    ftl::TimeDelta::FromSeconds(30);
+// static
+const ftl::TimeDelta NetConnectorImpl::kFastOpenRetryInterval =
+    ftl::TimeDelta::FromSeconds(600);
+// static
+const ftl::TimeDelta NetConnectorImpl::kNetworkReadyRecheckDelay =
+    ftl::TimeDelta::FromMilliseconds(250);
+// static
+const ftl::TimeDelta NetConnectorImpl::kDeviceChangeCoalescingInterval =
+    ftl::TimeDelta::FromMilliseconds(500);
+// static
+const std::string NetConnectorImpl::kMdnsCacheDirectory = "/data/netconnector";
+// static
+const std::string NetConnectorImpl::kMdnsCacheFileName =
+    "/data/netconnector/mdns_cache";
 
 NetConnectorImpl::NetConnectorImpl(NetConnectorParams* params)
     : params_(params),
@@ -29,7 +220,13 @@ NetConnectorImpl::NetConnectorImpl(NetConnectorParams* params)
       // to obtain a user environment. A RespondingServiceHost should be
       // created with that environment so that responding services are
       // launched in the correct environment.
-      responding_service_host_(application_context_->environment()) {
+      start_time_(ftl::TimePoint::Now()),
+      responding_service_host_(application_context_->environment()),
+      requestor_agent_pool_(this,
+                            params->connect_timeout(),
+                            params->connection_idle_timeout(),
+                            params->max_idle_connections(),
+                            params->multipath()) {
   if (!params->listen()) {
     // Start the listener.
     NetConnectorPtr net_connector =
@@ -41,6 +238,10 @@ NetConnectorImpl::NetConnectorImpl(NetConnectorParams* params)
       mdns_service->SetVerbose(true);
     }
 
+    if (params_->set_mdns_capture_size()) {
+      mdns_service->SetCaptureSize(params_->mdns_capture_size());
+    }
+
     if (params_->show_devices()) {
       net_connector->GetKnownDeviceNames(
           NetConnector::kInitialKnownDeviceNames,
@@ -56,6 +257,34 @@ NetConnectorImpl::NetConnectorImpl(NetConnectorParams* params)
 
             mtl::MessageLoop::GetCurrent()->PostQuitTask();
           }));
+    } else if (params_->show_stats()) {
+      net_connector->GetStats(ftl::MakeCopyable([
+        net_connector = std::move(net_connector)
+      ](NetConnectorStatsPtr stats) {
+        PrintStats(*stats);
+        mtl::MessageLoop::GetCurrent()->PostQuitTask();
+      }));
+    } else if (params_->show_mdns_stats()) {
+      mdns_service->GetStats(ftl::MakeCopyable([
+        mdns_service = std::move(mdns_service)
+      ](MdnsServiceStatsPtr stats) {
+        PrintMdnsStats(*stats);
+        mtl::MessageLoop::GetCurrent()->PostQuitTask();
+      }));
+    } else if (!params_->mdns_capture_file().empty()) {
+      std::string path = params_->mdns_capture_file();
+      mdns_service->WriteCapture(path, ftl::MakeCopyable([
+        path, mdns_service = std::move(mdns_service)
+      ](bool written) {
+        if (written) {
+          std::cout << "Wrote mDNS capture to " << path << std::endl;
+        } else {
+          std::cout << "Failed to write mDNS capture to " << path
+                    << std::endl;
+        }
+
+        mtl::MessageLoop::GetCurrent()->PostQuitTask();
+      }));
     } else {
       mtl::MessageLoop::GetCurrent()->PostQuitTask();
     }
@@ -65,27 +294,58 @@ NetConnectorImpl::NetConnectorImpl(NetConnectorParams* params)
 
   // Running as the listener.
 
+  LatencyTracer::Get()->SetEnabled(params->trace_latency());
+  LoopMonitor::Get()->SetTaskTimingEnabled(params->trace_tasks());
+  if (params->loop_probe_interval() > ftl::TimeDelta::Zero()) {
+    LoopMonitor::Get()->StartProbing(params->loop_probe_interval());
+  }
+
   device_names_publisher_.SetCallbackRunner(
       [this](const GetKnownDeviceNamesCallback& callback, uint64_t version) {
         fidl::Array<fidl::String> device_names =
             fidl::Array<fidl::String>::New(0);
 
-        for (auto& pair : params_->devices()) {
+        for (auto& pair : device_directory_.current()->devices_by_name_) {
           device_names.push_back(pair.first);
         }
 
         callback(version, std::move(device_names));
       });
 
+  // The directory starts out with the devices from the config file.
+  device_directory_.Update(DeviceDirectoryEntries());
+
+  bandwidth_shaper_.SetLimits(params_->service_bandwidth_limits(),
+                              params_->device_bandwidth_limits());
+
   // Register services.
-  for (auto& pair : params->MoveServices()) {
-    responding_service_host_.RegisterSingleton(pair.first,
-                                               std::move(pair.second));
+  for (const std::string& service_name : params->ServiceNames()) {
+    RegisterConfigService(service_name);
   }
 
-  listener_.Start(kPort, [this](ftl::UniqueFD fd) {
-    AddServiceAgent(ServiceAgent::Create(std::move(fd), this));
-  });
+  if (params->fast_open()) {
+    listener_.EnableFastOpen();
+  }
+
+  listener_.Start(kPort,
+                  [this](ftl::UniqueFD fd, const SocketAddress& address) {
+                    // Connections that exceed the limits are closed here,
+                    // before a transceiver and its threads are created.
+                    if (AdmitConnection(address)) {
+                      AddServiceAgent(
+                          ServiceAgent::Create(std::move(fd), address, this));
+                    }
+                  });
+
+  responding_service_host_.LaunchPrelaunchSingletons();
+
+  if (params->heartbeat_interval() > ftl::TimeDelta::Zero()) {
+    ScheduleHeartbeat();
+  }
+
+  if (params->config_check_interval() > ftl::TimeDelta::Zero()) {
+    ScheduleConfigCheck();
+  }
 
   application_context_->outgoing_services()->AddService<NetConnector>(
       [this](fidl::InterfaceRequest<NetConnector> request) {
@@ -108,27 +368,159 @@ void NetConnectorImpl::ReleaseDeviceServiceProvider(
 }
 
 void NetConnectorImpl::ReleaseRequestorAgent(RequestorAgent* requestor_agent) {
-  size_t removed = requestor_agents_.erase(requestor_agent);
-  FTL_DCHECK(removed == 1);
+  AddClosedConnectionStats(requestor_agent->GetStats());
+  requestor_agent_pool_.ReleaseAgent(requestor_agent);
 }
 
 void NetConnectorImpl::ReleaseServiceAgent(ServiceAgent* service_agent) {
+  AddClosedConnectionStats(service_agent->GetStats());
   size_t removed = service_agents_.erase(service_agent);
   FTL_DCHECK(removed == 1);
+  ScheduleLoadUpdate();
+}
+
+bool NetConnectorImpl::AdmitServiceConnection(
+    const std::string& service_name) {
+  size_t max_connections = params_->MaxConnectionsForService(service_name);
+  if (max_connections == 0) {
+    return true;
+  }
+
+  // Logical channels opened on existing connections count against the limit
+  // just as connections do. Closed channels are released by their
+  // transceivers and drop out of the count.
+  size_t count = 0;
+  for (auto& pair : service_agents_) {
+    if (pair.first->service_name() == service_name) {
+      ++count;
+    }
+
+    count += pair.first->LogicalChannelCount(service_name);
+  }
+
+  if (count < max_connections) {
+    return true;
+  }
+
+  FTL_LOG(WARNING) << "Refusing connection to service " << service_name
+                   << ", limit of " << max_connections << " reached";
+  ++connections_refused_service_limit_;
+  return false;
+}
+
+void NetConnectorImpl::OnRoundTripMeasured(const IpAddress& address,
+                                           ftl::TimeDelta rtt) {
+  std::string device_name = DeviceNameForAddress(address);
+  if (!device_name.empty()) {
+    params_->AddRttSample(device_name, rtt);
+  }
+}
+
+void NetConnectorImpl::OnThroughputMeasured(const IpAddress& address,
+                                            uint64_t bytes,
+                                            ftl::TimeDelta duration) {
+  std::string device_name = DeviceNameForAddress(address);
+  if (!device_name.empty()) {
+    params_->AddThroughputSample(device_name, bytes, duration);
+  }
+}
+
+bool NetConnectorImpl::DeviceMayProvideService(
+    const std::string& device_name,
+    const std::string& service_name) const {
+  auto iter = advertisements_by_device_name_.find(device_name);
+  return iter == advertisements_by_device_name_.end() ||
+         iter->second.services_.find(service_name) !=
+             iter->second.services_.end();
+}
+
+bool NetConnectorImpl::ConnectToRemoteService(
+    const SocketAddress& address,
+    const SocketAddress& alternate_address,
+    const std::string& service_name,
+    mx::channel* channel) {
+  return requestor_agent_pool_.ConnectToService(address, alternate_address,
+                                                service_name, channel);
+}
+
+void NetConnectorImpl::OnRequestorAgentIdle(RequestorAgent* requestor_agent) {
+  requestor_agent_pool_.OnAgentIdle(requestor_agent);
+}
+
+void NetConnectorImpl::OnRequestorAgentSuspended(
+    RequestorAgent* requestor_agent) {
+  requestor_agent_pool_.OnAgentSuspended(requestor_agent);
+}
+
+void NetConnectorImpl::OnServiceAgentSuspended(ServiceAgent* service_agent) {
+  uint64_t suspension_count = service_agent->suspension_count();
+  mtl::MessageLoop::GetCurrent()->task_runner()->PostDelayedTask(
+      [this, service_agent, suspension_count]() {
+        if (service_agents_.find(service_agent) != service_agents_.end() &&
+            service_agent->is_suspended() &&
+            service_agent->suspension_count() == suspension_count) {
+          FTL_LOG(WARNING) << "Connection from " << service_agent->address()
+                           << " wasn't resumed in time";
+          service_agent->Close();
+        }
+      },
+      params_->resume_timeout());
+}
+
+void NetConnectorImpl::ResumeServiceAgent(ServiceAgent* new_agent,
+                                          uint64_t session_id,
+                                          uint64_t received_count) {
+  FTL_DCHECK(session_id != 0);
+
+  ServiceAgent* service_agent = nullptr;
+  for (auto& pair : service_agents_) {
+    if (pair.first != new_agent && pair.first->session_id() == session_id) {
+      service_agent = pair.first;
+      break;
+    }
+  }
+
+  if (service_agent == nullptr) {
+    FTL_LOG(WARNING) << "Request from " << new_agent->address()
+                     << " to resume unknown session";
+    new_agent->Close();
+    return;
+  }
+
+  // Detaching the socket closes |new_agent|.
+  ftl::UniqueFD socket_fd = new_agent->DetachSocket();
+  if (!socket_fd.is_valid()) {
+    // The remote requestor will take the closing of the new connection to
+    // mean the session is gone.
+    service_agent->Close();
+    return;
+  }
+
+  service_agent->ResumeConnected(std::move(socket_fd), received_count);
 }
 
 void NetConnectorImpl::GetDeviceServiceProvider(
     const fidl::String& device_name,
     fidl::InterfaceRequest<app::ServiceProvider> request) {
+  if (IsLocalDevice(device_name)) {
+    // Services on this device are provided directly, bypassing the listener
+    // and agents.
+    responding_service_host_.AddBinding(std::move(request));
+    return;
+  }
+
   auto iter = params_->devices().find(device_name);
   if (iter == params_->devices().end()) {
     FTL_LOG(ERROR) << "Unrecognized device name " << device_name;
     return;
   }
 
+  SocketAddress address;
+  SocketAddress alternate_address;
+  GetSocketAddresses(iter->second, &address, &alternate_address);
+
   AddDeviceServiceProvider(DeviceServiceProvider::Create(
-      device_name, SocketAddress(iter->second, kPort), std::move(request),
-      this));
+      device_name, address, alternate_address, std::move(request), this));
 }
 
 void NetConnectorImpl::GetKnownDeviceNames(
@@ -137,11 +529,311 @@ void NetConnectorImpl::GetKnownDeviceNames(
   device_names_publisher_.Get(version_last_seen, callback);
 }
 
+void NetConnectorImpl::GetDeviceDirectory(
+    uint64_t version_last_seen,
+    const GetDeviceDirectoryCallback& callback) {
+  device_directory_.Get(
+      version_last_seen,
+      [callback](const DeviceDirectory::SnapshotPtr& current,
+                 const DeviceDirectory::SnapshotPtr& base) {
+        fidl::Array<DeviceInfoPtr> devices =
+            fidl::Array<DeviceInfoPtr>::New(0);
+        fidl::Array<fidl::String> removed_devices =
+            fidl::Array<fidl::String>::New(0);
+
+        if (!base) {
+          for (auto& pair : current->devices_by_name_) {
+            devices.push_back(ToFidl(pair.first, pair.second));
+          }
+
+          callback(current->version_, true, std::move(devices),
+                   std::move(removed_devices));
+          return;
+        }
+
+        DeviceDirectory::Changes changes =
+            DeviceDirectory::Diff(*base, *current);
+
+        for (const std::string& device_name : changes.changed_) {
+          auto iter = current->devices_by_name_.find(device_name);
+          FTL_DCHECK(iter != current->devices_by_name_.end());
+          devices.push_back(ToFidl(device_name, iter->second));
+        }
+
+        for (const std::string& device_name : changes.removed_) {
+          removed_devices.push_back(device_name);
+        }
+
+        callback(current->version_, false, std::move(devices),
+                 std::move(removed_devices));
+      });
+}
+
+void NetConnectorImpl::ConnectToServiceOnAnyDevice(
+    const fidl::String& service_name,
+    mx::channel channel) {
+  // Among equally loaded devices, the nearest is preferred. Devices with no
+  // round trip time estimate come after those that have one.
+  struct Candidate {
+    bool failed_recently_;
+    uint32_t load_;
+    ftl::TimeDelta rtt_;
+    std::string device_name_;
+    SocketAddress address_;
+    SocketAddress alternate_address_;
+
+    bool operator<(const Candidate& other) const {
+      return std::tie(failed_recently_, load_, rtt_, device_name_) <
+             std::tie(other.failed_recently_, other.load_, other.rtt_,
+                      other.device_name_);
+    }
+  };
+
+  std::vector<Candidate> candidates;
+  ftl::TimePoint now = ftl::TimePoint::Now();
+
+  for (auto& pair : advertisements_by_device_name_) {
+    const std::string& device_name = pair.first;
+    if (pair.second.services_.find(service_name) ==
+        pair.second.services_.end()) {
+      continue;
+    }
+
+    auto device_iter = params_->devices().find(device_name);
+    if (device_iter == params_->devices().end() ||
+        IsLocalDevice(device_name)) {
+      continue;
+    }
+
+    SocketAddress address;
+    SocketAddress alternate_address;
+    GetSocketAddresses(device_iter->second, &address, &alternate_address);
+
+    auto failure_iter = failure_times_by_device_name_.find(device_name);
+    bool failed_recently =
+        failure_iter != failure_times_by_device_name_.end() &&
+        now - failure_iter->second < kDeviceFailurePenaltyInterval;
+
+    const PathMetrics* metrics = params_->PathMetricsForDevice(device_name);
+    ftl::TimeDelta rtt = metrics != nullptr && metrics->rtt_sample_count_ != 0
+                             ? metrics->smoothed_rtt_
+                             : ftl::TimeDelta::Max();
+
+    candidates.push_back({failed_recently, pair.second.load_, rtt, device_name,
+                          address, alternate_address});
+  }
+
+  // Our own channels to each device count toward its load, since its
+  // advertisement may not reflect them yet.
+  requestor_agent_pool_.ForEachAgent([&candidates](
+      const RequestorAgent& agent) {
+    for (Candidate& candidate : candidates) {
+      if (candidate.address_ == agent.address() ||
+          candidate.alternate_address_ == agent.address()) {
+        candidate.load_ += agent.GetStats().channel_count_;
+      }
+    }
+  });
+
+  std::sort(candidates.begin(), candidates.end());
+
+  for (const Candidate& candidate : candidates) {
+    if (ConnectToRemoteService(candidate.address_,
+                               candidate.alternate_address_, service_name,
+                               &channel)) {
+      return;
+    }
+
+    FTL_LOG(WARNING) << "Connection failed, device "
+                     << candidate.device_name_ << ", trying another";
+    failure_times_by_device_name_[candidate.device_name_] = now;
+  }
+
+  FTL_LOG(ERROR) << "No device could be reached for service "
+                 << service_name;
+}
+
+void NetConnectorImpl::SendToDevices(fidl::Array<fidl::String> device_names,
+                                     const fidl::String& service_name,
+                                     fidl::Array<uint8_t> message,
+                                     const SendToDevicesCallback& callback) {
+  // Collects the statuses, which may arrive in any order, and reports them
+  // when the last one does.
+  struct FanOut {
+    void Complete() {
+      FTL_DCHECK(pending_count_ != 0);
+      if (--pending_count_ == 0) {
+        callback_(std::move(statuses_));
+      }
+    }
+
+    fidl::Array<DeliveryStatus> statuses_;
+    size_t pending_count_;
+    SendToDevicesCallback callback_;
+  };
+
+  std::shared_ptr<FanOut> fan_out = std::make_shared<FanOut>();
+  fan_out->statuses_ = fidl::Array<DeliveryStatus>::New(device_names.size());
+  // The extra count keeps the callback from being called before all the
+  // sends have been started.
+  fan_out->pending_count_ = device_names.size() + 1;
+  fan_out->callback_ = callback;
+
+  auto report = [fan_out](size_t index, DeliveryStatus status) {
+    fan_out->statuses_[index] = status;
+    fan_out->Complete();
+  };
+
+  MessageTransciever::SharedMessage shared_message =
+      std::make_shared<const std::vector<uint8_t>>(
+          message.To<std::vector<uint8_t>>());
+  bool valid_message =
+      !shared_message->empty() &&
+      shared_message->size() <= MessageTransciever::max_shared_message_size();
+
+  for (size_t i = 0; i < device_names.size(); ++i) {
+    const std::string& device_name = device_names[i];
+
+    if (!valid_message) {
+      report(i, DeliveryStatus::INVALID_MESSAGE);
+      continue;
+    }
+
+    if (IsLocalDevice(device_name)) {
+      report(i, SendToLocalService(service_name, *shared_message)
+                    ? DeliveryStatus::SENT
+                    : DeliveryStatus::CONNECTION_FAILED);
+      continue;
+    }
+
+    auto iter = params_->devices().find(device_name);
+    if (iter == params_->devices().end()) {
+      report(i, DeliveryStatus::UNKNOWN_DEVICE);
+      continue;
+    }
+
+    if (!DeviceMayProvideService(device_name, service_name)) {
+      report(i, DeliveryStatus::UNKNOWN_SERVICE);
+      continue;
+    }
+
+    SocketAddress address;
+    SocketAddress alternate_address;
+    GetSocketAddresses(iter->second, &address, &alternate_address);
+
+    if (!requestor_agent_pool_.SendToService(
+            address, alternate_address, service_name, shared_message,
+            [report, i](bool delivered) {
+              report(i, delivered ? DeliveryStatus::SENT
+                                  : DeliveryStatus::CONNECTION_FAILED);
+            })) {
+      FTL_LOG(ERROR) << "Connection failed, device " << device_name;
+      report(i, DeliveryStatus::CONNECTION_FAILED);
+    }
+  }
+
+  fan_out->Complete();
+}
+
+void NetConnectorImpl::GetStats(const GetStatsCallback& callback) {
+  NetConnectorStatsPtr stats = NetConnectorStats::New();
+  stats->uptime_ms = (ftl::TimePoint::Now() - start_time_).ToMilliseconds();
+  stats->connections_closed = closed_connection_count_;
+  stats->connections_refused_limit = connections_refused_limit_;
+  stats->connections_refused_peer_limit = connections_refused_peer_limit_;
+  stats->connections_refused_service_limit =
+      connections_refused_service_limit_;
+  stats->connections = fidl::Array<ConnectionStatsPtr>::New(0);
+
+  TransceiverStats totals = closed_connection_stats_;
+
+  requestor_agent_pool_.ForEachAgent(
+      [&totals, &stats](const RequestorAgent& agent) {
+        TransceiverStats agent_stats = agent.GetStats();
+        totals.Add(agent_stats);
+        stats->connections.push_back(
+            ToFidl(agent_stats, agent.address(), true));
+      });
+
+  for (auto& pair : service_agents_) {
+    TransceiverStats agent_stats = pair.first->GetStats();
+    totals.Add(agent_stats);
+    stats->connections.push_back(
+        ToFidl(agent_stats, pair.first->address(), false));
+  }
+
+  stats->totals = ToFidl(totals, SocketAddress(), false);
+
+  stats->bandwidth = fidl::Array<BandwidthStatsPtr>::New(0);
+  ftl::TimePoint now = ftl::TimePoint::Now();
+  for (auto& pair : bandwidth_shaper_.service_buckets()) {
+    stats->bandwidth.push_back(
+        ToFidl(pair.first, false, pair.second->GetState(now)));
+  }
+
+  for (auto& pair : bandwidth_shaper_.device_buckets()) {
+    stats->bandwidth.push_back(
+        ToFidl(pair.first, true, pair.second->GetState(now)));
+  }
+
+  stats->latencies = fidl::Array<LatencyStatsPtr>::New(0);
+  for (const LatencyTracer::Summary& summary :
+       LatencyTracer::Get()->GetSummaries()) {
+    LatencyStatsPtr latency = LatencyStats::New();
+    latency->service_name = summary.service_name_;
+    latency->stage = LatencyTracer::StageName(summary.stage_);
+    latency->count = summary.count_;
+    latency->p50_us = summary.p50_.ToMicroseconds();
+    latency->p90_us = summary.p90_.ToMicroseconds();
+    latency->p99_us = summary.p99_.ToMicroseconds();
+    latency->max_us = summary.max_.ToMicroseconds();
+    stats->latencies.push_back(std::move(latency));
+  }
+
+  stats->loop = fidl::Array<LoopStatsPtr>::New(0);
+  for (const LoopMonitor::Summary& summary :
+       LoopMonitor::Get()->GetSummaries()) {
+    LoopStatsPtr loop = LoopStats::New();
+    loop->name = summary.name_;
+    loop->count = summary.count_;
+    loop->total_us = summary.total_.ToMicroseconds();
+    loop->p50_us = summary.p50_.ToMicroseconds();
+    loop->p90_us = summary.p90_.ToMicroseconds();
+    loop->p99_us = summary.p99_.ToMicroseconds();
+    loop->max_us = summary.max_.ToMicroseconds();
+    stats->loop.push_back(std::move(loop));
+  }
+  callback(std::move(stats));
+}
+
+void NetConnectorImpl::GetDeviceMetrics(
+    const GetDeviceMetricsCallback& callback) {
+  fidl::Array<DeviceMetricsPtr> result = fidl::Array<DeviceMetricsPtr>::New(0);
+
+  for (auto& pair : params_->path_metrics()) {
+    const PathMetrics& metrics = pair.second;
+    DeviceMetricsPtr device_metrics = DeviceMetrics::New();
+    device_metrics->device_name = pair.first;
+    device_metrics->smoothed_rtt_us = metrics.smoothed_rtt_.ToMicroseconds();
+    device_metrics->min_rtt_us = metrics.min_rtt_.ToMicroseconds();
+    device_metrics->rtt_sample_count = metrics.rtt_sample_count_;
+    device_metrics->throughput_bytes_per_sec = metrics.throughput_;
+    device_metrics->throughput_sample_count = metrics.throughput_sample_count_;
+    result.push_back(std::move(device_metrics));
+  }
+
+  callback(std::move(result));
+}
+
 void NetConnectorImpl::RegisterServiceProvider(
     const fidl::String& name,
     fidl::InterfaceHandle<app::ServiceProvider> handle) {
   FTL_LOG(INFO) << "Service '" << name << "' provider registered.";
   responding_service_host_.RegisterProvider(name, std::move(handle));
+
+  if (mdns_started_) {
+    PublishMdnsInstance();
+  }
 }
 
 void NetConnectorImpl::AddDeviceServiceProvider(
@@ -151,58 +843,430 @@ void NetConnectorImpl::AddDeviceServiceProvider(
                                     std::move(device_service_provider));
 }
 
-void NetConnectorImpl::AddRequestorAgent(
-    std::unique_ptr<RequestorAgent> requestor_agent) {
-  RequestorAgent* raw_ptr = requestor_agent.get();
-  requestor_agents_.emplace(raw_ptr, std::move(requestor_agent));
+bool NetConnectorImpl::AdmitConnection(const SocketAddress& address) {
+  if (service_agents_.size() >= params_->max_connections()) {
+    FTL_LOG(WARNING) << "Refusing connection from " << address << ", limit of "
+                     << params_->max_connections() << " reached";
+    ++connections_refused_limit_;
+    return false;
+  }
+
+  size_t peer_count = 0;
+  for (auto& pair : service_agents_) {
+    if (pair.first->address().address() == address.address()) {
+      ++peer_count;
+    }
+  }
+
+  if (peer_count >= params_->max_connections_per_peer()) {
+    FTL_LOG(WARNING) << "Refusing connection from " << address
+                     << ", per-peer limit of "
+                     << params_->max_connections_per_peer() << " reached";
+    ++connections_refused_peer_limit_;
+    return false;
+  }
+
+  return true;
 }
 
 void NetConnectorImpl::AddServiceAgent(
     std::unique_ptr<ServiceAgent> service_agent) {
   ServiceAgent* raw_ptr = service_agent.get();
   service_agents_.emplace(raw_ptr, std::move(service_agent));
+  ScheduleLoadUpdate();
+}
+
+// static
+void NetConnectorImpl::GetSocketAddresses(const DeviceAddresses& addresses,
+                                          SocketAddress* address,
+                                          SocketAddress* alternate_address) {
+  FTL_DCHECK(address != nullptr);
+  FTL_DCHECK(alternate_address != nullptr);
+
+  // V4 is preferred, because V6 addresses discovered via mDNS are usually
+  // link-local, and those don't work everywhere.
+  if (addresses.v4_.is_valid()) {
+    *address = SocketAddress(addresses.v4_, kPort);
+    *alternate_address = addresses.v6_.is_valid()
+                             ? SocketAddress(addresses.v6_, kPort)
+                             : SocketAddress();
+  } else {
+    FTL_DCHECK(addresses.v6_.is_valid());
+    *address = SocketAddress(addresses.v6_, kPort);
+    *alternate_address = SocketAddress();
+  }
+}
+
+bool NetConnectorImpl::SendToLocalService(
+    const std::string& service_name,
+    const std::vector<uint8_t>& message) {
+  mx::channel local;
+  mx::channel remote;
+  mx_status_t status = mx::channel::create(0u, &local, &remote);
+  if (status != NO_ERROR) {
+    FTL_LOG(ERROR) << "Failed to create channel, status " << status;
+    return false;
+  }
+
+  status = local.write(0, message.data(), message.size(), nullptr, 0);
+  if (status != NO_ERROR) {
+    FTL_LOG(ERROR) << "Failed to write to channel, status " << status;
+    return false;
+  }
+
+  // Closing our end leaves the message readable on the service's end.
+  responding_service_host_.services()->ConnectToService(service_name,
+                                                        std::move(remote));
+  return true;
+}
+
+bool NetConnectorImpl::IsLocalDevice(const std::string& device_name) {
+  auto iter = params_->devices().find(device_name);
+  if (iter != params_->devices().end() && iter->second.is_loopback()) {
+    return true;
+  }
+
+  if (host_name_.empty()) {
+    host_name_ = GetHostName();
+  }
+
+  return device_name == host_name_;
+}
+
+std::string NetConnectorImpl::DeviceNameForAddress(
+    const IpAddress& address) const {
+  for (auto& pair : params_->devices()) {
+    if ((pair.second.v4_.is_valid() && pair.second.v4_ == address) ||
+        (pair.second.v6_.is_valid() && pair.second.v6_ == address)) {
+      return pair.first;
+    }
+  }
+
+  return std::string();
+}
+
+void NetConnectorImpl::AddClosedConnectionStats(
+    const TransceiverStats& stats) {
+  closed_connection_stats_.Add(stats);
+  ++closed_connection_count_;
 }
 
 void NetConnectorImpl::StartMdns() {
   // TODO: Remove this check when NET-79 is fixed.
   if (!NetworkIsReady()) {
     mtl::MessageLoop::GetCurrent()->task_runner()->PostDelayedTask(
-        [this]() { StartMdns(); }, ftl::TimeDelta::FromSeconds(5));
+        [this]() { StartMdns(); }, kNetworkReadyRecheckDelay);
     return;
   }
 
   host_name_ = GetHostName();
 
-  if (!mdns_service_impl_.Start(host_name_)) {
-    FTL_LOG(ERROR) << "mDNS failed to start";
-    return;
+  // Devices discovered before a restart are reported again as soon as the
+  // subscription below starts, from the cache, while mDNS confirms them.
+  mdns_service_impl_.SetAggregationWindow(
+      params_->mdns_min_aggregation_window(),
+      params_->mdns_max_aggregation_window());
+
+  if (params_->mdns_receive_threads()) {
+    mdns_service_impl_.EnableReceiveThreads();
+  }
+
+  if (files::CreateDirectory(kMdnsCacheDirectory)) {
+    mdns_service_impl_.SetCacheFile(kMdnsCacheFileName);
+  } else {
+    FTL_LOG(WARNING) << "Couldn't create " << kMdnsCacheDirectory
+                     << ", not saving mDNS cache";
   }
 
-  FTL_LOG(INFO) << "mDNS started, host name " << host_name_;
+  mdns_service_impl_.Start(host_name_, [this](bool started) {
+    if (!started) {
+      FTL_LOG(ERROR) << "mDNS failed to start";
+      return;
+    }
+
+    FTL_LOG(INFO) << "mDNS started, host name " << host_name_;
+
+    mdns_started_ = true;
+    PublishMdnsInstance();
+
+    // Coalescing lets a device's address and SRV records, which may arrive in
+    // separate messages, wake |GetKnownDeviceNames| callers just once.
+    mdns_service_impl_.SubscribeToService(
+        kFuchsiaServiceName, kDeviceChangeCoalescingInterval,
+        [this](const std::string& service_name,
+               const std::string& instance_name,
+               const SocketAddress& v4_address,
+               const SocketAddress& v6_address,
+               const std::vector<std::string>& text) {
+          if (v4_address.is_valid() || v6_address.is_valid()) {
+            DeviceAddresses addresses;
+            if (v4_address.is_valid()) {
+              FTL_LOG(INFO) << "Device '" << instance_name
+                            << "' discovered at address "
+                            << v4_address.address();
+              addresses.v4_ = v4_address.address();
+            }
+
+            if (v6_address.is_valid()) {
+              FTL_LOG(INFO) << "Device '" << instance_name
+                            << "' discovered at address "
+                            << v6_address.address();
+              addresses.v6_ = v6_address.address();
+            }
+
+            bool is_new = params_->devices().find(instance_name) ==
+                          params_->devices().end();
+            params_->RegisterDevice(instance_name, addresses);
+            UpdateDeviceServices(instance_name, text);
+
+            if (is_new && params_->preconnect() &&
+                !IsLocalDevice(instance_name)) {
+              SocketAddress address;
+              SocketAddress alternate_address;
+              GetSocketAddresses(addresses, &address, &alternate_address);
+              requestor_agent_pool_.Preconnect(address, alternate_address);
+            }
+          } else {
+            FTL_LOG(INFO) << "Device '" << instance_name << "' lost";
+            auto iter = params_->devices().find(instance_name);
+            if (iter != params_->devices().end()) {
+              SocketAddress address;
+              SocketAddress alternate_address;
+              GetSocketAddresses(iter->second, &address, &alternate_address);
+              requestor_agent_pool_.CloseIdleAgents(address);
+              if (alternate_address.is_valid()) {
+                // Multipath connections may be to the alternate address.
+                requestor_agent_pool_.CloseIdleAgents(alternate_address);
+              }
+            }
+
+            params_->UnregisterDevice(instance_name);
+            advertisements_by_device_name_.erase(instance_name);
+          }
+
+          UpdateDeviceDirectory();
+        });
+  });
+}
+
+void NetConnectorImpl::PublishMdnsInstance() {
+  advertised_load_ = service_agents_.size();
+
+  std::vector<std::string> text;
+  text.push_back(kServicesTextVersion);
+  text.push_back(kLoadTextKey + std::to_string(advertised_load_));
+
+  for (const std::string& service_name :
+       responding_service_host_.service_names()) {
+    // TXT strings are at most 255 bytes, and '=' would end the key.
+    if (service_name.empty() || service_name.size() > 255 ||
+        service_name.find('=') != std::string::npos) {
+      FTL_LOG(WARNING) << "Service '" << service_name
+                       << "' can't be advertised via mDNS";
+      continue;
+    }
+
+    text.push_back(service_name);
+  }
 
   mdns_service_impl_.PublishServiceInstance(kFuchsiaServiceName, host_name_,
-                                            kPort, std::vector<std::string>());
-
-  mdns_service_impl_.SubscribeToService(
-      kFuchsiaServiceName,
-      [this](const std::string& service_name, const std::string& instance_name,
-             const SocketAddress& v4_address, const SocketAddress& v6_address,
-             const std::vector<std::string>& text) {
-        if (v4_address.is_valid()) {
-          FTL_LOG(INFO) << "Device '" << instance_name
-                        << "' discovered at address " << v4_address.address();
-          params_->RegisterDevice(instance_name, v4_address.address());
-        } else if (v6_address.is_valid()) {
-          FTL_LOG(INFO) << "Device '" << instance_name
-                        << "' discovered at address " << v6_address.address();
-          params_->RegisterDevice(instance_name, v6_address.address());
+                                            kPort, text);
+}
+
+std::map<std::string, DeviceDirectory::Device>
+NetConnectorImpl::DeviceDirectoryEntries() const {
+  std::map<std::string, DeviceDirectory::Device> devices_by_name;
+
+  for (auto& pair : params_->devices()) {
+    DeviceDirectory::Device& device = devices_by_name[pair.first];
+    device.addresses_ = pair.second;
+
+    auto iter = advertisements_by_device_name_.find(pair.first);
+    if (iter != advertisements_by_device_name_.end()) {
+      device.services_.assign(iter->second.services_.begin(),
+                              iter->second.services_.end());
+      std::sort(device.services_.begin(), device.services_.end());
+      device.load_ = iter->second.load_;
+    }
+  }
+
+  return devices_by_name;
+}
+
+std::shared_ptr<TokenBucket> NetConnectorImpl::TokenBucketForAddress(
+    const SocketAddress& address) const {
+  if (bandwidth_shaper_.device_buckets().empty() || !address.is_valid()) {
+    return nullptr;
+  }
+
+  IpAddress ip_address = address.address();
+  for (auto& pair : params_->devices()) {
+    if (pair.second.v4_ == ip_address || pair.second.v6_ == ip_address) {
+      return bandwidth_shaper_.ForDevice(pair.first);
+    }
+  }
+
+  return nullptr;
+}
+
+bool NetConnectorImpl::FastOpenForAddress(const SocketAddress& address) const {
+  if (!params_->fast_open()) {
+    return false;
+  }
+
+  auto iter = fast_open_failure_times_by_device_name_.find(
+      DeviceNameForAddress(address.address()));
+  return iter == fast_open_failure_times_by_device_name_.end() ||
+         ftl::TimePoint::Now() - iter->second >= kFastOpenRetryInterval;
+}
+
+void NetConnectorImpl::OnFastOpenFailed(const SocketAddress& address) {
+  std::string device_name = DeviceNameForAddress(address.address());
+  if (device_name.empty()) {
+    return;
+  }
+
+  FTL_LOG(WARNING) << "Fast open connect to device " << device_name
+                   << " failed, connecting without it for "
+                   << kFastOpenRetryInterval.ToSeconds() << " seconds";
+  fast_open_failure_times_by_device_name_[device_name] =
+      ftl::TimePoint::Now();
+}
+
+void NetConnectorImpl::UpdateDeviceDirectory() {
+  device_directory_.Update(DeviceDirectoryEntries());
+  device_names_publisher_.SendUpdates();
+}
+
+void NetConnectorImpl::UpdateDeviceServices(
+    const std::string& device_name,
+    const std::vector<std::string>& text) {
+  if (text.empty() || text.front() != kServicesTextVersion) {
+    // The device doesn't advertise its services.
+    advertisements_by_device_name_.erase(device_name);
+    return;
+  }
+
+  DeviceAdvertisement& advertisement =
+      advertisements_by_device_name_[device_name];
+  advertisement.services_.clear();
+  advertisement.load_ = 0;
+
+  for (auto iter = text.begin() + 1; iter != text.end(); ++iter) {
+    if (iter->compare(0, kLoadTextKey.size(), kLoadTextKey) == 0) {
+      if (!ftl::StringToNumberWithError(iter->substr(kLoadTextKey.size()),
+                                        &advertisement.load_)) {
+        FTL_LOG(WARNING) << "Device '" << device_name
+                         << "' advertised invalid entry " << *iter;
+      }
+    } else if (iter->find('=') == std::string::npos) {
+      // Entries without values are service names.
+      advertisement.services_.insert(*iter);
+    }
+  }
+}
+
+void NetConnectorImpl::ScheduleLoadUpdate() {
+  if (!mdns_started_ || load_update_pending_) {
+    return;
+  }
+
+  // Connections come and go in bursts, so the load is republished at most
+  // once per |kLoadUpdateDelay|.
+  load_update_pending_ = true;
+  mtl::MessageLoop::GetCurrent()->task_runner()->PostDelayedTask(
+      [this]() {
+        load_update_pending_ = false;
+        if (service_agents_.size() != advertised_load_) {
+          PublishMdnsInstance();
+        }
+      },
+      kLoadUpdateDelay);
+}
+
+void NetConnectorImpl::ScheduleHeartbeat() {
+  mtl::MessageLoop::GetCurrent()->task_runner()->PostDelayedTask(
+      [this]() {
+        // Heartbeat only posts the close of an unresponsive connection, so the
+        // agents stay put while we iterate.
+        uint32_t max_missed = params_->heartbeat_misses();
+        requestor_agent_pool_.ForEachAgent([max_missed](RequestorAgent* agent) {
+          agent->Heartbeat(max_missed);
+        });
+
+        for (auto& pair : service_agents_) {
+          pair.first->Heartbeat(max_missed);
+        }
+
+        ScheduleHeartbeat();
+      },
+      params_->heartbeat_interval());
+}
+
+void NetConnectorImpl::RegisterConfigService(const std::string& service_name) {
+  responding_service_host_.RegisterSingleton(
+      service_name, params_->LaunchInfoForService(service_name),
+      params_->PrelaunchService(service_name),
+      params_->InstanceCountForService(service_name));
+}
+
+void NetConnectorImpl::ScheduleConfigCheck() {
+  mtl::MessageLoop::GetCurrent()->task_runner()->PostDelayedTask(
+      [this]() {
+        ConfigChanges changes;
+        if (!params_->ReloadConfig(&changes)) {
+          // The old config stays in effect, and the file is checked again
+          // next time, so this is logged just once per bad edit.
+          if (!config_reload_failed_) {
+            FTL_LOG(ERROR) << "Failed to reload config file, keeping the "
+                              "current config";
+            config_reload_failed_ = true;
+          }
         } else {
-          FTL_LOG(INFO) << "Device '" << instance_name << "' lost";
-          params_->UnregisterDevice(instance_name);
+          config_reload_failed_ = false;
+          if (!changes.empty()) {
+            ApplyConfigChanges(changes);
+          }
         }
 
-        device_names_publisher_.SendUpdates();
-      });
+        ScheduleConfigCheck();
+      },
+      params_->config_check_interval());
+}
+
+void NetConnectorImpl::ApplyConfigChanges(const ConfigChanges& changes) {
+  FTL_LOG(INFO) << "Config file reloaded";
+
+  // Connections already made keep running. Only the singletons of the
+  // services whose registrations changed are replaced.
+  for (const std::string& service_name : changes.services_unregistered_) {
+    FTL_LOG(INFO) << "Service '" << service_name << "' unregistered";
+    responding_service_host_.UnregisterSingleton(service_name);
+  }
+
+  for (const std::string& service_name : changes.services_registered_) {
+    FTL_LOG(INFO) << "Service '" << service_name << "' registered";
+    RegisterConfigService(service_name);
+  }
+
+  if (!changes.services_registered_.empty()) {
+    responding_service_host_.LaunchPrelaunchSingletons();
+  }
+
+  if (mdns_started_ && (!changes.services_registered_.empty() ||
+                        !changes.services_unregistered_.empty())) {
+    PublishMdnsInstance();
+  }
+
+  if (!changes.devices_changed_.empty()) {
+    UpdateDeviceDirectory();
+  }
+
+  if (changes.bandwidth_limits_changed_) {
+    FTL_LOG(INFO) << "Bandwidth limits changed";
+    bandwidth_shaper_.SetLimits(params_->service_bandwidth_limits(),
+                                params_->device_bandwidth_limits());
+  }
 }
 
 }  // namespace netconnector
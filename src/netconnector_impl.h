@@ -4,10 +4,12 @@
 
 #pragma once
 
+#include <map>
 #include <memory>
 #include <string>
 #include <thread>
 #include <unordered_map>
+#include <unordered_set>
 #include <vector>
 
 #include "application/lib/app/application_context.h"
@@ -15,16 +17,20 @@
 #include "application/services/service_provider.fidl.h"
 #include "apps/media/src/util/fidl_publisher.h"
 #include "apps/netconnector/services/netconnector.fidl.h"
+#include "apps/netconnector/src/bandwidth_shaper.h"
+#include "apps/netconnector/src/device_directory.h"
 #include "apps/netconnector/src/device_service_provider.h"
 #include "apps/netconnector/src/ip_port.h"
 #include "apps/netconnector/src/listener.h"
 #include "apps/netconnector/src/mdns/mdns_service_impl.h"
 #include "apps/netconnector/src/netconnector_params.h"
 #include "apps/netconnector/src/requestor_agent.h"
+#include "apps/netconnector/src/requestor_agent_pool.h"
 #include "apps/netconnector/src/responding_service_host.h"
 #include "apps/netconnector/src/service_agent.h"
 #include "lib/fidl/cpp/bindings/binding_set.h"
 #include "lib/ftl/macros.h"
+#include "lib/ftl/time/time_point.h"
 
 namespace netconnector {
 
@@ -43,8 +49,124 @@ class NetConnectorImpl : public NetConnector {
   void ReleaseDeviceServiceProvider(
       DeviceServiceProvider* device_service_provider);
 
-  // Adds an agent that represents a local requestor.
-  void AddRequestorAgent(std::unique_ptr<RequestorAgent> requestor_agent);
+  // Connects |channel| to the service named |service_name| on the device at
+  // |address|. An existing connection to the device is used if it can carry
+  // another service connection. A new connection races connects to |address|
+  // and, if it's valid, |alternate_address|. Returns false if a new connection
+  // was needed and couldn't be established, in which case |*channel| is left
+  // alone.
+  bool ConnectToRemoteService(const SocketAddress& address,
+                              const SocketAddress& alternate_address,
+                              const std::string& service_name,
+                              mx::channel* channel);
+
+  // Determines whether the device named |device_name| might provide the
+  // service named |service_name|. This is false only if the device
+  // advertises its services and |service_name| isn't among them.
+  bool DeviceMayProvideService(const std::string& device_name,
+                               const std::string& service_name) const;
+
+  // Called when an agent that manages a connection on behalf of local
+  // requestors has no open channels.
+  void OnRequestorAgentIdle(RequestorAgent* requestor_agent);
+
+  // Called when the socket of an agent that manages a connection on behalf
+  // of local requestors fails and the agent is waiting to reconnect.
+  void OnRequestorAgentSuspended(RequestorAgent* requestor_agent);
+
+  // Called when the socket of an agent that manages a connection on behalf
+  // of a remote requestor fails. The agent is closed if the remote requestor
+  // doesn't resume the connection in time.
+  void OnServiceAgentSuspended(ServiceAgent* service_agent);
+
+  // Moves the socket of |new_agent|, on which the remote requestor has asked
+  // to resume the session identified by |session_id|, to the agent with that
+  // session. |received_count| is from the request.
+  void ResumeServiceAgent(ServiceAgent* new_agent,
+                          uint64_t session_id,
+                          uint64_t received_count);
+
+  // Indicates whether agents should write received messages to their
+  // channels directly from the I/O thread.
+  bool direct_delivery() const { return params_->direct_delivery(); }
+
+  // Returns how long a failed connection may take to be resumed. Zero means
+  // connections aren't resumed.
+  ftl::TimeDelta resume_timeout() const { return params_->resume_timeout(); }
+
+  // Returns the limits on what agents coalesce into one socket write. Zero
+  // means the transceiver's default applies.
+  size_t send_batch_bytes() const { return params_->send_batch_bytes(); }
+  size_t send_batch_packets() const { return params_->send_batch_packets(); }
+
+  // Returns the flow control watermarks for channels connected to the
+  // service named |service_name|.
+  Watermarks WatermarksForService(const std::string& service_name) const {
+    return params_->WatermarksForService(service_name);
+  }
+
+  // Returns the socket options for connections carrying the service named
+  // |service_name|.
+  TransportProfile TransportProfileForService(
+      const std::string& service_name) const {
+    return params_->TransportProfileForService(service_name);
+  }
+
+  // Returns the size at and above which messages on channels connected to
+  // the service named |service_name| are moved in VMOs, or zero.
+  size_t VmoThresholdForService(const std::string& service_name) const {
+    return params_->VmoThresholdForService(service_name);
+  }
+
+  // Returns how long messages on channels connected to the service named
+  // |service_name| may wait to be sent, or zero if they don't expire.
+  ftl::TimeDelta MessageLifetimeForService(
+      const std::string& service_name) const {
+    return params_->MessageLifetimeForService(service_name);
+  }
+
+  // Returns the token bucket that limits the bandwidth of the service named
+  // |service_name|, or null if there's no limit.
+  std::shared_ptr<TokenBucket> TokenBucketForService(
+      const std::string& service_name) const {
+    return bandwidth_shaper_.ForService(service_name);
+  }
+
+  // Returns the token bucket that limits the bandwidth of connections to the
+  // configured device at |address|, or null if there's no limit.
+  std::shared_ptr<TokenBucket> TokenBucketForAddress(
+      const SocketAddress& address) const;
+
+  // Determines whether connects to |address| should use TCP fast open. The
+  // stack caches the fast open cookie for each remote address, so a device
+  // we've connected to before is sent data in the SYN.
+  bool FastOpenForAddress(const SocketAddress& address) const;
+
+  // Called when a fast open connect to |address| failed before the remote
+  // party answered. Connects to the device at |address| don't use fast open
+  // for a while, in case something on the path drops SYNs with data.
+  void OnFastOpenFailed(const SocketAddress& address);
+
+  // Returns the priority of channels connected to the service named
+  // |service_name|.
+  MessagePriority PriorityForService(const std::string& service_name) const {
+    return params_->PriorityForService(service_name);
+  }
+
+  // Determines whether a connection or logical channel from a remote
+  // requestor to the service named |service_name| is within the service's
+  // connection limit. The limit covers both, across all connections.
+  bool AdmitServiceConnection(const std::string& service_name);
+
+  // Records a round trip time measured by a connection to |address| in the
+  // path metrics of the device at that address.
+  void OnRoundTripMeasured(const IpAddress& address, ftl::TimeDelta rtt);
+
+  // Records a throughput sample taken by a connection to |address| in the
+  // path metrics of the device at that address.
+  void OnThroughputMeasured(const IpAddress& address,
+                            uint64_t bytes,
+                            ftl::TimeDelta duration);
 
   // Releases an agent that manages a connection on behalf of a local requestor.
   void ReleaseRequestorAgent(RequestorAgent* requestor_agent);
@@ -66,33 +188,149 @@ class NetConnectorImpl : public NetConnector {
       uint64_t version_last_seen,
       const GetKnownDeviceNamesCallback& callback) override;
 
+  void GetDeviceDirectory(uint64_t version_last_seen,
+                          const GetDeviceDirectoryCallback& callback) override;
+
+  void ConnectToServiceOnAnyDevice(const fidl::String& service_name,
+                                   mx::channel channel) override;
+
+  void SendToDevices(fidl::Array<fidl::String> device_names,
+                     const fidl::String& service_name,
+                     fidl::Array<uint8_t> message,
+                     const SendToDevicesCallback& callback) override;
+
+  void GetStats(const GetStatsCallback& callback) override;
+
+  void GetDeviceMetrics(const GetDeviceMetricsCallback& callback) override;
+
  private:
   static const IpPort kPort;
   static const std::string kFuchsiaServiceName;
+  static const std::string kServicesTextVersion;
+  static const std::string kLoadTextKey;
+  static const ftl::TimeDelta kLoadUpdateDelay;
+  static const ftl::TimeDelta kDeviceFailurePenaltyInterval;
+  static const ftl::TimeDelta kFastOpenRetryInterval;
+
+  // What a remote device advertises in the text of its mDNS instance.
+  struct DeviceAdvertisement {
+    std::unordered_set<std::string> services_;
+    // The number of connections the device was serving.
+    uint32_t load_ = 0;
+  };
+  static const ftl::TimeDelta kNetworkReadyRecheckDelay;
+  static const ftl::TimeDelta kDeviceChangeCoalescingInterval;
+  static const std::string kMdnsCacheDirectory;
+  static const std::string kMdnsCacheFileName;
+
+  // Gets the socket addresses for a device's addresses. |*address| is the
+  // preferred address, and |*alternate_address| is the address of the other
+  // family, if the device has one.
+  static void GetSocketAddresses(const DeviceAddresses& addresses,
+                                 SocketAddress* address,
+                                 SocketAddress* alternate_address);
 
   void AddDeviceServiceProvider(
       std::unique_ptr<DeviceServiceProvider> device_service_provider);
 
+  // Determines whether a new connection from |address| is within the global
+  // and per-peer connection limits.
+  bool AdmitConnection(const SocketAddress& address);
+
   void AddServiceAgent(std::unique_ptr<ServiceAgent> service_agent);
 
+  // Republishes the mDNS instance after |kLoadUpdateDelay| if the number of
+  // service agents has changed by then.
+  void ScheduleLoadUpdate();
+
+  // Sends heartbeats on all connections every |params_->heartbeat_interval()|,
+  // starting after one interval.
+  void ScheduleHeartbeat();
+
+  // Registers the singleton for the service named |service_name| as the
+  // config file specifies.
+  void RegisterConfigService(const std::string& service_name);
+
+  // Reloads the config file every |params_->config_check_interval()| if it
+  // has changed, starting after one interval.
+  void ScheduleConfigCheck();
+
+  // Applies changes from a config file reload without disturbing existing
+  // connections.
+  void ApplyConfigChanges(const ConfigChanges& changes);
+
   void StartMdns();
 
+  // Publishes this device's instance of the Fuchsia service, with the names
+  // of the responding services in its text.
+  void PublishMdnsInstance();
+
+  // Notes the services advertised in the text of a remote device's instance.
+  // Returns directory entries for the registered devices and their
+  // advertisements.
+  std::map<std::string, DeviceDirectory::Device> DeviceDirectoryEntries()
+      const;
+
+  // Makes a new device directory snapshot from the registered devices and
+  // their advertisements, and wakes callers waiting for device updates.
+  void UpdateDeviceDirectory();
+
+  void UpdateDeviceServices(const std::string& device_name,
+                            const std::vector<std::string>& text);
+
+  // Adds the statistics for a connection that's closing to the totals.
+  void AddClosedConnectionStats(const TransceiverStats& stats);
+
+  // Sends |message| to the service named |service_name| on this device.
+  // Returns false if the message couldn't be written.
+  bool SendToLocalService(const std::string& service_name,
+                          const std::vector<uint8_t>& message);
+
+  // Determines whether |device_name| refers to this device.
+  bool IsLocalDevice(const std::string& device_name);
+
+  // Returns the name of the device with address |address|, or an empty
+  // string if there's no such device.
+  std::string DeviceNameForAddress(const IpAddress& address) const;
+
   NetConnectorParams* params_;
   std::unique_ptr<app::ApplicationContext> application_context_;
   std::string host_name_;
+  bool mdns_started_ = false;
+  // The load in the published mDNS instance.
+  size_t advertised_load_ = 0;
+  bool load_update_pending_ = false;
+  bool config_reload_failed_ = false;
+  ftl::TimePoint start_time_;
+  TransceiverStats closed_connection_stats_;
+  uint64_t closed_connection_count_ = 0;
+  // Connections refused because of each kind of connection limit.
+  uint64_t connections_refused_limit_ = 0;
+  uint64_t connections_refused_peer_limit_ = 0;
+  uint64_t connections_refused_service_limit_ = 0;
   fidl::BindingSet<NetConnector> bindings_;
   Listener listener_;
   RespondingServiceHost responding_service_host_;
   std::unordered_map<DeviceServiceProvider*,
                      std::unique_ptr<DeviceServiceProvider>>
       device_service_providers_;
-  std::unordered_map<RequestorAgent*, std::unique_ptr<RequestorAgent>>
-      requestor_agents_;
+  RequestorAgentPool requestor_agent_pool_;
   std::unordered_map<ServiceAgent*, std::unique_ptr<ServiceAgent>>
       service_agents_;
 
   mdns::MdnsServiceImpl mdns_service_impl_;
+  // Advertisements of the remote devices that advertise their services.
+  std::unordered_map<std::string, DeviceAdvertisement>
+      advertisements_by_device_name_;
+  // When connections to each device that has failed last failed.
+  std::unordered_map<std::string, ftl::TimePoint> failure_times_by_device_name_;
+  // When fast open connects to each device on which they've failed last
+  // failed.
+  std::unordered_map<std::string, ftl::TimePoint>
+      fast_open_failure_times_by_device_name_;
 
+  DeviceDirectory device_directory_;
+  BandwidthShaper bandwidth_shaper_;
   media::FidlPublisher<GetKnownDeviceNamesCallback> device_names_publisher_;
 
   FTL_DISALLOW_COPY_AND_ASSIGN(NetConnectorImpl);
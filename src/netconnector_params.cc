@@ -11,14 +11,394 @@
 #include "lib/ftl/files/file.h"
 #include "lib/ftl/logging.h"
 #include "lib/ftl/strings/split_string.h"
+#include "lib/ftl/strings/string_number_conversions.h"
 
 namespace netconnector {
 namespace {
 
 constexpr char kConfigServices[] = "services";
+constexpr char kConfigUrl[] = "url";
+constexpr char kConfigArguments[] = "arguments";
+constexpr char kConfigPrelaunch[] = "prelaunch";
+constexpr char kConfigInstances[] = "instances";
+constexpr char kConfigMaxConnections[] = "max_connections";
+constexpr char kConfigPriority[] = "priority";
+constexpr char kConfigPriorityNormal[] = "normal";
+constexpr char kConfigPriorityHigh[] = "high";
 constexpr char kConfigDevices[] = "devices";
+constexpr char kConfigFlowControl[] = "flow_control";
+constexpr char kConfigFlowControlDefault[] = "default";
+constexpr char kConfigHighWatermark[] = "high_watermark";
+constexpr char kConfigLowWatermark[] = "low_watermark";
+constexpr char kConfigTransport[] = "transport";
+constexpr char kConfigTransportDefault[] = "default";
+constexpr char kConfigProfile[] = "profile";
+constexpr char kConfigProfileDefault[] = "default";
+constexpr char kConfigProfileLatency[] = "latency";
+constexpr char kConfigProfileThroughput[] = "throughput";
+constexpr char kConfigNoDelay[] = "no_delay";
+constexpr char kConfigKeepAlive[] = "keep_alive";
+constexpr char kConfigSendBufferSize[] = "send_buffer_size";
+constexpr char kConfigReceiveBufferSize[] = "receive_buffer_size";
+constexpr char kConfigSharedMemory[] = "shared_memory";
+constexpr char kConfigSharedMemoryDefault[] = "default";
+constexpr char kConfigMessageLifetime[] = "message_lifetime";
+constexpr char kConfigMessageLifetimeDefault[] = "default";
+constexpr char kConfigBandwidth[] = "bandwidth";
+constexpr char kConfigBandwidthServices[] = "services";
+constexpr char kConfigBandwidthDevices[] = "devices";
+constexpr char kConfigRate[] = "rate";
+constexpr char kConfigBurst[] = "burst";
 constexpr char kDefaultConfigFileName[] =
     "/system/data/netconnector/netconnector.config";
+constexpr uint32_t kDefaultConnectTimeoutMs = 10000;
+constexpr uint32_t kDefaultConnectionIdleTimeoutMs = 30000;
+constexpr uint32_t kDefaultMaxIdleConnections = 1;
+constexpr uint32_t kDefaultMaxConnections = 256;
+constexpr uint32_t kDefaultMaxConnectionsPerPeer = 32;
+constexpr uint32_t kDefaultHeartbeatMisses = 3;
+constexpr uint32_t kDefaultConfigCheckIntervalMs = 5000;
+constexpr char kMdnsAggregationWindowAdaptive[] = "adaptive";
+constexpr uint32_t kDefaultMdnsAggregationWindowMs = 100;
+constexpr uint32_t kMaxMdnsAggregationWindowMs = 100;
+constexpr uint32_t kMinAdaptiveMdnsAggregationWindowMs = 20;
+
+// Gets the value of a numeric option. Leaves |*value| unchanged if the option
+// isn't present. Returns false if the option is present and its value isn't
+// a number.
+bool GetNumericOption(const ftl::CommandLine& command_line,
+                      const char* name,
+                      uint32_t* value) {
+  std::string value_string;
+  if (!command_line.GetOptionValue(name, &value_string)) {
+    return true;
+  }
+
+  if (!ftl::StringToNumberWithError(value_string, value)) {
+    FTL_LOG(ERROR) << "Invalid --" << name << " value " << value_string;
+    return false;
+  }
+
+  return true;
+}
+
+// Parses a list of application arguments, appending them to |*arguments|.
+bool ParseArguments(const rapidjson::Value& value,
+                    fidl::Array<fidl::String>* arguments) {
+  FTL_DCHECK(arguments != nullptr);
+
+  if (!value.IsArray()) {
+    return false;
+  }
+
+  for (const auto& argument : value.GetArray()) {
+    if (!argument.IsString()) {
+      return false;
+    }
+
+    arguments->push_back(argument.GetString());
+  }
+
+  return true;
+}
+
+// Options for a registered service other than how to launch it.
+struct ServiceOptions {
+  bool prelaunch_ = false;
+  uint32_t instance_count_ = 1;
+  // Zero if the number of connections isn't limited.
+  uint32_t max_connections_ = 0;
+  MessagePriority priority_ = MessagePriority::kNormal;
+};
+
+// Parses a priority name ("normal" or "high") into |*priority|.
+bool ParsePriority(const rapidjson::Value& value, MessagePriority* priority) {
+  FTL_DCHECK(priority != nullptr);
+
+  if (!value.IsString()) {
+    return false;
+  }
+
+  std::string name = value.GetString();
+  if (name == kConfigPriorityNormal) {
+    *priority = MessagePriority::kNormal;
+  } else if (name == kConfigPriorityHigh) {
+    *priority = MessagePriority::kHigh;
+  } else {
+    FTL_LOG(ERROR) << "Config file contains unknown priority " << name;
+    return false;
+  }
+
+  return true;
+}
+
+// Parses a service registration, which is either an application url, an
+// array containing a url followed by arguments, or an object of the form
+// { "url": <url>, "arguments": [ <argument>... ], "prelaunch": <bool>,
+//   "instances": <count>, "max_connections": <count>,
+//   "priority": "normal"|"high" }. Only the url is required. Members of
+// |*options| are left unchanged if the corresponding members are omitted.
+bool ParseLaunchInfo(const rapidjson::Value& value,
+                     app::ApplicationLaunchInfo* launch_info,
+                     ServiceOptions* options) {
+  FTL_DCHECK(launch_info != nullptr);
+  FTL_DCHECK(options != nullptr);
+
+  if (value.IsString()) {
+    launch_info->url = value.GetString();
+    return true;
+  }
+
+  if (value.IsArray()) {
+    const auto& array = value.GetArray();
+
+    if (array.Empty() || !array[0].IsString()) {
+      return false;
+    }
+
+    launch_info->url = array[0].GetString();
+    for (size_t i = 1; i < array.Size(); ++i) {
+      if (!array[i].IsString()) {
+        return false;
+      }
+
+      launch_info->arguments.push_back(array[i].GetString());
+    }
+
+    return true;
+  }
+
+  if (!value.IsObject()) {
+    return false;
+  }
+
+  auto iter = value.FindMember(kConfigUrl);
+  if (iter == value.MemberEnd() || !iter->value.IsString()) {
+    return false;
+  }
+
+  launch_info->url = iter->value.GetString();
+
+  iter = value.FindMember(kConfigArguments);
+  if (iter != value.MemberEnd() &&
+      !ParseArguments(iter->value, &launch_info->arguments)) {
+    return false;
+  }
+
+  iter = value.FindMember(kConfigPrelaunch);
+  if (iter != value.MemberEnd()) {
+    if (!iter->value.IsBool()) {
+      return false;
+    }
+
+    options->prelaunch_ = iter->value.GetBool();
+  }
+
+  iter = value.FindMember(kConfigInstances);
+  if (iter != value.MemberEnd()) {
+    if (!iter->value.IsUint() || iter->value.GetUint() == 0) {
+      FTL_LOG(ERROR) << "Config file instances must be greater than zero";
+      return false;
+    }
+
+    options->instance_count_ = iter->value.GetUint();
+  }
+
+  iter = value.FindMember(kConfigMaxConnections);
+  if (iter != value.MemberEnd()) {
+    if (!iter->value.IsUint()) {
+      return false;
+    }
+
+    options->max_connections_ = iter->value.GetUint();
+  }
+
+  iter = value.FindMember(kConfigPriority);
+  if (iter != value.MemberEnd() &&
+      !ParsePriority(iter->value, &options->priority_)) {
+    return false;
+  }
+
+  return true;
+}
+
+// Parses a watermarks object of the form
+// { "high_watermark": <bytes>, "low_watermark": <bytes> }. Either member may
+// be omitted, in which case the corresponding value in |*watermarks| is left
+// unchanged.
+bool ParseWatermarks(const rapidjson::Value& value, Watermarks* watermarks) {
+  FTL_DCHECK(watermarks != nullptr);
+
+  if (!value.IsObject()) {
+    return false;
+  }
+
+  auto iter = value.FindMember(kConfigHighWatermark);
+  if (iter != value.MemberEnd()) {
+    if (!iter->value.IsUint()) {
+      return false;
+    }
+
+    watermarks->high_ = iter->value.GetUint();
+  }
+
+  iter = value.FindMember(kConfigLowWatermark);
+  if (iter != value.MemberEnd()) {
+    if (!iter->value.IsUint()) {
+      return false;
+    }
+
+    watermarks->low_ = iter->value.GetUint();
+  }
+
+  if (watermarks->high_ == 0 || watermarks->low_ >= watermarks->high_) {
+    FTL_LOG(ERROR) << "Config file high_watermark must be greater than zero "
+                      "and greater than low_watermark";
+    return false;
+  }
+
+  return true;
+}
+
+// Parses a transport profile name into |*profile|.
+bool ParseProfileName(const rapidjson::Value& value,
+                      TransportProfile* profile) {
+  FTL_DCHECK(profile != nullptr);
+
+  if (!value.IsString()) {
+    return false;
+  }
+
+  std::string name = value.GetString();
+  if (name == kConfigProfileDefault) {
+    *profile = TransportProfile::Default();
+  } else if (name == kConfigProfileLatency) {
+    *profile = TransportProfile::Latency();
+  } else if (name == kConfigProfileThroughput) {
+    *profile = TransportProfile::Throughput();
+  } else {
+    FTL_LOG(ERROR) << "Config file contains unknown transport profile "
+                   << name;
+    return false;
+  }
+
+  return true;
+}
+
+// Parses a transport profile, which is either a profile name ("default",
+// "latency" or "throughput") or an object of the form
+// { "profile": <name>, "no_delay": <bool>, "keep_alive": <bool>,
+//   "send_buffer_size": <bytes>, "receive_buffer_size": <bytes> }. Members of
+// the object may be omitted, in which case the values from the named profile
+// or, absent that, from |*profile| are used.
+bool ParseTransportProfile(const rapidjson::Value& value,
+                           TransportProfile* profile) {
+  FTL_DCHECK(profile != nullptr);
+
+  if (value.IsString()) {
+    return ParseProfileName(value, profile);
+  }
+
+  if (!value.IsObject()) {
+    return false;
+  }
+
+  auto iter = value.FindMember(kConfigProfile);
+  if (iter != value.MemberEnd() && !ParseProfileName(iter->value, profile)) {
+    return false;
+  }
+
+  iter = value.FindMember(kConfigNoDelay);
+  if (iter != value.MemberEnd()) {
+    if (!iter->value.IsBool()) {
+      return false;
+    }
+
+    profile->no_delay_ = iter->value.GetBool();
+  }
+
+  iter = value.FindMember(kConfigKeepAlive);
+  if (iter != value.MemberEnd()) {
+    if (!iter->value.IsBool()) {
+      return false;
+    }
+
+    profile->keep_alive_ = iter->value.GetBool();
+  }
+
+  iter = value.FindMember(kConfigSendBufferSize);
+  if (iter != value.MemberEnd()) {
+    if (!iter->value.IsUint()) {
+      return false;
+    }
+
+    profile->send_buffer_size_ = iter->value.GetUint();
+  }
+
+  iter = value.FindMember(kConfigReceiveBufferSize);
+  if (iter != value.MemberEnd()) {
+    if (!iter->value.IsUint()) {
+      return false;
+    }
+
+    profile->receive_buffer_size_ = iter->value.GetUint();
+  }
+
+  return true;
+}
+
+// Parses a bandwidth limit of the form { "rate": <bytes per second>,
+// "burst": <bytes> }. The burst defaults to one second's worth at the rate.
+bool ParseBandwidthLimit(const rapidjson::Value& value,
+                         BandwidthLimit* limit) {
+  FTL_DCHECK(limit != nullptr);
+
+  if (!value.IsObject()) {
+    return false;
+  }
+
+  auto iter = value.FindMember(kConfigRate);
+  if (iter == value.MemberEnd() || !iter->value.IsUint() ||
+      iter->value.GetUint() == 0) {
+    FTL_LOG(ERROR) << "Config file bandwidth limit must have a non-zero rate";
+    return false;
+  }
+
+  limit->rate_ = iter->value.GetUint();
+  limit->burst_ = limit->rate_;
+
+  iter = value.FindMember(kConfigBurst);
+  if (iter != value.MemberEnd()) {
+    if (!iter->value.IsUint()) {
+      return false;
+    }
+
+    limit->burst_ = iter->value.GetUint();
+  }
+
+  return true;
+}
+
+// Parses an object mapping service or device names to bandwidth limits.
+bool ParseBandwidthLimits(
+    const rapidjson::Value& value,
+    std::unordered_map<std::string, BandwidthLimit>* limits) {
+  FTL_DCHECK(limits != nullptr);
+
+  if (!value.IsObject()) {
+    return false;
+  }
+
+  for (const auto& pair : value.GetObject()) {
+    if (!pair.name.IsString() ||
+        !ParseBandwidthLimit(pair.value, &(*limits)[pair.name.GetString()])) {
+      return false;
+    }
+  }
+
+  return true;
+}
+
 }  // namespace
 
 NetConnectorParams::NetConnectorParams(const ftl::CommandLine& command_line) {
@@ -26,7 +406,18 @@ NetConnectorParams::NetConnectorParams(const ftl::CommandLine& command_line) {
 
   listen_ = command_line.HasOption("listen");
   show_devices_ = command_line.HasOption("show-devices");
+  show_stats_ = command_line.HasOption("stats");
+  show_mdns_stats_ = command_line.HasOption("mdns-stats");
+  set_mdns_capture_size_ = command_line.HasOption("mdns-capture");
+  command_line.GetOptionValue("mdns-write-capture", &mdns_capture_file_);
   mdns_verbose_ = command_line.HasOption("mdns-verbose");
+  mdns_receive_threads_ = command_line.HasOption("mdns-receive-threads");
+  direct_delivery_ = command_line.HasOption("direct-delivery");
+  trace_latency_ = command_line.HasOption("trace-latency");
+  trace_tasks_ = command_line.HasOption("trace-tasks");
+  preconnect_ = command_line.HasOption("preconnect");
+  multipath_ = command_line.HasOption("multipath");
+  fast_open_ = command_line.HasOption("fast-open");
 
   if (listen_ && show_devices_) {
     FTL_LOG(ERROR) << "--listen and --show-devices are mutually exclusive";
@@ -34,6 +425,134 @@ NetConnectorParams::NetConnectorParams(const ftl::CommandLine& command_line) {
     return;
   }
 
+  if (show_stats_ && (listen_ || show_devices_)) {
+    FTL_LOG(ERROR) << "--stats can't be combined with --listen or "
+                      "--show-devices";
+    Usage();
+    return;
+  }
+
+  if (show_mdns_stats_ && (listen_ || show_devices_ || show_stats_)) {
+    FTL_LOG(ERROR) << "--mdns-stats can't be combined with --listen, "
+                      "--show-devices or --stats";
+    Usage();
+    return;
+  }
+
+  if ((set_mdns_capture_size_ || !mdns_capture_file_.empty()) && listen_) {
+    FTL_LOG(ERROR) << "--mdns-capture and --mdns-write-capture can't be "
+                      "combined with --listen";
+    Usage();
+    return;
+  }
+
+  if (!mdns_capture_file_.empty() &&
+      (show_devices_ || show_stats_ || show_mdns_stats_)) {
+    FTL_LOG(ERROR) << "--mdns-write-capture can't be combined with "
+                      "--show-devices, --stats or --mdns-stats";
+    Usage();
+    return;
+  }
+
+  if (!GetNumericOption(command_line, "mdns-capture", &mdns_capture_size_)) {
+    Usage();
+    return;
+  }
+
+  uint32_t connect_timeout_ms = kDefaultConnectTimeoutMs;
+  uint32_t connection_idle_timeout_ms = kDefaultConnectionIdleTimeoutMs;
+  uint32_t max_idle_connections = kDefaultMaxIdleConnections;
+  uint32_t max_connections = kDefaultMaxConnections;
+  uint32_t max_connections_per_peer = kDefaultMaxConnectionsPerPeer;
+  uint32_t heartbeat_interval_ms = 0;
+  uint32_t heartbeat_misses = kDefaultHeartbeatMisses;
+  uint32_t resume_timeout_ms = 0;
+  uint32_t config_check_interval_ms = kDefaultConfigCheckIntervalMs;
+  uint32_t loop_probe_interval_ms = 0;
+  uint32_t send_batch_bytes = 0;
+  uint32_t send_batch_packets = 0;
+  if (!GetNumericOption(command_line, "connect-timeout", &connect_timeout_ms) ||
+      !GetNumericOption(command_line, "connection-idle-timeout",
+                        &connection_idle_timeout_ms) ||
+      !GetNumericOption(command_line, "max-idle-connections",
+                        &max_idle_connections) ||
+      !GetNumericOption(command_line, "max-connections", &max_connections) ||
+      !GetNumericOption(command_line, "max-connections-per-peer",
+                        &max_connections_per_peer) ||
+      !GetNumericOption(command_line, "heartbeat-interval",
+                        &heartbeat_interval_ms) ||
+      !GetNumericOption(command_line, "heartbeat-misses", &heartbeat_misses) ||
+      !GetNumericOption(command_line, "resume-timeout", &resume_timeout_ms) ||
+      !GetNumericOption(command_line, "config-check-interval",
+                        &config_check_interval_ms) ||
+      !GetNumericOption(command_line, "loop-probe-interval",
+                        &loop_probe_interval_ms) ||
+      !GetNumericOption(command_line, "send-batch-bytes", &send_batch_bytes) ||
+      !GetNumericOption(command_line, "send-batch-packets",
+                        &send_batch_packets)) {
+    Usage();
+    return;
+  }
+
+  if (max_connections == 0 || max_connections_per_peer == 0) {
+    FTL_LOG(ERROR) << "Connection limits must be greater than zero";
+    Usage();
+    return;
+  }
+
+  if (connect_timeout_ms == 0 || connection_idle_timeout_ms == 0) {
+    FTL_LOG(ERROR) << "Timeouts must be greater than zero";
+    Usage();
+    return;
+  }
+
+  if (heartbeat_misses == 0) {
+    FTL_LOG(ERROR) << "--heartbeat-misses must be greater than zero";
+    Usage();
+    return;
+  }
+
+  connect_timeout_ = ftl::TimeDelta::FromMilliseconds(connect_timeout_ms);
+  connection_idle_timeout_ =
+      ftl::TimeDelta::FromMilliseconds(connection_idle_timeout_ms);
+  max_idle_connections_ = max_idle_connections;
+  max_connections_ = max_connections;
+  max_connections_per_peer_ = max_connections_per_peer;
+  heartbeat_interval_ = ftl::TimeDelta::FromMilliseconds(heartbeat_interval_ms);
+  heartbeat_misses_ = heartbeat_misses;
+  resume_timeout_ = ftl::TimeDelta::FromMilliseconds(resume_timeout_ms);
+  send_batch_bytes_ = send_batch_bytes;
+  send_batch_packets_ = send_batch_packets;
+  config_check_interval_ =
+      ftl::TimeDelta::FromMilliseconds(config_check_interval_ms);
+  loop_probe_interval_ =
+      ftl::TimeDelta::FromMilliseconds(loop_probe_interval_ms);
+
+  std::string aggregation_window_string;
+  if (!command_line.GetOptionValue("mdns-aggregation-window",
+                                   &aggregation_window_string)) {
+    mdns_min_aggregation_window_ = mdns_max_aggregation_window_ =
+        ftl::TimeDelta::FromMilliseconds(kDefaultMdnsAggregationWindowMs);
+  } else if (aggregation_window_string == kMdnsAggregationWindowAdaptive) {
+    mdns_min_aggregation_window_ =
+        ftl::TimeDelta::FromMilliseconds(kMinAdaptiveMdnsAggregationWindowMs);
+    mdns_max_aggregation_window_ =
+        ftl::TimeDelta::FromMilliseconds(kMaxMdnsAggregationWindowMs);
+  } else {
+    uint32_t aggregation_window_ms;
+    if (!ftl::StringToNumberWithError(aggregation_window_string,
+                                      &aggregation_window_ms) ||
+        aggregation_window_ms > kMaxMdnsAggregationWindowMs) {
+      FTL_LOG(ERROR) << "Invalid --mdns-aggregation-window value "
+                     << aggregation_window_string;
+      Usage();
+      return;
+    }
+
+    mdns_min_aggregation_window_ = mdns_max_aggregation_window_ =
+        ftl::TimeDelta::FromMilliseconds(aggregation_window_ms);
+  }
+
   std::string config_file_name;
   if (!command_line.GetOptionValue("config", &config_file_name)) {
     config_file_name = kDefaultConfigFileName;
@@ -44,9 +563,18 @@ NetConnectorParams::NetConnectorParams(const ftl::CommandLine& command_line) {
     return;
   }
 
-  if (listen_ && !ReadConfigFrom(config_file_name)) {
-    FTL_LOG(ERROR) << "Failed to parse config file " << config_file_name;
-    return;
+  config_file_name_ = config_file_name;
+
+  if (listen_) {
+    if (!files::ReadFileToString(config_file_name_, &config_file_contents_) ||
+        !ParseConfig(config_file_contents_, &config_)) {
+      FTL_LOG(ERROR) << "Failed to parse config file " << config_file_name;
+      return;
+    }
+
+    for (auto& pair : config_.device_addresses_by_name_) {
+      RegisterDevice(pair.first, pair.second);
+    }
   }
 
   is_valid_ = true;
@@ -60,43 +588,288 @@ void NetConnectorParams::Usage() {
       << "    --config=<file>                  read config file (default "
       << kDefaultConfigFileName << ")";
   FTL_LOG(INFO) << "    --show-devices                   show known devices";
+  FTL_LOG(INFO) << "    --stats                          show connection "
+                   "statistics";
+  FTL_LOG(INFO) << "    --mdns-stats                     show mDNS statistics";
   FTL_LOG(INFO) << "    --mdns-verbose                   log mDNS traffic";
+  FTL_LOG(INFO) << "    --mdns-receive-threads           receive mDNS traffic "
+                   "on a thread per interface";
+  FTL_LOG(INFO) << "    --mdns-capture=<packets>         keep the last "
+                   "<packets> mDNS datagrams (0 to stop)";
+  FTL_LOG(INFO) << "    --mdns-write-capture=<file>      write captured mDNS "
+                   "datagrams to a pcapng file";
+  FTL_LOG(INFO) << "    --mdns-aggregation-window=<ms>|adaptive";
+  FTL_LOG(INFO) << "                                     send queued mDNS "
+                   "records this early (default "
+                << kDefaultMdnsAggregationWindowMs << ", max "
+                << kMaxMdnsAggregationWindowMs << ")";
+  FTL_LOG(INFO) << "    --connect-timeout=<ms>           connect timeout "
+                   "(default "
+                << kDefaultConnectTimeoutMs << ")";
+  FTL_LOG(INFO) << "    --connection-idle-timeout=<ms>   idle connection "
+                   "timeout (default "
+                << kDefaultConnectionIdleTimeoutMs << ")";
+  FTL_LOG(INFO) << "    --max-idle-connections=<n>       idle connections "
+                   "per device (default "
+                << kDefaultMaxIdleConnections << ")";
+  FTL_LOG(INFO) << "    --max-connections=<n>            connections from "
+                   "remote requestors (default "
+                << kDefaultMaxConnections << ")";
+  FTL_LOG(INFO) << "    --max-connections-per-peer=<n>   connections from "
+                   "one remote address (default "
+                << kDefaultMaxConnectionsPerPeer << ")";
+  FTL_LOG(INFO) << "    --heartbeat-interval=<ms>        ping connections "
+                   "this often (default 0, off)";
+  FTL_LOG(INFO) << "    --heartbeat-misses=<n>           close connections "
+                   "after <n> unanswered pings (default "
+                << kDefaultHeartbeatMisses << ")";
+  FTL_LOG(INFO) << "    --resume-timeout=<ms>            resume failed "
+                   "connections within <ms> (default 0, off)";
+  FTL_LOG(INFO) << "    --send-batch-bytes=<n>           coalesce at most <n> "
+                   "bytes into a socket write (default 0, built-in)";
+  FTL_LOG(INFO) << "    --send-batch-packets=<n>         coalesce at most <n> "
+                   "packets into a socket write (default 0, built-in)";
+  FTL_LOG(INFO) << "    --config-check-interval=<ms>     reload the config "
+                   "file if it changes (default "
+                << kDefaultConfigCheckIntervalMs << ", 0 off)";
+  FTL_LOG(INFO) << "    --direct-delivery                write received "
+                   "messages from the I/O thread";
+  FTL_LOG(INFO) << "    --trace-latency                  record message "
+                   "latencies (see --stats)";
+  FTL_LOG(INFO) << "    --trace-tasks                    time main loop "
+                   "tasks by category (see --stats)";
+  FTL_LOG(INFO) << "    --loop-probe-interval=<ms>       measure main loop "
+                   "lag this often (default 0, off)";
+  FTL_LOG(INFO) << "    --preconnect                     connect to devices "
+                   "as they're discovered";
+  FTL_LOG(INFO) << "    --multipath                      spread connections "
+                   "to a device over its V4 and V6 addresses";
+  FTL_LOG(INFO) << "    --fast-open                      use TCP fast open "
+                   "where supported";
   FTL_LOG(INFO) << "    --listen                         run as listener";
 }
 
-void NetConnectorParams::RegisterService(
-    const std::string& name,
-    app::ApplicationLaunchInfoPtr launch_info) {
-  auto result =
-      launch_infos_by_service_name_.emplace(name, std::move(launch_info));
+Watermarks NetConnectorParams::WatermarksForService(
+    const std::string& service_name) const {
+  auto iter = config_.watermarks_by_service_name_.find(service_name);
+  return iter == config_.watermarks_by_service_name_.end()
+             ? config_.default_watermarks_
+             : iter->second;
+}
+
+TransportProfile NetConnectorParams::TransportProfileForService(
+    const std::string& service_name) const {
+  auto iter = config_.transport_profiles_by_service_name_.find(service_name);
+  return iter == config_.transport_profiles_by_service_name_.end()
+             ? config_.default_transport_profile_
+             : iter->second;
+}
 
-  if (!result.second) {
-    FTL_DCHECK(result.first != launch_infos_by_service_name_.end());
-    result.first->second = std::move(launch_info);
+size_t NetConnectorParams::VmoThresholdForService(
+    const std::string& service_name) const {
+  auto iter = config_.vmo_thresholds_by_service_name_.find(service_name);
+  return iter == config_.vmo_thresholds_by_service_name_.end()
+             ? config_.default_vmo_threshold_
+             : iter->second;
+}
+
+ftl::TimeDelta NetConnectorParams::MessageLifetimeForService(
+    const std::string& service_name) const {
+  auto iter = config_.message_lifetimes_by_service_name_.find(service_name);
+  return iter == config_.message_lifetimes_by_service_name_.end()
+             ? config_.default_message_lifetime_
+             : iter->second;
+}
+
+uint32_t NetConnectorParams::InstanceCountForService(
+    const std::string& service_name) const {
+  auto iter = config_.instance_counts_by_service_name_.find(service_name);
+  return iter == config_.instance_counts_by_service_name_.end()
+             ? 1
+             : iter->second;
+}
+
+uint32_t NetConnectorParams::MaxConnectionsForService(
+    const std::string& service_name) const {
+  auto iter = config_.max_connections_by_service_name_.find(service_name);
+  return iter == config_.max_connections_by_service_name_.end()
+             ? 0
+             : iter->second;
+}
+
+MessagePriority NetConnectorParams::PriorityForService(
+    const std::string& service_name) const {
+  auto iter = config_.priorities_by_service_name_.find(service_name);
+  return iter == config_.priorities_by_service_name_.end()
+             ? MessagePriority::kNormal
+             : iter->second;
+}
+
+std::vector<std::string> NetConnectorParams::ServiceNames() const {
+  std::vector<std::string> result;
+  for (auto& pair : config_.launch_infos_by_service_name_) {
+    result.push_back(pair.first);
   }
+
+  return result;
+}
+
+app::ApplicationLaunchInfoPtr NetConnectorParams::LaunchInfoForService(
+    const std::string& service_name) const {
+  auto iter = config_.launch_infos_by_service_name_.find(service_name);
+  FTL_DCHECK(iter != config_.launch_infos_by_service_name_.end());
+
+  // Launch infos can carry handles, so they're copied field by field.
+  app::ApplicationLaunchInfoPtr result = app::ApplicationLaunchInfo::New();
+  result->url = iter->second->url;
+  result->arguments = iter->second->arguments.Clone();
+  return result;
+}
+
+bool NetConnectorParams::PrelaunchService(
+    const std::string& service_name) const {
+  return config_.prelaunch_service_names_.find(service_name) !=
+         config_.prelaunch_service_names_.end();
 }
 
 void NetConnectorParams::RegisterDevice(const std::string& name,
-                                        const IpAddress& address) {
-  auto result = device_addresses_by_name_.emplace(name, address);
+                                        const DeviceAddresses& addresses) {
+  FTL_DCHECK(addresses.v4_.is_valid() || addresses.v6_.is_valid());
+  auto result = device_addresses_by_name_.emplace(name, addresses);
 
   if (!result.second) {
     FTL_DCHECK(result.first != device_addresses_by_name_.end());
-    result.first->second = address;
+    result.first->second = addresses;
   }
 }
 
 void NetConnectorParams::UnregisterDevice(const std::string& name) {
   device_addresses_by_name_.erase(name);
+  path_metrics_by_device_name_.erase(name);
+}
+
+void NetConnectorParams::AddRttSample(const std::string& name,
+                                      ftl::TimeDelta rtt) {
+  if (device_addresses_by_name_.find(name) !=
+      device_addresses_by_name_.end()) {
+    path_metrics_by_device_name_[name].AddRttSample(rtt);
+  }
+}
+
+void NetConnectorParams::AddThroughputSample(const std::string& name,
+                                             uint64_t bytes,
+                                             ftl::TimeDelta duration) {
+  if (device_addresses_by_name_.find(name) !=
+      device_addresses_by_name_.end()) {
+    path_metrics_by_device_name_[name].AddThroughputSample(bytes, duration);
+  }
+}
+
+const PathMetrics* NetConnectorParams::PathMetricsForDevice(
+    const std::string& name) const {
+  auto iter = path_metrics_by_device_name_.find(name);
+  return iter == path_metrics_by_device_name_.end() ? nullptr : &iter->second;
 }
 
-bool NetConnectorParams::ReadConfigFrom(const std::string& config_file_name) {
+bool NetConnectorParams::ReloadConfig(ConfigChanges* changes) {
+  FTL_DCHECK(changes != nullptr);
+
   std::string config_file_contents;
-  return files::ReadFileToString(config_file_name, &config_file_contents) &&
-         ParseConfig(config_file_contents);
+  if (!files::ReadFileToString(config_file_name_, &config_file_contents)) {
+    return false;
+  }
+
+  if (config_file_contents == config_file_contents_) {
+    return true;
+  }
+
+  Config config;
+  if (!ParseConfig(config_file_contents, &config)) {
+    return false;
+  }
+
+  for (auto& pair : config.launch_infos_by_service_name_) {
+    if (ServiceChanged(pair.first, config_, config)) {
+      changes->services_registered_.push_back(pair.first);
+    }
+  }
+
+  for (auto& pair : config_.launch_infos_by_service_name_) {
+    if (config.launch_infos_by_service_name_.find(pair.first) ==
+        config.launch_infos_by_service_name_.end()) {
+      changes->services_unregistered_.push_back(pair.first);
+    }
+  }
+
+  for (auto& pair : config.device_addresses_by_name_) {
+    auto iter = config_.device_addresses_by_name_.find(pair.first);
+    if (iter == config_.device_addresses_by_name_.end() ||
+        iter->second.v4_ != pair.second.v4_ ||
+        iter->second.v6_ != pair.second.v6_) {
+      RegisterDevice(pair.first, pair.second);
+      changes->devices_changed_.push_back(pair.first);
+    }
+  }
+
+  for (auto& pair : config_.device_addresses_by_name_) {
+    if (config.device_addresses_by_name_.find(pair.first) ==
+        config.device_addresses_by_name_.end()) {
+      UnregisterDevice(pair.first);
+      changes->devices_changed_.push_back(pair.first);
+    }
+  }
+
+  changes->bandwidth_limits_changed_ =
+      config.service_bandwidth_limits_ != config_.service_bandwidth_limits_ ||
+      config.device_bandwidth_limits_ != config_.device_bandwidth_limits_;
+
+  config_ = std::move(config);
+  config_file_contents_ = std::move(config_file_contents);
+  return true;
+}
+
+// static
+bool NetConnectorParams::ServiceChanged(const std::string& service_name,
+                                        const Config& old_config,
+                                        const Config& new_config) {
+  auto old_iter = old_config.launch_infos_by_service_name_.find(service_name);
+  if (old_iter == old_config.launch_infos_by_service_name_.end()) {
+    return true;
+  }
+
+  auto new_iter = new_config.launch_infos_by_service_name_.find(service_name);
+  FTL_DCHECK(new_iter != new_config.launch_infos_by_service_name_.end());
+
+  const app::ApplicationLaunchInfo& old_launch_info = *old_iter->second;
+  const app::ApplicationLaunchInfo& new_launch_info = *new_iter->second;
+  if (old_launch_info.url != new_launch_info.url ||
+      old_launch_info.arguments.size() != new_launch_info.arguments.size()) {
+    return true;
+  }
+
+  for (size_t i = 0; i < old_launch_info.arguments.size(); ++i) {
+    if (old_launch_info.arguments[i] != new_launch_info.arguments[i]) {
+      return true;
+    }
+  }
+
+  auto old_count =
+      old_config.instance_counts_by_service_name_.find(service_name);
+  auto new_count =
+      new_config.instance_counts_by_service_name_.find(service_name);
+  FTL_DCHECK(old_count != old_config.instance_counts_by_service_name_.end());
+  FTL_DCHECK(new_count != new_config.instance_counts_by_service_name_.end());
+
+  return old_count->second != new_count->second ||
+         (old_config.prelaunch_service_names_.count(service_name) !=
+          new_config.prelaunch_service_names_.count(service_name));
 }
 
-bool NetConnectorParams::ParseConfig(const std::string& string) {
+// static
+bool NetConnectorParams::ParseConfig(const std::string& string,
+                                     Config* config) {
+  FTL_DCHECK(config != nullptr);
+
   rapidjson::Document document;
   document.Parse(string.data(), string.size());
   if (!document.IsObject())
@@ -115,28 +888,36 @@ bool NetConnectorParams::ParseConfig(const std::string& string) {
       }
 
       auto launch_info = app::ApplicationLaunchInfo::New();
-      if (pair.value.IsString()) {
-        launch_info->url = pair.value.GetString();
-      } else if (pair.value.IsArray()) {
-        const auto& array = pair.value.GetArray();
-
-        if (array.Empty() || !array[0].IsString()) {
-          return false;
-        }
-
-        launch_info->url = array[0].GetString();
-        for (size_t i = 1; i < array.Size(); ++i) {
-          if (!array[i].IsString()) {
-            return false;
-          }
-
-          launch_info->arguments.push_back(array[i].GetString());
-        }
-      } else {
+      ServiceOptions options;
+      if (!ParseLaunchInfo(pair.value, launch_info.get(), &options)) {
         return false;
       }
 
-      RegisterService(pair.name.GetString(), std::move(launch_info));
+      std::string service_name = pair.name.GetString();
+      if (options.prelaunch_) {
+        config->prelaunch_service_names_.insert(service_name);
+      } else {
+        config->prelaunch_service_names_.erase(service_name);
+      }
+
+      config->instance_counts_by_service_name_[service_name] =
+          options.instance_count_;
+
+      if (options.max_connections_ != 0) {
+        config->max_connections_by_service_name_[service_name] =
+            options.max_connections_;
+      } else {
+        config->max_connections_by_service_name_.erase(service_name);
+      }
+
+      if (options.priority_ != MessagePriority::kNormal) {
+        config->priorities_by_service_name_[service_name] = options.priority_;
+      } else {
+        config->priorities_by_service_name_.erase(service_name);
+      }
+
+      config->launch_infos_by_service_name_[service_name] =
+          std::move(launch_info);
     }
   }
 
@@ -159,8 +940,195 @@ bool NetConnectorParams::ParseConfig(const std::string& string) {
         return false;
       }
 
-      RegisterDevice(pair.name.GetString(), address);
+      DeviceAddresses addresses;
+      if (address.is_v4()) {
+        addresses.v4_ = address;
+      } else {
+        addresses.v6_ = address;
+      }
+
+      config->device_addresses_by_name_[pair.name.GetString()] = addresses;
+    }
+  }
+
+  iter = document.FindMember(kConfigFlowControl);
+  if (iter != document.MemberEnd() && !ParseFlowControl(iter->value, config)) {
+    return false;
+  }
+
+  iter = document.FindMember(kConfigTransport);
+  if (iter != document.MemberEnd() && !ParseTransport(iter->value, config)) {
+    return false;
+  }
+
+  iter = document.FindMember(kConfigSharedMemory);
+  if (iter != document.MemberEnd() &&
+      !ParseSharedMemory(iter->value, config)) {
+    return false;
+  }
+
+  iter = document.FindMember(kConfigMessageLifetime);
+  if (iter != document.MemberEnd() &&
+      !ParseMessageLifetime(iter->value, config)) {
+    return false;
+  }
+
+  iter = document.FindMember(kConfigBandwidth);
+  if (iter != document.MemberEnd() && !ParseBandwidth(iter->value, config)) {
+    return false;
+  }
+
+  return true;
+}
+
+// static
+bool NetConnectorParams::ParseFlowControl(const rapidjson::Value& value,
+                                          Config* config) {
+  FTL_DCHECK(config != nullptr);
+
+  if (!value.IsObject()) {
+    return false;
+  }
+
+  // Parse the default first, because per-service watermarks inherit from it.
+  auto iter = value.FindMember(kConfigFlowControlDefault);
+  if (iter != value.MemberEnd() &&
+      !ParseWatermarks(iter->value, &config->default_watermarks_)) {
+    return false;
+  }
+
+  for (const auto& pair : value.GetObject()) {
+    if (!pair.name.IsString()) {
+      return false;
     }
+
+    std::string service_name = pair.name.GetString();
+    if (service_name == kConfigFlowControlDefault) {
+      continue;
+    }
+
+    Watermarks watermarks = config->default_watermarks_;
+    if (!ParseWatermarks(pair.value, &watermarks)) {
+      return false;
+    }
+
+    config->watermarks_by_service_name_[service_name] = watermarks;
+  }
+
+  return true;
+}
+
+// static
+bool NetConnectorParams::ParseTransport(const rapidjson::Value& value,
+                                        Config* config) {
+  FTL_DCHECK(config != nullptr);
+
+  if (!value.IsObject()) {
+    return false;
+  }
+
+  // Parse the default first, because per-service profiles given as objects
+  // inherit from it.
+  auto iter = value.FindMember(kConfigTransportDefault);
+  if (iter != value.MemberEnd() &&
+      !ParseTransportProfile(iter->value,
+                             &config->default_transport_profile_)) {
+    return false;
+  }
+
+  for (const auto& pair : value.GetObject()) {
+    if (!pair.name.IsString()) {
+      return false;
+    }
+
+    std::string service_name = pair.name.GetString();
+    if (service_name == kConfigTransportDefault) {
+      continue;
+    }
+
+    TransportProfile profile = config->default_transport_profile_;
+    if (!ParseTransportProfile(pair.value, &profile)) {
+      return false;
+    }
+
+    config->transport_profiles_by_service_name_[service_name] = profile;
+  }
+
+  return true;
+}
+
+// static
+bool NetConnectorParams::ParseSharedMemory(const rapidjson::Value& value,
+                                           Config* config) {
+  FTL_DCHECK(config != nullptr);
+
+  if (!value.IsObject()) {
+    return false;
+  }
+
+  for (const auto& pair : value.GetObject()) {
+    if (!pair.name.IsString() || !pair.value.IsUint()) {
+      return false;
+    }
+
+    std::string service_name = pair.name.GetString();
+    if (service_name == kConfigSharedMemoryDefault) {
+      config->default_vmo_threshold_ = pair.value.GetUint();
+    } else {
+      config->vmo_thresholds_by_service_name_[service_name] =
+          pair.value.GetUint();
+    }
+  }
+
+  return true;
+}
+
+// static
+bool NetConnectorParams::ParseMessageLifetime(const rapidjson::Value& value,
+                                              Config* config) {
+  FTL_DCHECK(config != nullptr);
+
+  if (!value.IsObject()) {
+    return false;
+  }
+
+  for (const auto& pair : value.GetObject()) {
+    if (!pair.name.IsString() || !pair.value.IsUint()) {
+      return false;
+    }
+
+    ftl::TimeDelta lifetime =
+        ftl::TimeDelta::FromMilliseconds(pair.value.GetUint());
+    std::string service_name = pair.name.GetString();
+    if (service_name == kConfigMessageLifetimeDefault) {
+      config->default_message_lifetime_ = lifetime;
+    } else {
+      config->message_lifetimes_by_service_name_[service_name] = lifetime;
+    }
+  }
+
+  return true;
+}
+
+// static
+bool NetConnectorParams::ParseBandwidth(const rapidjson::Value& value,
+                                        Config* config) {
+  FTL_DCHECK(config != nullptr);
+
+  if (!value.IsObject()) {
+    return false;
+  }
+
+  auto iter = value.FindMember(kConfigBandwidthServices);
+  if (iter != value.MemberEnd() &&
+      !ParseBandwidthLimits(iter->value, &config->service_bandwidth_limits_)) {
+    return false;
+  }
+
+  iter = value.FindMember(kConfigBandwidthDevices);
+  if (iter != value.MemberEnd() &&
+      !ParseBandwidthLimits(iter->value, &config->device_bandwidth_limits_)) {
+    return false;
   }
 
   return true;
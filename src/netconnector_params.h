@@ -6,14 +6,57 @@
 
 #include <string>
 #include <unordered_map>
+#include <unordered_set>
+#include <vector>
+
+#include <rapidjson/document.h>
 
 #include "application/services/application_launcher.fidl.h"
 #include "apps/netconnector/src/ip_address.h"
+#include "apps/netconnector/src/message_priority.h"
+#include "apps/netconnector/src/path_metrics.h"
+#include "apps/netconnector/src/token_bucket.h"
+#include "apps/netconnector/src/transport_profile.h"
+#include "apps/netconnector/src/watermarks.h"
 #include "lib/ftl/command_line.h"
 #include "lib/ftl/macros.h"
+#include "lib/ftl/time/time_delta.h"
 
 namespace netconnector {
 
+// The addresses of a device, one for each family. At least one is valid.
+struct DeviceAddresses {
+  bool is_loopback() const {
+    return (v4_.is_valid() && v4_.is_loopback()) ||
+           (v6_.is_valid() && v6_.is_loopback());
+  }
+
+  IpAddress v4_;
+  IpAddress v6_;
+};
+
+// The differences between two versions of the config file that must be
+// applied outside of |NetConnectorParams|. Flow control, transport profiles,
+// shared memory thresholds, priorities and per-service connection limits are
+// looked up as connections are made, so changes to them need no action.
+struct ConfigChanges {
+  bool empty() const {
+    return services_registered_.empty() && services_unregistered_.empty() &&
+           devices_changed_.empty() && !bandwidth_limits_changed_;
+  }
+
+  // Services that were added or whose launch info, instance count or
+  // prelaunch setting changed, so their singletons must be registered anew.
+  std::vector<std::string> services_registered_;
+  // Services that were removed.
+  std::vector<std::string> services_unregistered_;
+  // Devices that were added, removed or given new addresses.
+  std::vector<std::string> devices_changed_;
+  // Whether any service or device bandwidth limit was added, removed or
+  // changed. These apply to open connections, too.
+  bool bandwidth_limits_changed_ = false;
+};
+
 class NetConnectorParams {
  public:
   NetConnectorParams(const ftl::CommandLine& command_line);
@@ -23,38 +66,259 @@ class NetConnectorParams {
   bool listen() const { return listen_; }
 
   bool show_devices() const { return show_devices_; }
+  bool show_stats() const { return show_stats_; }
+  bool show_mdns_stats() const { return show_mdns_stats_; }
+
+  // Whether --mdns-capture was given, and the number of datagrams to capture.
+  bool set_mdns_capture_size() const { return set_mdns_capture_size_; }
+  uint32_t mdns_capture_size() const { return mdns_capture_size_; }
+
+  // The file to which the mDNS capture should be written, or empty.
+  const std::string& mdns_capture_file() const { return mdns_capture_file_; }
+
   bool mdns_verbose() const { return mdns_verbose_; }
 
-  std::unordered_map<std::string, app::ApplicationLaunchInfoPtr>
-  MoveServices() {
-    return std::move(launch_infos_by_service_name_);
+  // Whether each interface should receive mDNS traffic on its own thread.
+  bool mdns_receive_threads() const { return mdns_receive_threads_; }
+
+  bool direct_delivery() const { return direct_delivery_; }
+  bool trace_latency() const { return trace_latency_; }
+  bool trace_tasks() const { return trace_tasks_; }
+
+  // Indicates whether a connection should be opened to each device as it's
+  // discovered, before any service is requested from it.
+  bool preconnect() const { return preconnect_; }
+
+  // Indicates whether service connections to a device with both a V4 and a
+  // V6 address should be spread over a connection to each address, with
+  // failed connections resumed over the other address.
+  bool multipath() const { return multipath_; }
+
+  // Whether connections should use TCP fast open where the stack supports
+  // it, sending the first packets in the SYN.
+  bool fast_open() const { return fast_open_; }
+
+  // The range of the mDNS aggregation window. The window is fixed if these
+  // are the same.
+  ftl::TimeDelta mdns_min_aggregation_window() const {
+    return mdns_min_aggregation_window_;
+  }
+  ftl::TimeDelta mdns_max_aggregation_window() const {
+    return mdns_max_aggregation_window_;
+  }
+
+  ftl::TimeDelta connect_timeout() const { return connect_timeout_; }
+
+  ftl::TimeDelta connection_idle_timeout() const {
+    return connection_idle_timeout_;
+  }
+
+  size_t max_idle_connections() const { return max_idle_connections_; }
+
+  // Returns the maximum number of connections from remote requestors.
+  size_t max_connections() const { return max_connections_; }
+
+  // Returns the maximum number of connections from any one remote address.
+  size_t max_connections_per_peer() const { return max_connections_per_peer_; }
+
+  // Returns how often connections are checked with heartbeats. Zero means
+  // heartbeats are disabled.
+  ftl::TimeDelta heartbeat_interval() const { return heartbeat_interval_; }
+
+  // Returns the number of consecutive heartbeats a remote party may miss
+  // before its connection is closed.
+  uint32_t heartbeat_misses() const { return heartbeat_misses_; }
+
+  // Returns how often the main loop's lag is probed. Zero means the loop
+  // isn't probed.
+  ftl::TimeDelta loop_probe_interval() const { return loop_probe_interval_; }
+
+  // Returns how long a failed connection may take to be resumed on a new
+  // connection before it's closed. Zero means connections aren't resumed.
+  ftl::TimeDelta resume_timeout() const { return resume_timeout_; }
+
+  // Returns the most bytes a connection coalesces into one socket write. Zero
+  // means the transceiver's default applies.
+  size_t send_batch_bytes() const { return send_batch_bytes_; }
+
+  // Returns the most packets a connection coalesces into one socket write.
+  // Zero means the transceiver's default applies.
+  size_t send_batch_packets() const { return send_batch_packets_; }
+
+  // Returns how often the listener checks the config file for changes. Zero
+  // means the config file is read only at startup.
+  ftl::TimeDelta config_check_interval() const {
+    return config_check_interval_;
   }
 
-  const std::unordered_map<std::string, IpAddress>& devices() {
+  // Returns the flow control watermarks for channels connected to the
+  // service named |service_name|.
+  Watermarks WatermarksForService(const std::string& service_name) const;
+
+  // Returns the socket options for connections carrying the service named
+  // |service_name|.
+  TransportProfile TransportProfileForService(
+      const std::string& service_name) const;
+
+  // Returns the size at and above which messages on channels connected to
+  // the service named |service_name| are moved in VMOs, or zero if VMO
+  // messages aren't used for the service.
+  size_t VmoThresholdForService(const std::string& service_name) const;
+
+  // Returns how long messages on channels connected to the service named
+  // |service_name| may wait to be sent before they're discarded, or zero if
+  // they don't expire.
+  ftl::TimeDelta MessageLifetimeForService(
+      const std::string& service_name) const;
+
+  // Returns the names of the services registered in the config file.
+  std::vector<std::string> ServiceNames() const;
+
+  // Returns a copy of the launch info for the service named |service_name|,
+  // which must be registered in the config file.
+  app::ApplicationLaunchInfoPtr LaunchInfoForService(
+      const std::string& service_name) const;
+
+  // Returns whether the singleton for the service named |service_name| should
+  // be launched when the listener starts rather than on first use.
+  bool PrelaunchService(const std::string& service_name) const;
+
+  // Returns the number of instances of the singleton for the service named
+  // |service_name| that should be launched to share its connections.
+  uint32_t InstanceCountForService(const std::string& service_name) const;
+
+  // Returns the maximum number of connections from remote requestors to the
+  // service named |service_name|, or zero if there's no limit.
+  uint32_t MaxConnectionsForService(const std::string& service_name) const;
+
+  // Returns the priority of channels connected to the service named
+  // |service_name|.
+  MessagePriority PriorityForService(const std::string& service_name) const;
+
+  const std::unordered_map<std::string, DeviceAddresses>& devices() {
     return device_addresses_by_name_;
   }
 
-  void RegisterDevice(const std::string& name, const IpAddress& address);
+  // Returns the bandwidth limits by service name and by device name.
+  const std::unordered_map<std::string, BandwidthLimit>&
+  service_bandwidth_limits() const {
+    return config_.service_bandwidth_limits_;
+  }
+
+  const std::unordered_map<std::string, BandwidthLimit>&
+  device_bandwidth_limits() const {
+    return config_.device_bandwidth_limits_;
+  }
+
+  void RegisterDevice(const std::string& name,
+                      const DeviceAddresses& addresses);
 
   void UnregisterDevice(const std::string& name);
 
+  // Adds samples to the path metrics of the device named |name|. Samples for
+  // devices that aren't registered are ignored.
+  void AddRttSample(const std::string& name, ftl::TimeDelta rtt);
+  void AddThroughputSample(const std::string& name,
+                           uint64_t bytes,
+                           ftl::TimeDelta duration);
+
+  // Returns the path metrics of the device named |name|, or nullptr if no
+  // samples have been added for the device.
+  const PathMetrics* PathMetricsForDevice(const std::string& name) const;
+
+  const std::unordered_map<std::string, PathMetrics>& path_metrics() const {
+    return path_metrics_by_device_name_;
+  }
+
+  // Reads the config file again if its contents have changed. If the new
+  // config is valid, it replaces the old one, devices it adds, removes or
+  // readdresses are registered or unregistered, and |*changes| describes the
+  // changes the caller must apply. Returns false if the config file couldn't
+  // be read or parsed, in which case the old config remains in effect.
+  bool ReloadConfig(ConfigChanges* changes);
+
  private:
+  // Settings read from the config file.
+  struct Config {
+    std::unordered_map<std::string, app::ApplicationLaunchInfoPtr>
+        launch_infos_by_service_name_;
+    std::unordered_set<std::string> prelaunch_service_names_;
+    std::unordered_map<std::string, uint32_t> instance_counts_by_service_name_;
+    std::unordered_map<std::string, uint32_t> max_connections_by_service_name_;
+    std::unordered_map<std::string, MessagePriority>
+        priorities_by_service_name_;
+    std::unordered_map<std::string, DeviceAddresses> device_addresses_by_name_;
+    Watermarks default_watermarks_;
+    std::unordered_map<std::string, Watermarks> watermarks_by_service_name_;
+    TransportProfile default_transport_profile_;
+    std::unordered_map<std::string, TransportProfile>
+        transport_profiles_by_service_name_;
+    uint32_t default_vmo_threshold_ = 0;
+    std::unordered_map<std::string, uint32_t> vmo_thresholds_by_service_name_;
+    ftl::TimeDelta default_message_lifetime_;
+    std::unordered_map<std::string, ftl::TimeDelta>
+        message_lifetimes_by_service_name_;
+    std::unordered_map<std::string, BandwidthLimit> service_bandwidth_limits_;
+    std::unordered_map<std::string, BandwidthLimit> device_bandwidth_limits_;
+  };
+
   void Usage();
 
-  bool ReadConfigFrom(const std::string& config_file);
+  static bool ParseConfig(const std::string& string, Config* config);
+
+  static bool ParseFlowControl(const rapidjson::Value& value, Config* config);
+
+  static bool ParseTransport(const rapidjson::Value& value, Config* config);
+
+  static bool ParseSharedMemory(const rapidjson::Value& value, Config* config);
+
+  static bool ParseMessageLifetime(const rapidjson::Value& value,
+                                   Config* config);
 
-  bool ParseConfig(const std::string& string);
+  static bool ParseBandwidth(const rapidjson::Value& value, Config* config);
 
-  void RegisterService(const std::string& selector,
-                       app::ApplicationLaunchInfoPtr launch_info);
+  // Returns whether the service named |service_name| must be registered
+  // anew to go from |old_config| to |new_config|.
+  static bool ServiceChanged(const std::string& service_name,
+                             const Config& old_config,
+                             const Config& new_config);
 
   bool is_valid_;
   bool listen_ = false;
   bool show_devices_ = false;
+  bool show_stats_ = false;
+  bool show_mdns_stats_ = false;
+  bool set_mdns_capture_size_ = false;
+  uint32_t mdns_capture_size_ = 0;
+  std::string mdns_capture_file_;
   bool mdns_verbose_ = false;
-  std::unordered_map<std::string, app::ApplicationLaunchInfoPtr>
-      launch_infos_by_service_name_;
-  std::unordered_map<std::string, IpAddress> device_addresses_by_name_;
+  bool mdns_receive_threads_ = false;
+  bool direct_delivery_ = false;
+  bool trace_latency_ = false;
+  bool trace_tasks_ = false;
+  bool preconnect_ = false;
+  bool multipath_ = false;
+  bool fast_open_ = false;
+  ftl::TimeDelta mdns_min_aggregation_window_;
+  ftl::TimeDelta mdns_max_aggregation_window_;
+  ftl::TimeDelta connect_timeout_;
+  ftl::TimeDelta connection_idle_timeout_;
+  size_t max_idle_connections_;
+  size_t max_connections_;
+  size_t max_connections_per_peer_;
+  ftl::TimeDelta heartbeat_interval_;
+  ftl::TimeDelta loop_probe_interval_;
+  uint32_t heartbeat_misses_;
+  ftl::TimeDelta resume_timeout_;
+  size_t send_batch_bytes_ = 0;
+  size_t send_batch_packets_ = 0;
+  ftl::TimeDelta config_check_interval_;
+  std::string config_file_name_;
+  std::string config_file_contents_;
+  Config config_;
+  // All known devices, including those from the config file.
+  std::unordered_map<std::string, DeviceAddresses> device_addresses_by_name_;
+  std::unordered_map<std::string, PathMetrics> path_metrics_by_device_name_;
 
   FTL_DISALLOW_COPY_AND_ASSIGN(NetConnectorParams);
 };
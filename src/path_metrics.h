@@ -0,0 +1,65 @@
+// Copyright 2017 The Fuchsia Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#pragma once
+
+#include <stdint.h>
+
+#include "lib/ftl/time/time_delta.h"
+
+namespace netconnector {
+
+// Estimates of the round trip time and throughput of the network path to a
+// device, built from samples taken by the connections to the device.
+struct PathMetrics {
+  // Samples are folded into the smoothed values with these weights, the RTT
+  // weight being the one TCP uses (RFC 6298).
+  static constexpr int64_t kRttSmoothingDivisor = 8;
+  static constexpr uint64_t kThroughputSmoothingDivisor = 4;
+
+  // Adds a round trip time sample, taken from a version exchange or a
+  // heartbeat.
+  void AddRttSample(ftl::TimeDelta rtt) {
+    if (rtt_sample_count_ == 0) {
+      smoothed_rtt_ = rtt;
+      min_rtt_ = rtt;
+    } else {
+      smoothed_rtt_ += (rtt - smoothed_rtt_) / kRttSmoothingDivisor;
+      if (rtt < min_rtt_) {
+        min_rtt_ = rtt;
+      }
+    }
+
+    ++rtt_sample_count_;
+  }
+
+  // Adds a throughput sample of |bytes| written over |duration| while the
+  // socket was backed up, so the network rather than the sender set the pace.
+  void AddThroughputSample(uint64_t bytes, ftl::TimeDelta duration) {
+    if (duration <= ftl::TimeDelta::Zero()) {
+      return;
+    }
+
+    uint64_t sample = static_cast<uint64_t>(bytes / duration.ToSecondsF());
+    if (throughput_sample_count_ == 0) {
+      throughput_ = sample;
+    } else {
+      throughput_ = throughput_ - throughput_ / kThroughputSmoothingDivisor +
+                    sample / kThroughputSmoothingDivisor;
+    }
+
+    ++throughput_sample_count_;
+  }
+
+  // Smoothed and minimum round trip times. Zero if there are no samples.
+  ftl::TimeDelta smoothed_rtt_;
+  ftl::TimeDelta min_rtt_;
+  uint32_t rtt_sample_count_ = 0;
+
+  // Smoothed throughput in bytes per second. Zero if there are no samples.
+  uint64_t throughput_ = 0;
+  uint32_t throughput_sample_count_ = 0;
+};
+
+}  // namespace netconnector
@@ -5,6 +5,9 @@
 #include "apps/netconnector/src/requestor_agent.h"
 
 #include <errno.h>
+#include <fcntl.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
 #include <sys/socket.h>
 
 #include "apps/netconnector/src/ip_port.h"
@@ -16,47 +19,247 @@ namespace netconnector {
 // static
 std::unique_ptr<RequestorAgent> RequestorAgent::Create(
     const SocketAddress& address,
+    const SocketAddress& alternate_address,
     const std::string& service_name,
-    mx::channel local_channel,
+    mx::channel* local_channel,
+    ftl::TimeDelta connect_timeout,
     NetConnectorImpl* owner) {
   FTL_DCHECK(address.is_valid());
-  FTL_DCHECK(!service_name.empty());
-  FTL_DCHECK(local_channel);
+  FTL_DCHECK(service_name.empty() == (local_channel == nullptr));
+  FTL_DCHECK(!local_channel || *local_channel);
   FTL_DCHECK(owner != nullptr);
 
+  // A fast open connect completes at once, so it can't be raced against a
+  // connect to the alternate address.
+  bool fast_open =
+      !alternate_address.is_valid() && owner->FastOpenForAddress(address);
+  ftl::UniqueFD fd = StartConnect(address, &fast_open);
+  if (!fd.is_valid()) {
+    return std::unique_ptr<RequestorAgent>();
+  }
+
+  // The transceiver starts the connect to the alternate address if the first
+  // connect is slow, so only the socket is created here.
+  ftl::UniqueFD alternate_fd;
+  if (alternate_address.is_valid()) {
+    alternate_fd =
+        ftl::UniqueFD(socket(alternate_address.family(), SOCK_STREAM, 0));
+    if (!alternate_fd.is_valid()) {
+      FTL_LOG(WARNING) << "Failed to open alternate requestor agent socket, "
+                          "errno "
+                       << errno;
+    }
+  }
+
+  return std::unique_ptr<RequestorAgent>(new RequestorAgent(
+      std::move(fd), address, std::move(alternate_fd), alternate_address,
+      service_name, local_channel ? std::move(*local_channel) : mx::channel(),
+      connect_timeout, fast_open, owner));
+}
+
+// static
+ftl::UniqueFD RequestorAgent::StartConnect(const SocketAddress& address,
+                                           bool* fast_open) {
+  FTL_DCHECK(fast_open != nullptr);
+
   ftl::UniqueFD fd(socket(address.family(), SOCK_STREAM, 0));
   if (!fd.is_valid()) {
     FTL_LOG(WARNING) << "Failed to open requestor agent socket, errno" << errno;
-    return std::unique_ptr<RequestorAgent>();
+    return ftl::UniqueFD();
+  }
+
+  // The connect completes on the I/O thread, so we don't block here waiting
+  // for a slow or unreachable device.
+  int flags = fcntl(fd.get(), F_GETFL, 0);
+  if (flags < 0 || fcntl(fd.get(), F_SETFL, flags | O_NONBLOCK) < 0) {
+    FTL_LOG(WARNING) << "Failed to make requestor agent socket non-blocking, "
+                        "errno "
+                     << errno;
+    return ftl::UniqueFD();
   }
 
-  if (connect(fd.get(), address.as_sockaddr(), address.socklen()) < 0) {
+#ifdef TCP_FASTOPEN_CONNECT
+  // With this option, if the stack has a cookie for |address|, connect
+  // returns at once, and the SYN goes out with the first write, carrying the
+  // version and service name packets. Otherwise, the connect proceeds as
+  // usual and asks the remote party for a cookie.
+  int enable = 1;
+  if (*fast_open &&
+      setsockopt(fd.get(), IPPROTO_TCP, TCP_FASTOPEN_CONNECT, &enable,
+                 sizeof(enable)) < 0) {
+    FTL_VLOG(1) << "TCP fast open isn't supported, errno " << errno;
+    *fast_open = false;
+  }
+#else
+  *fast_open = false;
+#endif
+
+  if (connect(fd.get(), address.as_sockaddr(), address.socklen()) < 0 &&
+      errno != EINPROGRESS) {
     FTL_LOG(WARNING) << "Failed to connect, errno" << errno;
-    return std::unique_ptr<RequestorAgent>();
+    return ftl::UniqueFD();
   }
 
-  return std::unique_ptr<RequestorAgent>(new RequestorAgent(
-      std::move(fd), service_name, std::move(local_channel), owner));
+  return fd;
 }
 
 RequestorAgent::RequestorAgent(ftl::UniqueFD socket_fd,
+                               const SocketAddress& address,
+                               ftl::UniqueFD alternate_socket_fd,
+                               const SocketAddress& alternate_address,
                                const std::string& service_name,
                                mx::channel local_channel,
+                               ftl::TimeDelta connect_timeout,
+                               bool fast_open,
                                NetConnectorImpl* owner)
-    : MessageTransciever(std::move(socket_fd)),
-      service_name_(service_name),
-      local_channel_(std::move(local_channel)),
-      owner_(owner) {
-  FTL_DCHECK(!service_name_.empty());
-  FTL_DCHECK(local_channel_);
+    : MessageTransciever(std::move(socket_fd),
+                         std::move(alternate_socket_fd),
+                         alternate_address,
+                         connect_timeout,
+                         owner->direct_delivery()),
+      address_(address),
+      alternate_address_(alternate_address),
+      connect_timeout_(connect_timeout),
+      owner_(owner),
+      fast_open_(fast_open),
+      speculative_(service_name.empty()) {
+  FTL_DCHECK(service_name.empty() == !local_channel);
   FTL_DCHECK(owner_ != nullptr);
+
+  if (owner_->resume_timeout() > ftl::TimeDelta::Zero()) {
+    EnableResumption(true);
+  }
+
+  SetSendBatchLimits(owner_->send_batch_bytes(), owner_->send_batch_packets());
+
+  std::shared_ptr<TokenBucket> token_bucket =
+      owner_->TokenBucketForAddress(address);
+  if (token_bucket) {
+    SetDeviceTokenBucket(token_bucket);
+  }
+
+  if (!speculative_) {
+    // Rather than waiting a round trip for the version exchange, we send the
+    // service name and start forwarding messages right away. These are sent
+    // in the version 1 format, which all versions of the remote party accept.
+    SendServiceName(service_name);
+    SetChannelEarly(std::move(local_channel));
+  }
 }
 
 RequestorAgent::~RequestorAgent() {}
 
+bool RequestorAgent::CanConnectToService() const {
+  return !is_closed() && (!version_received_ || is_multiplexed());
+}
+
+void RequestorAgent::ConnectToService(const std::string& service_name,
+                                      mx::channel channel) {
+  FTL_DCHECK(CanConnectToService());
+
+  if (!version_received_) {
+    // We don't know yet whether the remote party supports multiplexing.
+    pending_connections_.emplace_back(service_name, std::move(channel));
+    return;
+  }
+
+  OpenChannel(service_name, std::move(channel));
+}
+
+void RequestorAgent::SendToService(const std::string& service_name,
+                                   SharedMessage message,
+                                   const DeliveryCallback& callback) {
+  FTL_DCHECK(CanConnectToService());
+
+  if (!version_received_) {
+    pending_messages_.push_back({service_name, std::move(message), callback});
+    return;
+  }
+
+  SendSharedMessage(service_name, std::move(message), callback);
+}
+
+void RequestorAgent::Close() {
+  CloseConnection();
+}
+
+void RequestorAgent::Reconnect() {
+  FTL_DCHECK(owner_ != nullptr);
+
+  if (is_closed() || !is_suspended()) {
+    return;
+  }
+
+  if (ftl::TimePoint::Now() - suspend_time() >= owner_->resume_timeout()) {
+    FTL_LOG(WARNING) << "Connection to " << address_
+                     << " couldn't be resumed in time";
+    CloseConnection();
+    return;
+  }
+
+  // Without failover, only the preferred address is tried when reconnecting.
+  const SocketAddress* reconnect_address = &address_;
+  if (failover_ && alternate_address_.is_valid()) {
+    if (reconnect_to_alternate_) {
+      reconnect_address = &alternate_address_;
+    }
+
+    reconnect_to_alternate_ = !reconnect_to_alternate_;
+  }
+
+  bool fast_open = owner_->FastOpenForAddress(*reconnect_address);
+  ftl::UniqueFD fd = StartConnect(*reconnect_address, &fast_open);
+  if (!fd.is_valid()) {
+    owner_->OnRequestorAgentSuspended(this);
+    return;
+  }
+
+  ResumeConnecting(std::move(fd), connect_timeout_);
+}
+
 void RequestorAgent::OnVersionReceived(uint32_t version) {
-  SendServiceName(service_name_);
-  SetChannel(std::move(local_channel_));
+  version_received_ = true;
+
+  std::vector<std::pair<std::string, mx::channel>> pending_connections;
+  pending_connections.swap(pending_connections_);
+
+  for (auto& pair : pending_connections) {
+    if (is_multiplexed()) {
+      OpenChannel(pair.first, std::move(pair.second));
+    } else {
+      // The remote party needs a connection per service.
+      owner_->ConnectToRemoteService(address_, alternate_address_, pair.first,
+                                     &pair.second);
+    }
+  }
+
+  std::vector<PendingMessage> pending_messages;
+  pending_messages.swap(pending_messages_);
+
+  for (PendingMessage& pending : pending_messages) {
+    if (is_multiplexed()) {
+      SendSharedMessage(pending.service_name_, std::move(pending.message_),
+                        pending.callback_);
+    } else {
+      FTL_LOG(WARNING) << "Can't send shared message to " << address_
+                       << ", which doesn't support multiplexing";
+      pending.callback_(false);
+    }
+  }
+
+  if (!speculative_) {
+    return;
+  }
+
+  speculative_ = false;
+
+  if (!is_multiplexed()) {
+    // The connection can't carry a service connection now that the version
+    // exchange is done.
+    CloseConnection();
+  } else if (pending_connections.empty()) {
+    OnIdle();
+  }
 }
 
 void RequestorAgent::OnServiceNameReceived(const std::string& service_name) {
@@ -64,9 +267,88 @@ void RequestorAgent::OnServiceNameReceived(const std::string& service_name) {
   CloseConnection();
 }
 
+void RequestorAgent::OnChannelRequested(uint16_t channel_id,
+                                        const std::string& service_name) {
+  FTL_LOG(ERROR) << "RequestorAgent received open channel request";
+  CloseConnection();
+}
+
 void RequestorAgent::OnConnectionClosed() {
   FTL_DCHECK(owner_ != nullptr);
+
+  CheckFastOpen();
+
+  std::vector<PendingMessage> pending_messages;
+  pending_messages.swap(pending_messages_);
+  for (PendingMessage& pending : pending_messages) {
+    pending.callback_(false);
+  }
+
   owner_->ReleaseRequestorAgent(this);
 }
 
+void RequestorAgent::OnIdle() {
+  FTL_DCHECK(owner_ != nullptr);
+  owner_->OnRequestorAgentIdle(this);
+}
+
+void RequestorAgent::OnConnectionSuspended() {
+  FTL_DCHECK(owner_ != nullptr);
+  CheckFastOpen();
+  owner_->OnRequestorAgentSuspended(this);
+}
+
+Watermarks RequestorAgent::GetWatermarks(const std::string& service_name) {
+  FTL_DCHECK(owner_ != nullptr);
+  return owner_->WatermarksForService(service_name);
+}
+
+size_t RequestorAgent::GetVmoThreshold(const std::string& service_name) {
+  FTL_DCHECK(owner_ != nullptr);
+  return owner_->VmoThresholdForService(service_name);
+}
+
+ftl::TimeDelta RequestorAgent::GetMessageLifetime(
+    const std::string& service_name) {
+  FTL_DCHECK(owner_ != nullptr);
+  return owner_->MessageLifetimeForService(service_name);
+}
+
+std::shared_ptr<TokenBucket> RequestorAgent::GetTokenBucket(
+    const std::string& service_name) {
+  FTL_DCHECK(owner_ != nullptr);
+  return owner_->TokenBucketForService(service_name);
+}
+
+TransportProfile RequestorAgent::GetTransportProfile(
+    const std::string& service_name) {
+  FTL_DCHECK(owner_ != nullptr);
+  return owner_->TransportProfileForService(service_name);
+}
+
+MessagePriority RequestorAgent::GetPriority(const std::string& service_name) {
+  FTL_DCHECK(owner_ != nullptr);
+  return owner_->PriorityForService(service_name);
+}
+
+void RequestorAgent::OnRoundTripMeasured(ftl::TimeDelta rtt) {
+  FTL_DCHECK(owner_ != nullptr);
+  owner_->OnRoundTripMeasured(address_.address(), rtt);
+}
+
+void RequestorAgent::OnThroughputMeasured(uint64_t bytes,
+                                          ftl::TimeDelta duration) {
+  FTL_DCHECK(owner_ != nullptr);
+  owner_->OnThroughputMeasured(address_.address(), bytes, duration);
+}
+
+void RequestorAgent::CheckFastOpen() {
+  if (fast_open_ && !version_received_) {
+    // The remote party never answered our SYN data.
+    owner_->OnFastOpenFailed(address_);
+  }
+
+  fast_open_ = false;
+}
+
 }  // namespace netconnector
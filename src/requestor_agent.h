@@ -7,10 +7,13 @@
 #include <arpa/inet.h>
 
 #include <memory>
+#include <utility>
+#include <vector>
 
 #include "apps/netconnector/src/message_transceiver.h"
 #include "apps/netconnector/src/socket_address.h"
 #include "lib/ftl/files/unique_fd.h"
+#include "lib/ftl/time/time_delta.h"
 
 namespace netconnector {
 
@@ -18,30 +21,136 @@ class NetConnectorImpl;
 
 class RequestorAgent : public MessageTransciever {
  public:
-  static std::unique_ptr<RequestorAgent> Create(const SocketAddress& address,
-                                                const std::string& service_name,
-                                                mx::channel local_channel,
-                                                NetConnectorImpl* owner);
+  // Creates a requestor agent that connects to |address| asynchronously. If
+  // |alternate_address| is valid, a connect to it is raced against the connect
+  // to |address|, and whichever completes first is used. The connection is
+  // closed if it isn't established within |connect_timeout|. |*local_channel|
+  // is taken only if an agent is returned. If |service_name| is empty and
+  // |local_channel| is null, the connection is opened speculatively with no
+  // service connection, and the agent reports itself idle once the version
+  // exchange completes.
+  static std::unique_ptr<RequestorAgent> Create(
+      const SocketAddress& address,
+      const SocketAddress& alternate_address,
+      const std::string& service_name,
+      mx::channel* local_channel,
+      ftl::TimeDelta connect_timeout,
+      NetConnectorImpl* owner);
 
   ~RequestorAgent() override;
 
+  const SocketAddress& address() const { return address_; }
+
+  // Determines whether this agent's connection can carry another service
+  // connection. This is true until the version exchange completes and, if the
+  // remote party supports multiplexing, remains true until the connection
+  // closes.
+  bool CanConnectToService() const;
+
+  // Connects |channel| to |service_name| over this agent's connection. May only
+  // be called if |CanConnectToService()| returns true.
+  void ConnectToService(const std::string& service_name, mx::channel channel);
+
+  // Sends |message| to |service_name| over this agent's connection on a
+  // channel of its own, which is closed after the message (see
+  // SendSharedMessage). |callback| is called when the message has been
+  // written or can't be. May only be called if |CanConnectToService()|
+  // returns true.
+  void SendToService(const std::string& service_name,
+                     SharedMessage message,
+                     const DeliveryCallback& callback);
+
+  // Closes the connection.
+  void Close();
+
+  // Opens a new connection to resume the session of a connection whose socket
+  // has failed, or closes the connection if it has been suspended for longer
+  // than the resume timeout.
+  void Reconnect();
+
+  // Has |Reconnect| alternate between the address and the alternate address,
+  // starting with the alternate, so a session whose path has failed moves to
+  // the other path. By default, only the address is tried.
+  void EnableFailover() { failover_ = true; }
+
  protected:
   // MessageTransciever overrides.
   void OnVersionReceived(uint32_t version) override;
 
   void OnServiceNameReceived(const std::string& service_name) override;
 
+  void OnChannelRequested(uint16_t channel_id,
+                          const std::string& service_name) override;
+
   void OnConnectionClosed() override;
 
+  void OnIdle() override;
+
+  void OnConnectionSuspended() override;
+
+  Watermarks GetWatermarks(const std::string& service_name) override;
+
+  size_t GetVmoThreshold(const std::string& service_name) override;
+
+  ftl::TimeDelta GetMessageLifetime(const std::string& service_name) override;
+
+  std::shared_ptr<TokenBucket> GetTokenBucket(
+      const std::string& service_name) override;
+
+  TransportProfile GetTransportProfile(
+      const std::string& service_name) override;
+
+  MessagePriority GetPriority(const std::string& service_name) override;
+
+  void OnRoundTripMeasured(ftl::TimeDelta rtt) override;
+
+  void OnThroughputMeasured(uint64_t bytes, ftl::TimeDelta duration) override;
+
  private:
   RequestorAgent(ftl::UniqueFD socket_fd,
+                 const SocketAddress& address,
+                 ftl::UniqueFD alternate_socket_fd,
+                 const SocketAddress& alternate_address,
                  const std::string& service_name,
                  mx::channel local_channel,
+                 ftl::TimeDelta connect_timeout,
+                 bool fast_open,
                  NetConnectorImpl* owner);
 
-  std::string service_name_;
-  mx::channel local_channel_;
+  // Opens a socket and starts a non-blocking connect to |address|, using TCP
+  // fast open if |*fast_open| is true. |*fast_open| is cleared if the stack
+  // doesn't support fast open. Returns an invalid descriptor on failure.
+  static ftl::UniqueFD StartConnect(const SocketAddress& address,
+                                    bool* fast_open);
+
+  // Reports a failed fast open connect to the owner if the connection's
+  // socket failed before the version exchange.
+  void CheckFastOpen();
+
+  SocketAddress address_;
+  SocketAddress alternate_address_;
+  ftl::TimeDelta connect_timeout_;
   NetConnectorImpl* owner_;
+  // Whether the first connect used TCP fast open and hasn't been checked.
+  bool fast_open_;
+  bool version_received_ = false;
+  // Indicates whether the connection was opened with no service connection.
+  bool speculative_;
+  bool failover_ = false;
+  // Whether the next reconnect goes to |alternate_address_|, if failover is
+  // enabled.
+  bool reconnect_to_alternate_ = true;
+
+  // A shared message sent before the version exchange completed.
+  struct PendingMessage {
+    std::string service_name_;
+    SharedMessage message_;
+    DeliveryCallback callback_;
+  };
+
+  // Service connections requested before the version exchange completed.
+  std::vector<std::pair<std::string, mx::channel>> pending_connections_;
+  std::vector<PendingMessage> pending_messages_;
 
   FTL_DISALLOW_COPY_AND_ASSIGN(RequestorAgent);
 };
@@ -0,0 +1,275 @@
+// Copyright 2017 The Fuchsia Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#include "apps/netconnector/src/requestor_agent_pool.h"
+
+#include "lib/ftl/logging.h"
+#include "lib/mtl/tasks/message_loop.h"
+
+namespace netconnector {
+namespace {
+
+// How long a requestor agent whose socket has failed waits before
+// reconnecting.
+constexpr ftl::TimeDelta kReconnectDelay =
+    ftl::TimeDelta::FromMilliseconds(500);
+
+}  // namespace
+
+RequestorAgentPool::RequestorAgentPool(NetConnectorImpl* owner,
+                                       ftl::TimeDelta connect_timeout,
+                                       ftl::TimeDelta idle_timeout,
+                                       size_t max_idle_per_device,
+                                       bool multipath)
+    : owner_(owner),
+      connect_timeout_(connect_timeout),
+      idle_timeout_(idle_timeout),
+      max_idle_per_device_(max_idle_per_device),
+      multipath_(multipath),
+      task_runner_(mtl::MessageLoop::GetCurrent()->task_runner()) {
+  FTL_DCHECK(owner_ != nullptr);
+}
+
+RequestorAgentPool::~RequestorAgentPool() {}
+
+bool RequestorAgentPool::ConnectToService(
+    const SocketAddress& address,
+    const SocketAddress& alternate_address,
+    const std::string& service_name,
+    mx::channel* channel) {
+  FTL_DCHECK(channel);
+
+  bool use_alternate;
+  Entry* entry = SelectEntry(address, alternate_address, &use_alternate);
+  if (entry != nullptr) {
+    entry->idle_ = false;
+    entry->preconnected_ = false;
+    entry->agent_->ConnectToService(service_name, std::move(*channel));
+    return true;
+  }
+
+  return AddAgent(address, alternate_address, use_alternate, service_name,
+                  channel) != nullptr;
+}
+
+bool RequestorAgentPool::SendToService(
+    const SocketAddress& address,
+    const SocketAddress& alternate_address,
+    const std::string& service_name,
+    MessageTransciever::SharedMessage message,
+    const MessageTransciever::DeliveryCallback& callback) {
+  // The message's channel closes as soon as the message is sent, so an idle
+  // connection stays idle.
+  bool use_alternate;
+  Entry* entry = SelectEntry(address, alternate_address, &use_alternate);
+  if (entry != nullptr) {
+    entry->agent_->SendToService(service_name, std::move(message), callback);
+    return true;
+  }
+
+  // The new connection reports itself idle once the version exchange
+  // completes, at which point the message is sent.
+  RequestorAgent* requestor_agent = AddAgent(
+      address, alternate_address, use_alternate, std::string(), nullptr);
+  if (requestor_agent == nullptr) {
+    return false;
+  }
+
+  requestor_agent->SendToService(service_name, std::move(message), callback);
+  return true;
+}
+
+void RequestorAgentPool::Preconnect(const SocketAddress& address,
+                                    const SocketAddress& alternate_address) {
+  for (auto& pair : entries_) {
+    if (pair.first->address() == address && pair.first->CanConnectToService()) {
+      return;
+    }
+  }
+
+  RequestorAgent* requestor_agent =
+      AddAgent(address, alternate_address, false, std::string(), nullptr);
+  if (requestor_agent != nullptr) {
+    entries_.find(requestor_agent)->second.preconnected_ = true;
+  }
+}
+
+void RequestorAgentPool::CloseIdleAgents(const SocketAddress& address) {
+  // Closing an agent doesn't release it right away, so |entries_| doesn't
+  // change during this loop.
+  for (auto& pair : entries_) {
+    if (pair.second.idle_ && pair.first->address() == address) {
+      pair.second.idle_ = false;
+      pair.first->Close();
+    }
+  }
+}
+
+void RequestorAgentPool::OnAgentIdle(RequestorAgent* requestor_agent) {
+  auto iter = entries_.find(requestor_agent);
+  FTL_DCHECK(iter != entries_.end());
+  Entry& entry = iter->second;
+
+  if (entry.preconnected_) {
+    // Kept until it's used.
+    entry.idle_ = true;
+    return;
+  }
+
+  if (IdleCount(requestor_agent->address()) >= max_idle_per_device_) {
+    requestor_agent->Close();
+    return;
+  }
+
+  entry.idle_ = true;
+  uint64_t idle_serial = next_idle_serial_++;
+  entry.idle_serial_ = idle_serial;
+
+  task_runner_->PostDelayedTask(
+      [this, requestor_agent, idle_serial]() {
+        OnIdleTimeout(requestor_agent, idle_serial);
+      },
+      idle_timeout_);
+}
+
+void RequestorAgentPool::OnAgentSuspended(RequestorAgent* requestor_agent) {
+  auto iter = entries_.find(requestor_agent);
+  FTL_DCHECK(iter != entries_.end());
+
+  // Another agent may be allocated at the same address once this one is
+  // released, so the entry is matched by serial as well as by pointer.
+  uint64_t suspend_serial = next_suspend_serial_++;
+  iter->second.suspend_serial_ = suspend_serial;
+
+  task_runner_->PostDelayedTask(
+      [this, requestor_agent, suspend_serial]() {
+        auto entry_iter = entries_.find(requestor_agent);
+        if (entry_iter != entries_.end() &&
+            entry_iter->second.suspend_serial_ == suspend_serial) {
+          requestor_agent->Reconnect();
+        }
+      },
+      kReconnectDelay);
+}
+
+void RequestorAgentPool::ReleaseAgent(RequestorAgent* requestor_agent) {
+  size_t removed = entries_.erase(requestor_agent);
+  FTL_DCHECK(removed == 1);
+}
+
+void RequestorAgentPool::ForEachAgent(
+    const std::function<void(const RequestorAgent&)>& callback) const {
+  for (auto& pair : entries_) {
+    callback(*pair.second.agent_);
+  }
+}
+
+void RequestorAgentPool::ForEachAgent(
+    const std::function<void(RequestorAgent*)>& callback) {
+  for (auto& pair : entries_) {
+    callback(pair.second.agent_.get());
+  }
+}
+
+RequestorAgentPool::Entry* RequestorAgentPool::FindEntry(
+    const SocketAddress& address) {
+  // Prefer a connection that's already in use, so idle connections can time
+  // out when they're not needed.
+  Entry* idle_entry = nullptr;
+  for (auto& pair : entries_) {
+    Entry& entry = pair.second;
+    if (entry.agent_->address() != address ||
+        !entry.agent_->CanConnectToService()) {
+      continue;
+    }
+
+    if (!entry.idle_) {
+      return &entry;
+    }
+
+    if (idle_entry == nullptr) {
+      idle_entry = &entry;
+    }
+  }
+
+  return idle_entry;
+}
+
+RequestorAgentPool::Entry* RequestorAgentPool::SelectEntry(
+    const SocketAddress& address,
+    const SocketAddress& alternate_address,
+    bool* use_alternate) {
+  FTL_DCHECK(use_alternate);
+  *use_alternate = false;
+
+  Entry* entry = FindEntry(address);
+  if (!multipath_ || !alternate_address.is_valid() || entry == nullptr) {
+    return entry;
+  }
+
+  Entry* alternate_entry = FindEntry(alternate_address);
+  if (alternate_entry == nullptr) {
+    // Open a connection over the other path.
+    *use_alternate = true;
+    return nullptr;
+  }
+
+  return alternate_entry->agent_->channel_count() <
+                 entry->agent_->channel_count()
+             ? alternate_entry
+             : entry;
+}
+
+RequestorAgent* RequestorAgentPool::AddAgent(
+    const SocketAddress& address,
+    const SocketAddress& alternate_address,
+    bool use_alternate,
+    const std::string& service_name,
+    mx::channel* local_channel) {
+  // A connection to the alternate address still races a connect to the
+  // preferred address, so it's established even if the alternate path
+  // turns out to be unusable.
+  std::unique_ptr<RequestorAgent> requestor_agent = RequestorAgent::Create(
+      use_alternate ? alternate_address : address,
+      use_alternate ? address : alternate_address, service_name, local_channel,
+      connect_timeout_, owner_);
+
+  if (!requestor_agent) {
+    return nullptr;
+  }
+
+  if (multipath_) {
+    requestor_agent->EnableFailover();
+  }
+
+  RequestorAgent* raw_ptr = requestor_agent.get();
+  entries_.emplace(raw_ptr, Entry(std::move(requestor_agent)));
+  return raw_ptr;
+}
+
+void RequestorAgentPool::OnIdleTimeout(RequestorAgent* requestor_agent,
+                                       uint64_t idle_serial) {
+  auto iter = entries_.find(requestor_agent);
+  if (iter == entries_.end() || !iter->second.idle_ ||
+      iter->second.idle_serial_ != idle_serial) {
+    // The agent is gone or has been used since this timeout was scheduled.
+    return;
+  }
+
+  iter->second.idle_ = false;
+  requestor_agent->Close();
+}
+
+size_t RequestorAgentPool::IdleCount(const SocketAddress& address) const {
+  size_t count = 0;
+  for (auto& pair : entries_) {
+    if (pair.second.idle_ && pair.first->address() == address) {
+      ++count;
+    }
+  }
+
+  return count;
+}
+
+}  // namespace netconnector
@@ -0,0 +1,155 @@
+// Copyright 2017 The Fuchsia Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#pragma once
+
+#include <functional>
+#include <memory>
+#include <string>
+#include <unordered_map>
+
+#include <mx/channel.h>
+
+#include "apps/netconnector/src/requestor_agent.h"
+#include "apps/netconnector/src/socket_address.h"
+#include "lib/ftl/macros.h"
+#include "lib/ftl/tasks/task_runner.h"
+#include "lib/ftl/time/time_delta.h"
+
+namespace netconnector {
+
+class NetConnectorImpl;
+
+// Owns the requestor agents for all remote devices and keeps connections to
+// those devices open for reuse after their last service connection closes.
+//
+// Idle connections are closed after |idle_timeout|, and no more than
+// |max_idle_per_device| idle connections are kept for any one device. Only
+// multiplexed connections become idle. Connections to devices that don't
+// support multiplexing close when their service connection closes.
+//
+// RequestorAgentPool is not thread-safe. All methods calls must be serialized.
+class RequestorAgentPool {
+ public:
+  // If |multipath| is true, service connections to a device with an
+  // alternate address are spread over a connection to each of its addresses,
+  // and connections whose sockets fail are resumed over the other address.
+  RequestorAgentPool(NetConnectorImpl* owner,
+                     ftl::TimeDelta connect_timeout,
+                     ftl::TimeDelta idle_timeout,
+                     size_t max_idle_per_device,
+                     bool multipath);
+
+  ~RequestorAgentPool();
+
+  // Connects |channel| to the service named |service_name| on the device at
+  // |address|, using an existing connection to the device if one can carry
+  // another service connection. A new connection races connects to |address|
+  // and, if it's valid, |alternate_address|. Returns false if a new connection
+  // was needed and couldn't be established, in which case |*channel| is left
+  // alone.
+  bool ConnectToService(const SocketAddress& address,
+                        const SocketAddress& alternate_address,
+                        const std::string& service_name,
+                        mx::channel* channel);
+
+  // Sends |message| to the service named |service_name| on the device at
+  // |address| (see RequestorAgent::SendToService), using an existing
+  // connection to the device if one can carry it. Addresses are as for
+  // |ConnectToService|. Returns false if a new connection was needed and
+  // couldn't be established, in which case |callback| isn't called.
+  bool SendToService(const SocketAddress& address,
+                     const SocketAddress& alternate_address,
+                     const std::string& service_name,
+                     MessageTransciever::SharedMessage message,
+                     const MessageTransciever::DeliveryCallback& callback);
+
+  // Opens a connection to the device at |address| in the background, unless
+  // there's one already, so the first service connection to the device doesn't
+  // wait for a connect and a version exchange. The connection isn't closed
+  // for being idle until it has been used.
+  void Preconnect(const SocketAddress& address,
+                  const SocketAddress& alternate_address);
+
+  // Closes the idle connections to the device at |address|.
+  void CloseIdleAgents(const SocketAddress& address);
+
+  // Called when |requestor_agent|'s connection has no open channels.
+  void OnAgentIdle(RequestorAgent* requestor_agent);
+
+  // Called when |requestor_agent|'s socket has failed. The agent reconnects
+  // after a short delay.
+  void OnAgentSuspended(RequestorAgent* requestor_agent);
+
+  // Releases |requestor_agent|, whose connection has closed.
+  void ReleaseAgent(RequestorAgent* requestor_agent);
+
+  // Calls |callback| for each agent in the pool.
+  void ForEachAgent(
+      const std::function<void(const RequestorAgent&)>& callback) const;
+  void ForEachAgent(const std::function<void(RequestorAgent*)>& callback);
+
+ private:
+  struct Entry {
+    explicit Entry(std::unique_ptr<RequestorAgent> agent)
+        : agent_(std::move(agent)) {}
+
+    std::unique_ptr<RequestorAgent> agent_;
+    bool idle_ = false;
+    // Set for a connection opened by |Preconnect| until it's first used.
+    bool preconnected_ = false;
+    // Identifies the most recent transition to idle so stale idle timeouts
+    // can be recognized.
+    uint64_t idle_serial_ = 0;
+    // Identifies the most recent suspension so reconnects scheduled for an
+    // agent that has since been released, or for an earlier suspension,
+    // can be recognized.
+    uint64_t suspend_serial_ = 0;
+  };
+
+  // Returns the entry for a connection to |address| that can carry another
+  // service connection, preferring one that's in use, or nullptr if there's
+  // none.
+  Entry* FindEntry(const SocketAddress& address);
+
+  // Returns the entry for the connection that should carry a new service
+  // connection to the device with the given addresses, or nullptr if a new
+  // connection should be opened, in which case |*use_alternate| indicates
+  // whether it should be opened to |alternate_address|. In multipath mode,
+  // each address gets a connection before any connection is shared, and
+  // then the connection with the fewest channels is chosen.
+  Entry* SelectEntry(const SocketAddress& address,
+                     const SocketAddress& alternate_address,
+                     bool* use_alternate);
+
+  // Creates an agent as RequestorAgent::Create does, swapping the addresses
+  // if |use_alternate| is true, and adds it to the pool. Returns nullptr if
+  // the agent couldn't be created.
+  RequestorAgent* AddAgent(const SocketAddress& address,
+                           const SocketAddress& alternate_address,
+                           bool use_alternate,
+                           const std::string& service_name,
+                           mx::channel* local_channel);
+
+  // Closes |requestor_agent| if it's still idle after becoming idle at
+  // |idle_serial|.
+  void OnIdleTimeout(RequestorAgent* requestor_agent, uint64_t idle_serial);
+
+  // Returns the number of idle agents connected to |address|.
+  size_t IdleCount(const SocketAddress& address) const;
+
+  NetConnectorImpl* owner_;
+  ftl::TimeDelta connect_timeout_;
+  ftl::TimeDelta idle_timeout_;
+  size_t max_idle_per_device_;
+  bool multipath_;
+  ftl::RefPtr<ftl::TaskRunner> task_runner_;
+  std::unordered_map<RequestorAgent*, Entry> entries_;
+  uint64_t next_idle_serial_ = 1;
+  uint64_t next_suspend_serial_ = 1;
+
+  FTL_DISALLOW_COPY_AND_ASSIGN(RequestorAgentPool);
+};
+
+}  // namespace netconnector
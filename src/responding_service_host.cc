@@ -4,14 +4,27 @@
 
 #include "apps/netconnector/src/responding_service_host.h"
 
+#include <algorithm>
+
 #include "application/lib/app/connect.h"
-#include "lib/ftl/functional/make_copyable.h"
 #include "lib/ftl/logging.h"
+#include "lib/mtl/tasks/message_loop.h"
 
 namespace netconnector {
 
+namespace {
+
+// The first relaunch of a prelaunch singleton is delayed by
+// |kMinRelaunchDelay|. The delay doubles, up to |kMaxRelaunchDelay|, each time
+// the singleton dies less than |kMaxRelaunchDelay| after it was launched.
+constexpr ftl::TimeDelta kMinRelaunchDelay = ftl::TimeDelta::FromSeconds(1);
+constexpr ftl::TimeDelta kMaxRelaunchDelay = ftl::TimeDelta::FromSeconds(60);
+
+}  // namespace
+
 RespondingServiceHost::RespondingServiceHost(
-    const app::ApplicationEnvironmentPtr& environment) {
+    const app::ApplicationEnvironmentPtr& environment)
+    : task_runner_(mtl::MessageLoop::GetCurrent()->task_runner()) {
   FTL_DCHECK(environment);
   environment->GetApplicationLauncher(launcher_.NewRequest());
 }
@@ -20,54 +33,187 @@ RespondingServiceHost::~RespondingServiceHost() {}
 
 void RespondingServiceHost::RegisterSingleton(
     const std::string& service_name,
-    app::ApplicationLaunchInfoPtr launch_info) {
+    app::ApplicationLaunchInfoPtr launch_info,
+    bool prelaunch,
+    size_t instance_count) {
+  FTL_DCHECK(instance_count > 0);
+  service_names_.insert(service_name);
+
+  std::unique_ptr<Singleton> singleton = std::make_unique<Singleton>();
+  singleton->id_ = next_singleton_id_++;
+  singleton->launch_info_ = std::move(launch_info);
+  singleton->prelaunch_ = prelaunch;
+  singleton->instances_.resize(instance_count);
+  for (Instance& instance : singleton->instances_) {
+    instance.relaunch_delay_ = kMinRelaunchDelay;
+  }
+
+  Singleton* raw_singleton = singleton.get();
+  singletons_by_name_[service_name] = std::move(singleton);
+
   service_provider_.AddServiceForName(
-      ftl::MakeCopyable([
-        this, service_name, launch_info = std::move(launch_info),
-        controller = app::ApplicationControllerPtr()
-      ](mx::channel client_handle) mutable {
+      [this, service_name, raw_singleton](mx::channel client_handle) {
         FTL_VLOG(2) << "Servicing singleton service request for "
                     << service_name;
 
-        auto iter = service_providers_by_name_.find(service_name);
-
-        if (iter == service_providers_by_name_.end()) {
-          FTL_VLOG(1) << "Starting singleton " << launch_info->url
-                      << " for service " << service_name;
-
-          // TODO(dalesat): Create application-specific environment.
-          // We're launching this application in the environment supplied to
-          // the constructor. Instead, we should be launching it in a new
-          // environment that is restricted based on app permissions.
-
-          auto dup_launch_info = app::ApplicationLaunchInfo::New();
-          dup_launch_info->url = launch_info->url;
-          dup_launch_info->arguments = launch_info->arguments.Clone();
-          app::ServiceProviderPtr service_provider;
-          dup_launch_info->services = service_provider.NewRequest();
-
-          launcher_->CreateApplication(std::move(dup_launch_info),
-                                       controller.NewRequest());
-
-          service_provider.set_connection_error_handler(
-              [this, service_name, &controller] {
-                FTL_LOG(ERROR) << "Singleton " << service_name << " died";
-                controller.reset();  // kills the singleton application
-                service_providers_by_name_.erase(service_name);
-              });
-
-          std::tie(iter, std::ignore) = service_providers_by_name_.emplace(
-              service_name, std::move(service_provider));
+        Instance* instance = NextInstance(raw_singleton);
+        if (!instance->service_provider_) {
+          LaunchInstance(service_name, raw_singleton, instance);
         }
 
-        iter->second->ConnectToService(service_name, std::move(client_handle));
-      }),
+        instance->service_provider_->ConnectToService(
+            service_name, std::move(client_handle));
+      },
       service_name);
 }
 
+void RespondingServiceHost::UnregisterSingleton(
+    const std::string& service_name) {
+  if (singletons_by_name_.erase(service_name) == 0) {
+    return;
+  }
+
+  // A provider registered for the same service takes over.
+  if (service_providers_by_name_.find(service_name) ==
+      service_providers_by_name_.end()) {
+    service_names_.erase(service_name);
+    service_provider_.RemoveServiceForName(service_name);
+  } else {
+    AddProviderService(service_name);
+  }
+}
+
+void RespondingServiceHost::LaunchPrelaunchSingletons() {
+  for (auto& pair : singletons_by_name_) {
+    if (!pair.second->prelaunch_) {
+      continue;
+    }
+
+    for (Instance& instance : pair.second->instances_) {
+      if (!instance.service_provider_) {
+        LaunchInstance(pair.first, pair.second.get(), &instance);
+      }
+    }
+  }
+}
+
+// static
+RespondingServiceHost::Instance* RespondingServiceHost::NextInstance(
+    Singleton* singleton) {
+  FTL_DCHECK(singleton);
+  size_t count = singleton->instances_.size();
+  FTL_DCHECK(count > 0);
+
+  // Skip instances that are waiting to be relaunched, so connections don't
+  // see startup latency while other instances are running. Instances that were
+  // never launched are launched on demand.
+  size_t index = singleton->next_instance_;
+  for (size_t i = 0; i < count; ++i) {
+    const Instance& instance = singleton->instances_[(index + i) % count];
+    if (instance.service_provider_ || !instance.relaunch_pending_) {
+      index = (index + i) % count;
+      break;
+    }
+  }
+
+  singleton->next_instance_ = (index + 1) % count;
+  return &singleton->instances_[index];
+}
+
+void RespondingServiceHost::LaunchInstance(const std::string& service_name,
+                                           Singleton* singleton,
+                                           Instance* instance) {
+  FTL_DCHECK(singleton);
+  FTL_DCHECK(instance);
+  FTL_DCHECK(!instance->service_provider_);
+
+  FTL_VLOG(1) << "Starting singleton " << singleton->launch_info_->url
+              << " for service " << service_name;
+
+  // TODO(dalesat): Create application-specific environment.
+  // We're launching this application in the environment supplied to
+  // the constructor. Instead, we should be launching it in a new
+  // environment that is restricted based on app permissions.
+
+  auto dup_launch_info = app::ApplicationLaunchInfo::New();
+  dup_launch_info->url = singleton->launch_info_->url;
+  dup_launch_info->arguments = singleton->launch_info_->arguments.Clone();
+  dup_launch_info->services = instance->service_provider_.NewRequest();
+
+  launcher_->CreateApplication(std::move(dup_launch_info),
+                               instance->controller_.NewRequest());
+  instance->launch_time_ = ftl::TimePoint::Now();
+
+  instance->service_provider_.set_connection_error_handler(
+      [this, service_name, singleton, instance] {
+        OnInstanceDied(service_name, singleton, instance);
+      });
+}
+
+void RespondingServiceHost::OnInstanceDied(const std::string& service_name,
+                                           Singleton* singleton,
+                                           Instance* instance) {
+  FTL_DCHECK(singleton);
+  FTL_DCHECK(instance);
+  FTL_LOG(ERROR) << "Singleton " << service_name << " died";
+
+  instance->controller_.reset();  // kills the singleton application
+
+  if (singleton->prelaunch_ && !instance->relaunch_pending_) {
+    ScheduleRelaunch(service_name, singleton, instance);
+  }
+
+  // This destroys the error handler that called us, so it's done last.
+  instance->service_provider_.reset();
+}
+
+void RespondingServiceHost::ScheduleRelaunch(const std::string& service_name,
+                                             Singleton* singleton,
+                                             Instance* instance) {
+  FTL_DCHECK(singleton);
+  FTL_DCHECK(instance);
+  FTL_DCHECK(!instance->relaunch_pending_);
+
+  // An instance that dies soon after launching is probably crashing on
+  // startup, so back off.
+  if (ftl::TimePoint::Now() - instance->launch_time_ < kMaxRelaunchDelay) {
+    instance->relaunch_delay_ =
+        std::min(instance->relaunch_delay_ * 2, kMaxRelaunchDelay);
+  } else {
+    instance->relaunch_delay_ = kMinRelaunchDelay;
+  }
+
+  FTL_VLOG(1) << "Relaunching singleton " << service_name << " in "
+              << instance->relaunch_delay_.ToMilliseconds() << "ms";
+
+  // The singleton may be replaced or unregistered before the task runs, so
+  // the task finds it again by name and id.
+  uint64_t id = singleton->id_;
+  size_t index = instance - singleton->instances_.data();
+  instance->relaunch_pending_ = true;
+  task_runner_->PostDelayedTask(
+      [this, service_name, id, index]() {
+        auto iter = singletons_by_name_.find(service_name);
+        if (iter == singletons_by_name_.end() || iter->second->id_ != id) {
+          return;
+        }
+
+        Singleton* singleton = iter->second.get();
+        Instance* instance = &singleton->instances_[index];
+        instance->relaunch_pending_ = false;
+
+        // A request may have launched the instance in the meantime.
+        if (!instance->service_provider_) {
+          LaunchInstance(service_name, singleton, instance);
+        }
+      },
+      instance->relaunch_delay_);
+}
+
 void RespondingServiceHost::RegisterProvider(
     const std::string& service_name,
     fidl::InterfaceHandle<app::ServiceProvider> handle) {
+  service_names_.insert(service_name);
   app::ServiceProviderPtr service_provider =
       app::ServiceProviderPtr::Create(std::move(handle));
 
@@ -78,6 +224,11 @@ void RespondingServiceHost::RegisterProvider(
 
   service_providers_by_name_.emplace(service_name, std::move(service_provider));
 
+  AddProviderService(service_name);
+}
+
+void RespondingServiceHost::AddProviderService(
+    const std::string& service_name) {
   service_provider_.AddServiceForName(
       [this, service_name](mx::channel client_handle) {
         FTL_VLOG(2) << "Servicing provided service request for "
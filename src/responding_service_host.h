@@ -4,12 +4,19 @@
 
 #pragma once
 
+#include <memory>
+#include <set>
+#include <string>
 #include <unordered_map>
+#include <vector>
 
 #include "application/lib/app/application_context.h"
 #include "application/lib/app/service_provider_impl.h"
 #include "application/services/application_launcher.fidl.h"
 #include "lib/ftl/macros.h"
+#include "lib/ftl/tasks/task_runner.h"
+#include "lib/ftl/time/time_delta.h"
+#include "lib/ftl/time/time_point.h"
 
 namespace netconnector {
 
@@ -20,23 +27,99 @@ class RespondingServiceHost {
 
   ~RespondingServiceHost();
 
-  // Registers a singleton service.
+  // Registers a singleton service. If |prelaunch| is true, the singleton is
+  // launched by |LaunchPrelaunchSingletons| rather than on first use, and it's
+  // relaunched in the background if it dies. If |instance_count| is greater
+  // than one, that many instances of the application are launched, and
+  // connections are distributed across them round-robin. If a singleton is
+  // already registered for |service_name|, it's replaced, and its running
+  // instances are killed.
   void RegisterSingleton(const std::string& service_name,
-                         app::ApplicationLaunchInfoPtr launch_info);
+                         app::ApplicationLaunchInfoPtr launch_info,
+                         bool prelaunch = false,
+                         size_t instance_count = 1);
+
+  // Unregisters the singleton for |service_name|, killing its running
+  // instances. Channels already connected to other services are unaffected.
+  void UnregisterSingleton(const std::string& service_name);
+
+  // Launches the prelaunch singletons that aren't running.
+  void LaunchPrelaunchSingletons();
 
   // Registers a provider for a singleton service.
   void RegisterProvider(const std::string& service_name,
                         fidl::InterfaceHandle<app::ServiceProvider> handle);
 
+  // Binds |request| directly to the registered services. This is used for
+  // requests that originate on this device and don't need a connection.
+  void AddBinding(fidl::InterfaceRequest<app::ServiceProvider> request) {
+    service_provider_.AddBinding(std::move(request));
+  }
+
   app::ServiceProvider* services() {
     return static_cast<app::ServiceProvider*>(&service_provider_);
   }
 
+  // Returns the names of the registered services.
+  const std::set<std::string>& service_names() const { return service_names_; }
+
  private:
+  // One running (or waiting to be relaunched) instance of a singleton.
+  struct Instance {
+    app::ApplicationControllerPtr controller_;
+    // Null if the instance isn't running.
+    app::ServiceProviderPtr service_provider_;
+    ftl::TimePoint launch_time_;
+    // Delay before the next relaunch of a prelaunch instance.
+    ftl::TimeDelta relaunch_delay_;
+    bool relaunch_pending_ = false;
+  };
+
+  struct Singleton {
+    // Distinguishes this singleton from others registered for the same
+    // service before or after it.
+    uint64_t id_;
+    app::ApplicationLaunchInfoPtr launch_info_;
+    bool prelaunch_;
+    // Sized at registration and never resized, so pointers to the elements
+    // remain valid.
+    std::vector<Instance> instances_;
+    // Index of the instance that gets the next connection.
+    size_t next_instance_ = 0;
+  };
+
+  // Routes requests for |service_name| to the provider registered for it.
+  void AddProviderService(const std::string& service_name);
+
+  // Selects the instance of |singleton| that gets the next connection,
+  // preferring those that aren't waiting to be relaunched.
+  static Instance* NextInstance(Singleton* singleton);
+
+  // Launches |instance| of the singleton for |service_name|.
+  void LaunchInstance(const std::string& service_name,
+                      Singleton* singleton,
+                      Instance* instance);
+
+  // Handles the death of |instance| of the singleton for |service_name|.
+  void OnInstanceDied(const std::string& service_name,
+                      Singleton* singleton,
+                      Instance* instance);
+
+  // Schedules a relaunch of |instance| of the prelaunch singleton for
+  // |service_name| after the instance's relaunch delay.
+  void ScheduleRelaunch(const std::string& service_name,
+                        Singleton* singleton,
+                        Instance* instance);
+
+  std::set<std::string> service_names_;
+  uint64_t next_singleton_id_ = 0;
+  std::unordered_map<std::string, std::unique_ptr<Singleton>>
+      singletons_by_name_;
   std::unordered_map<std::string, app::ServiceProviderPtr>
       service_providers_by_name_;
   app::ServiceProviderImpl service_provider_;
   app::ApplicationLauncherPtr launcher_;
+  ftl::RefPtr<ftl::TaskRunner> task_runner_;
 
   FTL_DISALLOW_COPY_AND_ASSIGN(RespondingServiceHost);
 };
@@ -11,21 +11,135 @@ namespace netconnector {
 
 // static
 std::unique_ptr<ServiceAgent> ServiceAgent::Create(ftl::UniqueFD socket_fd,
+                                                   const SocketAddress& address,
                                                    NetConnectorImpl* owner) {
   return std::unique_ptr<ServiceAgent>(
-      new ServiceAgent(std::move(socket_fd), owner));
+      new ServiceAgent(std::move(socket_fd), address, owner));
 }
 
-ServiceAgent::ServiceAgent(ftl::UniqueFD socket_fd, NetConnectorImpl* owner)
-    : MessageTransciever(std::move(socket_fd)), owner_(owner) {
+ServiceAgent::ServiceAgent(ftl::UniqueFD socket_fd,
+                           const SocketAddress& address,
+                           NetConnectorImpl* owner)
+    : MessageTransciever(std::move(socket_fd), owner->direct_delivery()),
+      address_(address),
+      owner_(owner) {
   FTL_DCHECK(owner != nullptr);
+
+  if (owner->resume_timeout() > ftl::TimeDelta::Zero()) {
+    EnableResumption(false);
+  }
+
+  SetSendBatchLimits(owner->send_batch_bytes(), owner->send_batch_packets());
+
+  std::shared_ptr<TokenBucket> token_bucket =
+      owner->TokenBucketForAddress(address);
+  if (token_bucket) {
+    SetDeviceTokenBucket(token_bucket);
+  }
 }
 
 ServiceAgent::~ServiceAgent() {}
 
+void ServiceAgent::Close() {
+  CloseConnection();
+}
+
 void ServiceAgent::OnVersionReceived(uint32_t version) {}
 
 void ServiceAgent::OnServiceNameReceived(const std::string& service_name) {
+  FTL_DCHECK(owner_ != nullptr);
+  if (!owner_->AdmitServiceConnection(service_name)) {
+    CloseConnection();
+    return;
+  }
+
+  service_name_ = service_name;
+
+  mx::channel local = ConnectToResponder(service_name);
+  if (local) {
+    SetChannel(std::move(local));
+  }
+}
+
+void ServiceAgent::OnChannelRequested(uint16_t channel_id,
+                                      const std::string& service_name) {
+  FTL_DCHECK(owner_ != nullptr);
+  if (!owner_->AdmitServiceConnection(service_name)) {
+    RefuseChannel(channel_id);
+    return;
+  }
+
+  mx::channel local = ConnectToResponder(service_name);
+  if (local) {
+    SetChannel(channel_id, std::move(local));
+  }
+}
+
+void ServiceAgent::OnConnectionClosed() {
+  FTL_DCHECK(owner_ != nullptr);
+  owner_->ReleaseServiceAgent(this);
+}
+
+void ServiceAgent::OnIdle() {
+  // The requestor decides when an idle connection should be closed.
+}
+
+void ServiceAgent::OnConnectionSuspended() {
+  FTL_DCHECK(owner_ != nullptr);
+  owner_->OnServiceAgentSuspended(this);
+}
+
+void ServiceAgent::OnResumeRequested(uint64_t session_id,
+                                     uint64_t received_count) {
+  FTL_DCHECK(owner_ != nullptr);
+  owner_->ResumeServiceAgent(this, session_id, received_count);
+}
+
+Watermarks ServiceAgent::GetWatermarks(const std::string& service_name) {
+  FTL_DCHECK(owner_ != nullptr);
+  return owner_->WatermarksForService(service_name);
+}
+
+size_t ServiceAgent::GetVmoThreshold(const std::string& service_name) {
+  FTL_DCHECK(owner_ != nullptr);
+  return owner_->VmoThresholdForService(service_name);
+}
+
+ftl::TimeDelta ServiceAgent::GetMessageLifetime(
+    const std::string& service_name) {
+  FTL_DCHECK(owner_ != nullptr);
+  return owner_->MessageLifetimeForService(service_name);
+}
+
+std::shared_ptr<TokenBucket> ServiceAgent::GetTokenBucket(
+    const std::string& service_name) {
+  FTL_DCHECK(owner_ != nullptr);
+  return owner_->TokenBucketForService(service_name);
+}
+
+TransportProfile ServiceAgent::GetTransportProfile(
+    const std::string& service_name) {
+  FTL_DCHECK(owner_ != nullptr);
+  return owner_->TransportProfileForService(service_name);
+}
+
+MessagePriority ServiceAgent::GetPriority(const std::string& service_name) {
+  FTL_DCHECK(owner_ != nullptr);
+  return owner_->PriorityForService(service_name);
+}
+
+void ServiceAgent::OnRoundTripMeasured(ftl::TimeDelta rtt) {
+  FTL_DCHECK(owner_ != nullptr);
+  owner_->OnRoundTripMeasured(address_.address(), rtt);
+}
+
+void ServiceAgent::OnThroughputMeasured(uint64_t bytes,
+                                        ftl::TimeDelta duration) {
+  FTL_DCHECK(owner_ != nullptr);
+  owner_->OnThroughputMeasured(address_.address(), bytes, duration);
+}
+
+void ServiceAgent::RefuseChannel(uint16_t channel_id) {
   mx::channel local;
   mx::channel remote;
   mx_status_t status = mx::channel::create(0u, &local, &remote);
@@ -36,15 +150,26 @@ void ServiceAgent::OnServiceNameReceived(const std::string& service_name) {
     return;
   }
 
+  // The remote end is closed, so the channel closes as though the responder
+  // had declined it, leaving the connection's other channels alone.
+  SetChannel(channel_id, std::move(local));
+}
+
+mx::channel ServiceAgent::ConnectToResponder(const std::string& service_name) {
+  mx::channel local;
+  mx::channel remote;
+  mx_status_t status = mx::channel::create(0u, &local, &remote);
+
+  if (status != NO_ERROR) {
+    FTL_LOG(ERROR) << "Failed to create channel, status " << status;
+    CloseConnection();
+    return mx::channel();
+  }
+
   owner_->responding_services()->ConnectToService(service_name,
                                                   std::move(remote));
 
-  SetChannel(std::move(local));
-}
-
-void ServiceAgent::OnConnectionClosed() {
-  FTL_DCHECK(owner_ != nullptr);
-  owner_->ReleaseServiceAgent(this);
+  return local;
 }
 
 }  // namespace netconnector
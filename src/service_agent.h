@@ -5,9 +5,11 @@
 #pragma once
 
 #include <memory>
+#include <string>
 
 #include "apps/netconnector/services/netconnector.fidl.h"
 #include "apps/netconnector/src/message_transceiver.h"
+#include "apps/netconnector/src/socket_address.h"
 #include "lib/ftl/files/unique_fd.h"
 
 namespace netconnector {
@@ -16,22 +18,77 @@ class NetConnectorImpl;
 
 class ServiceAgent : public MessageTransciever {
  public:
+  // Creates a service agent for the connection on |socket_fd| from
+  // |address|.
   static std::unique_ptr<ServiceAgent> Create(ftl::UniqueFD socket_fd,
+                                              const SocketAddress& address,
                                               NetConnectorImpl* owner);
 
   ~ServiceAgent();
 
+  // Returns the address of the remote party, which is invalid if it couldn't
+  // be determined.
+  const SocketAddress& address() const { return address_; }
+
+  // Returns the name of the service requested when the connection was
+  // opened, which is empty until the name is received.
+  const std::string& service_name() const { return service_name_; }
+
+  // Closes the connection.
+  void Close();
+
  protected:
   // MessageTransciever overrides.
   void OnVersionReceived(uint32_t version) override;
 
   void OnServiceNameReceived(const std::string& service_name) override;
 
+  void OnChannelRequested(uint16_t channel_id,
+                          const std::string& service_name) override;
+
   void OnConnectionClosed() override;
 
+  void OnIdle() override;
+
+  void OnConnectionSuspended() override;
+
+  void OnResumeRequested(uint64_t session_id,
+                         uint64_t received_count) override;
+
+  Watermarks GetWatermarks(const std::string& service_name) override;
+
+  size_t GetVmoThreshold(const std::string& service_name) override;
+
+  ftl::TimeDelta GetMessageLifetime(const std::string& service_name) override;
+
+  std::shared_ptr<TokenBucket> GetTokenBucket(
+      const std::string& service_name) override;
+
+  TransportProfile GetTransportProfile(
+      const std::string& service_name) override;
+
+  MessagePriority GetPriority(const std::string& service_name) override;
+
+  void OnRoundTripMeasured(ftl::TimeDelta rtt) override;
+
+  void OnThroughputMeasured(uint64_t bytes, ftl::TimeDelta duration) override;
+
  private:
-  ServiceAgent(ftl::UniqueFD socket_fd, NetConnectorImpl* owner);
+  ServiceAgent(ftl::UniqueFD socket_fd,
+               const SocketAddress& address,
+               NetConnectorImpl* owner);
+
+  // Closes the logical channel identified by |channel_id| without connecting
+  // it to a responder.
+  void RefuseChannel(uint16_t channel_id);
+
+  // Connects a new channel to the responding service named |service_name| and
+  // returns the local end. Closes the connection and returns an invalid
+  // channel on failure.
+  mx::channel ConnectToResponder(const std::string& service_name);
 
+  SocketAddress address_;
+  std::string service_name_;
   NetConnectorImpl* owner_;
 
   FTL_DISALLOW_COPY_AND_ASSIGN(ServiceAgent);
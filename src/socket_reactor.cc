@@ -0,0 +1,34 @@
+// Copyright 2017 The Fuchsia Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#include "apps/netconnector/src/socket_reactor.h"
+
+#include "lib/ftl/logging.h"
+#include "lib/mtl/threading/create_thread.h"
+
+namespace netconnector {
+
+// static
+SocketReactor* SocketReactor::Get() {
+  static SocketReactor* reactor = new SocketReactor();
+  return reactor;
+}
+
+SocketReactor::SocketReactor()
+    : task_runners_(kThreadCount), next_thread_index_(0) {
+  for (ftl::RefPtr<ftl::TaskRunner>& task_runner : task_runners_) {
+    threads_.push_back(mtl::CreateThread(&task_runner, "netconnector io"));
+    FTL_DCHECK(task_runner);
+  }
+}
+
+SocketReactor::~SocketReactor() {
+  FTL_NOTREACHED();
+}
+
+ftl::RefPtr<ftl::TaskRunner> SocketReactor::AssignThread() {
+  return task_runners_[next_thread_index_++ % task_runners_.size()];
+}
+
+}  // namespace netconnector
@@ -0,0 +1,47 @@
+// Copyright 2017 The Fuchsia Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#pragma once
+
+#include <atomic>
+#include <thread>
+#include <vector>
+
+#include "lib/ftl/macros.h"
+#include "lib/ftl/tasks/task_runner.h"
+
+namespace netconnector {
+
+// A fixed-size pool of I/O threads shared by all socket connections in the
+// process. Sockets are registered with one of the threads, and their reads
+// and writes are driven by readiness notifications delivered there, so the
+// number of threads doesn't grow with the number of connections.
+//
+// SocketReactor is thread-safe.
+class SocketReactor {
+ public:
+  // Returns the process-wide reactor, creating it on first use.
+  static SocketReactor* Get();
+
+  // Selects an I/O thread for a new socket and returns its task runner.
+  // Readiness waits for the socket must be started, and cancelled, using
+  // tasks posted to the returned task runner.
+  ftl::RefPtr<ftl::TaskRunner> AssignThread();
+
+ private:
+  static const size_t kThreadCount = 2;
+
+  SocketReactor();
+
+  // The reactor lives for the life of the process, so this is never called.
+  ~SocketReactor();
+
+  std::vector<std::thread> threads_;
+  std::vector<ftl::RefPtr<ftl::TaskRunner>> task_runners_;
+  std::atomic<size_t> next_thread_index_;
+
+  FTL_DISALLOW_COPY_AND_ASSIGN(SocketReactor);
+};
+
+}  // namespace netconnector
@@ -0,0 +1,112 @@
+// Copyright 2017 The Fuchsia Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#pragma once
+
+#include <atomic>
+
+#include "lib/ftl/logging.h"
+#include "lib/ftl/macros.h"
+
+namespace netconnector {
+
+// An unbounded lock-free queue with a single producer thread and a single
+// consumer thread. Values are stored in fixed-size ring segments. When the
+// producer fills a segment, it links a new one, reusing a segment the
+// consumer has finished with if there is one, so a queue in steady state
+// doesn't allocate.
+//
+// Push must only be called on the producer thread and Pop only on the
+// consumer thread. T must be default-constructible and move-assignable.
+template <typename T, size_t kSegmentSize = 256>
+class SpscQueue {
+ public:
+  SpscQueue()
+      : tail_(new Segment()), head_(tail_), spare_(nullptr) {}
+
+  ~SpscQueue() {
+    while (head_ != nullptr) {
+      Segment* next = head_->next_.load(std::memory_order_relaxed);
+      delete head_;
+      head_ = next;
+    }
+
+    delete spare_.load(std::memory_order_relaxed);
+  }
+
+  // Adds a value to the end of the queue. Must be called on the producer
+  // thread.
+  void Push(T value) {
+    if (tail_index_ == kSegmentSize) {
+      Segment* segment = spare_.exchange(nullptr, std::memory_order_acquire);
+      if (segment == nullptr) {
+        segment = new Segment();
+      }
+
+      tail_->next_.store(segment, std::memory_order_release);
+      tail_ = segment;
+      tail_index_ = 0;
+    }
+
+    tail_->values_[tail_index_] = std::move(value);
+    ++tail_index_;
+    tail_->written_.store(tail_index_, std::memory_order_release);
+  }
+
+  // Removes the value at the front of the queue, returning false if the queue
+  // is empty. Must be called on the consumer thread.
+  bool Pop(T* value) {
+    FTL_DCHECK(value != nullptr);
+
+    if (head_index_ == head_->written_.load(std::memory_order_acquire)) {
+      if (head_index_ != kSegmentSize) {
+        return false;
+      }
+
+      Segment* next = head_->next_.load(std::memory_order_acquire);
+      if (next == nullptr) {
+        return false;
+      }
+
+      // The producer is done with the old segment, and so are we.
+      Segment* old = head_;
+      head_ = next;
+      head_index_ = 0;
+      old->next_.store(nullptr, std::memory_order_relaxed);
+      old->written_.store(0, std::memory_order_relaxed);
+      delete spare_.exchange(old, std::memory_order_release);
+
+      if (head_index_ == head_->written_.load(std::memory_order_acquire)) {
+        return false;
+      }
+    }
+
+    *value = std::move(head_->values_[head_index_]);
+    ++head_index_;
+    return true;
+  }
+
+ private:
+  struct Segment {
+    T values_[kSegmentSize];
+    // The number of values the producer has written to this segment.
+    std::atomic<size_t> written_{0};
+    std::atomic<Segment*> next_{nullptr};
+  };
+
+  // Accessed on the producer thread only.
+  Segment* tail_;
+  size_t tail_index_ = 0;
+
+  // Accessed on the consumer thread only.
+  Segment* head_;
+  size_t head_index_ = 0;
+
+  // A segment the consumer has finished with, for reuse by the producer.
+  std::atomic<Segment*> spare_;
+
+  FTL_DISALLOW_COPY_AND_ASSIGN(SpscQueue);
+};
+
+}  // namespace netconnector
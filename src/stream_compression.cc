@@ -0,0 +1,166 @@
+// Copyright 2017 The Fuchsia Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#include "apps/netconnector/src/stream_compression.h"
+
+#include <cstring>
+
+#include "apps/netconnector/lib/buffer_pool.h"
+#include "lib/ftl/logging.h"
+
+namespace netconnector {
+namespace {
+
+// Raw deflate (no zlib header or checksum). The transport is already
+// reliable, so the checksum would only cost bytes.
+constexpr int kWindowBits = -15;
+constexpr int kMemLevel = 8;
+
+// Each sync flush appends an empty stored block, which deflateBound doesn't
+// account for.
+constexpr size_t kFlushOverhead = 16;
+
+// Initial output buffer size for decompression as a multiple of the input.
+constexpr size_t kInitialExpansion = 4;
+
+}  // namespace
+
+StreamCompressor::StreamCompressor() {
+  std::memset(&stream_, 0, sizeof(stream_));
+}
+
+StreamCompressor::~StreamCompressor() {
+  if (initialized_) {
+    deflateEnd(&stream_);
+  }
+}
+
+bool StreamCompressor::Compress(const uint8_t* data,
+                                size_t size,
+                                std::vector<uint8_t>* out) {
+  FTL_DCHECK(data != nullptr);
+  FTL_DCHECK(size != 0);
+  FTL_DCHECK(out != nullptr);
+
+  if (!initialized_) {
+    // Speed matters more than ratio here, because we compress on the I/O
+    // thread.
+    int result = deflateInit2(&stream_, Z_BEST_SPEED, Z_DEFLATED, kWindowBits,
+                              kMemLevel, Z_DEFAULT_STRATEGY);
+    if (result != Z_OK) {
+      FTL_LOG(ERROR) << "deflateInit2 failed, result " << result;
+      return false;
+    }
+
+    initialized_ = true;
+  }
+
+  *out = BufferPool::Get()->Allocate(deflateBound(&stream_, size) +
+                                     kFlushOverhead);
+
+  stream_.next_in = const_cast<Bytef*>(data);
+  stream_.avail_in = size;
+  size_t produced = 0;
+
+  // With Z_SYNC_FLUSH, all the output has been produced once deflate returns
+  // with output space to spare.
+  do {
+    if (produced == out->size()) {
+      out->resize(out->size() * 2);
+    }
+
+    stream_.next_out = out->data() + produced;
+    stream_.avail_out = out->size() - produced;
+
+    int result = deflate(&stream_, Z_SYNC_FLUSH);
+    if (result != Z_OK && result != Z_BUF_ERROR) {
+      FTL_LOG(ERROR) << "deflate failed, result " << result;
+      return false;
+    }
+
+    produced = out->size() - stream_.avail_out;
+  } while (stream_.avail_out == 0);
+
+  FTL_DCHECK(stream_.avail_in == 0);
+  out->resize(produced);
+  return true;
+}
+
+StreamDecompressor::StreamDecompressor() {
+  std::memset(&stream_, 0, sizeof(stream_));
+}
+
+StreamDecompressor::~StreamDecompressor() {
+  if (initialized_) {
+    inflateEnd(&stream_);
+  }
+}
+
+bool StreamDecompressor::Decompress(const uint8_t* data,
+                                    size_t size,
+                                    size_t max_size,
+                                    std::vector<uint8_t>* out) {
+  FTL_DCHECK(data != nullptr);
+  FTL_DCHECK(size != 0);
+  FTL_DCHECK(max_size != 0);
+  FTL_DCHECK(out != nullptr);
+
+  if (!initialized_) {
+    int result = inflateInit2(&stream_, kWindowBits);
+    if (result != Z_OK) {
+      FTL_LOG(ERROR) << "inflateInit2 failed, result " << result;
+      return false;
+    }
+
+    initialized_ = true;
+  }
+
+  // We allow one byte more than |max_size| so we can tell when the limit is
+  // exceeded.
+  size_t limit = max_size + 1;
+  size_t initial_size = size * kInitialExpansion;
+  *out = BufferPool::Get()->Allocate(initial_size < limit ? initial_size
+                                                          : limit);
+
+  stream_.next_in = const_cast<Bytef*>(data);
+  stream_.avail_in = size;
+  size_t produced = 0;
+
+  while (true) {
+    stream_.next_out = out->data() + produced;
+    stream_.avail_out = out->size() - produced;
+
+    int result = inflate(&stream_, Z_SYNC_FLUSH);
+    if (result != Z_OK && result != Z_BUF_ERROR) {
+      FTL_LOG(ERROR) << "inflate failed, result " << result;
+      return false;
+    }
+
+    produced = out->size() - stream_.avail_out;
+
+    if (stream_.avail_in == 0 && stream_.avail_out != 0) {
+      break;
+    }
+
+    if (stream_.avail_out != 0) {
+      // Input remains, output space remains, and inflate made no progress.
+      FTL_LOG(ERROR) << "inflate stalled";
+      return false;
+    }
+
+    if (out->size() == limit) {
+      FTL_LOG(ERROR) << "Decompressed payload exceeds " << max_size
+                     << " bytes";
+      return false;
+    }
+
+    size_t new_size = out->size() * 2;
+    out->resize(new_size < limit ? new_size : limit);
+  }
+
+  out->resize(produced);
+  return true;
+}
+
+}  // namespace netconnector
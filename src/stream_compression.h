@@ -0,0 +1,61 @@
+// Copyright 2017 The Fuchsia Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#pragma once
+
+#include <vector>
+
+#include <zlib.h>
+
+#include "lib/ftl/macros.h"
+
+namespace netconnector {
+
+// Compresses a sequence of payloads as a single deflate stream, so the
+// history from earlier payloads improves compression of later ones. Each
+// payload is flushed to a byte boundary, so the matching StreamDecompressor
+// can decompress it as soon as it arrives. Payloads must be decompressed in
+// the order in which they were compressed.
+class StreamCompressor {
+ public:
+  StreamCompressor();
+
+  ~StreamCompressor();
+
+  // Compresses |size| bytes at |data| into |*out|, which is allocated from
+  // the buffer pool. Returns false if compression fails, in which case the
+  // stream can't be used again.
+  bool Compress(const uint8_t* data, size_t size, std::vector<uint8_t>* out);
+
+ private:
+  z_stream stream_;
+  bool initialized_ = false;
+
+  FTL_DISALLOW_COPY_AND_ASSIGN(StreamCompressor);
+};
+
+// Decompresses payloads produced by a StreamCompressor.
+class StreamDecompressor {
+ public:
+  StreamDecompressor();
+
+  ~StreamDecompressor();
+
+  // Decompresses |size| bytes at |data| into |*out|, which is allocated from
+  // the buffer pool. Returns false if the data is malformed or decompresses
+  // to more than |max_size| bytes, in which case the stream can't be used
+  // again.
+  bool Decompress(const uint8_t* data,
+                  size_t size,
+                  size_t max_size,
+                  std::vector<uint8_t>* out);
+
+ private:
+  z_stream stream_;
+  bool initialized_ = false;
+
+  FTL_DISALLOW_COPY_AND_ASSIGN(StreamDecompressor);
+};
+
+}  // namespace netconnector
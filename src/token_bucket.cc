@@ -0,0 +1,113 @@
+// Copyright 2017 The Fuchsia Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#include "apps/netconnector/src/token_bucket.h"
+
+#include "lib/ftl/logging.h"
+
+namespace netconnector {
+namespace {
+
+constexpr double kNanosecondsPerSecond = 1000000000.0;
+
+}  // namespace
+
+TokenBucket::TokenBucket(const BandwidthLimit& limit)
+    : limit_(limit),
+      tokens_(static_cast<int64_t>(limit.burst_)),
+      last_refill_time_(ftl::TimePoint::Now()) {}
+
+TokenBucket::~TokenBucket() {}
+
+void TokenBucket::SetLimit(const BandwidthLimit& limit) {
+  ftl::MutexLocker locker(&mutex_);
+  ftl::TimePoint now = ftl::TimePoint::Now();
+  Refill(now);
+
+  if (limit_.rate_ == 0) {
+    // The bucket wasn't metering, so it starts out full.
+    tokens_ = static_cast<int64_t>(limit.burst_);
+  } else if (tokens_ > static_cast<int64_t>(limit.burst_)) {
+    tokens_ = static_cast<int64_t>(limit.burst_);
+  }
+
+  limit_ = limit;
+  last_refill_time_ = now;
+}
+
+ftl::TimeDelta TokenBucket::Delay(ftl::TimePoint now) {
+  ftl::MutexLocker locker(&mutex_);
+  if (limit_.rate_ == 0) {
+    return ftl::TimeDelta::Zero();
+  }
+
+  Refill(now);
+  if (tokens_ >= 0) {
+    return ftl::TimeDelta::Zero();
+  }
+
+  ++delays_;
+
+  // Rounded up, so the debt is repaid when the delay is over.
+  double delay_ns = -tokens_ * kNanosecondsPerSecond / limit_.rate_;
+  return ftl::TimeDelta::FromNanoseconds(static_cast<int64_t>(delay_ns) + 1);
+}
+
+void TokenBucket::Spend(size_t bytes, ftl::TimePoint now) {
+  ftl::MutexLocker locker(&mutex_);
+  bytes_ += bytes;
+
+  if (limit_.rate_ == 0) {
+    return;
+  }
+
+  Refill(now);
+  tokens_ -= static_cast<int64_t>(bytes);
+}
+
+TokenBucket::State TokenBucket::GetState(ftl::TimePoint now) {
+  ftl::MutexLocker locker(&mutex_);
+  if (limit_.rate_ != 0) {
+    Refill(now);
+  }
+
+  State state;
+  state.limit_ = limit_;
+  state.tokens_ = tokens_;
+  state.bytes_ = bytes_;
+  state.delays_ = delays_;
+  return state;
+}
+
+void TokenBucket::Refill(ftl::TimePoint now) {
+  FTL_DCHECK(limit_.rate_ != 0);
+
+  if (now <= last_refill_time_) {
+    return;
+  }
+
+  int64_t capacity = static_cast<int64_t>(limit_.burst_) - tokens_;
+  if (capacity <= 0) {
+    last_refill_time_ = now;
+    return;
+  }
+
+  // Doubles keep the products in range for any rate and interval.
+  double accrued = (now - last_refill_time_).ToNanoseconds() *
+                   static_cast<double>(limit_.rate_) / kNanosecondsPerSecond;
+  if (accrued >= capacity) {
+    tokens_ = static_cast<int64_t>(limit_.burst_);
+    last_refill_time_ = now;
+    return;
+  }
+
+  // Only whole tokens are added, and the refill time advances just as far as
+  // they account for, so frequent refills don't lose the fractions.
+  int64_t added = static_cast<int64_t>(accrued);
+  tokens_ += added;
+  last_refill_time_ += ftl::TimeDelta::FromNanoseconds(static_cast<int64_t>(
+      added * kNanosecondsPerSecond / limit_.rate_));
+}
+
+}  // namespace netconnector
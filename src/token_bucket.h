@@ -0,0 +1,87 @@
+// Copyright 2017 The Fuchsia Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "lib/ftl/macros.h"
+#include "lib/ftl/synchronization/mutex.h"
+#include "lib/ftl/synchronization/thread_annotations.h"
+#include "lib/ftl/time/time_delta.h"
+#include "lib/ftl/time/time_point.h"
+
+namespace netconnector {
+
+// A sustained rate in bytes per second and the number of bytes that may be
+// sent in a burst above that rate. A |rate_| of zero means no limit.
+struct BandwidthLimit {
+  BandwidthLimit() : rate_(0), burst_(0) {}
+
+  BandwidthLimit(uint64_t rate, uint64_t burst) : rate_(rate), burst_(burst) {}
+
+  bool operator==(const BandwidthLimit& other) const {
+    return rate_ == other.rate_ && burst_ == other.burst_;
+  }
+
+  bool operator!=(const BandwidthLimit& other) const {
+    return !(*this == other);
+  }
+
+  uint64_t rate_;
+  uint64_t burst_;
+};
+
+// Meters bytes against a BandwidthLimit. Tokens accrue at the limit's rate up
+// to the burst size, and sending spends them. A send may overdraw the bucket,
+// so packets larger than the burst size still go, and the next send waits
+// until the debt is repaid.
+//
+// TokenBucket is thread-safe, so a bucket may be shared by connections on
+// different I/O threads.
+class TokenBucket {
+ public:
+  struct State {
+    BandwidthLimit limit_;
+    // Negative if the bucket is overdrawn.
+    int64_t tokens_;
+    // Bytes spent from the bucket.
+    uint64_t bytes_;
+    // The number of times a send had to wait for tokens.
+    uint64_t delays_;
+  };
+
+  explicit TokenBucket(const BandwidthLimit& limit);
+
+  ~TokenBucket();
+
+  // Changes the limit. The bucket keeps its tokens, up to the new burst size.
+  void SetLimit(const BandwidthLimit& limit);
+
+  // Returns how long from |now| until the bucket has a non-negative balance,
+  // which is zero if a send may go now.
+  ftl::TimeDelta Delay(ftl::TimePoint now);
+
+  // Spends |bytes| tokens for a send at |now|.
+  void Spend(size_t bytes, ftl::TimePoint now);
+
+  // Returns the current state of the bucket.
+  State GetState(ftl::TimePoint now);
+
+ private:
+  // Adds the tokens accrued since |last_refill_time_|.
+  void Refill(ftl::TimePoint now) FTL_EXCLUSIVE_LOCKS_REQUIRED(mutex_);
+
+  ftl::Mutex mutex_;
+  BandwidthLimit limit_ FTL_GUARDED_BY(mutex_);
+  int64_t tokens_ FTL_GUARDED_BY(mutex_);
+  ftl::TimePoint last_refill_time_ FTL_GUARDED_BY(mutex_);
+  uint64_t bytes_ FTL_GUARDED_BY(mutex_) = 0;
+  uint64_t delays_ FTL_GUARDED_BY(mutex_) = 0;
+
+  FTL_DISALLOW_COPY_AND_ASSIGN(TokenBucket);
+};
+
+}  // namespace netconnector
@@ -0,0 +1,59 @@
+// Copyright 2017 The Fuchsia Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "lib/ftl/time/time_delta.h"
+
+namespace netconnector {
+
+// Statistics for a connection managed by a MessageTransciever.
+struct TransceiverStats {
+  // Adds the counters, queue depths and channel counts from |other| to this.
+  // Lifetimes and round trip times aren't accumulated.
+  void Add(const TransceiverStats& other) {
+    bytes_sent_ += other.bytes_sent_;
+    bytes_received_ += other.bytes_received_;
+    messages_sent_ += other.messages_sent_;
+    messages_received_ += other.messages_received_;
+    messages_expired_ += other.messages_expired_;
+    send_stalls_ += other.send_stalls_;
+    receive_pauses_ += other.receive_pauses_;
+    send_queue_bytes_ += other.send_queue_bytes_;
+    receive_queue_bytes_ += other.receive_queue_bytes_;
+    channel_count_ += other.channel_count_;
+  }
+
+  // How long the connection has existed.
+  ftl::TimeDelta lifetime_;
+  // Bytes written to and read from the socket, including packet headers.
+  uint64_t bytes_sent_ = 0;
+  uint64_t bytes_received_ = 0;
+  // Messages queued for the socket and messages received from it.
+  uint64_t messages_sent_ = 0;
+  uint64_t messages_received_ = 0;
+  // Messages discarded in either direction because they waited longer than
+  // their service's message lifetime.
+  uint64_t messages_expired_ = 0;
+  // The number of times the socket wouldn't accept more data.
+  uint64_t send_stalls_ = 0;
+  // The number of times receipt from the socket paused because a channel
+  // was backed up.
+  uint64_t receive_pauses_ = 0;
+  // Message bytes read from channels and not yet written to the socket.
+  size_t send_queue_bytes_ = 0;
+  // Message bytes received from the socket and waiting to be written to
+  // channels by their relays.
+  size_t receive_queue_bytes_ = 0;
+  // The number of open logical channels.
+  size_t channel_count_ = 0;
+  // The round trip time of the most recent heartbeat, or zero if none has
+  // completed.
+  ftl::TimeDelta heartbeat_rtt_;
+};
+
+}  // namespace netconnector
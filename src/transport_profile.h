@@ -0,0 +1,66 @@
+// Copyright 2017 The Fuchsia Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#pragma once
+
+#include <stddef.h>
+
+namespace netconnector {
+
+// Socket options for connections carrying a particular service. A zero
+// buffer size means the system default is used.
+struct TransportProfile {
+  static constexpr size_t kThroughputBufferSize = 1024 * 1024;
+
+  // Returns a profile that leaves the socket options as they are.
+  static TransportProfile Default() { return TransportProfile(); }
+
+  // Returns a profile for interactive services. Small messages are sent
+  // immediately rather than being held back by Nagle's algorithm.
+  static TransportProfile Latency() {
+    TransportProfile profile;
+    profile.no_delay_ = true;
+    return profile;
+  }
+
+  // Returns a profile for bulk services. Large socket buffers keep the
+  // connection busy on high bandwidth-delay links.
+  static TransportProfile Throughput() {
+    TransportProfile profile;
+    profile.send_buffer_size_ = kThroughputBufferSize;
+    profile.receive_buffer_size_ = kThroughputBufferSize;
+    return profile;
+  }
+
+  // Combines |other| into this profile. A connection carrying several
+  // services gets the most demanding settings of any of them.
+  void Merge(const TransportProfile& other) {
+    no_delay_ = no_delay_ || other.no_delay_;
+    keep_alive_ = keep_alive_ || other.keep_alive_;
+    if (send_buffer_size_ < other.send_buffer_size_) {
+      send_buffer_size_ = other.send_buffer_size_;
+    }
+
+    if (receive_buffer_size_ < other.receive_buffer_size_) {
+      receive_buffer_size_ = other.receive_buffer_size_;
+    }
+  }
+
+  bool operator==(const TransportProfile& other) const {
+    return no_delay_ == other.no_delay_ && keep_alive_ == other.keep_alive_ &&
+           send_buffer_size_ == other.send_buffer_size_ &&
+           receive_buffer_size_ == other.receive_buffer_size_;
+  }
+
+  bool operator!=(const TransportProfile& other) const {
+    return !(*this == other);
+  }
+
+  bool no_delay_ = false;
+  bool keep_alive_ = false;
+  size_t send_buffer_size_ = 0;
+  size_t receive_buffer_size_ = 0;
+};
+
+}  // namespace netconnector
@@ -0,0 +1,26 @@
+// Copyright 2017 The Fuchsia Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#pragma once
+
+#include <stddef.h>
+
+namespace netconnector {
+
+// Watermarks in bytes for a queue of messages moving between a channel and a
+// socket. When the queue grows to |high_| bytes or more, the producer for the
+// queue is paused until the queue shrinks to |low_| bytes or fewer.
+struct Watermarks {
+  static constexpr size_t kDefaultHigh = 1024 * 1024;
+  static constexpr size_t kDefaultLow = 256 * 1024;
+
+  Watermarks() : high_(kDefaultHigh), low_(kDefaultLow) {}
+
+  Watermarks(size_t high, size_t low) : high_(high), low_(low) {}
+
+  size_t high_;
+  size_t low_;
+};
+
+}  // namespace netconnector